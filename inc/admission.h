@@ -0,0 +1,95 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hashmap.h"
+#include "memory-pool.h"
+
+/*
+ * Defaults for zero AdmissionOpts fields.  A handshake keeps one CPU busy
+ * until it is done, so max_in_flight defaults to admission_default_in_flight(),
+ * one slot per online CPU, and max_queued to ADMISSION_QUEUE_PER_SLOT
+ * waiting connections per slot.  Every source may burst 40 handshakes and
+ * then 20 per second.
+ */
+#define ADMISSION_RATE 20.0
+#define ADMISSION_BURST 40.0
+#define ADMISSION_QUEUE_PER_SLOT 8
+#define ADMISSION_SOURCES 4096
+#define ADMISSION_HANDSHAKE_MS 5000
+
+typedef enum {
+    ADMIT_OK,
+    ADMIT_RATE_LIMITED,         /* source is out of tokens */
+    ADMIT_BUSY,                 /* handshake slots and queue are taken */
+} AdmitResult;
+
+typedef struct ADMISSION_OPTS_T {
+    double rate;                /* handshakes per second per source, < 0 for no limit */
+    double burst;               /* bucket size */
+    size_t max_in_flight;       /* concurrent handshakes, 0 for one per online CPU */
+    size_t max_queued;          /* admitted connections waiting for a handshake slot */
+    size_t max_sources;         /* tracked source addresses */
+} AdmissionOpts;
+
+typedef struct ADMISSION_BUCKET_T {
+    uint32_t addr;
+    double tokens;
+    uint64_t last;
+} AdmissionBucket;
+
+typedef struct ADMISSION_STATS_T {
+    size_t admitted;
+    size_t rate_limited;
+    size_t busy;
+    size_t in_flight;
+    size_t queued;
+    size_t sources;
+} AdmissionStats;
+
+typedef struct ADMISSION_T {
+    double rate;
+    double burst;
+    size_t max_in_flight;
+    size_t max_queued;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    /* Source address -> bucket, buckets come from the pool */
+    HashMap *sources;
+    MemoryPool *buckets;
+    /* Shared by every source that did not fit into the table */
+    AdmissionBucket overflow;
+    size_t pending;             /* admitted, handshake not finished */
+    size_t in_flight;
+    AdmissionStats stats;
+} AdmissionControl;
+
+/*
+ * Handshake admission control, decided right after accept() before any
+ * TLS work.  Every source IPv4 address has a token bucket of burst
+ * handshakes refilled at rate per second, and at most max_in_flight
+ * handshakes run at once with max_queued more waiting for a slot.
+ * Zero options take the ADMISSION_* defaults.
+ */
+AdmissionControl *admission_init(const AdmissionOpts *opts);
+void admission_destroy(AdmissionControl *);
+
+/* Online CPU count, at least 1 */
+size_t admission_default_in_flight(void);
+
+/*
+ * Take a token of addr (network byte order) at now (CLOCK_MONOTONIC ns)
+ * and reserve a place for the handshake.  Anything but ADMIT_OK should
+ * be answered by closing the socket.
+ */
+AdmitResult admission_try(AdmissionControl *, uint32_t addr, uint64_t now);
+/* Give back the reservation of an admitted connection never handshaked */
+void admission_cancel(AdmissionControl *);
+
+/* Wait for a handshake slot, and release it once the handshake is over */
+void admission_begin(AdmissionControl *);
+void admission_end(AdmissionControl *);
+
+void admission_get_stats(AdmissionControl *, AdmissionStats *out);
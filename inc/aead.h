@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <openssl/evp.h>
+
+#define AEAD_KEY_SIZE 32
+#define AEAD_IV_SIZE  12
+#define AEAD_TAG_SIZE 16
+
+#define AEAD_AES_256_GCM        0
+#define AEAD_CHACHA20_POLY1305  1
+#define AEAD_ALG_COUNT          2
+
+/*
+ * Authenticated encryption with a cached key schedule.  One AEADCipher
+ * holds an encrypt and a decrypt context bound to a key; every message
+ * only resets the IV.  Like MessageDigest, an AEADCipher must not be used
+ * by several threads at once.
+ */
+typedef struct AEAD_T {
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+    const EVP_CIPHER *cipher;   /* fetched once, shared */
+    int alg;
+} AEADCipher;
+
+/* One message of a batch, status is 0 or -1 after the call */
+typedef struct AEAD_MSG_T {
+    const unsigned char *iv;
+    const void *aad;
+    size_t aad_len;
+    unsigned char *buf;         /* encrypted or decrypted in place */
+    size_t len;
+    unsigned char *tag;
+    int status;
+} AEADMessage;
+
+AEADCipher *AEAD_init(int alg, const unsigned char key[AEAD_KEY_SIZE]);
+int AEAD_set_key(AEADCipher *, const unsigned char key[AEAD_KEY_SIZE]);
+void AEAD_free(AEADCipher **);
+
+/*
+ * In-place encrypt/decrypt of buf.  Decrypt returns -1 if the tag does not
+ * match, in which case buf is wiped.
+ */
+int AEAD_encrypt(AEADCipher *, const unsigned char iv[AEAD_IV_SIZE], const void *aad, size_t aad_len,
+                 unsigned char *buf, size_t len, unsigned char tag[AEAD_TAG_SIZE]);
+int AEAD_decrypt(AEADCipher *, const unsigned char iv[AEAD_IV_SIZE], const void *aad, size_t aad_len,
+                 unsigned char *buf, size_t len, const unsigned char tag[AEAD_TAG_SIZE]);
+
+/* Same for a message scattered over iovcnt buffers, each processed in place */
+int AEAD_encrypt_iov(AEADCipher *, const unsigned char iv[AEAD_IV_SIZE], const void *aad, size_t aad_len,
+                     const struct iovec *iov, int iovcnt, unsigned char tag[AEAD_TAG_SIZE]);
+int AEAD_decrypt_iov(AEADCipher *, const unsigned char iv[AEAD_IV_SIZE], const void *aad, size_t aad_len,
+                     const struct iovec *iov, int iovcnt, const unsigned char tag[AEAD_TAG_SIZE]);
+
+/* Independent messages under one key, returns the number of failed ones */
+size_t AEAD_encrypt_batch(AEADCipher *, AEADMessage *msgs, size_t count);
+size_t AEAD_decrypt_batch(AEADCipher *, AEADMessage *msgs, size_t count);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define ARENA_DEFAULT_ALIGN _Alignof(max_align_t)
+
+typedef struct ARENA_BLOCK_T {
+    struct ARENA_BLOCK_T *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) unsigned char data[];
+} ArenaBlock;
+
+typedef struct ARENA_T {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    size_t block_size;
+} Arena;
+
+typedef struct ARENA_MARK_T {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+Arena *arena_init(size_t block_size);
+void *arena_alloc(Arena *, size_t size);
+void *arena_alloc_aligned(Arena *, size_t size, size_t align);
+void *arena_memdup(Arena *, const void *src, size_t size);
+ArenaMark arena_mark(Arena *);
+void arena_rewind(Arena *, ArenaMark mark);
+void arena_reset(Arena *);
+size_t arena_capacity(Arena *);
+void arena_destroy(Arena *);
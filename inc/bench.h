@@ -0,0 +1,216 @@
+#pragma once
+
+/*
+ * Timing harness for the bench-*.c programs.
+ *
+ * bench_run() calls fn(arg, ops) for warmup and then for the measured
+ * repetitions, and reports nanoseconds per operation as min, median, p99
+ * and mean over the repetitions, plus TSC ticks per operation on x86.
+ * Results are printed as a table and, with -j FILE or BENCH_JSON=FILE,
+ * written as JSON so runs from different commits can be compared.  With
+ * JSON on stdout the table goes to stderr so stdout stays valid JSON.
+ *
+ * Options understood by bench_suite_init():
+ *   -j FILE   JSON output ("-" for stdout)
+ *   -r N      measured repetitions (default 25)
+ *   -w N      warmup repetitions (default 3)
+ *   -s X      scale operation counts by X
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#else
+#define BENCH_HAVE_TSC 0
+#endif
+
+#define BENCH_MAX_RESULTS 128
+#define BENCH_MAX_REPS 1000
+
+typedef void (*bench_fn)(void *arg, size_t ops);
+
+typedef struct BENCH_RESULT_T {
+    char name[48];
+    char params[48];
+    size_t ops;                 /* operations per repetition */
+    size_t bytes;               /* bytes per operation, 0 if not a throughput test */
+    size_t reps;
+    double min_ns;              /* all per operation */
+    double median_ns;
+    double p99_ns;
+    double mean_ns;
+    double ticks;               /* median TSC ticks, 0 without TSC */
+} BenchResult;
+
+typedef struct BENCH_SUITE_T {
+    const char *suite;
+    const char *json_path;
+    size_t warmup;
+    size_t reps;
+    double scale;
+    FILE *table;                /* human readable results */
+    size_t count;
+    BenchResult results[BENCH_MAX_RESULTS];
+    BenchResult overflow;       /* results past BENCH_MAX_RESULTS, not reported */
+} BenchSuite;
+
+static inline double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t bench_ticks(void)
+{
+#if BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Keep the compiler from optimizing a result away */
+static inline void bench_consume(const void *p)
+{
+    __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+static inline void bench_suite_init(BenchSuite *s, const char *suite, int argc, char *argv[])
+{
+    memset(s, 0, sizeof(*s));
+    s->suite = suite;
+    s->json_path = getenv("BENCH_JSON");
+    s->warmup = 3;
+    s->reps = 25;
+    s->scale = 1.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:r:w:s:")) != -1) {
+        switch (opt) {
+        case 'j': s->json_path = optarg; break;
+        case 'r': s->reps = strtoul(optarg, NULL, 10); break;
+        case 'w': s->warmup = strtoul(optarg, NULL, 10); break;
+        case 's': s->scale = strtod(optarg, NULL); break;
+        default:
+            fprintf(stderr, "usage: %s [-j json] [-r reps] [-w warmup] [-s scale]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (s->reps < 1) s->reps = 1;
+    if (s->reps > BENCH_MAX_REPS) s->reps = BENCH_MAX_REPS;
+    if (s->scale <= 0) s->scale = 1.0;
+    s->table = s->json_path != NULL && strcmp(s->json_path, "-") == 0 ? stderr : stdout;
+
+    fprintf(s->table, "%-22s %-18s %10s %10s %10s %10s %8s %10s\n", "benchmark", "params", "min ns",
+            "median ns", "p99 ns", "mean ns", "ticks", "MB/s");
+}
+
+/* Operation count scaled by -s, at least 1 */
+static inline size_t bench_ops(BenchSuite *s, size_t ops)
+{
+    size_t n = (size_t) (ops * s->scale);
+    return n ? n : 1;
+}
+
+static inline int bench_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time fn(arg, ops) over the suite's repetitions.  setup(arg, ops), when
+ * not NULL, runs untimed before every warmup and timed call, e.g. to
+ * empty a structure the benchmark fills.
+ */
+static inline BenchResult *bench_run_ex(BenchSuite *s, const char *name, const char *params,
+                                        bench_fn setup, bench_fn fn, void *arg, size_t ops, size_t bytes)
+{
+    double ns[BENCH_MAX_REPS], ticks[BENCH_MAX_REPS];
+
+    for (size_t i = 0; i < s->warmup; i++) {
+        if (setup) setup(arg, ops);
+        fn(arg, ops);
+    }
+    for (size_t i = 0; i < s->reps; i++) {
+        if (setup) setup(arg, ops);
+        double t0 = bench_now_ns();
+        uint64_t c0 = bench_ticks();
+        fn(arg, ops);
+        uint64_t c1 = bench_ticks();
+        double t1 = bench_now_ns();
+        ns[i] = (t1 - t0) / ops;
+        ticks[i] = (double) (c1 - c0) / ops;
+    }
+
+    BenchResult *r = &s->overflow;
+    if (s->count < BENCH_MAX_RESULTS)
+        r = &s->results[s->count++];
+    else
+        fprintf(stderr, "warning: more than %d results, %s %s is left out of the report\n",
+                BENCH_MAX_RESULTS, name, params ? params : "");
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->params, sizeof(r->params), "%s", params ? params : "");
+    r->ops = ops;
+    r->bytes = bytes;
+    r->reps = s->reps;
+
+    for (size_t i = 0; i < s->reps; i++)
+        r->mean_ns += ns[i] / s->reps;
+    qsort(ns, s->reps, sizeof(double), bench_cmp_double);
+    qsort(ticks, s->reps, sizeof(double), bench_cmp_double);
+    size_t p99 = (s->reps * 99 + 99) / 100 - 1;
+    r->min_ns = ns[0];
+    r->median_ns = ns[s->reps / 2];
+    r->p99_ns = ns[p99];
+    r->ticks = BENCH_HAVE_TSC ? ticks[s->reps / 2] : 0;
+
+    char rate[16] = "-";
+    if (bytes) snprintf(rate, sizeof(rate), "%.1f", bytes / r->median_ns * 1e3);
+    fprintf(s->table, "%-22s %-18s %10.1f %10.1f %10.1f %10.1f %8.0f %10s\n", r->name, r->params,
+            r->min_ns, r->median_ns, r->p99_ns, r->mean_ns, r->ticks, rate);
+    fflush(s->table);
+    return r;
+}
+
+static inline BenchResult *bench_run(BenchSuite *s, const char *name, const char *params,
+                                     bench_fn fn, void *arg, size_t ops, size_t bytes)
+{
+    return bench_run_ex(s, name, params, NULL, fn, arg, ops, bytes);
+}
+
+/* Write the JSON report if requested, returns 0 or -1 */
+static inline int bench_suite_finish(BenchSuite *s)
+{
+    if (s->json_path == NULL || s->json_path[0] == '\0') return 0;
+
+    FILE *out = strcmp(s->json_path, "-") == 0 ? stdout : fopen(s->json_path, "w");
+    if (out == NULL) {
+        perror(s->json_path);
+        return -1;
+    }
+
+    fprintf(out, "{\n  \"suite\": \"%s\",\n  \"timestamp\": %ld,\n  \"compiler\": \"%s\",\n"
+            "  \"reps\": %zu,\n  \"warmup\": %zu,\n  \"results\": [\n",
+            s->suite, (long) time(NULL), __VERSION__, s->reps, s->warmup);
+    for (size_t i = 0; i < s->count; i++) {
+        BenchResult *r = &s->results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"params\": \"%s\", \"ops\": %zu, \"bytes\": %zu, "
+                "\"min_ns\": %.3f, \"median_ns\": %.3f, \"p99_ns\": %.3f, \"mean_ns\": %.3f, "
+                "\"ticks\": %.1f}%s\n", r->name, r->params, r->ops, r->bytes, r->min_ns,
+                r->median_ns, r->p99_ns, r->mean_ns, r->ticks, i + 1 < s->count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
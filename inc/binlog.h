@@ -0,0 +1,143 @@
+#pragma once
+
+/*
+ * Deferred-formatting binary logger.
+ *
+ * BINLOG(level, fmt, args...) registers the call site (level, file, line,
+ * function, format and argument types) at compile time in the
+ * "binlog_sites" section.  At run time the call only copies the site id,
+ * a timestamp and the raw argument values into a per-thread lock-free
+ * ring.  A background thread writes the rings to a binary file, and the
+ * logdecode tool turns the file back into text with printf semantics.
+ *
+ * Messages below the runtime level are skipped with a single relaxed load.
+ * Before binlog_open() records are rendered directly to stdout, so the
+ * macros are usable everywhere.  At most BL_MAX_ARGS arguments are
+ * supported, and '*' width/precision is not.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BL_ERROR 0
+#define BL_INFO  1
+#define BL_DEBUG 2
+
+#define BL_MAX_ARGS 8
+#define BL_MAX_STR 256
+#define BL_MAX_RECORD 1024
+#define BL_THREAD_BUFFER (64 * 1024)
+
+#define BL_FILE_MAGIC 0x474f4c42U  /* "BLOG" */
+#define BL_FILE_VERSION 1
+#define BL_ID_DROPPED 0xffffffffU
+
+/* Argument type codes */
+#define BL_T_I32 1
+#define BL_T_U32 2
+#define BL_T_I64 3
+#define BL_T_U64 4
+#define BL_T_DBL 5
+#define BL_T_STR 6
+#define BL_T_PTR 7
+
+typedef struct BL_SITE_T {
+    uint32_t level;
+    uint32_t line;
+    const char *file;
+    const char *func;
+    const char *fmt;
+    uint8_t nargs;
+    uint8_t types[BL_MAX_ARGS + 1];
+} __attribute__((aligned(64))) BinlogSite;
+
+/*
+ * Sites are found by indexing the section, so every site must have the
+ * same size and alignment.  The explicit alignment keeps GCC from raising
+ * it for larger statics.
+ */
+_Static_assert(sizeof(BinlogSite) == 64, "binlog sites must be one cache line");
+
+/* Record framing in the per-thread rings and the file */
+typedef struct BL_REC_HDR_T {
+    uint32_t id;
+    uint16_t len;               /* payload bytes after the header */
+    uint16_t thread;
+    uint64_t ts_ns;             /* CLOCK_REALTIME */
+} BinlogRecordHeader;
+
+extern _Atomic int binlog_level;
+
+int binlog_open(const char *path);
+void binlog_flush(void);
+void binlog_close(void);
+void binlog_set_level(int level);
+/* BINLOG_LEVEL=error|info|debug, also applies to the printf logger */
+void binlog_level_from_env(void);
+uint64_t binlog_dropped(void);
+/* fmt is only there for compile-time format checking */
+void binlog_write(const BinlogSite *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Render one record as text, shared by the stdout fallback and the
+ * decoder.  Returns the number of characters written.
+ */
+size_t binlog_render(const BinlogSite *site, const BinlogRecordHeader *rec,
+                     const uint8_t *payload, char *out, size_t outlen);
+
+/* Reading binary log files */
+typedef struct BL_READER_T {
+    FILE *file;
+    BinlogSite *sites;
+    uint32_t site_count;
+} BinlogReader;
+
+BinlogReader *binlog_reader_open(const char *path);
+/* 1 with a rendered line, 0 at end of file, -1 on a corrupt file */
+int binlog_reader_next(BinlogReader *, char *line, size_t len);
+void binlog_reader_close(BinlogReader *);
+
+#define BL_TYPE(a) _Generic((a),                                               \
+    _Bool: BL_T_I32, char: BL_T_I32, signed char: BL_T_I32,                   \
+    unsigned char: BL_T_U32, short: BL_T_I32, unsigned short: BL_T_U32,        \
+    int: BL_T_I32, unsigned int: BL_T_U32,                                     \
+    long: BL_T_I64, unsigned long: BL_T_U64,                                   \
+    long long: BL_T_I64, unsigned long long: BL_T_U64,                         \
+    float: BL_T_DBL, double: BL_T_DBL,                                         \
+    char *: BL_T_STR, const char *: BL_T_STR,                                  \
+    unsigned char *: BL_T_STR, const unsigned char *: BL_T_STR,                \
+    default: BL_T_PTR),
+
+#define BL_CAT_(a, b) a##b
+#define BL_CAT(a, b) BL_CAT_(a, b)
+#define BL_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, N, ...) N
+#define BL_COUNT(...) BL_COUNT_(__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+/* Type codes of all arguments after the format string */
+#define BL_TYPES_1(f)
+#define BL_TYPES_2(f, a) BL_TYPE(a)
+#define BL_TYPES_3(f, a, ...) BL_TYPE(a) BL_TYPES_2(f, __VA_ARGS__)
+#define BL_TYPES_4(f, a, ...) BL_TYPE(a) BL_TYPES_3(f, __VA_ARGS__)
+#define BL_TYPES_5(f, a, ...) BL_TYPE(a) BL_TYPES_4(f, __VA_ARGS__)
+#define BL_TYPES_6(f, a, ...) BL_TYPE(a) BL_TYPES_5(f, __VA_ARGS__)
+#define BL_TYPES_7(f, a, ...) BL_TYPE(a) BL_TYPES_6(f, __VA_ARGS__)
+#define BL_TYPES_8(f, a, ...) BL_TYPE(a) BL_TYPES_7(f, __VA_ARGS__)
+#define BL_TYPES_9(f, a, ...) BL_TYPE(a) BL_TYPES_8(f, __VA_ARGS__)
+#define BL_TYPES(...) BL_CAT(BL_TYPES_, BL_COUNT(__VA_ARGS__))(__VA_ARGS__)
+
+#define BL_FMT(f, ...) f
+
+#define BINLOG(lvl, ...) do {                                                  \
+    static const BinlogSite bl_site_                                           \
+        __attribute__((section("binlog_sites"), used)) = {                     \
+        .level = (lvl), .line = __LINE__, .file = __FILE__, .func = __func__,  \
+        .fmt = BL_FMT(__VA_ARGS__, 0),                                         \
+        .nargs = BL_COUNT(__VA_ARGS__) - 1,                                    \
+        .types = { BL_TYPES(__VA_ARGS__) 0 },                                  \
+    };                                                                         \
+    if ((lvl) <= atomic_load_explicit(&binlog_level, memory_order_relaxed))    \
+        binlog_write(&bl_site_, __VA_ARGS__);                                 \
+} while (0)
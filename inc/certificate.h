@@ -4,4 +4,22 @@
 
 
 int CA_certificate_file(TLSConnection **tls);
-int CA_certificate_priv_file(TLSConnection **tls);
\ No newline at end of file
+int CA_certificate_priv_file(TLSConnection **tls);
+
+typedef enum CA_KEY_T {
+    CA_KEY_EC_P256 = 0,
+    CA_KEY_EC_P384,
+    CA_KEY_RSA_2048,
+    CA_KEY_ED25519,
+    CA_KEY_TYPE_COUNT,
+} CAKeyType;
+
+/*
+ * Generate a throwaway self-signed P-256 certificate with the given common
+ * name and install it with its key into the context.  Meant for tests and
+ * benchmarks, returns 1 on success.
+ */
+int CA_generate_self_signed(TLSConnection **tls, const char *cn);
+/* Same with a chosen key type */
+int CA_generate_self_signed_key(TLSConnection **tls, const char *cn, CAKeyType type);
+const char *CA_key_type_name(CAKeyType type);
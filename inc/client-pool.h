@@ -0,0 +1,106 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "tls-connection.h"
+#include "mpsc-queue.h"
+
+#define CLIENT_POOL_MAX_CONNS 4
+#define CLIENT_POOL_IDLE_NS (30ULL * 1000000000ULL)
+#define CLIENT_POOL_BATCH 64
+
+/* status is 0 when the message was written, -1 otherwise */
+typedef void (*client_send_cb)(void *arg, int status);
+
+typedef struct CLIENT_POOL_OPTS_T {
+    size_t max_conns;           /* per endpoint, 0 for CLIENT_POOL_MAX_CONNS */
+    uint64_t idle_ns;           /* evict connections idle longer, 0 for CLIENT_POOL_IDLE_NS */
+} ClientPoolOpts;
+
+typedef struct CLIENT_CONN_T {
+    SSL *ssl;
+    int fd;
+    struct CLIENT_POOL_T *pool;
+    struct CLIENT_ENDPOINT_T *ep;
+    uint64_t last_used;
+    struct CLIENT_CONN_T *next;
+} ClientConn;
+
+typedef struct CLIENT_ENDPOINT_T {
+    struct sockaddr_in addr;
+    /* Most recently used first */
+    ClientConn *idle;
+    size_t open;
+    /* Latest ticket from this server for resumption */
+    SSL_SESSION *session;
+    /* Worker round in which every connection was in use */
+    uint64_t busy_round;
+    struct CLIENT_ENDPOINT_T *next;
+} ClientEndpoint;
+
+typedef struct CLIENT_POOL_STATS_T {
+    size_t handshakes;
+    size_t resumed;             /* of which abbreviated */
+    size_t reused;              /* acquires served by an idle connection */
+    size_t evicted;             /* idle timeout */
+    size_t dead;                /* failed the health check or a write */
+    size_t sent;
+    size_t failed;
+} ClientPoolStats;
+
+typedef struct CLIENT_POOL_T {
+    SSL_CTX *ctx;
+    size_t max_conns;
+    uint64_t idle_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    ClientEndpoint *endpoints;
+    ClientPoolStats stats;
+    /* Asynchronous sends, consumed by the worker thread */
+    MPSCQueue *queue;
+    pthread_t worker;
+    atomic_int running;
+    atomic_size_t pending;
+    pthread_cond_t drained;
+} ClientPool;
+
+/*
+ * Keep-alive TLS client connections.  The pool uses the client context of
+ * tls (certificates and verification set up by the caller) and installs
+ * its session callback there, tls must outlive the pool.
+ */
+ClientPool *client_pool_init(TLSConnection **tls, const ClientPoolOpts *opts);
+void client_pool_destroy(ClientPool *);
+
+/*
+ * Connection to ip:port for exclusive use until released.  Idle
+ * connections are health checked before reuse.  Blocks while max_conns
+ * connections to the endpoint are in use, returns NULL on connect or
+ * handshake failure.
+ */
+ClientConn *client_pool_acquire(ClientPool *, const char *ip, uint16_t port);
+/* healthy 0 closes the connection instead of keeping it */
+void client_pool_release(ClientPool *, ClientConn *, int healthy);
+
+/* Blocking send over a pooled connection, 0 on success */
+int client_pool_send(ClientPool *, const char *ip, uint16_t port, const void *buf, size_t len);
+
+/*
+ * Copy the message and return at once, cb(arg, status) runs on the pool's
+ * worker thread once it was written.  Queued messages to one endpoint are
+ * pipelined over the same connection and written in order; while all of
+ * an endpoint's connections are acquired elsewhere its messages wait and
+ * other endpoints are served.  Returns 0 when queued.
+ */
+int client_pool_send_async(ClientPool *, const char *ip, uint16_t port, const void *buf, size_t len,
+                           client_send_cb cb, void *arg);
+/* Wait until every queued message has completed */
+void client_pool_flush(ClientPool *);
+
+/* Close connections idle longer than idle_ns at now (CLOCK_MONOTONIC ns) */
+size_t client_pool_evict_idle(ClientPool *, uint64_t now);
+void client_pool_get_stats(ClientPool *, ClientPoolStats *out);
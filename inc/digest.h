@@ -2,14 +2,71 @@
 #include <openssl/evp.h>
 
 #define MD_DIGEST_SIZE(X) EVP_MD_get_size(X)
+#define MD_SHA256_SIZE 32
+
+/* Registry slots, MD_register_algorithm() adds more up to MD_MAX_ALGS */
+#define MD_SHA256       0
+#define MD_SHA512       1
+#define MD_SHA3_256     2
+#define MD_BLAKE2B512   3
+#define MD_BUILTIN_ALGS 4
+#define MD_MAX_ALGS     16
+
+/* Released digests each thread keeps per algorithm */
+#define MD_THREAD_CACHE 8
 
 typedef struct MD_T {
     EVP_MD_CTX *ctx;
-    EVP_MD *sha256;
+    const EVP_MD *md;           /* owned by the registry */
+    int alg;
     int md_size;
 } MessageDigest;
 
+/*
+ * Algorithm registry.  The built-in algorithms are fetched once, on the
+ * first call to any MD_ function, and live until MD_registry_cleanup() at
+ * exit.  Registered names are copied.
+ */
+int MD_registry_init(void);
+int MD_register_algorithm(const char *name);
+int MD_find_algorithm(const char *name);
+const EVP_MD *MD_get_algorithm(int alg);
+const char *MD_algorithm_name(int alg);
+void MD_registry_cleanup(void);
+
 MessageDigest *MD_digest_init();
+MessageDigest *MD_digest_init_alg(int alg);
 int MD_update_message(MessageDigest *md, void *msg, size_t msg_size);
 int MD_calculate_digest(MessageDigest *md, unsigned char *out, unsigned int *len);
-void MD_digest_free(MessageDigest **md);
\ No newline at end of file
+int MD_digest_reset(MessageDigest *md);
+void MD_digest_free(MessageDigest **md);
+
+/*
+ * Per-thread digest pool.  MD_digest_acquire() returns a digest ready for
+ * MD_update_message(), MD_digest_release() resets it and keeps it for the
+ * next acquire on the same thread.  A digest may be released on another
+ * thread than the one that acquired it.
+ */
+MessageDigest *MD_digest_acquire(int alg);
+void MD_digest_release(MessageDigest *md);
+
+/* Digest of a single buffer with a cached per-thread context */
+int MD_digest_oneshot(int alg, const void *msg, size_t len, unsigned char *out, unsigned int *out_len);
+
+/* Kernels for MD_digest_batch(), MD_BATCH_AUTO picks the fastest one the CPU supports */
+typedef enum MD_BATCH_IMPL_T {
+    MD_BATCH_AUTO = 0,
+    MD_BATCH_EVP,
+    MD_BATCH_AVX2,
+    MD_BATCH_SHANI,
+} MDBatchImpl;
+
+/*
+ * SHA-256 of count independent messages, digest i is written to
+ * out + i * MD_SHA256_SIZE.  Returns 0 on success, -1 on error.
+ */
+int MD_digest_batch(const unsigned char *const msgs[], const size_t lens[], size_t count,
+                    unsigned char *out);
+/* Returns -1 if the CPU lacks the instructions for impl */
+int MD_batch_set_impl(MDBatchImpl impl);
+const char *MD_batch_impl_name(void);
@@ -15,4 +15,6 @@ typedef struct HASH_T {
 HashMap *HM_init(int capacity);
 void *HM_add_value(HashMap *hm, int key, void *value);
 void *HM_get_value(HashMap *hm, int key);
+/* Returns the removed value, NULL if the key was not there */
+void *HM_remove_value(HashMap *hm, int key);
 void HM_free(HashMap **);
\ No newline at end of file
@@ -14,5 +14,5 @@ typedef struct {
 
 LinkedList *ll_init_list(void);
 void ll_destroy_list(LinkedList *);
-void *ll_append_data_to_list(LinkedList *, void *, size_t);
+void *ll_append_list(LinkedList *, void *, size_t);
 void *ll_pop_data_from_list(LinkedList *);
\ No newline at end of file
@@ -2,20 +2,42 @@
 #define DEBUG 1
 #endif
 
+#ifndef LOG_BINARY
+#define LOG_BINARY 0
+#endif
+
 #include <stdio.h>
 
-#define INFO_PRINT(fmt, ...) \
-    printf("[INFO] %s:%d %s(): " fmt "\n", \
-           __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+/* Both loggers filter on binlog_level at run time, see binlog.h */
+#include "binlog.h"
 
-#define ERROR_PRINT(fmt, ...) \
-    printf("[ERROR] %s:%d %s(): " fmt "\n", \
-           __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+#if LOG_BINARY
+/* Deferred formatting through binlog */
 
+#define INFO_PRINT(...) BINLOG(BL_INFO, __VA_ARGS__)
+#define ERROR_PRINT(...) BINLOG(BL_ERROR, __VA_ARGS__)
 #if DEBUG
-#define DEBUG_PRINT(fmt, ...) \
-    printf("[DEBUG] %s:%d %s(): " fmt "\n", \
-           __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+#define DEBUG_PRINT(...) BINLOG(BL_DEBUG, __VA_ARGS__)
 #else
-#define MEM_DEBUG_PRINT(fmt, ...) ((void)0)
-#endif
\ No newline at end of file
+/* Arguments stay type checked and used, the call compiles away */
+#define DEBUG_PRINT(fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#endif
+
+#else
+
+#define LOG_PRINTF(lvl, name, fmt, ...) do { \
+    if ((lvl) <= atomic_load_explicit(&binlog_level, memory_order_relaxed)) \
+        printf("[" name "] %s:%d %s(): " fmt "\n", \
+               __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
+} while (0)
+
+#define INFO_PRINT(fmt, ...) LOG_PRINTF(BL_INFO, "INFO", fmt, ##__VA_ARGS__)
+#define ERROR_PRINT(fmt, ...) LOG_PRINTF(BL_ERROR, "ERROR", fmt, ##__VA_ARGS__)
+
+#if DEBUG
+#define DEBUG_PRINT(fmt, ...) LOG_PRINTF(BL_DEBUG, "DEBUG", fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#endif
+
+#endif
@@ -9,16 +9,61 @@
 #define READ_BITMAP(bmap, i) \
     (((bmap)[(i)/8] >> ((i)%8)) & 1)
 
+/* Add new slabs on demand instead of failing when the pool is empty */
+#define POOL_GROWABLE   0x1
+/* Back slabs with explicit huge pages (MAP_HUGETLB), falls back to POOL_THP */
+#define POOL_HUGETLB    0x2
+/* Back slabs with transparent huge pages (madvise(MADV_HUGEPAGE)) */
+#define POOL_THP        0x4
+/* Place slabs on NUMA node opts->node with mbind(), first touch if that fails */
+#define POOL_NODE_LOCAL 0x8
+
+#define POOL_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+typedef struct MEM_SLAB_T {
+    void *base;
+    size_t bytes;
+    int mapped;
+    void **flist;
+    size_t flist_count;
+    size_t carved;
+    size_t free_count;
+    unsigned char *block_map;
+    struct MEM_SLAB_T *prev_partial;
+    struct MEM_SLAB_T *next_partial;
+} MemorySlab;
+
+typedef struct MEM_P_OPTS_T {
+    size_t slab_blocks;
+    size_t max_slabs;
+    size_t free_slab_watermark;
+    int flags;
+    int node;                   /* sysfs node id for POOL_NODE_LOCAL */
+} MemoryPoolOpts;
+
 typedef struct MEM_P {
-    void *pool;
     size_t block_size;
+    int block_shift;            /* log2(block_size), -1 if not a power of two */
+    size_t slab_blocks;
     size_t total_blocks;
-    void **flist;
     size_t free_count;
-    unsigned char *block_map;
+    size_t max_slabs;
+    size_t free_slab_watermark;
+    size_t empty_slabs;
+    size_t high_water;          /* most blocks in use at once */
+    int flags;
+    int node;
+    /* Slabs sorted by base address for block lookup */
+    MemorySlab **slabs;
+    size_t slab_count;
+    size_t slab_capacity;
+    /* Slabs that still have free blocks */
+    MemorySlab *partial;
 } MemoryPool;
 
 MemoryPool *pool_init(size_t block_size, size_t block_count);
+MemoryPool *pool_init_ex(size_t block_size, const MemoryPoolOpts *opts);
 void *pool_malloc(MemoryPool *);
 void pool_free(MemoryPool *, void *block);
-void pool_destroy(MemoryPool *);
\ No newline at end of file
+int pool_owns(MemoryPool *, void *block);
+void pool_destroy(MemoryPool *);
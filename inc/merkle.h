@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "digest.h"
+
+/*
+ * Merkle tree over a memory mapped file.  The file is split into fixed
+ * size chunks, leaves are H(0x00 || chunk) and inner nodes
+ * H(0x01 || left || right); a node without a sibling is promoted to the
+ * next level unchanged.  Leaves are hashed in parallel.
+ *
+ * The mapping follows in-place writes to the file, but the file must not
+ * shrink while a rehash is running (reads past the new end fault).
+ */
+
+#define MERKLE_DEFAULT_CHUNK (1024 * 1024)
+
+typedef struct MERKLE_OPTS_T {
+    size_t chunk_size;          /* 0 for MERKLE_DEFAULT_CHUNK */
+    int threads;                /* 0 for one per online CPU */
+    int alg;                    /* digest registry slot, e.g. MD_SHA256 */
+} MerkleOpts;
+
+typedef struct MERKLE_TREE_T {
+    int fd;
+    const unsigned char *map;
+    size_t size;
+    size_t chunk_size;
+    int threads;
+    int alg;
+    int md_size;
+    size_t leaves;
+    size_t levels;
+    size_t *level_start;        /* first node of each level, leaves are level 0 */
+    size_t *level_count;
+    unsigned char *nodes;       /* all levels, md_size bytes per node */
+    unsigned char *dirty;       /* per leaf, scratch for inner levels */
+    size_t dirty_count;
+} MerkleTree;
+
+MerkleTree *merkle_open(const char *path, const MerkleOpts *opts);
+void merkle_close(MerkleTree *);
+
+/* Mark byte range as modified, merkle_rehash() hashes just those chunks */
+int merkle_mark_dirty(MerkleTree *, off_t offset, size_t len);
+/* Rehash dirty chunks and remap if the file size changed, returns chunks hashed or -1 */
+ssize_t merkle_rehash(MerkleTree *);
+
+const unsigned char *merkle_root(MerkleTree *);
+const unsigned char *merkle_leaf(MerkleTree *, size_t index);
+
+/* Leaf hash of a received chunk, to check it against a proof */
+int merkle_hash_chunk(int alg, const void *data, size_t len, unsigned char *out);
+/*
+ * Sibling hashes from leaf to root, written to out (max hashes).  Returns
+ * the number of hashes or -1.
+ */
+ssize_t merkle_proof(MerkleTree *, size_t index, unsigned char *out, size_t max);
+/* Returns 1 if leaf_hash at index belongs to root, 0 if not */
+int merkle_verify(int alg, const unsigned char *leaf_hash, size_t index, size_t leaves,
+                  const unsigned char *proof, size_t proof_count, const unsigned char *root);
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "memory-pool.h"
+
+/*
+ * Metrics registry.
+ *
+ * Counters and histograms are sharded: every thread updates its own cache
+ * line with a relaxed atomic add and the shards are only summed when the
+ * metrics are read.  Gauges are a single atomic value.  Counters and
+ * gauges can also be backed by a callback evaluated at read time, for
+ * values another module already keeps (SSL session cache, pools).
+ *
+ * metrics_serve() answers every connection on a Unix socket with a text
+ * dump, e.g. `socat - UNIX-CONNECT:/tmp/server.metrics`.
+ */
+
+#define METRICS_SHARDS 8
+#define METRICS_NAME_LEN 64
+#define METRICS_CACHE_LINE 64
+
+/* Log-linear histogram: 8 sub-buckets per power of two, values < 2^40 */
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_BITS 40
+#define METRICS_HIST_BUCKETS ((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB)
+
+#define METRIC_COUNTER   0
+#define METRIC_GAUGE     1
+#define METRIC_HISTOGRAM 2
+
+typedef struct METRIC_SHARD_T {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t value;
+} MetricShard;
+
+typedef struct METRIC_HIST_SHARD_T {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[METRICS_HIST_BUCKETS];
+} MetricHistShard;
+
+typedef struct METRIC_T {
+    char name[METRICS_NAME_LEN];
+    const char *help;
+    int type;
+    MetricShard *shards;            /* counters */
+    MetricHistShard *hist;          /* histograms */
+    _Atomic int64_t gauge;          /* gauges */
+    int64_t (*fn)(void *arg);       /* callback backed counters and gauges */
+    void *arg;
+    pthread_mutex_t *lock;          /* held around fn, NULL if not needed */
+    struct METRIC_T *next;
+} Metric;
+
+typedef struct METRIC_HIST_SNAP_T {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+} MetricHistogramSnapshot;
+
+extern __thread int metrics_shard_id;
+int metrics_assign_shard(void);
+
+static inline int metrics_shard(void)
+{
+    int id = metrics_shard_id;
+    return id >= 0 ? id : metrics_assign_shard();
+}
+
+/* Registering an existing name returns the existing metric */
+Metric *metrics_counter(const char *name, const char *help);
+Metric *metrics_gauge(const char *name, const char *help);
+Metric *metrics_histogram(const char *name, const char *help);
+Metric *metrics_counter_fn(const char *name, const char *help, int64_t (*fn)(void *), void *arg);
+Metric *metrics_gauge_fn(const char *name, const char *help, int64_t (*fn)(void *), void *arg);
+/*
+ * Free blocks, blocks and high-water mark of a pool as <prefix>_* gauges.
+ * MemoryPool has no lock of its own, so the counters are read under the
+ * lock its users take around pool calls (NULL for a single thread).
+ */
+int metrics_register_pool(const char *prefix, MemoryPool *, pthread_mutex_t *lock);
+
+static inline void metrics_add(Metric *m, uint64_t n)
+{
+    atomic_fetch_add_explicit(&m->shards[metrics_shard()].value, n, memory_order_relaxed);
+}
+
+static inline void metrics_inc(Metric *m)
+{
+    metrics_add(m, 1);
+}
+
+static inline void metrics_gauge_set(Metric *m, int64_t v)
+{
+    atomic_store_explicit(&m->gauge, v, memory_order_relaxed);
+}
+
+static inline void metrics_gauge_add(Metric *m, int64_t v)
+{
+    atomic_fetch_add_explicit(&m->gauge, v, memory_order_relaxed);
+}
+
+void metrics_record(Metric *hist, uint64_t value);
+
+/* Aggregated reads */
+int64_t metrics_read(Metric *);
+void metrics_hist_snapshot(Metric *, MetricHistogramSnapshot *);
+uint64_t metrics_hist_quantile(const MetricHistogramSnapshot *, double q);
+uint64_t metrics_hist_bucket_upper(int bucket);
+
+void metrics_dump(FILE *out);
+int metrics_serve(const char *socket_path);
+void metrics_stop(void);
+/* Free all metrics, only at exit once nothing updates them */
+void metrics_destroy(void);
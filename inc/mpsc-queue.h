@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define MPSC_CACHE_LINE 64
+
+/*
+ * Get pointer to the structure that embeds the given queue node.
+ */
+#define MPSC_ENTRY(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+typedef struct MPSC_NODE_T {
+    struct MPSC_NODE_T *_Atomic next;
+} MPSCNode;
+
+typedef struct MPSC_Q_T {
+    /* Written by producers */
+    _Alignas(MPSC_CACHE_LINE) MPSCNode *_Atomic head;
+    /* Written by consumer */
+    _Alignas(MPSC_CACHE_LINE) MPSCNode *tail;
+    MPSCNode stub;
+    /* Optional wakeup for a consumer sleeping in epoll */
+    _Alignas(MPSC_CACHE_LINE) atomic_int armed;
+    int event_fd;
+} MPSCQueue;
+
+MPSCQueue *mpsc_init_queue(void);
+void mpsc_destroy_queue(MPSCQueue *);
+void mpsc_push(MPSCQueue *, MPSCNode *node);
+MPSCNode *mpsc_pop(MPSCQueue *);
+size_t mpsc_pop_batch(MPSCQueue *, MPSCNode **nodes, size_t max);
+int mpsc_is_empty(MPSCQueue *);
+
+/*
+ * Wakeup support.  mpsc_enable_wakeup() creates an eventfd that the consumer
+ * can add to its epoll set.  Before blocking, the consumer calls
+ * mpsc_arm_wakeup(); if it returns 0 the queue was empty and the next push
+ * will signal the eventfd.  After waking, mpsc_ack_wakeup() clears the fd.
+ */
+int mpsc_enable_wakeup(MPSCQueue *);
+int mpsc_arm_wakeup(MPSCQueue *);
+void mpsc_ack_wakeup(MPSCQueue *);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "memory-pool.h"
+
+#define PCACHE_DEFAULT_MAG_SIZE 64
+#define PCACHE_DEFAULT_MAX_FULL 16
+
+typedef struct POOL_MAG_T {
+    struct POOL_MAG_T *next;
+    size_t rounds;
+    void *slots[];
+} PoolMagazine;
+
+typedef struct POOL_TCACHE_T {
+    struct POOL_CACHE_T *pc;
+    PoolMagazine *loaded;
+    PoolMagazine *previous;
+    struct POOL_TCACHE_T *next;
+} PoolThreadCache;
+
+typedef struct POOL_CACHE_T {
+    MemoryPool *pool;
+    size_t mag_size;
+    size_t max_full;
+    pthread_key_t key;
+    /* Depot, protected by lock */
+    pthread_mutex_t lock;
+    PoolMagazine *full;
+    size_t full_count;
+    PoolMagazine *empty;
+    PoolThreadCache *threads;
+} PoolCache;
+
+/*
+ * Concurrent front end for a MemoryPool.  Every thread keeps two magazines
+ * of free blocks and only takes the depot lock when both are empty (alloc)
+ * or both are full (free).  The underlying pool is only touched under the
+ * depot lock, so blocks may be freed from any thread.
+ *
+ * Blocks sitting in magazines are free from the pool's point of view, so
+ * double-free detection only happens once a magazine is flushed back to
+ * the pool.
+ */
+PoolCache *pcache_init(MemoryPool *mp, size_t mag_size, size_t max_full);
+void *pcache_malloc(PoolCache *);
+void pcache_free(PoolCache *, void *block);
+void pcache_flush_thread(PoolCache *);
+void pcache_destroy(PoolCache *);
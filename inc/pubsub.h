@@ -0,0 +1,115 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "memory-pool.h"
+#include "pool-cache.h"
+
+#define PUBSUB_MAX_MESSAGE 4000
+#define PUBSUB_QUEUE_LEN 64
+#define PUBSUB_TOPIC_LEN 32
+
+/*
+ * Writes up to len bytes like write() on a non-blocking socket: bytes
+ * written, or -1 with errno EAGAIN when it has to be repeated later.
+ */
+typedef ssize_t (*pubsub_write_fn)(void *ctx, const void *buf, size_t len);
+
+typedef struct PUBSUB_MSG_T {
+    atomic_uint refs;
+    uint32_t pooled;            /* 0 when larger than the pool blocks */
+    struct PUBSUB_T *ps;
+    size_t len;
+    unsigned char data[];
+} PubSubMessage;
+
+typedef struct PUBSUB_SUB_T {
+    struct PUBSUB_T *ps;
+    pthread_mutex_t lock;
+    /* Messages not yet written, shared with every other subscriber */
+    PubSubMessage **queue;
+    size_t queue_mask;
+    size_t head;
+    size_t tail;
+    /* Bytes of the head message already written */
+    size_t offset;
+    size_t dropped;
+    void *user;
+} PubSubSubscriber;
+
+typedef struct PUBSUB_TOPIC_T {
+    char name[PUBSUB_TOPIC_LEN];
+    PubSubSubscriber **subs;
+    size_t count;
+    size_t capacity;
+    struct PUBSUB_TOPIC_T *next;
+} PubSubTopic;
+
+typedef struct PUBSUB_STATS_T {
+    size_t published;
+    size_t queued;              /* subscriber references taken */
+    size_t dropped;             /* subscriber queue was full */
+    size_t live;                /* messages not yet freed */
+} PubSubStats;
+
+typedef struct PUBSUB_T {
+    MemoryPool *pool;
+    PoolCache *cache;
+    size_t max_message;
+    size_t queue_len;
+    /* Topic list and subscriber arrays */
+    pthread_rwlock_t lock;
+    PubSubTopic *topics;
+    atomic_size_t published;
+    atomic_size_t queued;
+    atomic_size_t dropped;
+    atomic_size_t live;
+} PubSub;
+
+/*
+ * Topic based fan-out.  A published message is stored once in a pool
+ * block and every subscriber queues a reference to it, the block goes
+ * back to the pool when the last subscriber has written it.  Messages up
+ * to max_message bytes (0 for PUBSUB_MAX_MESSAGE) come from the pool,
+ * larger ones from malloc.  queue_len (0 for PUBSUB_QUEUE_LEN) is rounded
+ * up to a power of two, a subscriber with a full queue misses messages.
+ */
+PubSub *pubsub_init(size_t max_message, size_t queue_len);
+void pubsub_destroy(PubSub *);
+
+PubSubSubscriber *pubsub_subscriber_new(PubSub *, void *user);
+/* Unsubscribes from every topic and drops the queued messages */
+void pubsub_subscriber_free(PubSubSubscriber *);
+int pubsub_subscribe(PubSubSubscriber *, const char *topic);
+int pubsub_unsubscribe(PubSubSubscriber *, const char *topic);
+
+/*
+ * Copy data once into a message and queue it to every subscriber of the
+ * topic.  Returns the number of subscribers it was queued to, -1 on error.
+ */
+int pubsub_publish(PubSub *, const char *topic, const void *data, size_t len);
+
+/*
+ * Build the payload in place: fill msg->data and publish it, which hands
+ * the caller's reference over.  pubsub_msg_release() drops it unpublished.
+ */
+PubSubMessage *pubsub_msg_alloc(PubSub *, size_t len);
+int pubsub_publish_msg(PubSub *, const char *topic, PubSubMessage *msg);
+void pubsub_msg_release(PubSubMessage *);
+
+/*
+ * Write queued messages straight from the shared buffers with fn(ctx, ..)
+ * until the queue is empty or fn would block.  Only one thread may flush
+ * a subscriber at a time.  Returns bytes written, -1 when fn failed.
+ */
+ssize_t pubsub_flush(PubSubSubscriber *, pubsub_write_fn fn, void *ctx);
+size_t pubsub_pending(PubSubSubscriber *);
+
+/* pubsub_write_fn for an SSL *, encrypts from the shared buffer */
+ssize_t pubsub_ssl_write(void *ssl, const void *buf, size_t len);
+
+void pubsub_get_stats(PubSub *, PubSubStats *out);
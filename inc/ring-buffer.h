@@ -2,18 +2,51 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
+/* Default size for rbuf_init_buffer(), sizes are always powers of two */
 #define BUFFER_SIZE 1024
 
 typedef struct BUFF_T {
-    uint8_t data[BUFFER_SIZE];
-    size_t head;
-    size_t tail;
+    uint8_t *data;
+    size_t size;
+    size_t mask;
+    /* Free-running byte counters, position is counter & mask */
+    uint64_t head;
+    uint64_t tail;
+    /* Data is mapped twice back-to-back, see rbuf_init_mirrored() */
+    int mirrored;
+    /* Stores that overwrote unread data */
+    uint64_t overwrites;
 } RingBuffer;
 
 void rbuf_store_data(RingBuffer*, uint8_t *src, size_t count);
 size_t rbuf_pop_data(RingBuffer*, uint8_t *dest, size_t count);
+size_t rbuf_peek(RingBuffer *, struct iovec iov[2], int *iovcnt);
+size_t rbuf_skip(RingBuffer *, size_t count);
 size_t rbuf_get_buffer_size(RingBuffer *);
 size_t rbuf_get_free_space(RingBuffer *);
+size_t rbuf_get_readable(RingBuffer *);
+/* Overwrite events of all ring buffers in the process */
+uint64_t rbuf_get_overwrite_events(void);
 RingBuffer *rbuf_init_buffer(void);
+RingBuffer *rbuf_init_buffer_size(size_t size);
+
+/*
+ * Mirrored ring buffer.  The same memfd pages are mapped twice in a row,
+ * so every readable or writable region is contiguous and can be passed
+ * directly to recv(), SSL_read() or a parser.  Size is rounded up to a
+ * power of two of at least one page.
+ */
+RingBuffer *rbuf_init_mirrored(size_t size);
+
+/*
+ * In-place access.  For mirrored buffers avail covers all free/readable
+ * bytes, otherwise only the part up to the wrap point.
+ */
+uint8_t *rbuf_write_ptr(RingBuffer *, size_t *avail);
+size_t rbuf_write_iov(RingBuffer *, struct iovec iov[2], int *iovcnt);
+void rbuf_commit(RingBuffer *, size_t count);
+uint8_t *rbuf_read_ptr(RingBuffer *, size_t *avail);
+void rbuf_consume(RingBuffer *, size_t count);
 void rbuf_free_buffer(RingBuffer *);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ring-buffer.h"
+
+#define RJ_MAGIC 0x4a425252U   /* "RRBJ" */
+#define RJ_VERSION 1
+
+/* rbuf_journal_next() return value when the reader fell behind the tail */
+#define RJ_OVERWRITTEN (-2)
+
+/* Durability policy */
+#define RJ_DURABILITY_NONE   0  /* leave writeback to the kernel */
+#define RJ_DURABILITY_BATCH  1  /* sync when a batch threshold is reached */
+#define RJ_DURABILITY_ALWAYS 2  /* sync after every append */
+
+/* Sync method */
+#define RJ_SYNC_MSYNC     0     /* msync() only the dirty range */
+#define RJ_SYNC_FDATASYNC 1     /* fdatasync() the whole file */
+
+typedef struct RJ_OPTS_T {
+    int durability;
+    int sync_method;
+    /* RJ_DURABILITY_BATCH thresholds, 0 disables the threshold */
+    size_t batch_records;
+    size_t batch_bytes;
+    unsigned batch_interval_ms;
+} RingJournalOpts;
+
+/* First page of the journal file */
+typedef struct RJ_FILE_HDR_T {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t head_seq;          /* sequence of the next record */
+    uint64_t tail_seq;          /* sequence of the oldest record */
+} RingJournalHeader;
+
+typedef struct RJ_REC_HDR_T {
+    uint32_t len;
+    uint32_t crc;
+    uint64_t seq;
+} RingJournalRecordHeader;
+
+typedef struct RJ_T {
+    int fd;
+    RingJournalHeader *hdr;
+    /* Mirrored view of the data area, head/tail mirror the file header */
+    RingBuffer rb;
+    size_t map_bytes;
+    RingJournalOpts opts;
+    /* Dirty state since the last sync */
+    uint64_t synced_head;
+    size_t pending_records;
+    uint64_t last_sync_ms;
+} RingJournal;
+
+typedef struct RJ_READER_T {
+    uint64_t pos;
+    uint64_t next_seq;
+    uint64_t lost;              /* records overwritten before they were read */
+} RingJournalReader;
+
+typedef struct RJ_RECORD_T {
+    uint64_t seq;
+    const void *data;           /* points into the journal mapping */
+    size_t len;
+} RingJournalRecord;
+
+/*
+ * Open or create a journal file with `size` bytes of record storage
+ * (rounded up to a power of two pages).  An existing file is recovered:
+ * records are validated from the tail by sequence number and CRC, and the
+ * journal ends at the first torn or stale record.  A tail left behind by a
+ * header that did not reach the disk moves to the oldest intact record.
+ * opts may be NULL.
+ */
+RingJournal *rbuf_journal_open(const char *path, size_t size, const RingJournalOpts *opts);
+/* Append one record, evicting the oldest records when full. 0 or -1. */
+int rbuf_journal_append(RingJournal *, const void *data, size_t len, uint64_t *seq);
+int rbuf_journal_sync(RingJournal *);
+/* Drop records up to and including seq */
+void rbuf_journal_trim(RingJournal *, uint64_t seq);
+size_t rbuf_journal_replay(RingJournal *, void (*cb)(const RingJournalRecord *, void *), void *arg);
+void rbuf_journal_close(RingJournal *);
+
+/*
+ * Readers start at the oldest record and return 1 per record, 0 when they
+ * caught up, or RJ_OVERWRITTEN once if the writer lapped them.  In that
+ * case reader->lost counts the skipped records and the reader continues
+ * from the oldest record still available.
+ */
+void rbuf_journal_reader_init(RingJournal *, RingJournalReader *);
+int rbuf_journal_next(RingJournal *, RingJournalReader *, RingJournalRecord *);
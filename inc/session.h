@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include "tls-connection.h"
 
+#define SESSION_MAX_PUBKEYS 64
+
 /*
  * Servers that want to enable session resumption must specify a cache id
  * byte array, that identifies the server application, and reduces the
@@ -29,4 +31,19 @@ void TLS_set_session_timeout(TLSConnection **tls, int timeout);
 /*
  * 
  */
-int TLS_server_set_client_verification(TLSConnection **tls, const bool verification);
\ No newline at end of file
+int TLS_server_set_client_verification(TLSConnection **tls, const bool verification);
+
+/*
+ * Require client certificates issued by (or equal to) cert, verified by
+ * the same handler as TLS_server_set_client_verification() but without a
+ * CA file.  Returns 1 on success.
+ */
+int TLS_server_trust_client_cert(TLSConnection **tls, X509 *cert);
+
+/*
+ * Client public keys accepted in addition to ALLOWED_PUBKEYS in
+ * whitelist.h, SESSION_MAX_PUBKEYS in total.  The whitelist holds a
+ * reference to the key, TLS_whitelist_clear() drops the added keys.
+ */
+int TLS_whitelist_add_pubkey(EVP_PKEY *pubkey);
+void TLS_whitelist_clear(void);
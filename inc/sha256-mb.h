@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-256 kernels behind MD_digest_batch().  Every kernel hashes `count`
+ * independent messages and writes count * 32 bytes of digests to out.
+ */
+
+#define SHA256_MB_LANES 8
+
+typedef void (*sha256_mb_fn)(const unsigned char *const msgs[], const size_t lens[],
+                             size_t count, unsigned char *out);
+
+int sha256_mb_have_shani(void);
+int sha256_mb_have_avx2(void);
+
+/* SHA-NI, two messages interleaved */
+void sha256_mb_shani(const unsigned char *const msgs[], const size_t lens[],
+                     size_t count, unsigned char *out);
+/* AVX2, 8 messages interleaved in the lanes of 256-bit registers */
+void sha256_mb_avx2(const unsigned char *const msgs[], const size_t lens[],
+                    size_t count, unsigned char *out);
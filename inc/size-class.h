@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory-pool.h"
+#include "pool-cache.h"
+
+#define SC_MIN_SHIFT 5
+#define SC_MAX_SHIFT 12
+#define SC_CLASS_COUNT (SC_MAX_SHIFT - SC_MIN_SHIFT + 1)
+#define SC_HEADER_SIZE 16
+#define SC_SLAB_BYTES (64 * 1024)
+
+typedef struct SC_CLASS_T {
+    size_t block_size;
+    MemoryPool *pool;
+    PoolCache *cache;
+    atomic_size_t allocs;
+    atomic_size_t frees;
+    atomic_size_t requested;
+} SizeClass;
+
+typedef struct SC_ALLOC_T {
+    SizeClass classes[SC_CLASS_COUNT];
+    /* Requests above the largest class go to malloc */
+    atomic_size_t large_allocs;
+    atomic_size_t large_frees;
+    atomic_size_t large_requested;
+} SizeClassAllocator;
+
+typedef struct SC_STATS_T {
+    size_t block_size;          /* 0 for the malloc fallback */
+    size_t allocs;
+    size_t frees;
+    size_t live;
+    size_t requested;           /* total bytes asked for */
+    size_t pool_blocks;         /* blocks owned by the class pool */
+    size_t pool_free;           /* of which free in the pool itself */
+} SizeClassStats;
+
+SizeClassAllocator *sc_init(void);
+void *sc_malloc(SizeClassAllocator *, size_t size);
+void *sc_realloc(SizeClassAllocator *, void *ptr, size_t size);
+void sc_free(SizeClassAllocator *, void *ptr);
+size_t sc_get_stats(SizeClassAllocator *, SizeClassStats *out, size_t max);
+void sc_dump_stats(SizeClassAllocator *, FILE *out);
+void sc_destroy(SizeClassAllocator *);
+
+/*
+ * Route OpenSSL allocations through the allocator.  Must be called before
+ * the first OpenSSL allocation (i.e. before SSL_CTX_new()), and the
+ * allocator must not be destroyed afterwards.
+ */
+int sc_install_openssl(SizeClassAllocator *);
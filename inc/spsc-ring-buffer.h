@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#define SPSC_CACHE_LINE 64
+
+/*
+ * Lock-free single-producer/single-consumer byte ring.
+ *
+ * Unlike RingBuffer it never overwrites: the producer only writes into
+ * free space.  Each side keeps its working counter and a cached copy of
+ * the other side's counter on a private cache line, so the shared
+ * counters are only re-read when the cached view runs out.  The published
+ * counters sit on lines of their own: the side polling one doesn't lose
+ * its copy of the line to every store or pop of the other side.
+ *
+ * rbuf_spsc_store() writes without making data visible, and
+ * rbuf_spsc_publish() releases everything stored so far with a single
+ * atomic store.  rbuf_spsc_push() does both.
+ */
+typedef struct SPSC_BUFF_T {
+    /* Producer private */
+    _Alignas(SPSC_CACHE_LINE) uint64_t head_local;
+    uint64_t tail_cache;
+    /* Published by the producer */
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint64_t head;
+    /* Consumer private */
+    _Alignas(SPSC_CACHE_LINE) uint64_t tail_local;
+    uint64_t head_cache;
+    /* Published by the consumer */
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint64_t tail;
+    /* Read-only after init */
+    _Alignas(SPSC_CACHE_LINE) uint8_t *data;
+    size_t size;
+    size_t mask;
+} SPSCRingBuffer;
+
+SPSCRingBuffer *rbuf_spsc_init(size_t size);
+void rbuf_spsc_free(SPSCRingBuffer *);
+
+/* Producer side */
+size_t rbuf_spsc_store(SPSCRingBuffer *, const uint8_t *src, size_t count);
+void rbuf_spsc_publish(SPSCRingBuffer *);
+size_t rbuf_spsc_push(SPSCRingBuffer *, const uint8_t *src, size_t count);
+size_t rbuf_spsc_free_space(SPSCRingBuffer *);
+
+/* Consumer side */
+size_t rbuf_spsc_pop(SPSCRingBuffer *, uint8_t *dest, size_t count);
+size_t rbuf_spsc_peek(SPSCRingBuffer *, struct iovec iov[2], int *iovcnt);
+void rbuf_spsc_consume(SPSCRingBuffer *, size_t count);
+size_t rbuf_spsc_readable(SPSCRingBuffer *);
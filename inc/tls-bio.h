@@ -0,0 +1,27 @@
+#pragma once
+
+#include <sys/types.h>
+#include <openssl/bio.h>
+
+#include "tls-connection.h"
+#include "ring-buffer.h"
+
+/*
+ * BIO whose reads come from `in` and whose writes go to `out`.  OpenSSL
+ * never touches the socket, the event loop moves data between the socket
+ * and the buffers with TLS_bio_fill_from_socket() and
+ * TLS_bio_drain_to_socket().  When `in` is empty reads ask for a retry
+ * (SSL_ERROR_WANT_READ), when `out` is full writes do (SSL_ERROR_WANT_WRITE).
+ */
+BIO *TLS_bio_new(RingBuffer *in, RingBuffer *out);
+void TLS_bio_set_eof(BIO *bio);
+
+int TLS_init_ssl_for_buffers(TLSConnection **tls, RingBuffer *in, RingBuffer *out);
+
+/*
+ * Move as much as fits/is available in one readv()/writev().  Return the
+ * byte count, 0 on EOF (fill only), or -1 with errno set.  EAGAIN is
+ * reported as -1 as well, like the underlying syscalls.
+ */
+ssize_t TLS_bio_fill_from_socket(int fd, RingBuffer *in);
+ssize_t TLS_bio_drain_to_socket(int fd, RingBuffer *out);
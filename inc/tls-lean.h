@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tls-connection.h"
+#include "ring-buffer.h"
+#include "memory-pool.h"
+#include "pool-cache.h"
+
+/* Ring buffer block size, a full TLS record fits in one */
+#define TLS_LEAN_BUFFER_SIZE (16 * 1024)
+#define TLS_LEAN_IDLE_NS (5ULL * 1000000000ULL)
+
+typedef struct TLS_LEAN_POOL_T {
+    MemoryPool *pool;
+    PoolCache *cache;
+    size_t buffer_size;
+    /* Empty buffers are kept this long after the last activity */
+    uint64_t idle_ns;
+    atomic_size_t in_use;
+} TLSLeanPool;
+
+typedef struct TLS_LEAN_CONN_T {
+    SSL *ssl;
+    int fd;
+    TLSLeanPool *pool;
+    /* data is NULL while no bytes are in flight */
+    RingBuffer in;
+    RingBuffer out;
+    uint64_t last_active;
+} TLSLeanConn;
+
+/*
+ * Idle connection memory mode for servers holding very many mostly idle
+ * connections.  TLS_set_lean_mode() makes OpenSSL release its read and
+ * write buffers whenever they are empty (SSL_MODE_RELEASE_BUFFERS).
+ */
+void TLS_set_lean_mode(TLSConnection **tls);
+
+/*
+ * Shared pool of ring buffer blocks.  buffer_size is rounded up to a power
+ * of two, 0 means TLS_LEAN_BUFFER_SIZE.  idle_ns 0 returns buffers to the
+ * pool as soon as they run empty, otherwise TLS_lean_shrink() does it.
+ */
+TLSLeanPool *TLS_lean_pool_init(size_t buffer_size, uint64_t idle_ns);
+void TLS_lean_pool_destroy(TLSLeanPool *);
+
+/*
+ * Connection on a non-blocking socket whose ring buffers are taken from
+ * the pool only while data is in flight.  Call SSL_set_accept_state() or
+ * SSL_set_connect_state() on conn->ssl before the handshake.
+ */
+TLSLeanConn *TLS_lean_conn_new(TLSConnection **tls, TLSLeanPool *pool, int fd);
+void TLS_lean_conn_free(TLSLeanConn *);
+
+/* 1 when done, 0 when waiting for the socket, -1 on failure */
+int TLS_lean_handshake(TLSLeanConn *);
+
+/*
+ * Like read()/write() on a non-blocking socket: -1 with errno EAGAIN when
+ * the call has to be repeated once the socket is ready, 0 on EOF (read).
+ * Ciphertext the socket did not take stays buffered, TLS_lean_flush()
+ * sends it on POLLOUT.
+ */
+ssize_t TLS_lean_read(TLSLeanConn *, void *buf, size_t len);
+ssize_t TLS_lean_write(TLSLeanConn *, const void *buf, size_t len);
+ssize_t TLS_lean_flush(TLSLeanConn *);
+
+/*
+ * Give the ring buffers back to the pool and free OpenSSL buffers when
+ * the connection has been idle for the pool's idle_ns at time now
+ * (CLOCK_MONOTONIC ns) and nothing is buffered.  Returns 1 if shrunk.
+ */
+int TLS_lean_shrink(TLSLeanConn *, uint64_t now);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <openssl/ssl.h>
+
+/*
+ * Handshake tracing.  tls_info_callback() feeds every state transition
+ * into a per-connection span buffer; sampled handshakes are written to a
+ * Chrome trace-event JSON file (chrome://tracing, ui.perfetto.dev) when
+ * they complete, one row per handshake.  With tracing off, each callback
+ * costs one relaxed load.
+ */
+
+#define TLS_TRACE_MAX_EVENTS 64
+
+extern _Atomic int tls_trace_enabled;
+
+/* Trace one of every sample_every handshakes, 1 traces all of them */
+int TLS_trace_open(const char *path, unsigned sample_every);
+void TLS_trace_close(void);
+
+void TLS_trace_info(const SSL *ssl, int where, int ret);
+/* Named span inside the handshake, e.g. around the verify callback */
+void TLS_trace_mark(const SSL *ssl, const char *name, int begin);
+
+static inline int TLS_trace_active(void)
+{
+    return atomic_load_explicit(&tls_trace_enabled, memory_order_relaxed);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TOPO_MAX_NODES 64
+#define TOPO_MAX_CPUS 1024
+
+typedef struct TOPO_NODE_T {
+    int id;                     /* node number in sysfs */
+    int cpu_count;
+    uint64_t cpus[TOPO_MAX_CPUS / 64];
+} TopologyNode;
+
+typedef struct TOPOLOGY_T {
+    int node_count;
+    int cpu_count;
+    TopologyNode nodes[TOPO_MAX_NODES];
+    /* Index into nodes for every online CPU, -1 otherwise */
+    short cpu_node[TOPO_MAX_CPUS];
+} Topology;
+
+/*
+ * Read the CPU and NUMA layout from sysfs_root (NULL for "/sys").
+ * Without node directories, e.g. kernels built without NUMA, all online
+ * CPUs form a single node.  Returns the node count, -1 on failure.
+ */
+int topology_load(Topology *, const char *sysfs_root);
+
+/* Everything below is a no-op on a single node machine */
+static inline int topology_is_numa(const Topology *topo)
+{
+    return topo->node_count > 1;
+}
+
+/* Node index of cpu, or of the calling thread's CPU for cpu < 0 */
+int topology_node_of_cpu(const Topology *, int cpu);
+
+/*
+ * Pin a thread to the node's CPUs, or with core >= 0 to core-th CPU of
+ * the node (modulo its CPU count).  The attr variant applies to threads
+ * created with it.  0 on success.
+ */
+int topology_pin_thread(const Topology *, pthread_t thread, int node, int core);
+int topology_attr_set_node(const Topology *, pthread_attr_t *, int node);
+
+/*
+ * Prefer the sysfs node id for pages of [addr, addr + len) with mbind().
+ * Must be called before the pages are touched.  When mbind() is not
+ * available the pages land wherever they are first touched, so touch
+ * them from a thread pinned to the node.  0 on success.
+ */
+int topology_bind_memory(void *addr, size_t len, int node_id);
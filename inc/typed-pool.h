@@ -0,0 +1,113 @@
+#pragma once
+
+/*
+ * Type-specialized fixed-size pools.
+ *
+ * DEFINE_POOL(Type, N) generates a pool structure TypePool holding N
+ * objects of Type and the functions Type_pool_init(), Type_pool_alloc(),
+ * Type_pool_free(), Type_pool_owns(), Type_pool_create() and
+ * Type_pool_destroy().  Type must be a single identifier (use a typedef
+ * for structs).
+ *
+ * The block stride is known at compile time and rounded up to the type's
+ * alignment, or to a cache line with DEFINE_POOL_CACHELINE() so objects
+ * used by different threads never share a line.  Power-of-two strides use
+ * shift/mask index math.  Free blocks are tracked in 64-bit words and
+ * found with __builtin_ctzll(), starting from the word of the last hit.
+ *
+ * Like MemoryPool, the generated pools are not thread-safe.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TPOOL_CACHE_LINE 64
+#define TPOOL_ROUND_UP(x, a) ((((x) + (a) - 1) / (a)) * (a))
+#define TPOOL_IS_POW2(x) (((x) & ((x) - 1)) == 0)
+
+#define DEFINE_POOL(Type, N) \
+    DEFINE_POOL_ALIGNED(Type, N, _Alignof(Type))
+
+#define DEFINE_POOL_CACHELINE(Type, N) \
+    DEFINE_POOL_ALIGNED(Type, N, TPOOL_CACHE_LINE)
+
+#define DEFINE_POOL_ALIGNED(Type, N, Align)                                     \
+enum {                                                                         \
+    Type##_pool_capacity = (N),                                                \
+    Type##_pool_align = (Align) > _Alignof(Type) ? (Align) : _Alignof(Type),   \
+    Type##_pool_stride = TPOOL_ROUND_UP(sizeof(Type), Type##_pool_align),      \
+    Type##_pool_words = ((N) + 63) / 64,                                       \
+};                                                                             \
+                                                                               \
+typedef struct Type##_POOL_T {                                                 \
+    _Alignas(Type##_pool_align)                                                \
+    unsigned char blocks[(size_t) Type##_pool_stride * (N)];                   \
+    uint64_t free_map[Type##_pool_words];                                      \
+    size_t hint;                                                               \
+    size_t free_count;                                                         \
+} Type##Pool;                                                                  \
+                                                                               \
+static inline void Type##_pool_init(Type##Pool *p)                             \
+{                                                                              \
+    memset(p->free_map, 0xff, sizeof(p->free_map));                            \
+    if ((N) % 64)                                                              \
+        p->free_map[Type##_pool_words - 1] = (1ULL << ((N) % 64)) - 1;         \
+    p->hint = 0;                                                               \
+    p->free_count = (N);                                                       \
+}                                                                              \
+                                                                               \
+static inline Type *Type##_pool_alloc(Type##Pool *p)                           \
+{                                                                              \
+    size_t w = p->hint;                                                        \
+    for (size_t n = 0; n < Type##_pool_words; n++) {                           \
+        uint64_t bits = p->free_map[w];                                        \
+        if (bits) {                                                            \
+            size_t idx = (w << 6) | (size_t) __builtin_ctzll(bits);            \
+            p->free_map[w] = bits & (bits - 1);                                \
+            p->hint = w;                                                       \
+            p->free_count--;                                                   \
+            return (Type *) (p->blocks + idx * Type##_pool_stride);            \
+        }                                                                      \
+        if (++w == Type##_pool_words) w = 0;                                   \
+    }                                                                          \
+    return NULL;                                                               \
+}                                                                              \
+                                                                               \
+static inline int Type##_pool_owns(Type##Pool *p, const Type *obj)             \
+{                                                                              \
+    uintptr_t off = (uintptr_t) obj - (uintptr_t) p->blocks;                   \
+    if (off >= sizeof(p->blocks)) return 0;                                    \
+    if (TPOOL_IS_POW2(Type##_pool_stride))                                     \
+        return (off & (Type##_pool_stride - 1)) == 0;                          \
+    return off % Type##_pool_stride == 0;                                      \
+}                                                                              \
+                                                                               \
+/* Returns 0 on success, -1 for foreign pointers and double frees */          \
+static inline int Type##_pool_free(Type##Pool *p, Type *obj)                   \
+{                                                                              \
+    if (!Type##_pool_owns(p, obj)) return -1;                                  \
+    uintptr_t off = (uintptr_t) obj - (uintptr_t) p->blocks;                   \
+    size_t idx = TPOOL_IS_POW2(Type##_pool_stride)                             \
+        ? off >> __builtin_ctzll(Type##_pool_stride)                           \
+        : off / Type##_pool_stride;                                            \
+    uint64_t bit = 1ULL << (idx & 63);                                         \
+    if (p->free_map[idx >> 6] & bit) return -1;                                \
+    p->free_map[idx >> 6] |= bit;                                              \
+    p->free_count++;                                                           \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+static inline Type##Pool *Type##_pool_create(void)                             \
+{                                                                              \
+    size_t size = TPOOL_ROUND_UP(sizeof(Type##Pool), _Alignof(Type##Pool));    \
+    Type##Pool *p = aligned_alloc(_Alignof(Type##Pool), size);                 \
+    if (p) Type##_pool_init(p);                                                \
+    return p;                                                                  \
+}                                                                              \
+                                                                               \
+static inline void Type##_pool_destroy(Type##Pool *p)                          \
+{                                                                              \
+    free(p);                                                                   \
+}
@@ -0,0 +1,214 @@
+/******************************************************************************
+ *  admission.c
+ *
+ *  Handshake admission control for the TLS server.
+ *
+ *  Description:
+ *  SSL_accept() is the most expensive thing a client can make the server
+ *  do, so connections are admitted before the handshake starts:
+ *   - admission_init(): limits, per-source table and bucket pool
+ *   - admission_try(): token bucket and handshake capacity check
+ *   - admission_begin(), admission_end(): bracket the handshake itself
+ *   - admission_cancel(): undo admission_try() without a handshake
+ *
+ *  Implementation details:
+ *   - Token buckets are blocks of a fixed MemoryPool found through a
+ *     HashMap keyed by the IPv4 address.  Buckets are refilled lazily
+ *     from the time of their last use.
+ *   - When the pool runs out, buckets that have refilled completely are
+ *     dropped (a full bucket is the same as no bucket), and sources that
+ *     still don't fit share one overflow bucket.
+ *   - pending counts connections between admission_try() and
+ *     admission_end(), at most max_in_flight of them inside a handshake.
+ *     Everything is done under one mutex, the critical sections are a
+ *     few arithmetic operations and a hash lookup.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "admission.h"
+#include "logging.h"
+
+#include <string.h>
+#include <unistd.h>
+
+size_t admission_default_in_flight(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t) cpus : 1;
+}
+
+AdmissionControl *admission_init(const AdmissionOpts *opts)
+{
+    AdmissionControl *adm = calloc(1, sizeof(AdmissionControl));
+    if (adm == NULL) {
+        ERROR_PRINT("Cannot allocate memory for admission control");
+        return NULL;
+    }
+
+    AdmissionOpts o = { 0 };
+    if (opts != NULL) o = *opts;
+    adm->rate = o.rate != 0 ? o.rate : ADMISSION_RATE;
+    adm->burst = o.burst > 0 ? o.burst : ADMISSION_BURST;
+    adm->max_in_flight = o.max_in_flight ? o.max_in_flight : admission_default_in_flight();
+    adm->max_queued = o.max_queued ? o.max_queued : adm->max_in_flight * ADMISSION_QUEUE_PER_SLOT;
+    size_t max_sources = o.max_sources ? o.max_sources : ADMISSION_SOURCES;
+
+    adm->sources = HM_init((int) (max_sources * 2));
+    adm->buckets = pool_init(sizeof(AdmissionBucket), max_sources);
+    if (adm->sources == NULL || adm->buckets == NULL) {
+        ERROR_PRINT("Cannot allocate table for %zu sources", max_sources);
+        HM_free(&adm->sources);
+        pool_destroy(adm->buckets);
+        free(adm);
+        return NULL;
+    }
+
+    adm->overflow.tokens = adm->burst;
+    pthread_mutex_init(&adm->lock, NULL);
+    pthread_cond_init(&adm->slot_free, NULL);
+
+    DEBUG_PRINT("Admission control %.1f/s burst %.0f per source, %zu handshakes + %zu queued",
+                adm->rate, adm->burst, adm->max_in_flight, adm->max_queued);
+    return adm;
+}
+
+void admission_destroy(AdmissionControl *adm)
+{
+    if (adm == NULL) return;
+    HM_free(&adm->sources);
+    pool_destroy(adm->buckets);
+    pthread_cond_destroy(&adm->slot_free);
+    pthread_mutex_destroy(&adm->lock);
+    free(adm);
+}
+
+static void bucket_refill(AdmissionControl *adm, AdmissionBucket *b, uint64_t now)
+{
+    if (now > b->last) {
+        b->tokens += (double) (now - b->last) * adm->rate / 1e9;
+        if (b->tokens > adm->burst) b->tokens = adm->burst;
+    }
+    b->last = now;
+}
+
+/* Drop buckets that are full again, caller holds adm->lock */
+static void bucket_sweep(AdmissionControl *adm, uint64_t now)
+{
+    HashMap *hm = adm->sources;
+    size_t dropped = 0;
+
+    for (int i = 0; i < hm->capacity;) {
+        HashEntry *entry = &hm->entries[i];
+        if (entry->used) {
+            AdmissionBucket *b = entry->value;
+            bucket_refill(adm, b, now);
+            if (b->tokens >= adm->burst) {
+                /* Removal may shift a later entry into this slot, look again */
+                HM_remove_value(hm, entry->key);
+                pool_free(adm->buckets, b);
+                dropped++;
+                continue;
+            }
+        }
+        i++;
+    }
+    DEBUG_PRINT("Dropped %zu idle source buckets", dropped);
+}
+
+static AdmissionBucket *bucket_get(AdmissionControl *adm, uint32_t addr, uint64_t now)
+{
+    AdmissionBucket *b = HM_get_value(adm->sources, (int) addr);
+    if (b != NULL) return b;
+
+    if (adm->buckets->free_count == 0) bucket_sweep(adm, now);
+    if (adm->buckets->free_count == 0) return &adm->overflow;
+
+    b = pool_malloc(adm->buckets);
+    b->addr = addr;
+    b->tokens = adm->burst;
+    b->last = now;
+    HM_add_value(adm->sources, (int) addr, b);
+    return b;
+}
+
+AdmitResult admission_try(AdmissionControl *adm, uint32_t addr, uint64_t now)
+{
+    pthread_mutex_lock(&adm->lock);
+
+    AdmissionBucket *b = NULL;
+    if (adm->rate >= 0) {
+        b = bucket_get(adm, addr, now);
+        bucket_refill(adm, b, now);
+        if (b->tokens < 1.0) {
+            adm->stats.rate_limited++;
+            pthread_mutex_unlock(&adm->lock);
+            return ADMIT_RATE_LIMITED;
+        }
+    }
+
+    if (adm->pending >= adm->max_in_flight + adm->max_queued) {
+        adm->stats.busy++;
+        pthread_mutex_unlock(&adm->lock);
+        return ADMIT_BUSY;
+    }
+
+    if (b != NULL) b->tokens -= 1.0;
+    adm->pending++;
+    adm->stats.admitted++;
+    pthread_mutex_unlock(&adm->lock);
+    return ADMIT_OK;
+}
+
+void admission_cancel(AdmissionControl *adm)
+{
+    pthread_mutex_lock(&adm->lock);
+    adm->pending--;
+    pthread_mutex_unlock(&adm->lock);
+}
+
+void admission_begin(AdmissionControl *adm)
+{
+    pthread_mutex_lock(&adm->lock);
+    while (adm->in_flight >= adm->max_in_flight)
+        pthread_cond_wait(&adm->slot_free, &adm->lock);
+    adm->in_flight++;
+    pthread_mutex_unlock(&adm->lock);
+}
+
+void admission_end(AdmissionControl *adm)
+{
+    pthread_mutex_lock(&adm->lock);
+    adm->in_flight--;
+    adm->pending--;
+    pthread_cond_signal(&adm->slot_free);
+    pthread_mutex_unlock(&adm->lock);
+}
+
+void admission_get_stats(AdmissionControl *adm, AdmissionStats *out)
+{
+    pthread_mutex_lock(&adm->lock);
+    *out = adm->stats;
+    out->in_flight = adm->in_flight;
+    out->queued = adm->pending - adm->in_flight;
+    out->sources = (size_t) adm->sources->size;
+    pthread_mutex_unlock(&adm->lock);
+}
@@ -0,0 +1,182 @@
+/******************************************************************************
+ *  arena.c
+ *
+ *  Arena (bump) allocator for data with a per-request lifetime.
+ *
+ *  Description:
+ *  This module provides variable sized allocations that are all released
+ *  together:
+ *   - arena_init(): create an arena with the given block size
+ *   - arena_alloc(), arena_alloc_aligned(): bump allocate from the arena
+ *   - arena_mark(), arena_rewind(): release everything after a mark
+ *   - arena_reset(): release everything at once
+ *   - arena_destroy(): free the arena and its blocks
+ *
+ *  Implementation details:
+ *   - Memory comes from a chain of blocks, an allocation is just aligning
+ *     and bumping the used offset of the current block.
+ *   - Rewind and reset only move the current block and offset, the blocks
+ *     stay chained and are reused by the next request, so both are O(1)
+ *     and the arena stops calling malloc once it has warmed up.
+ *   - Requests larger than the block size get a dedicated block that is
+ *     inserted after the current one.
+ *   - Individual allocations cannot be freed.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "arena.h"
+#include "logging.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static ArenaBlock *arena_new_block(size_t size)
+{
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+        ERROR_PRINT("Cannot allocate arena block of %zu bytes", size);
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/*
+ * Offset in block where an aligned allocation of size fits, or SIZE_MAX.
+ */
+static inline size_t arena_fit(ArenaBlock *block, size_t size, size_t align)
+{
+    uintptr_t addr = (uintptr_t) block->data + block->used;
+    size_t offset = block->used + ((align - (addr & (align - 1))) & (align - 1));
+    if (offset > block->size || block->size - offset < size)
+        return SIZE_MAX;
+    return offset;
+}
+
+Arena *arena_init(size_t block_size)
+{
+    Arena *arena = malloc(sizeof(Arena));
+    if (arena == NULL) {
+        ERROR_PRINT("Cannot allocate memory for arena");
+        return NULL;
+    }
+
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    arena->first = arena_new_block(arena->block_size);
+    if (arena->first == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+
+    DEBUG_PRINT("Arena initialized with block size %zu", arena->block_size);
+    return arena;
+}
+
+void *arena_alloc_aligned(Arena *arena, size_t size, size_t align)
+{
+    if (arena == NULL || align == 0 || (align & (align - 1)) != 0) {
+        ERROR_PRINT("Invalid arena allocation, align %zu", align);
+        return NULL;
+    }
+
+    ArenaBlock *block = arena->current;
+    size_t offset = arena_fit(block, size, align);
+
+    if (offset == SIZE_MAX) {
+        /* Move on to the next chained block if the request fits there */
+        ArenaBlock *next = block->next;
+        if (next != NULL) {
+            next->used = 0;
+            offset = arena_fit(next, size, align);
+        }
+
+        if (offset == SIZE_MAX) {
+            size_t need = size + align;
+            next = arena_new_block(need > arena->block_size ? need : arena->block_size);
+            if (next == NULL) return NULL;
+            next->next = block->next;
+            block->next = next;
+            offset = arena_fit(next, size, align);
+        }
+        arena->current = block = next;
+    }
+
+    block->used = offset + size;
+    return block->data + offset;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, ARENA_DEFAULT_ALIGN);
+}
+
+void *arena_memdup(Arena *arena, const void *src, size_t size)
+{
+    void *dst = arena_alloc_aligned(arena, size, 1);
+    if (dst != NULL)
+        memcpy(dst, src, size);
+    return dst;
+}
+
+ArenaMark arena_mark(Arena *arena)
+{
+    ArenaMark mark = { arena->current, arena->current->used };
+    return mark;
+}
+
+void arena_rewind(Arena *arena, ArenaMark mark)
+{
+    if (mark.block == NULL) return;
+    arena->current = mark.block;
+    arena->current->used = mark.used;
+}
+
+void arena_reset(Arena *arena)
+{
+    if (arena == NULL) return;
+    arena->current = arena->first;
+    arena->first->used = 0;
+}
+
+size_t arena_capacity(Arena *arena)
+{
+    size_t total = 0;
+    for (ArenaBlock *block = arena->first; block != NULL; block = block->next)
+        total += block->size;
+    return total;
+}
+
+void arena_destroy(Arena *arena)
+{
+    if (arena == NULL) return;
+    ArenaBlock *block = arena->first;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+    DEBUG_PRINT("Arena destroyed");
+}
@@ -0,0 +1,395 @@
+/*
+ * bench-admission.c
+ *
+ * Handshake flood load test.  An in-process server on TCP loopback works
+ * like main-server: admission check right after accept(), a thread per
+ * admitted connection, the handshake inside an admission slot, then echo
+ * until EOF.  Established clients, each on its own thread, do 64 byte
+ * round trips over kept connections while a forked flood process connects
+ * from 127.0.0.2 and up and does full handshakes as fast as it can.
+ *   idle       no flood
+ *   flood      flood, admission limits lifted
+ *   admission  flood, default per-source buckets and handshake slots
+ *
+ * Goodput is the established clients' round trips per second, "slowest"
+ * that of the worst client and "of idle" the total against the idle run.
+ * "hs cpu" is the server thread CPU time spent in SSL_accept() over the
+ * wall time.  The flood runs at the given nice level; at 19 it only stands
+ * in for the server side of remote handshakes, at 0 it competes for the
+ * CPU like a local attacker would, which on one CPU also takes time the
+ * server could have spent on the clients whatever admission does.
+ *
+ * Usage: bench-admission [seconds] [flood threads] [clients] [flood nice]
+ */
+
+#include "admission.h"
+#include "certificate.h"
+#include "tls-connection.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_SIZE 64
+#define MAX_FLOOD 64
+#define MAX_CLIENTS 64
+#define FLOOD_SOURCES 2
+
+typedef struct {
+    SSL_CTX *ctx;
+    int listen_fd;
+    uint16_t port;
+    AdmissionControl *adm;
+    atomic_int threads;
+    atomic_uint_fast64_t handshake_cpu_ns;
+} Server;
+
+typedef struct {
+    Server *server;
+    int fd;
+} Conn;
+
+typedef struct {
+    SSL_CTX *ctx;
+    uint16_t port;
+    int index;
+    atomic_int *stop;
+    size_t handshakes;
+    size_t refused;
+} Flooder;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void *serve_conn(void *arg)
+{
+    Conn *c = arg;
+    Server *s = c->server;
+    char buf[4096];
+
+    SSL *ssl = SSL_new(s->ctx);
+    SSL_set_fd(ssl, c->fd);
+    admission_begin(s->adm);
+    uint64_t cpu = thread_cpu_ns();
+    int ok = SSL_accept(ssl) == 1;
+    atomic_fetch_add(&s->handshake_cpu_ns, thread_cpu_ns() - cpu);
+    admission_end(s->adm);
+
+    int n;
+    while (ok && (n = SSL_read(ssl, buf, sizeof(buf))) > 0)
+        if (SSL_write(ssl, buf, n) != n) break;
+
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl);
+    close(c->fd);
+    free(c);
+    atomic_fetch_sub(&s->threads, 1);
+    return NULL;
+}
+
+static void *acceptor(void *arg)
+{
+    Server *s = arg;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    while ((fd = accept(s->listen_fd, (struct sockaddr *) &addr, &len)) >= 0) {
+        if (admission_try(s->adm, addr.sin_addr.s_addr, now_ns()) != ADMIT_OK) {
+            close(fd);
+            continue;
+        }
+        Conn *c = malloc(sizeof(Conn));
+        c->server = s;
+        c->fd = fd;
+        atomic_fetch_add(&s->threads, 1);
+        pthread_t th;
+        if (pthread_create(&th, NULL, serve_conn, c) != 0) {
+            atomic_fetch_sub(&s->threads, 1);
+            admission_cancel(s->adm);
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(th);
+    }
+    return NULL;
+}
+
+static int connect_from(uint32_t src, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = src;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *flood(void *arg)
+{
+    Flooder *f = arg;
+    uint32_t src = htonl(INADDR_LOOPBACK + 1 + (uint32_t) (f->index % FLOOD_SOURCES));
+
+    while (!atomic_load(f->stop)) {
+        int fd = connect_from(src, f->port);
+        if (fd < 0) {
+            f->refused++;
+            continue;
+        }
+        SSL *ssl = SSL_new(f->ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_connect(ssl) == 1) {
+            f->handshakes++;
+            SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        } else {
+            f->refused++;
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+typedef struct {
+    SSL *ssl;
+    int fd;
+    uint64_t end_ns;
+    size_t round_trips;
+    uint64_t max_rtt_ns;
+} EchoClient;
+
+static void *echo_client(void *arg)
+{
+    EchoClient *c = arg;
+    unsigned char msg[MSG_SIZE], echo[MSG_SIZE];
+    memset(msg, 'g', sizeof(msg));
+
+    uint64_t t;
+    while ((t = now_ns()) < c->end_ns) {
+        if (SSL_write(c->ssl, msg, MSG_SIZE) != MSG_SIZE) break;
+        size_t got = 0;
+        while (got < MSG_SIZE) {
+            int n = SSL_read(c->ssl, echo + got, (int) (MSG_SIZE - got));
+            if (n <= 0) break;
+            got += (size_t) n;
+        }
+        if (got != MSG_SIZE) break;
+        uint64_t rtt = now_ns() - t;
+        if (rtt > c->max_rtt_ns) c->max_rtt_ns = rtt;
+        c->round_trips++;
+    }
+    return NULL;
+}
+
+/* Flood child process, writes handshakes and refusals to out */
+static int run_flood(uint16_t port, int threads, int niceness, int out)
+{
+    setpriority(PRIO_PROCESS, 0, niceness);
+    TLSConnection *client = TLS_init_client();
+    if (client == NULL) return 1;
+
+    static atomic_int stop;
+    Flooder f[MAX_FLOOD];
+    pthread_t th[MAX_FLOOD];
+    for (int i = 0; i < threads; i++) {
+        f[i] = (Flooder) { .ctx = client->ctx, .port = port, .index = i, .stop = &stop };
+        pthread_create(&th[i], NULL, flood, &f[i]);
+    }
+
+    /* Parent closes its end of the pipe to stop the flood */
+    char c;
+    while (read(out, &c, 1) > 0)
+        ;
+    atomic_store(&stop, 1);
+
+    size_t totals[2] = { 0, 0 };
+    for (int i = 0; i < threads; i++) {
+        pthread_join(th[i], NULL);
+        totals[0] += f[i].handshakes;
+        totals[1] += f[i].refused;
+    }
+    int ok = write(out, totals, sizeof(totals)) == sizeof(totals);
+    TLS_free_connection(&client);
+    return ok ? 0 : 1;
+}
+
+static int run_scenario(const char *name, Server *s, SSL_CTX *client_ctx, const AdmissionOpts *opts,
+                        double seconds, int threads, int clients, int niceness, double *idle_goodput)
+{
+    s->adm = admission_init(opts);
+    if (s->adm == NULL) return 1;
+    atomic_store(&s->handshake_cpu_ns, 0);
+    pthread_t acc;
+    pthread_create(&acc, NULL, acceptor, s);
+
+    /* The established clients connect before the flood starts */
+    EchoClient ec[MAX_CLIENTS];
+    memset(ec, 0, sizeof(ec));
+    for (int i = 0; i < clients; i++) {
+        ec[i].fd = connect_from(htonl(INADDR_LOOPBACK), s->port);
+        ec[i].ssl = SSL_new(client_ctx);
+        SSL_set_fd(ec[i].ssl, ec[i].fd);
+        if (ec[i].fd < 0 || SSL_connect(ec[i].ssl) != 1) {
+            fprintf(stderr, "%s: established client %i failed to connect\n", name, i);
+            return 1;
+        }
+    }
+
+    int sv[2] = { -1, -1 };
+    pid_t pid = 0;
+    if (threads > 0) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 1;
+        pid = fork();
+        if (pid == 0) {
+            close(sv[0]);
+            _exit(run_flood(s->port, threads, niceness, sv[1]));
+        }
+        close(sv[1]);
+        usleep(200000);
+    }
+
+    pthread_t th[MAX_CLIENTS];
+    uint64_t start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        ec[i].end_ns = start + (uint64_t) (seconds * 1e9);
+        pthread_create(&th[i], NULL, echo_client, &ec[i]);
+    }
+    size_t round_trips = 0, slowest = SIZE_MAX;
+    uint64_t max_rtt = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(th[i], NULL);
+        round_trips += ec[i].round_trips;
+        if (ec[i].round_trips < slowest) slowest = ec[i].round_trips;
+        if (ec[i].max_rtt_ns > max_rtt) max_rtt = ec[i].max_rtt_ns;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    size_t totals[2] = { 0, 0 };
+    if (pid > 0) {
+        shutdown(sv[0], SHUT_WR);
+        if (read(sv[0], totals, sizeof(totals)) != sizeof(totals))
+            fprintf(stderr, "%s: no flood totals\n", name);
+        close(sv[0]);
+        waitpid(pid, NULL, 0);
+    }
+
+    for (int i = 0; i < clients; i++) {
+        SSL_shutdown(ec[i].ssl);
+        SSL_free(ec[i].ssl);
+        close(ec[i].fd);
+    }
+
+    /* Stop accepting and let the connection threads finish */
+    shutdown(s->listen_fd, SHUT_RD);
+    pthread_join(acc, NULL);
+    while (atomic_load(&s->threads) > 0)
+        usleep(1000);
+
+    AdmissionStats stats;
+    admission_get_stats(s->adm, &stats);
+    admission_destroy(s->adm);
+    s->adm = NULL;
+
+    double goodput = round_trips / elapsed;
+    if (threads == 0) *idle_goodput = goodput;
+    printf("%-10s %12.0f %10.0f %8.1f %10.2f %8.1f %10.0f %10.0f %8zu %8zu\n", name, goodput,
+           slowest / elapsed, *idle_goodput > 0 ? 100.0 * goodput / *idle_goodput : 0.0, max_rtt / 1e6,
+           atomic_load(&s->handshake_cpu_ns) / elapsed / 1e7, totals[0] / elapsed, totals[1] / elapsed,
+           stats.rate_limited, stats.busy);
+    fflush(stdout);
+    return 0;
+}
+
+static int server_listen(Server *s)
+{
+    s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(s->port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(s->listen_fd, (struct sockaddr *) &addr, len) != 0 || listen(s->listen_fd, 128) != 0 ||
+        getsockname(s->listen_fd, (struct sockaddr *) &addr, &len) != 0)
+        return -1;
+    s->port = ntohs(addr.sin_port);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : 3.0;
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    int niceness = argc > 4 ? atoi(argv[4]) : 19;
+    if (threads > MAX_FLOOD) threads = MAX_FLOOD;
+    if (clients < 1) clients = 1;
+    if (clients > MAX_CLIENTS) clients = MAX_CLIENTS;
+    signal(SIGPIPE, SIG_IGN);
+
+    TLSConnection *server = TLS_init_server();
+    TLSConnection *client = TLS_init_client();
+    if (server == NULL || client == NULL || CA_generate_self_signed(&server, "localhost") != 1) return 1;
+
+    AdmissionOpts unlimited = { .rate = -1, .max_in_flight = 1024, .max_queued = 1024 };
+    struct {
+        const char *name;
+        const AdmissionOpts *opts;
+        int flood;
+    } scenarios[] = {
+        { "idle", &unlimited, 0 },
+        { "flood", &unlimited, threads },
+        { "admission", NULL, threads },
+    };
+
+    printf("%i established clients, flood at nice %i\n", clients, niceness);
+    printf("%-10s %12s %10s %8s %10s %8s %10s %10s %8s %8s\n", "scenario", "goodput rt/s", "slowest",
+           "of idle", "max rtt ms", "hs cpu", "flood hs/s", "refused/s", "limited", "busy");
+    fflush(stdout);
+
+    Server s = { .ctx = server->ctx };
+    double idle_goodput = 0;
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        /* A fresh listening socket per scenario, the previous one was shut down */
+        s.port = 0;
+        if (server_listen(&s) != 0) return 1;
+        failed |= run_scenario(scenarios[i].name, &s, client->ctx, scenarios[i].opts, seconds,
+                               scenarios[i].flood, clients, niceness, &idle_goodput);
+        close(s.listen_fd);
+    }
+
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+    return failed;
+}
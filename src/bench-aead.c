@@ -0,0 +1,111 @@
+#include "aead.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Encryption cost per message of every AEAD cipher and message size:
+ *   - naive   cipher fetch, new context and key schedule per message
+ *   - cached  AEAD_encrypt() on the cipher's kept context
+ *   - batch   AEAD_encrypt_batch() over MSGS messages
+ *
+ *   bench-aead [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+#define MSGS 1024
+
+typedef struct {
+    const char *name;
+    AEADCipher *c;
+    unsigned char key[AEAD_KEY_SIZE];
+    unsigned char iv[AEAD_IV_SIZE];
+    size_t len;
+    AEADMessage *msgs;
+} AEADBench;
+
+/* Fresh context and key schedule for every message */
+static void naive_encrypt(const char *name, const unsigned char *key, const unsigned char *iv,
+                          unsigned char *buf, size_t len, unsigned char *tag)
+{
+    EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, name, NULL);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    unsigned char final[EVP_MAX_BLOCK_LENGTH];
+    int outl;
+
+    EVP_EncryptInit_ex2(ctx, cipher, key, iv, NULL);
+    EVP_EncryptUpdate(ctx, buf, &outl, buf, (int) len);
+    EVP_EncryptFinal_ex(ctx, final, &outl);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, tag);
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_free(cipher);
+}
+
+static void bench_naive(void *arg, size_t ops)
+{
+    AEADBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        AEADMessage *m = &b->msgs[i % MSGS];
+        naive_encrypt(b->name, b->key, b->iv, m->buf, b->len, m->tag);
+    }
+}
+
+static void bench_cached(void *arg, size_t ops)
+{
+    AEADBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        AEADMessage *m = &b->msgs[i % MSGS];
+        AEAD_encrypt(b->c, b->iv, NULL, 0, m->buf, b->len, m->tag);
+    }
+}
+
+static void bench_batch(void *arg, size_t ops)
+{
+    AEADBench *b = arg;
+    for (size_t done = 0; done < ops; done += MSGS)
+        AEAD_encrypt_batch(b->c, b->msgs, ops - done < MSGS ? ops - done : MSGS);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "aead", argc, argv);
+
+    const char *names[AEAD_ALG_COUNT] = { "AES-256-GCM", "ChaCha20-Poly1305" };
+    size_t sizes[] = { 64, 256, 1024, 16384 };
+    AEADBench b = { 0 };
+    memset(b.key, 0x42, sizeof(b.key));
+
+    unsigned char *data = malloc(MSGS * 16384);
+    unsigned char *tags = malloc(MSGS * AEAD_TAG_SIZE);
+    b.msgs = calloc(MSGS, sizeof(AEADMessage));
+    if (!data || !tags || !b.msgs) return 1;
+    memset(data, 0x17, MSGS * 16384);
+
+    size_t ops = bench_ops(&bs, MSGS);
+    for (int alg = 0; alg < AEAD_ALG_COUNT; alg++) {
+        b.name = names[alg];
+        b.c = AEAD_init(alg, b.key);
+        if (b.c == NULL) return 1;
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            char params[48];
+            snprintf(params, sizeof(params), "%s %zuB", names[alg], sizes[s]);
+            b.len = sizes[s];
+            for (size_t i = 0; i < MSGS; i++)
+                b.msgs[i] = (AEADMessage) { .iv = b.iv, .buf = data + i * b.len, .len = b.len,
+                                            .tag = tags + i * AEAD_TAG_SIZE };
+
+            bench_run(&bs, "naive", params, bench_naive, &b, ops, b.len);
+            bench_run(&bs, "cached", params, bench_cached, &b, ops, b.len);
+            bench_run(&bs, "batch", params, bench_batch, &b, ops, b.len);
+        }
+        AEAD_free(&b.c);
+    }
+
+    free(b.msgs);
+    free(tags);
+    free(data);
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
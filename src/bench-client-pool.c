@@ -0,0 +1,147 @@
+#include "bench.h"
+#include "certificate.h"
+#include "client-pool.h"
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+/*
+ * Cost per message of the client pool against connecting for every
+ * message, over TCP loopback to an in-process keep-alive server:
+ *   - new_pool   full handshake and teardown per message, like the old client
+ *   - reconnect  resumed handshake per message
+ *   - pooled     blocking sends over a kept connection
+ *   - async      client_pool_send_async() and one flush per repetition
+ *
+ *   bench-client-pool [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+#define MSG_SIZE 64
+
+typedef struct {
+    SSL_CTX *ctx;
+    int listen_fd;
+    atomic_size_t bytes;
+} Sink;
+
+typedef struct {
+    TLSConnection *client;
+    ClientPool *pool;
+    uint16_t port;
+    unsigned char msg[MSG_SIZE];
+    int failed;
+} PoolBench;
+
+static void *sink_reader(void *arg)
+{
+    SSL *ssl = arg;
+    char buf[4096];
+    while (SSL_read(ssl, buf, sizeof(buf)) > 0)
+        ;
+    close(SSL_get_fd(ssl));
+    SSL_free(ssl);
+    return NULL;
+}
+
+static void *sink_acceptor(void *arg)
+{
+    Sink *sink = arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    int fd;
+    while ((fd = accept(sink->listen_fd, NULL, NULL)) >= 0) {
+        SSL *ssl = SSL_new(sink->ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) != 1) {
+            SSL_free(ssl);
+            close(fd);
+            continue;
+        }
+        pthread_t th;
+        pthread_create(&th, NULL, sink_reader, ssl);
+        pthread_detach(th);
+    }
+    return NULL;
+}
+
+static void bench_new_pool(void *arg, size_t ops)
+{
+    PoolBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        ClientPool *pool = client_pool_init(&b->client, NULL);
+        if (pool == NULL || client_pool_send(pool, "127.0.0.1", b->port, b->msg, MSG_SIZE) != 0)
+            b->failed = 1;
+        client_pool_destroy(pool);
+    }
+}
+
+static void bench_reconnect(void *arg, size_t ops)
+{
+    PoolBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        if (client_pool_send(b->pool, "127.0.0.1", b->port, b->msg, MSG_SIZE) != 0) b->failed = 1;
+        client_pool_evict_idle(b->pool, UINT64_MAX);
+    }
+}
+
+static void bench_pooled(void *arg, size_t ops)
+{
+    PoolBench *b = arg;
+    for (size_t i = 0; i < ops; i++)
+        if (client_pool_send(b->pool, "127.0.0.1", b->port, b->msg, MSG_SIZE) != 0) b->failed = 1;
+}
+
+static void bench_async(void *arg, size_t ops)
+{
+    PoolBench *b = arg;
+    for (size_t i = 0; i < ops; i++)
+        if (client_pool_send_async(b->pool, "127.0.0.1", b->port, b->msg, MSG_SIZE, NULL, NULL) != 0)
+            b->failed = 1;
+    client_pool_flush(b->pool);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "client-pool", argc, argv);
+
+    TLSConnection *server = TLS_init_server();
+    if (server == NULL || CA_generate_self_signed(&server, "localhost") != 1) return 1;
+    Sink sink = { .ctx = server->ctx };
+    sink.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(sink.listen_fd, (struct sockaddr *) &addr, len) != 0 || listen(sink.listen_fd, 128) != 0 ||
+        getsockname(sink.listen_fd, (struct sockaddr *) &addr, &len) != 0)
+        return 1;
+    pthread_t acceptor;
+    pthread_create(&acceptor, NULL, sink_acceptor, &sink);
+
+    PoolBench b = { .port = ntohs(addr.sin_port) };
+    memset(b.msg, 'm', sizeof(b.msg));
+    b.client = TLS_init_client();
+    if (b.client == NULL) return 1;
+
+    bench_run(&bs, "new_pool", "64B", bench_new_pool, &b, bench_ops(&bs, 8), MSG_SIZE);
+
+    b.pool = client_pool_init(&b.client, NULL);
+    if (b.pool == NULL) return 1;
+    bench_run(&bs, "reconnect", "64B", bench_reconnect, &b, bench_ops(&bs, 8), MSG_SIZE);
+    bench_run(&bs, "pooled", "64B", bench_pooled, &b, bench_ops(&bs, 1000), MSG_SIZE);
+    bench_run(&bs, "async", "64B", bench_async, &b, bench_ops(&bs, 1000), MSG_SIZE);
+    client_pool_destroy(b.pool);
+
+    if (b.failed) fprintf(stderr, "some sends failed\n");
+    shutdown(sink.listen_fd, SHUT_RDWR);
+    pthread_join(acceptor, NULL);
+    close(sink.listen_fd);
+    TLS_free_connection(&b.client);
+    TLS_free_connection(&server);
+    return bench_suite_finish(&bs) == 0 && !b.failed ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#include "bench.h"
+#include "digest.h"
+#include "hashmap.h"
+#include "linked-list.h"
+#include "memory-pool.h"
+#include "ring-buffer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Core data structure microbenchmarks.
+ *
+ *   bench-core [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+#define HM_CAPACITY 65536
+#define POOL_BLOCKS 4096
+#define POOL_BLOCK_SIZE 64
+
+typedef struct {
+    int *keys;
+    int count;
+    HashMap *hm;
+} HashBench;
+
+typedef struct {
+    MemoryPool *pool;
+    void **blocks;
+} AllocBench;
+
+typedef struct {
+    RingBuffer *rb;
+    uint8_t *chunk;
+    size_t size;
+} RingBench;
+
+typedef struct {
+    MessageDigest *md;
+    unsigned char *msg;
+    size_t size;
+} DigestBench;
+
+static uint32_t rng_state = 2463534242U;
+
+static uint32_t xorshift32(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/* Untimed, an empty map whose pages are already touched */
+static void hm_clear(void *arg, size_t ops)
+{
+    HashBench *b = arg;
+    (void) ops;
+    for (int i = 0; i < b->count; i++)
+        HM_remove_value(b->hm, b->keys[i]);
+}
+
+/* Cost per insert into the empty map */
+static void hm_insert(void *arg, size_t ops)
+{
+    HashBench *b = arg;
+    (void) ops;
+    for (int i = 0; i < b->count; i++)
+        HM_add_value(b->hm, b->keys[i], &b->keys[i]);
+}
+
+static void hm_lookup(void *arg, size_t ops)
+{
+    HashBench *b = arg;
+    for (size_t i = 0; i < ops; i++)
+        bench_consume(HM_get_value(b->hm, b->keys[xorshift32() % b->count]));
+}
+
+static void pool_alloc_free(void *arg, size_t ops)
+{
+    AllocBench *b = arg;
+    for (size_t i = 0; i < ops; i++)
+        b->blocks[i] = pool_malloc(b->pool);
+    for (size_t i = 0; i < ops; i++)
+        pool_free(b->pool, b->blocks[i]);
+}
+
+static void malloc_free(void *arg, size_t ops)
+{
+    AllocBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        b->blocks[i] = malloc(POOL_BLOCK_SIZE);
+        bench_consume(b->blocks[i]);
+    }
+    for (size_t i = 0; i < ops; i++)
+        free(b->blocks[i]);
+}
+
+static void ring_store_pop(void *arg, size_t ops)
+{
+    RingBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        rbuf_store_data(b->rb, b->chunk, b->size);
+        rbuf_pop_data(b->rb, b->chunk, b->size);
+    }
+}
+
+static void list_append_pop(void *arg, size_t ops)
+{
+    LinkedList *list = ll_init_list();
+    uint64_t value = 42;
+    for (size_t i = 0; i < ops; i++)
+        ll_append_list(list, &value, sizeof(value));
+    for (size_t i = 0; i < ops; i++)
+        free(ll_pop_data_from_list(list));
+    ll_destroy_list(list);
+    (void) arg;
+}
+
+static void digest_update(void *arg, size_t ops)
+{
+    DigestBench *b = arg;
+    for (size_t i = 0; i < ops; i++)
+        MD_update_message(b->md, b->msg, b->size);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite suite;
+    char params[48];
+    bench_suite_init(&suite, "core", argc, argv);
+
+    /* HashMap at several load factors */
+    int loads[] = { 25, 50, 75, 90 };
+    int *keys = malloc(HM_CAPACITY * sizeof(int));
+    for (int i = 0; i < HM_CAPACITY; i++)
+        keys[i] = (int) (xorshift32() & 0x3fffffff);
+
+    for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        HashBench b = { .keys = keys, .count = HM_CAPACITY * loads[l] / 100, .hm = HM_init(HM_CAPACITY) };
+        snprintf(params, sizeof(params), "load=%d%%", loads[l]);
+        bench_run_ex(&suite, "hashmap_insert", params, hm_clear, hm_insert, &b, (size_t) b.count, 0);
+
+        /* The last repetition left every key in the map */
+        bench_run(&suite, "hashmap_lookup", params, hm_lookup, &b, bench_ops(&suite, 100000), 0);
+        HM_free(&b.hm);
+    }
+
+    /* MemoryPool vs malloc, one op is an alloc/free pair */
+    AllocBench ab = { .pool = pool_init(POOL_BLOCK_SIZE, POOL_BLOCKS), .blocks = malloc(POOL_BLOCKS * sizeof(void *)) };
+    snprintf(params, sizeof(params), "size=%d", POOL_BLOCK_SIZE);
+    bench_run(&suite, "pool_malloc_free", params, pool_alloc_free, &ab, POOL_BLOCKS, 0);
+    bench_run(&suite, "malloc_free", params, malloc_free, &ab, POOL_BLOCKS, 0);
+    pool_destroy(ab.pool);
+    free(ab.blocks);
+
+    /* RingBuffer store/pop by chunk size */
+    size_t chunks[] = { 16, 64, 256, 1024, 4096 };
+    RingBench rb = { .rb = rbuf_init_buffer_size(64 * 1024), .chunk = malloc(4096) };
+    memset(rb.chunk, 0xab, 4096);
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        rb.size = chunks[c];
+        snprintf(params, sizeof(params), "chunk=%zu", chunks[c]);
+        bench_run(&suite, "ring_store_pop", params, ring_store_pop, &rb, bench_ops(&suite, 20000), chunks[c]);
+    }
+    rbuf_free_buffer(rb.rb);
+    free(rb.chunk);
+
+    /* LinkedList, one op is an append and a pop */
+    bench_run(&suite, "list_append_pop", "size=8", list_append_pop, NULL, bench_ops(&suite, 10000), 0);
+
+    /* MD_update_message throughput */
+    size_t sizes[] = { 64, 1024, 16384, 1024 * 1024 };
+    DigestBench db = { .md = MD_digest_init(), .msg = malloc(1024 * 1024) };
+    memset(db.msg, 0x5a, 1024 * 1024);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        db.size = sizes[i];
+        snprintf(params, sizeof(params), "size=%zu", sizes[i]);
+        size_t ops = bench_ops(&suite, (4 * 1024 * 1024) / sizes[i]);
+        bench_run(&suite, "md_update", params, digest_update, &db, ops ? ops : 1, sizes[i]);
+    }
+    MD_digest_free(&db.md);
+    free(db.msg);
+    free(keys);
+
+    return bench_suite_finish(&suite) == 0 ? 0 : 1;
+}
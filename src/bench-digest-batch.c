@@ -0,0 +1,88 @@
+#include "bench.h"
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * SHA-256 cost per message of MSGS equally sized messages, one
+ * MessageDigest per message ("single") against MD_digest_batch() with
+ * every batch kernel the CPU supports.
+ *
+ *   bench-digest-batch [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+#define MSGS 4096
+
+typedef struct {
+    MessageDigest *md;
+    const unsigned char **msgs;
+    size_t *lens;
+    unsigned char *out;
+} DigestBatchBench;
+
+/* One MD_update_message()/MD_calculate_digest() pair per message, the pre-batch way */
+static void run_single(void *arg, size_t ops)
+{
+    DigestBatchBench *b = arg;
+    for (size_t op = 0; op < ops; op++) {
+        size_t i = op % MSGS;
+        unsigned int len;
+        MD_digest_reset(b->md);
+        MD_update_message(b->md, (void *) b->msgs[i], b->lens[i]);
+        MD_calculate_digest(b->md, b->out + i * MD_SHA256_SIZE, &len);
+    }
+}
+
+static void run_batch(void *arg, size_t ops)
+{
+    DigestBatchBench *b = arg;
+    for (size_t done = 0; done < ops; done += MSGS)
+        MD_digest_batch(b->msgs, b->lens, ops - done < MSGS ? ops - done : MSGS, b->out);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "digest-batch", argc, argv);
+
+    size_t sizes[] = { 16, 64, 256, 1024 };
+    MDBatchImpl impls[] = { MD_BATCH_EVP, MD_BATCH_AVX2, MD_BATCH_SHANI };
+
+    unsigned char *data = malloc(MSGS * 1024);
+    DigestBatchBench b = {
+        .md = MD_digest_init(),
+        .msgs = malloc(MSGS * sizeof(*b.msgs)),
+        .lens = malloc(MSGS * sizeof(*b.lens)),
+        .out = malloc(MSGS * MD_SHA256_SIZE),
+    };
+    if (!data || !b.out || !b.msgs || !b.lens || !b.md) return 1;
+    memset(data, 0x5a, MSGS * 1024);
+
+    size_t ops = bench_ops(&bs, MSGS);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char params[32];
+        snprintf(params, sizeof(params), "size=%zu", sizes[s]);
+        for (size_t i = 0; i < MSGS; i++) {
+            b.msgs[i] = data + i * sizes[s];
+            b.lens[i] = sizes[s];
+        }
+
+        bench_run(&bs, "single", params, run_single, &b, ops, sizes[s]);
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (MD_batch_set_impl(impls[k]) != 0) continue;
+            char name[32];
+            snprintf(name, sizeof(name), "batch_%s", MD_batch_impl_name());
+            bench_run(&bs, name, params, run_batch, &b, ops, sizes[s]);
+        }
+        MD_batch_set_impl(MD_BATCH_AUTO);
+    }
+
+    MD_digest_free(&b.md);
+    free(b.lens);
+    free(b.msgs);
+    free(b.out);
+    free(data);
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+#include "bench.h"
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Cost of one 64 byte digest of every built-in algorithm by how the
+ * context is obtained:
+ *   - fetch+new  EVP_MD_fetch() and a new EVP_MD_CTX per digest
+ *   - init/free  MD_digest_init_alg() and MD_digest_free()
+ *   - acquire    MD_digest_acquire() from the per-thread pool
+ *   - oneshot    MD_digest_oneshot()
+ *
+ *   bench-digest-ctx [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+typedef struct {
+    int alg;
+    const char *name;
+    unsigned char msg[64];
+    unsigned char out[EVP_MAX_MD_SIZE];
+} DigestCtxBench;
+
+static void fetch_new(void *arg, size_t ops)
+{
+    DigestCtxBench *b = arg;
+    unsigned int len;
+    for (size_t i = 0; i < ops; i++) {
+        EVP_MD *type = EVP_MD_fetch(NULL, b->name, NULL);
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, type, NULL);
+        EVP_DigestUpdate(ctx, b->msg, sizeof(b->msg));
+        EVP_DigestFinal_ex(ctx, b->out, &len);
+        EVP_MD_CTX_free(ctx);
+        EVP_MD_free(type);
+    }
+}
+
+static void init_free(void *arg, size_t ops)
+{
+    DigestCtxBench *b = arg;
+    unsigned int len;
+    for (size_t i = 0; i < ops; i++) {
+        MessageDigest *md = MD_digest_init_alg(b->alg);
+        MD_update_message(md, b->msg, sizeof(b->msg));
+        MD_calculate_digest(md, b->out, &len);
+        MD_digest_free(&md);
+    }
+}
+
+static void acquire(void *arg, size_t ops)
+{
+    DigestCtxBench *b = arg;
+    unsigned int len;
+    for (size_t i = 0; i < ops; i++) {
+        MessageDigest *md = MD_digest_acquire(b->alg);
+        MD_update_message(md, b->msg, sizeof(b->msg));
+        MD_calculate_digest(md, b->out, &len);
+        MD_digest_release(md);
+    }
+}
+
+static void oneshot(void *arg, size_t ops)
+{
+    DigestCtxBench *b = arg;
+    unsigned int len;
+    for (size_t i = 0; i < ops; i++)
+        MD_digest_oneshot(b->alg, b->msg, sizeof(b->msg), b->out, &len);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "digest-ctx", argc, argv);
+
+    DigestCtxBench b;
+    memset(b.msg, 0xa5, sizeof(b.msg));
+
+    MD_registry_init();
+    size_t ops = bench_ops(&bs, 20000);
+    for (int alg = 0; alg < MD_BUILTIN_ALGS; alg++) {
+        if (MD_get_algorithm(alg) == NULL) continue;
+        b.alg = alg;
+        b.name = MD_algorithm_name(alg);
+
+        bench_run(&bs, "fetch+new", b.name, fetch_new, &b, ops, sizeof(b.msg));
+        bench_run(&bs, "init/free", b.name, init_free, &b, ops, sizeof(b.msg));
+        bench_run(&bs, "acquire", b.name, acquire, &b, ops, sizeof(b.msg));
+        bench_run(&bs, "oneshot", b.name, oneshot, &b, ops, sizeof(b.msg));
+    }
+
+    MD_registry_cleanup();
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/*
+ * bench-mpsc-queue.c
+ *
+ * Contention benchmark for the lock-free MPSC queue against a mutex
+ * protected LinkedList.  N producer threads each hand over M messages to
+ * a single consumer thread, the consumer checks the per-producer ordering
+ * and the time is reported per message, from thread start to the last
+ * message received.
+ *
+ * Usage: bench-mpsc-queue [-j results.json] [-r reps] [-w warmup] [-s scale] [producers]
+ */
+
+#include "bench.h"
+#include "mpsc-queue.h"
+#include "linked-list.h"
+#include "memory-pool.h"
+#include "logging.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_PRODUCERS 64
+#define BATCH_SIZE 64
+
+typedef struct {
+    MPSCNode node;
+    uint32_t producer;
+    uint64_t seq;
+} Message;
+
+typedef struct {
+    uint32_t producer;
+    uint64_t seq;
+} Payload;
+
+static size_t n_producers = 4;
+static size_t n_messages = 100000;
+
+static MPSCQueue *queue;
+static MemoryPool *pools[MAX_PRODUCERS];
+
+static LinkedList *list;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_barrier_t start_barrier;
+
+static void *mpsc_producer(void *arg)
+{
+    uint32_t id = (uint32_t) (uintptr_t) arg;
+    pthread_barrier_wait(&start_barrier);
+
+    for (uint64_t i = 0; i < n_messages; i++) {
+        Message *msg = pool_malloc(pools[id]);
+        msg->producer = id;
+        msg->seq = i;
+        mpsc_push(queue, &msg->node);
+    }
+    return NULL;
+}
+
+static void *list_producer(void *arg)
+{
+    Payload p = { .producer = (uint32_t) (uintptr_t) arg };
+    pthread_barrier_wait(&start_barrier);
+
+    for (uint64_t i = 0; i < n_messages; i++) {
+        p.seq = i;
+        pthread_mutex_lock(&list_lock);
+        ll_append_list(list, &p, sizeof(p));
+        pthread_mutex_unlock(&list_lock);
+    }
+    return NULL;
+}
+
+static int check_order(uint64_t *next_seq, uint32_t producer, uint64_t seq)
+{
+    if (next_seq[producer] != seq) {
+        ERROR_PRINT("Producer %u out of order: got %" PRIu64 " expected %" PRIu64,
+                    producer, seq, next_seq[producer]);
+        return -1;
+    }
+    next_seq[producer]++;
+    return 0;
+}
+
+static void run_mpsc(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    pthread_t threads[MAX_PRODUCERS];
+    uint64_t next_seq[MAX_PRODUCERS] = { 0 };
+    MPSCNode *batch[BATCH_SIZE];
+
+    n_messages = ops / n_producers;
+    queue = mpsc_init_queue();
+    for (size_t i = 0; i < n_producers; i++) {
+        pools[i] = pool_init(sizeof(Message), n_messages);
+        pthread_create(&threads[i], NULL, mpsc_producer, (void *) (uintptr_t) i);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+
+    size_t total = n_producers * n_messages, received = 0;
+    while (received < total) {
+        size_t n = mpsc_pop_batch(queue, batch, BATCH_SIZE);
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        for (size_t i = 0; i < n; i++) {
+            Message *msg = MPSC_ENTRY(batch[i], Message, node);
+            check_order(next_seq, msg->producer, msg->seq);
+        }
+        received += n;
+    }
+
+    for (size_t i = 0; i < n_producers; i++) {
+        pthread_join(threads[i], NULL);
+        pool_destroy(pools[i]);
+    }
+    mpsc_destroy_queue(queue);
+}
+
+static void run_list(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    pthread_t threads[MAX_PRODUCERS];
+    uint64_t next_seq[MAX_PRODUCERS] = { 0 };
+
+    n_messages = ops / n_producers;
+    list = ll_init_list();
+    for (size_t i = 0; i < n_producers; i++)
+        pthread_create(&threads[i], NULL, list_producer, (void *) (uintptr_t) i);
+
+    pthread_barrier_wait(&start_barrier);
+
+    size_t total = n_producers * n_messages, received = 0;
+    while (received < total) {
+        pthread_mutex_lock(&list_lock);
+        Payload *p = ll_pop_data_from_list(list);
+        pthread_mutex_unlock(&list_lock);
+        if (p == NULL) {
+            sched_yield();
+            continue;
+        }
+        check_order(next_seq, p->producer, p->seq);
+        free(p);
+        received++;
+    }
+
+    for (size_t i = 0; i < n_producers; i++)
+        pthread_join(threads[i], NULL);
+    ll_destroy_list(list);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "mpsc-queue", argc, argv);
+
+    if (optind < argc) n_producers = strtoul(argv[optind], NULL, 10);
+    if (n_producers == 0 || n_producers > MAX_PRODUCERS) {
+        ERROR_PRINT("Producer count must be 1..%i", MAX_PRODUCERS);
+        return -1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, n_producers + 1);
+
+    char params[32];
+    snprintf(params, sizeof(params), "producers=%zu", n_producers);
+    size_t ops = bench_ops(&bs, n_messages) * n_producers;
+    bench_run(&bs, "mpsc_queue", params, run_mpsc, NULL, ops, 0);
+    bench_run(&bs, "mutex_linked_list", params, run_list, NULL, ops, 0);
+
+    pthread_barrier_destroy(&start_barrier);
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
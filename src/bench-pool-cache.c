@@ -0,0 +1,158 @@
+/*
+ * bench-pool-cache.c
+ *
+ * Scaling benchmark for the magazine cached MemoryPool.  Every thread
+ * allocates a burst of blocks and frees them again, first through a
+ * mutex-wrapped pool and then through a PoolCache.  A last round frees
+ * every block on a different thread than the one that allocated it.  The
+ * time is reported per allocated and freed block.
+ *
+ * Usage: bench-pool-cache [-j results.json] [-r reps] [-w warmup] [-s scale] [threads]
+ */
+
+#include "bench.h"
+#include "pool-cache.h"
+#include "mpsc-queue.h"
+#include "logging.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_THREADS 64
+#define BURST 256
+#define BLOCK_SIZE 64
+
+typedef struct {
+    MPSCNode node;
+} Block;
+
+static size_t n_threads = 4;
+static size_t n_rounds = 2000;
+
+static MemoryPool *pool;
+static PoolCache *cache;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static MPSCQueue *handoff;
+static atomic_size_t in_flight;
+
+static void *mutex_worker(__attribute__((__unused__)) void *arg)
+{
+    void *blocks[BURST];
+    for (size_t r = 0; r < n_rounds; r++) {
+        for (int i = 0; i < BURST; i++) {
+            pthread_mutex_lock(&pool_lock);
+            blocks[i] = pool_malloc(pool);
+            pthread_mutex_unlock(&pool_lock);
+        }
+        for (int i = 0; i < BURST; i++) {
+            pthread_mutex_lock(&pool_lock);
+            pool_free(pool, blocks[i]);
+            pthread_mutex_unlock(&pool_lock);
+        }
+    }
+    return NULL;
+}
+
+static void *cache_worker(__attribute__((__unused__)) void *arg)
+{
+    void *blocks[BURST];
+    for (size_t r = 0; r < n_rounds; r++) {
+        for (int i = 0; i < BURST; i++)
+            blocks[i] = pcache_malloc(cache);
+        for (int i = 0; i < BURST; i++)
+            pcache_free(cache, blocks[i]);
+    }
+    return NULL;
+}
+
+static void *remote_producer(__attribute__((__unused__)) void *arg)
+{
+    for (size_t r = 0; r < n_rounds; r++) {
+        /* Keep the consumer within reach so the pool never runs dry */
+        while (atomic_load(&in_flight) > pool->total_blocks / 2)
+            sched_yield();
+        atomic_fetch_add(&in_flight, BURST);
+        for (int i = 0; i < BURST; i++) {
+            Block *b = pcache_malloc(cache);
+            mpsc_push(handoff, &b->node);
+        }
+    }
+    return NULL;
+}
+
+static void run(void *(*worker)(void *), size_t ops)
+{
+    pthread_t tid[MAX_THREADS];
+    n_rounds = ops / (n_threads * BURST);
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_create(&tid[i], NULL, worker, NULL);
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_join(tid[i], NULL);
+}
+
+static void run_mutex(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    run(mutex_worker, ops);
+}
+
+static void run_cache(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    run(cache_worker, ops);
+}
+
+static void run_remote_free(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    pthread_t tid[MAX_THREADS];
+    handoff = mpsc_init_queue();
+
+    n_rounds = ops / (n_threads * BURST);
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_create(&tid[i], NULL, remote_producer, NULL);
+
+    size_t total = n_threads * n_rounds * BURST, freed = 0;
+    while (freed < total) {
+        MPSCNode *node = mpsc_pop(handoff);
+        if (node == NULL) {
+            sched_yield();
+            continue;
+        }
+        pcache_free(cache, MPSC_ENTRY(node, Block, node));
+        atomic_fetch_sub(&in_flight, 1);
+        freed++;
+    }
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_join(tid[i], NULL);
+    mpsc_destroy_queue(handoff);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "pool-cache", argc, argv);
+
+    if (optind < argc) n_threads = strtoul(argv[optind], NULL, 10);
+    if (n_threads == 0 || n_threads > MAX_THREADS) {
+        ERROR_PRINT("Thread count must be 1..%i", MAX_THREADS);
+        return -1;
+    }
+
+    pool = pool_init(BLOCK_SIZE, n_threads * BURST * 16);
+    cache = pcache_init(pool, 0, 0);
+
+    char params[32];
+    snprintf(params, sizeof(params), "threads=%zu burst=%i", n_threads, BURST);
+    size_t ops = bench_ops(&bs, n_rounds) * n_threads * BURST;
+    bench_run(&bs, "mutex_pool", params, run_mutex, NULL, ops, 0);
+    bench_run(&bs, "pool_cache", params, run_cache, NULL, ops, 0);
+    bench_run(&bs, "pool_cache_remote", params, run_remote_free, NULL, ops, 0);
+
+    pcache_destroy(cache);
+    if (pool->free_count != pool->total_blocks)
+        ERROR_PRINT("Leaked %zu blocks", pool->total_blocks - pool->free_count);
+    pool_destroy(pool);
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+#include "bench.h"
+#include "pubsub.h"
+
+/*
+ * Fan-out of one message to every subscriber, per published message:
+ *   - copy    a private malloc'd copy queued per subscriber, freed once written
+ *   - shared  pubsub_publish() and pubsub_flush() of every subscriber
+ * The writer reads the whole payload once, like the TLS encryption would.
+ *
+ *   bench-pubsub [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+#define SUBSCRIBERS 1000
+
+typedef struct {
+    size_t size;
+    unsigned char *payload;
+    PubSub *ps;
+    PubSubSubscriber *subs[SUBSCRIBERS];
+    unsigned char *copies[SUBSCRIBERS];
+    unsigned char scratch[PUBSUB_MAX_MESSAGE];
+} FanOut;
+
+static ssize_t scratch_write(void *ctx, const void *buf, size_t len)
+{
+    FanOut *f = ctx;
+    memcpy(f->scratch, buf, len);
+    bench_consume(f->scratch);
+    return (ssize_t) len;
+}
+
+static void bench_copy(void *arg, size_t ops)
+{
+    FanOut *f = arg;
+    for (size_t op = 0; op < ops; op++) {
+        for (int i = 0; i < SUBSCRIBERS; i++) {
+            f->copies[i] = malloc(f->size);
+            memcpy(f->copies[i], f->payload, f->size);
+        }
+        for (int i = 0; i < SUBSCRIBERS; i++) {
+            scratch_write(f, f->copies[i], f->size);
+            free(f->copies[i]);
+        }
+    }
+}
+
+static void bench_shared(void *arg, size_t ops)
+{
+    FanOut *f = arg;
+    for (size_t op = 0; op < ops; op++) {
+        pubsub_publish(f->ps, "bench", f->payload, f->size);
+        for (int i = 0; i < SUBSCRIBERS; i++)
+            pubsub_flush(f->subs[i], scratch_write, f);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "pubsub", argc, argv);
+
+    static FanOut f;
+    f.ps = pubsub_init(0, 0);
+    if (f.ps == NULL) return 1;
+    for (int i = 0; i < SUBSCRIBERS; i++) {
+        f.subs[i] = pubsub_subscriber_new(f.ps, NULL);
+        if (f.subs[i] == NULL || pubsub_subscribe(f.subs[i], "bench") != 0) return 1;
+    }
+
+    size_t sizes[] = { 256, PUBSUB_MAX_MESSAGE };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char params[32];
+        snprintf(params, sizeof(params), "%zuB x%d", sizes[s], SUBSCRIBERS);
+        f.size = sizes[s];
+        f.payload = malloc(f.size);
+        memset(f.payload, 'm', f.size);
+
+        bench_run(&bs, "copy", params, bench_copy, &f, bench_ops(&bs, 20), f.size * SUBSCRIBERS);
+        bench_run(&bs, "shared", params, bench_shared, &f, bench_ops(&bs, 20), f.size * SUBSCRIBERS);
+        free(f.payload);
+    }
+
+    PubSubStats stats;
+    pubsub_get_stats(f.ps, &stats);
+    for (int i = 0; i < SUBSCRIBERS; i++)
+        pubsub_subscriber_free(f.subs[i]);
+    pubsub_destroy(f.ps);
+    return bench_suite_finish(&bs) == 0 && stats.dropped == 0 ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+/*
+ * bench-spsc-ring.c
+ *
+ * Throughput benchmark for the lock-free SPSC ring buffer against a
+ * RingBuffer wrapped in a mutex.  One producer thread streams a byte
+ * pattern in fixed size chunks, one consumer thread reads it back and
+ * verifies it.  The SPSC run publishes once per batch of chunks.  The
+ * time is reported per chunk, the -s scale sets the amount streamed.
+ *
+ * Usage: bench-spsc-ring [-j results.json] [-r reps] [-w warmup] [-s scale] [chunk-size] [ring-size]
+ */
+
+#include "bench.h"
+#include "spsc-ring-buffer.h"
+#include "ring-buffer.h"
+#include "logging.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PUBLISH_BATCH 8
+
+static size_t total_bytes = 16UL * 1024 * 1024;
+static size_t chunk = 1024;
+static size_t ring_size = 64 * 1024;
+
+static SPSCRingBuffer *spsc;
+static RingBuffer *rbuf;
+static pthread_mutex_t rbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fill_pattern(uint8_t *buf, size_t len, uint64_t offset)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t) ((offset + i) * 31);
+}
+
+static int check_pattern(const uint8_t *buf, size_t len, uint64_t offset)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != (uint8_t) ((offset + i) * 31))
+            return -1;
+    }
+    return 0;
+}
+
+static void *spsc_producer(__attribute__((__unused__)) void *arg)
+{
+    uint8_t *src = malloc(chunk * 2);
+    uint64_t sent = 0;
+    int pending = 0;
+
+    while (sent < total_bytes) {
+        size_t len = chunk < total_bytes - sent ? chunk : total_bytes - sent;
+        fill_pattern(src, len, sent);
+        size_t done = 0;
+        while (done < len) {
+            size_t n = rbuf_spsc_store(spsc, src + done, len - done);
+            if (n == 0) {
+                rbuf_spsc_publish(spsc);
+                pending = 0;
+                sched_yield();
+                continue;
+            }
+            done += n;
+        }
+        sent += len;
+        if (++pending == PUBLISH_BATCH) {
+            rbuf_spsc_publish(spsc);
+            pending = 0;
+        }
+    }
+    rbuf_spsc_publish(spsc);
+    free(src);
+    return NULL;
+}
+
+static void *mutex_producer(__attribute__((__unused__)) void *arg)
+{
+    uint8_t *src = malloc(chunk);
+    uint64_t sent = 0;
+
+    while (sent < total_bytes) {
+        size_t len = chunk < total_bytes - sent ? chunk : total_bytes - sent;
+        fill_pattern(src, len, sent);
+        size_t done = 0;
+        while (done < len) {
+            /* RingBuffer overwrites when full, only store what fits */
+            pthread_mutex_lock(&rbuf_lock);
+            size_t n = rbuf_get_free_space(rbuf);
+            if (n > len - done) n = len - done;
+            if (n) rbuf_store_data(rbuf, src + done, n);
+            pthread_mutex_unlock(&rbuf_lock);
+            if (n == 0) {
+                sched_yield();
+                continue;
+            }
+            done += n;
+        }
+        sent += len;
+    }
+    free(src);
+    return NULL;
+}
+
+static void run(void *(*producer)(void *), int use_spsc, size_t ops)
+{
+    pthread_t tid;
+    uint8_t *dest = malloc(chunk);
+    uint64_t received = 0;
+    int errors = 0;
+
+    total_bytes = ops * chunk;
+    pthread_create(&tid, NULL, producer, NULL);
+
+    while (received < total_bytes) {
+        size_t n;
+        if (use_spsc) {
+            n = rbuf_spsc_pop(spsc, dest, chunk);
+        } else {
+            pthread_mutex_lock(&rbuf_lock);
+            n = rbuf_pop_data(rbuf, dest, chunk);
+            pthread_mutex_unlock(&rbuf_lock);
+        }
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        if (check_pattern(dest, n, received) != 0)
+            errors++;
+        received += n;
+    }
+
+    pthread_join(tid, NULL);
+    if (errors)
+        ERROR_PRINT("%i corrupted reads", errors);
+    free(dest);
+}
+
+static void run_spsc(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    run(spsc_producer, 1, ops);
+}
+
+static void run_mutex(__attribute__((__unused__)) void *arg, size_t ops)
+{
+    run(mutex_producer, 0, ops);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    bench_suite_init(&bs, "spsc-ring", argc, argv);
+
+    if (optind < argc) chunk = strtoul(argv[optind], NULL, 10);
+    if (optind + 1 < argc) ring_size = strtoul(argv[optind + 1], NULL, 10);
+    if (chunk == 0) {
+        ERROR_PRINT("Invalid parameters");
+        return -1;
+    }
+
+    spsc = rbuf_spsc_init(ring_size);
+    rbuf = rbuf_init_buffer_size(ring_size);
+
+    char params[32];
+    snprintf(params, sizeof(params), "chunk=%zu ring=%zu", chunk, rbuf_get_buffer_size(rbuf));
+    size_t ops = bench_ops(&bs, total_bytes / chunk);
+    bench_run(&bs, "spsc_ring", params, run_spsc, NULL, ops, chunk);
+    bench_run(&bs, "mutex_ring_buffer", params, run_mutex, NULL, ops, chunk);
+
+    rbuf_spsc_free(spsc);
+    rbuf_free_buffer(rbuf);
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
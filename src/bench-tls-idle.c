@@ -0,0 +1,179 @@
+/*
+ * bench-tls-idle.c
+ *
+ * Resident memory per idle TLS connection.  A forked client opens the
+ * connections over TCP loopback, one at a time: handshake, one small
+ * request/response, then it goes quiet.  The server side keeps every
+ * connection open and the growth of its RSS is divided by the connection
+ * count.  Each mode runs in its own server process:
+ *   default  buffers stay attached, OpenSSL keeps its record buffers
+ *   release  SSL_MODE_RELEASE_BUFFERS, ring buffers stay attached
+ *   lean     SSL_MODE_RELEASE_BUFFERS and TLS_lean_shrink() after idle
+ *
+ * Usage: bench-tls-idle [connections]
+ */
+
+#define _GNU_SOURCE
+#include "certificate.h"
+#include "tls-connection.h"
+#include "tls-lean.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { MODE_DEFAULT, MODE_RELEASE, MODE_LEAN, MODE_COUNT };
+static const char *mode_names[MODE_COUNT] = { "default", "release", "lean" };
+
+static size_t rss_bytes(void)
+{
+    size_t pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void wait_fd(int fd)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    poll(&p, 1, 1000);
+}
+
+/* Blocking client, connections are kept open until the pipe closes */
+static void run_client(uint16_t port, size_t count, int done_fd)
+{
+    TLSConnection *tls = TLS_init_client();
+    TLS_set_lean_mode(&tls);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char buf[16];
+
+    for (size_t i = 0; i < count; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) _exit(1);
+        SSL *ssl = SSL_new(tls->ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_connect(ssl) != 1 || SSL_write(ssl, "ping", 4) != 4 || SSL_read(ssl, buf, sizeof(buf)) != 4)
+            _exit(1);
+    }
+
+    read(done_fd, buf, 1);
+    _exit(0);
+}
+
+static TLSLeanConn *serve_one(TLSConnection **tls, TLSLeanPool *pool, int listen_fd)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) return NULL;
+
+    TLSLeanConn *c = TLS_lean_conn_new(tls, pool, fd);
+    if (c == NULL) return NULL;
+    SSL_set_accept_state(c->ssl);
+
+    int r;
+    while ((r = TLS_lean_handshake(c)) == 0) wait_fd(fd);
+    if (r < 0) return NULL;
+
+    char buf[16];
+    ssize_t n;
+    while ((n = TLS_lean_read(c, buf, sizeof(buf))) < 0) wait_fd(fd);
+    if (n != 4 || TLS_lean_write(c, "pong", 4) != 4) return NULL;
+    return c;
+}
+
+static int run_server(int mode, size_t count)
+{
+    TLSConnection *tls = TLS_init_server();
+    if (tls == NULL || CA_generate_self_signed(&tls, "localhost") != 1) return 1;
+    if (mode != MODE_DEFAULT) TLS_set_lean_mode(&tls);
+    TLSLeanPool *pool = TLS_lean_pool_init(0, mode == MODE_LEAN ? TLS_LEAN_IDLE_NS : UINT64_MAX);
+    TLSLeanConn **conns = calloc(count + 1, sizeof(TLSLeanConn *));
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr *) &addr, len) != 0 || listen(listen_fd, 128) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *) &addr, &len) != 0)
+        return 1;
+
+    int done[2];
+    if (pipe(done) != 0) return 1;
+    pid_t client = fork();
+    if (client == 0) {
+        close(done[1]);
+        run_client(ntohs(addr.sin_port), count + 1, done[0]);
+    }
+    close(done[0]);
+
+    /* First connection pays for lazily initialized OpenSSL state */
+    conns[0] = serve_one(&tls, pool, listen_fd);
+    size_t before = rss_bytes();
+    size_t served = 0;
+    for (size_t i = 1; i <= count && conns[i - 1] != NULL; i++, served++)
+        conns[i] = serve_one(&tls, pool, listen_fd);
+    size_t after = rss_bytes();
+    size_t in_use = atomic_load(&pool->in_use);
+
+    size_t shrunk = 0;
+    uint64_t later = now_ns() + TLS_LEAN_IDLE_NS;
+    for (size_t i = 0; i <= served && mode == MODE_LEAN; i++)
+        shrunk += conns[i] != NULL && TLS_lean_shrink(conns[i], later);
+    size_t idle = rss_bytes();
+
+    if (served != count || conns[count] == NULL) {
+        fprintf(stderr, "%s: only %zu of %zu connections served\n", mode_names[mode], served, count);
+        return 1;
+    }
+    printf("%-8s %8zu %14.1f %14.1f %10zu %10zu\n", mode_names[mode], count,
+           (double) (after - before) / count / 1024, ((double) idle - (double) before) / count / 1024,
+           in_use, shrunk);
+    fflush(stdout);
+
+    close(done[1]);
+    waitpid(client, NULL, 0);
+    for (size_t i = 0; i <= count; i++) {
+        close(conns[i]->fd);
+        TLS_lean_conn_free(conns[i]);
+    }
+    free(conns);
+    TLS_lean_pool_destroy(pool);
+    TLS_free_connection(&tls);
+    close(listen_fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000;
+    int failed = 0;
+
+    printf("%-8s %8s %14s %14s %10s %10s\n", "mode", "conns", "KiB/conn", "KiB/conn idle",
+           "buffers", "shrunk");
+    fflush(stdout);
+    for (int mode = 0; mode < MODE_COUNT; mode++) {
+        pid_t pid = fork();
+        if (pid == 0) _exit(run_server(mode, count));
+        int status = 0;
+        waitpid(pid, &status, 0);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    return failed;
+}
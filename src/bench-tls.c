@@ -0,0 +1,214 @@
+#include "bench.h"
+#include "certificate.h"
+#include "session.h"
+#include "tls-connection.h"
+
+#include <openssl/err.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * In-process TLS benchmark.  Client and server SSL objects talk through a
+ * BIO pair, so the numbers contain no kernel networking.  For every key
+ * type and cipher suite, with and without client certificates checked by
+ * session_handler:
+ *   - full handshakes
+ *   - resumed handshakes
+ *   - bulk throughput in 16 KiB records
+ *
+ *   bench-tls [-j results.json] [-r reps] [-w warmup] [-s scale]
+ */
+
+#define BIO_PAIR_SIZE (64 * 1024)
+#define RECORD_SIZE 16384
+#define HANDSHAKES 4
+#define RECORDS 64
+
+typedef struct {
+    const char *name;
+    int version;
+} Suite;
+
+typedef struct {
+    TLSConnection *server;
+    TLSConnection *client;
+    SSL_SESSION *session;
+    SSL *c;
+    SSL *s;
+    unsigned char *record;
+    int failed;
+} TLSBench;
+
+static const Suite suites[] = {
+    { "TLS_AES_128_GCM_SHA256", TLS1_3_VERSION },
+    { "TLS_AES_256_GCM_SHA384", TLS1_3_VERSION },
+    { "TLS_CHACHA20_POLY1305_SHA256", TLS1_3_VERSION },
+    { "ECDHE-ECDSA-AES128-GCM-SHA256", TLS1_2_VERSION },
+    { "ECDHE-RSA-AES128-GCM-SHA256", TLS1_2_VERSION },
+};
+
+static int pump_handshake(SSL *client, SSL *server)
+{
+    int client_done = 0, server_done = 0;
+    for (int i = 0; i < 100 && !(client_done && server_done); i++) {
+        if (!client_done) client_done = SSL_do_handshake(client) == 1;
+        if (!server_done) server_done = SSL_do_handshake(server) == 1;
+    }
+    return client_done && server_done;
+}
+
+static int connect_pair(TLSBench *b, SSL_SESSION *session)
+{
+    BIO *cbio, *sbio;
+    b->c = SSL_new(b->client->ctx);
+    b->s = SSL_new(b->server->ctx);
+    if (b->c == NULL || b->s == NULL || !BIO_new_bio_pair(&cbio, BIO_PAIR_SIZE, &sbio, BIO_PAIR_SIZE))
+        return -1;
+
+    SSL_set_bio(b->c, cbio, cbio);
+    SSL_set_bio(b->s, sbio, sbio);
+    SSL_set_connect_state(b->c);
+    SSL_set_accept_state(b->s);
+    if (session) SSL_set_session(b->c, session);
+
+    if (!pump_handshake(b->c, b->s)) {
+        b->failed = 1;
+        return -1;
+    }
+
+    /* TLS 1.3 tickets arrive after the handshake, let the client read them */
+    unsigned char tmp[1];
+    SSL_read(b->c, tmp, sizeof(tmp));
+    return 0;
+}
+
+static void close_pair(TLSBench *b)
+{
+    /* Freeing without a shutdown would evict the session from the cache */
+    SSL_set_shutdown(b->c, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_set_shutdown(b->s, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(b->c);
+    SSL_free(b->s);
+    b->c = b->s = NULL;
+}
+
+static void bench_full(void *arg, size_t ops)
+{
+    TLSBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        connect_pair(b, NULL);
+        close_pair(b);
+    }
+}
+
+static void bench_resumed(void *arg, size_t ops)
+{
+    TLSBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        connect_pair(b, b->session);
+        if (!SSL_session_reused(b->c)) b->failed = 1;
+        /* TLS 1.3 tickets are single use, keep the fresh one */
+        SSL_SESSION *fresh = SSL_get1_session(b->c);
+        if (fresh) {
+            SSL_SESSION_free(b->session);
+            b->session = fresh;
+        }
+        close_pair(b);
+    }
+}
+
+static void bench_bulk(void *arg, size_t ops)
+{
+    TLSBench *b = arg;
+    for (size_t i = 0; i < ops; i++) {
+        if (SSL_write(b->c, b->record, RECORD_SIZE) != RECORD_SIZE ||
+            SSL_read(b->s, b->record, RECORD_SIZE) != RECORD_SIZE)
+            b->failed = 1;
+    }
+}
+
+static int setup(TLSBench *b, CAKeyType key, const Suite *suite, int verify)
+{
+    memset(b, 0, sizeof(*b));
+    b->server = TLS_init_server();
+    b->client = TLS_init_client();
+    if (b->server == NULL || b->client == NULL) return -1;
+
+    if (CA_generate_self_signed_key(&b->server, "localhost", key) != 1) return -1;
+    TLS_set_session_cache_mode(&b->server, "bench-tls", 9);
+
+    for (int i = 0; i < 2; i++) {
+        SSL_CTX *ctx = i ? b->server->ctx : b->client->ctx;
+        SSL_CTX_set_min_proto_version(ctx, suite->version);
+        SSL_CTX_set_max_proto_version(ctx, suite->version);
+        int ok = suite->version == TLS1_3_VERSION ? SSL_CTX_set_ciphersuites(ctx, suite->name)
+                                                  : SSL_CTX_set_cipher_list(ctx, suite->name);
+        if (!ok) return -1;
+    }
+
+    if (verify) {
+        /* Client certificate with a whitelisted CN and key */
+        if (CA_generate_self_signed_key(&b->client, "Horse bench", key) != 1) return -1;
+        X509 *cert = SSL_CTX_get0_certificate(b->client->ctx);
+        if (TLS_server_trust_client_cert(&b->server, cert) != 1 ||
+            TLS_whitelist_add_pubkey(X509_get0_pubkey(cert)) != 0)
+            return -1;
+    }
+
+    if (connect_pair(b, NULL) != 0) return -1;
+    b->session = SSL_get1_session(b->c);
+    close_pair(b);
+
+    b->record = calloc(1, RECORD_SIZE);
+    return b->session && b->record ? 0 : -1;
+}
+
+static void teardown(TLSBench *b)
+{
+    SSL_SESSION_free(b->session);
+    TLS_free_connection(&b->server);
+    TLS_free_connection(&b->client);
+    free(b->record);
+    TLS_whitelist_clear();
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSuite bs;
+    char params[48];
+    bench_suite_init(&bs, "tls", argc, argv);
+
+    for (int key = 0; key < CA_KEY_TYPE_COUNT; key++) {
+        for (size_t s = 0; s < sizeof(suites) / sizeof(suites[0]); s++) {
+            const Suite *suite = &suites[s];
+            /* TLS 1.2 suites name the certificate type */
+            int rsa = key == CA_KEY_RSA_2048;
+            if (suite->version == TLS1_2_VERSION && (strstr(suite->name, "-RSA-") != NULL) != rsa)
+                continue;
+
+            for (int verify = 0; verify < 2; verify++) {
+                TLSBench b;
+                snprintf(params, sizeof(params), "%s %s%s", CA_key_type_name(key), suite->name,
+                         verify ? " +verify" : "");
+                if (setup(&b, key, suite, verify) != 0) {
+                    fprintf(stderr, "setup failed: %s\n", params);
+                    ERR_print_errors_fp(stderr);
+                    teardown(&b);
+                    continue;
+                }
+
+                bench_run(&bs, "handshake_full", params, bench_full, &b, bench_ops(&bs, HANDSHAKES), 0);
+                bench_run(&bs, "handshake_resumed", params, bench_resumed, &b, bench_ops(&bs, HANDSHAKES), 0);
+
+                connect_pair(&b, NULL);
+                bench_run(&bs, "bulk_16k", params, bench_bulk, &b, bench_ops(&bs, RECORDS), RECORD_SIZE);
+                close_pair(&b);
+
+                if (b.failed) fprintf(stderr, "errors during: %s\n", params);
+                teardown(&b);
+            }
+        }
+    }
+
+    return bench_suite_finish(&bs) == 0 ? 0 : 1;
+}
@@ -0,0 +1,706 @@
+/******************************************************************************
+ *  binlog.c
+ *
+ *  Deferred-formatting binary logger.
+ *
+ *  Description:
+ *  Formatting a message costs far more than producing it.  BINLOG() call
+ *  sites are described at compile time, so at run time only the site id,
+ *  a timestamp and the raw arguments are copied into a per-thread ring.
+ *  Formatting happens offline in the logdecode tool.
+ *   - binlog_open(): start logging into a binary file
+ *   - binlog_write(): called by the BINLOG() macro
+ *   - binlog_flush(), binlog_close(): drain the thread rings
+ *   - binlog_set_level(): runtime level filter, also BINLOG_LEVEL env
+ *     through binlog_level_from_env()
+ *   - binlog_render(): printf-compatible rendering of one record
+ *   - binlog_reader_*(): read a binary log file back as text lines
+ *
+ *  Implementation details:
+ *   - Call sites live in the "binlog_sites" section, the site id is its
+ *     index there.  The site table is written to the file header once.
+ *   - Each thread owns an SPSCRingBuffer.  The producer never blocks:
+ *     when the ring is full the record is dropped and counted, and the
+ *     flusher writes a BL_ID_DROPPED record with the count.
+ *   - One background thread drains the rings into the file every
+ *     millisecond.  Rings of exited threads are freed once drained.
+ *   - Character pointers are only copied as strings when the format uses
+ *     %s for them, otherwise they are logged as pointers.  This is
+ *     resolved once per site when the log is opened.
+ *   - Integers and pointers are stored as 8 bytes, doubles as 8 bytes and
+ *     strings as a 16-bit length followed by at most BL_MAX_STR bytes.
+ *   - The file uses host byte order.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include "binlog.h"
+#include "spsc-ring-buffer.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct BL_THREAD_T {
+    SPSCRingBuffer *ring;
+    _Atomic uint64_t dropped;
+    uint64_t dropped_reported;
+    _Atomic int retired;
+    int exit_passes;
+    uint16_t id;
+    struct BL_THREAD_T *next;
+} BinlogThread;
+
+extern const BinlogSite __start_binlog_sites[] __attribute__((weak));
+extern const BinlogSite __stop_binlog_sites[] __attribute__((weak));
+
+_Atomic int binlog_level = DEBUG ? BL_DEBUG : BL_INFO;
+
+static _Atomic int bl_open = 0;
+static FILE *bl_file = NULL;
+static pthread_t bl_flusher;
+static int bl_running = 0;
+static pthread_mutex_t bl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bl_cond = PTHREAD_COND_INITIALIZER;
+/* Serializes draining, the rings have a single consumer */
+static pthread_mutex_t bl_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static BinlogThread *bl_threads = NULL;
+static uint16_t bl_next_thread = 0;
+static _Atomic uint64_t bl_dropped_total = 0;
+
+static pthread_key_t bl_key;
+static pthread_once_t bl_key_once = PTHREAD_ONCE_INIT;
+static __thread BinlogThread *bl_self = NULL;
+/* Set once the ring is retired, records logged after that are dropped */
+static __thread int bl_exited = 0;
+/* Set while the logger itself runs, its own messages go to stdout */
+static __thread int bl_busy = 0;
+
+static const char *bl_level_names[] = { "ERROR", "INFO", "DEBUG" };
+
+/* Argument types of every site after matching them with the format */
+static uint8_t (*bl_site_types)[BL_MAX_ARGS + 1] = NULL;
+static uint32_t bl_site_count = 0;
+static pthread_once_t bl_types_once = PTHREAD_ONCE_INIT;
+
+static void bl_resolve_types(const BinlogSite *site, uint8_t *types)
+{
+    int i = 0;
+    memcpy(types, site->types, BL_MAX_ARGS + 1);
+
+    for (const char *f = site->fmt; *f && i < site->nargs; f++) {
+        if (*f != '%') continue;
+        if (f[1] == '%') {
+            f++;
+            continue;
+        }
+        f++;
+        while (*f && strchr("-+ #0123456789.hlLqjzt", *f))
+            f++;
+        if (*f == 0) break;
+        if (types[i] == BL_T_STR && *f != 's')
+            types[i] = BL_T_PTR;
+        i++;
+    }
+}
+
+static void bl_types_init(void)
+{
+    uint32_t count = __start_binlog_sites ? (uint32_t) (__stop_binlog_sites - __start_binlog_sites) : 0;
+    bl_site_types = calloc(count ? count : 1, sizeof(*bl_site_types));
+    if (bl_site_types == NULL) return;
+    for (uint32_t i = 0; i < count; i++)
+        bl_resolve_types(&__start_binlog_sites[i], bl_site_types[i]);
+    bl_site_count = count;
+}
+
+/*
+ * Destructors of other keys may still log, so the ring is kept until the
+ * last destructor pass.  Only then it is handed to the flusher to free.
+ */
+static void bl_thread_exit(void *arg)
+{
+    BinlogThread *t = arg;
+    if (++t->exit_passes < PTHREAD_DESTRUCTOR_ITERATIONS && pthread_setspecific(bl_key, t) == 0)
+        return;
+
+    bl_self = NULL;
+    bl_exited = 1;
+    atomic_store_explicit(&t->retired, 1, memory_order_release);
+}
+
+static void bl_key_init(void)
+{
+    pthread_key_create(&bl_key, bl_thread_exit);
+}
+
+static BinlogThread *bl_get_thread(void)
+{
+    if (bl_self != NULL) return bl_self;
+    if (bl_exited) return NULL;
+
+    pthread_once(&bl_key_once, bl_key_init);
+    BinlogThread *t = calloc(1, sizeof(BinlogThread));
+    if (t == NULL) return NULL;
+    bl_busy = 1;
+    t->ring = rbuf_spsc_init(BL_THREAD_BUFFER);
+    bl_busy = 0;
+    if (t->ring == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bl_lock);
+    t->id = bl_next_thread++;
+    t->next = bl_threads;
+    bl_threads = t;
+    pthread_mutex_unlock(&bl_lock);
+
+    pthread_setspecific(bl_key, t);
+    bl_self = t;
+    return t;
+}
+
+static inline uint64_t bl_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void binlog_write(const BinlogSite *site, const char *fmt, ...)
+{
+    (void) fmt;
+    uint32_t id = (uint32_t) (site - __start_binlog_sites);
+    int open = !bl_busy && atomic_load_explicit(&bl_open, memory_order_acquire);
+    uint8_t local_types[BL_MAX_ARGS + 1];
+    const uint8_t *types;
+
+    if (open) {
+        types = bl_site_types[id];
+    } else {
+        bl_resolve_types(site, local_types);
+        types = local_types;
+    }
+
+    uint8_t buf[BL_MAX_RECORD];
+    uint8_t *p = buf + sizeof(BinlogRecordHeader);
+    uint8_t *end = buf + sizeof(buf);
+    va_list ap;
+
+    va_start(ap, fmt);
+    for (int i = 0; i < site->nargs; i++) {
+        union { int64_t i; uint64_t u; double d; } v;
+        switch (types[i]) {
+        case BL_T_I32: v.i = va_arg(ap, int); break;
+        case BL_T_U32: v.u = va_arg(ap, unsigned int); break;
+        case BL_T_I64: v.i = va_arg(ap, long long); break;
+        case BL_T_U64: v.u = va_arg(ap, unsigned long long); break;
+        case BL_T_DBL: v.d = va_arg(ap, double); break;
+        case BL_T_PTR: v.u = (uintptr_t) va_arg(ap, void *); break;
+        case BL_T_STR: {
+            const char *s = va_arg(ap, const char *);
+            if (s == NULL) s = "(null)";
+            size_t room = (size_t) (end - p) > sizeof(uint16_t) ? (size_t) (end - p) - sizeof(uint16_t) : 0;
+            uint16_t n = (uint16_t) strnlen(s, room < BL_MAX_STR ? room : BL_MAX_STR);
+            if (room == 0) goto full;
+            memcpy(p, &n, sizeof(n));
+            memcpy(p + sizeof(n), s, n);
+            p += sizeof(n) + n;
+            continue;
+        }
+        default:
+            goto full;
+        }
+        if ((size_t) (end - p) < sizeof(v)) goto full;
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+    }
+full:
+    va_end(ap);
+
+    BinlogRecordHeader *hdr = (BinlogRecordHeader *) buf;
+    hdr->id = id;
+    hdr->len = (uint16_t) (p - buf - sizeof(BinlogRecordHeader));
+    hdr->ts_ns = bl_now_ns();
+
+    if (!open) {
+        char line[BL_MAX_RECORD * 2];
+        BinlogSite resolved = *site;
+        memcpy(resolved.types, types, sizeof(resolved.types));
+        hdr->thread = 0;
+        binlog_render(&resolved, hdr, buf + sizeof(BinlogRecordHeader), line, sizeof(line));
+        puts(line);
+        return;
+    }
+
+    BinlogThread *t = bl_get_thread();
+    if (t == NULL) return;
+    hdr->thread = t->id;
+
+    /* Use the producer's cached view first, the consumer line stays remote */
+    SPSCRingBuffer *ring = t->ring;
+    size_t total = (size_t) (p - buf);
+    if (ring->size - (size_t) (ring->head_local - ring->tail_cache) < total &&
+        rbuf_spsc_free_space(ring) < total) {
+        atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    rbuf_spsc_push(ring, buf, total);
+}
+
+/*
+ * Flusher side
+ */
+static void bl_write_dropped(BinlogThread *t)
+{
+    uint64_t dropped = atomic_load_explicit(&t->dropped, memory_order_relaxed);
+    if (dropped == t->dropped_reported) return;
+
+    uint64_t delta = dropped - t->dropped_reported;
+    BinlogRecordHeader hdr = {
+        .id = BL_ID_DROPPED, .len = sizeof(delta), .thread = t->id, .ts_ns = bl_now_ns(),
+    };
+    fwrite(&hdr, sizeof(hdr), 1, bl_file);
+    fwrite(&delta, sizeof(delta), 1, bl_file);
+    t->dropped_reported = dropped;
+    atomic_fetch_add_explicit(&bl_dropped_total, delta, memory_order_relaxed);
+}
+
+static void bl_drain_all(void)
+{
+    int busy = bl_busy;
+    bl_busy = 1;
+    pthread_mutex_lock(&bl_drain_lock);
+    pthread_mutex_lock(&bl_lock);
+
+    for (BinlogThread **it = &bl_threads; *it != NULL;) {
+        BinlogThread *t = *it;
+        int retired = atomic_load_explicit(&t->retired, memory_order_acquire);
+        struct iovec iov[2];
+        int iovcnt;
+        size_t n = rbuf_spsc_peek(t->ring, iov, &iovcnt);
+
+        if (n > 0 && bl_file != NULL) {
+            for (int i = 0; i < iovcnt; i++)
+                fwrite(iov[i].iov_base, 1, iov[i].iov_len, bl_file);
+            rbuf_spsc_consume(t->ring, n);
+        }
+        if (bl_file != NULL)
+            bl_write_dropped(t);
+
+        if (retired && rbuf_spsc_readable(t->ring) == 0) {
+            *it = t->next;
+            rbuf_spsc_free(t->ring);
+            free(t);
+            continue;
+        }
+        it = &t->next;
+    }
+
+    pthread_mutex_unlock(&bl_lock);
+    if (bl_file != NULL)
+        fflush(bl_file);
+    pthread_mutex_unlock(&bl_drain_lock);
+    bl_busy = busy;
+}
+
+static void *bl_flusher_main(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&bl_lock);
+    while (bl_running) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&bl_cond, &bl_lock, &until);
+        pthread_mutex_unlock(&bl_lock);
+        bl_drain_all();
+        pthread_mutex_lock(&bl_lock);
+    }
+    pthread_mutex_unlock(&bl_lock);
+    return NULL;
+}
+
+static void bl_write_str(FILE *f, const char *s)
+{
+    uint16_t n = (uint16_t) strnlen(s, UINT16_MAX);
+    fwrite(&n, sizeof(n), 1, f);
+    fwrite(s, 1, n, f);
+}
+
+static void bl_write_sites(FILE *f)
+{
+    uint32_t count = bl_site_count;
+    uint32_t head[3] = { BL_FILE_MAGIC, BL_FILE_VERSION, count };
+    fwrite(head, sizeof(head), 1, f);
+
+    for (uint32_t i = 0; i < count; i++) {
+        const BinlogSite *s = &__start_binlog_sites[i];
+        fwrite(&s->level, sizeof(s->level), 1, f);
+        fwrite(&s->line, sizeof(s->line), 1, f);
+        fwrite(&s->nargs, sizeof(s->nargs), 1, f);
+        fwrite(bl_site_types[i], 1, s->nargs, f);
+        bl_write_str(f, s->file);
+        bl_write_str(f, s->func);
+        bl_write_str(f, s->fmt);
+    }
+}
+
+void binlog_set_level(int level)
+{
+    if (level < BL_ERROR) level = BL_ERROR;
+    if (level > BL_DEBUG) level = BL_DEBUG;
+    atomic_store_explicit(&binlog_level, level, memory_order_relaxed);
+}
+
+void binlog_level_from_env(void)
+{
+    const char *env = getenv("BINLOG_LEVEL");
+    if (env == NULL) return;
+    for (int i = BL_ERROR; i <= BL_DEBUG; i++)
+        if (strcasecmp(env, bl_level_names[i]) == 0)
+            binlog_set_level(i);
+}
+
+uint64_t binlog_dropped(void)
+{
+    return atomic_load_explicit(&bl_dropped_total, memory_order_relaxed);
+}
+
+int binlog_open(const char *path)
+{
+    pthread_mutex_lock(&bl_lock);
+    if (bl_file != NULL) {
+        pthread_mutex_unlock(&bl_lock);
+        ERROR_PRINT("Binary log is already open");
+        return -1;
+    }
+
+    pthread_once(&bl_types_once, bl_types_init);
+    if (bl_site_types == NULL) {
+        pthread_mutex_unlock(&bl_lock);
+        ERROR_PRINT("Cannot allocate binary log site table");
+        return -1;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        pthread_mutex_unlock(&bl_lock);
+        ERROR_PRINT("Cannot open binary log %s, errno %i", path, errno);
+        return -1;
+    }
+    bl_write_sites(f);
+    bl_file = f;
+    bl_running = 1;
+    pthread_mutex_unlock(&bl_lock);
+
+    binlog_level_from_env();
+
+    if (pthread_create(&bl_flusher, NULL, bl_flusher_main, NULL) != 0) {
+        ERROR_PRINT("Cannot start binary log flusher");
+        pthread_mutex_lock(&bl_lock);
+        bl_running = 0;
+        bl_file = NULL;
+        pthread_mutex_unlock(&bl_lock);
+        fclose(f);
+        return -1;
+    }
+    atomic_store_explicit(&bl_open, 1, memory_order_release);
+    return 0;
+}
+
+void binlog_flush(void)
+{
+    bl_drain_all();
+}
+
+void binlog_close(void)
+{
+    pthread_mutex_lock(&bl_lock);
+    if (bl_file == NULL) {
+        pthread_mutex_unlock(&bl_lock);
+        return;
+    }
+    atomic_store_explicit(&bl_open, 0, memory_order_release);
+    bl_running = 0;
+    pthread_cond_signal(&bl_cond);
+    pthread_mutex_unlock(&bl_lock);
+
+    pthread_join(bl_flusher, NULL);
+    bl_drain_all();
+
+    /* Rings of live threads stay registered for the next binlog_open() */
+    pthread_mutex_lock(&bl_drain_lock);
+    fclose(bl_file);
+    bl_file = NULL;
+    pthread_mutex_unlock(&bl_drain_lock);
+}
+
+/*
+ * Rendering
+ */
+typedef struct BL_ARG_T {
+    uint8_t type;
+    union { int64_t i; uint64_t u; double d; } v;
+    const char *s;
+    uint16_t slen;
+} BinlogArg;
+
+static int bl_decode_args(const BinlogSite *site, const uint8_t *p, size_t len, BinlogArg *args)
+{
+    const uint8_t *end = p + len;
+    int n = 0;
+    for (; n < site->nargs; n++) {
+        args[n].type = site->types[n];
+        if (args[n].type == BL_T_STR) {
+            if ((size_t) (end - p) < sizeof(uint16_t)) break;
+            memcpy(&args[n].slen, p, sizeof(uint16_t));
+            p += sizeof(uint16_t);
+            if ((size_t) (end - p) < args[n].slen) break;
+            args[n].s = (const char *) p;
+            p += args[n].slen;
+        } else {
+            if ((size_t) (end - p) < sizeof(args[n].v)) break;
+            memcpy(&args[n].v, p, sizeof(args[n].v));
+            p += sizeof(args[n].v);
+        }
+    }
+    return n;
+}
+
+static size_t bl_append(size_t outlen, size_t pos, int n)
+{
+    if (n < 0) return pos;
+    pos += (size_t) n;
+    return pos < outlen ? pos : outlen - 1;
+}
+
+static size_t bl_render_arg(char *out, size_t outlen, size_t pos, char *spec, size_t speclen,
+                            char conv, const BinlogArg *a)
+{
+    char tmp[BL_MAX_STR + 1];
+    int n;
+
+    switch (conv) {
+    case 'd': case 'i':
+        spec[speclen++] = 'l'; spec[speclen++] = 'l'; spec[speclen++] = conv; spec[speclen] = 0;
+        n = snprintf(out + pos, outlen - pos, spec,
+                     a->type == BL_T_DBL ? (long long) a->v.d : (long long) a->v.i);
+        break;
+    case 'o': case 'u': case 'x': case 'X':
+        spec[speclen++] = 'l'; spec[speclen++] = 'l'; spec[speclen++] = conv; spec[speclen] = 0;
+        n = snprintf(out + pos, outlen - pos, spec,
+                     a->type == BL_T_DBL ? (unsigned long long) a->v.d : (unsigned long long) a->v.u);
+        break;
+    case 'c':
+        spec[speclen++] = conv; spec[speclen] = 0;
+        n = snprintf(out + pos, outlen - pos, spec, (int) a->v.i);
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        spec[speclen++] = conv; spec[speclen] = 0;
+        n = snprintf(out + pos, outlen - pos, spec,
+                     a->type == BL_T_DBL ? a->v.d : (double) a->v.i);
+        break;
+    case 's':
+        spec[speclen++] = conv; spec[speclen] = 0;
+        if (a->type == BL_T_STR) {
+            memcpy(tmp, a->s, a->slen);
+            tmp[a->slen] = 0;
+        } else {
+            snprintf(tmp, sizeof(tmp), "(?)");
+        }
+        n = snprintf(out + pos, outlen - pos, spec, tmp);
+        break;
+    case 'p':
+        spec[speclen++] = conv; spec[speclen] = 0;
+        n = snprintf(out + pos, outlen - pos, spec, (void *) (uintptr_t) a->v.u);
+        break;
+    default:
+        n = 0;
+    }
+    return bl_append(outlen, pos, n);
+}
+
+size_t binlog_render(const BinlogSite *site, const BinlogRecordHeader *rec,
+                     const uint8_t *payload, char *out, size_t outlen)
+{
+    BinlogArg args[BL_MAX_ARGS];
+    int nargs = bl_decode_args(site, payload, rec->len, args);
+    int next = 0;
+    size_t pos = 0;
+
+    if (outlen == 0) return 0;
+    out[0] = 0;
+
+    const char *level = site->level <= BL_DEBUG ? bl_level_names[site->level] : "?";
+    pos = bl_append(outlen, pos, snprintf(out, outlen, "[%s] %s:%u %s(): ",
+                                               level, site->file, site->line, site->func));
+
+    for (const char *f = site->fmt; *f && pos < outlen - 1; f++) {
+        if (*f != '%') {
+            out[pos++] = *f;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[pos++] = '%';
+            f++;
+            continue;
+        }
+
+        /* Keep flags, width and precision, normalize the length modifier */
+        char spec[32] = "%";
+        size_t speclen = 1;
+        const char *start = f++;
+        while (*f && strchr("-+ #0123456789.", *f) && speclen < sizeof(spec) - 4)
+            spec[speclen++] = *f++;
+        while (*f && strchr("hlLqjzt", *f))
+            f++;
+        if (*f == 0) break;
+
+        if (next < nargs && strchr("diouxXceEfFgGaAsp", *f)) {
+            pos = bl_render_arg(out, outlen, pos, spec, speclen, *f, &args[next++]);
+        } else {
+            /* Unsupported or missing argument, print the spec as is */
+            size_t n = (size_t) (f - start) + 1;
+            if (n > outlen - 1 - pos) n = outlen - 1 - pos;
+            memcpy(out + pos, start, n);
+            pos += n;
+        }
+    }
+    out[pos] = 0;
+    return pos;
+}
+
+/*
+ * Reading log files
+ */
+static char *bl_read_str(FILE *f)
+{
+    uint16_t n;
+    if (fread(&n, sizeof(n), 1, f) != 1) return NULL;
+    char *s = malloc((size_t) n + 1);
+    if (s == NULL) return NULL;
+    if (n && fread(s, 1, n, f) != n) {
+        free(s);
+        return NULL;
+    }
+    s[n] = 0;
+    return s;
+}
+
+BinlogReader *binlog_reader_open(const char *path)
+{
+    BinlogReader *r = calloc(1, sizeof(BinlogReader));
+    if (r == NULL) return NULL;
+
+    r->file = fopen(path, "rb");
+    if (r->file == NULL) {
+        ERROR_PRINT("Cannot open %s, errno %i", path, errno);
+        free(r);
+        return NULL;
+    }
+
+    uint32_t head[3];
+    if (fread(head, sizeof(head), 1, r->file) != 1 ||
+        head[0] != BL_FILE_MAGIC || head[1] != BL_FILE_VERSION) {
+        ERROR_PRINT("%s is not a binary log", path);
+        goto fail;
+    }
+
+    r->sites = calloc(head[2] ? head[2] : 1, sizeof(BinlogSite));
+    if (r->sites == NULL) goto fail;
+
+    for (uint32_t i = 0; i < head[2]; i++) {
+        BinlogSite *s = &r->sites[i];
+        r->site_count = i + 1;
+        if (fread(&s->level, sizeof(s->level), 1, r->file) != 1 ||
+            fread(&s->line, sizeof(s->line), 1, r->file) != 1 ||
+            fread(&s->nargs, sizeof(s->nargs), 1, r->file) != 1 ||
+            s->nargs > BL_MAX_ARGS ||
+            fread(s->types, 1, s->nargs, r->file) != s->nargs ||
+            (s->file = bl_read_str(r->file)) == NULL ||
+            (s->func = bl_read_str(r->file)) == NULL ||
+            (s->fmt = bl_read_str(r->file)) == NULL) {
+            ERROR_PRINT("Truncated site table in %s", path);
+            goto fail;
+        }
+    }
+    return r;
+
+fail:
+    binlog_reader_close(r);
+    return NULL;
+}
+
+int binlog_reader_next(BinlogReader *r, char *line, size_t len)
+{
+    BinlogRecordHeader hdr;
+    uint8_t payload[BL_MAX_RECORD];
+
+    if (fread(&hdr, sizeof(hdr), 1, r->file) != 1)
+        return 0;
+    if (hdr.len > sizeof(payload) || fread(payload, 1, hdr.len, r->file) != hdr.len)
+        return -1;
+
+    time_t sec = (time_t) (hdr.ts_ns / 1000000000ULL);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t pos = strftime(line, len, "%Y-%m-%d %H:%M:%S", &tm);
+    pos = bl_append(len, pos, snprintf(line + pos, len - pos, ".%09llu T%u ",
+                                             (unsigned long long) (hdr.ts_ns % 1000000000ULL),
+                                             hdr.thread));
+
+    if (hdr.id == BL_ID_DROPPED) {
+        uint64_t count = 0;
+        memcpy(&count, payload, hdr.len < sizeof(count) ? hdr.len : sizeof(count));
+        snprintf(line + pos, len - pos, "[binlog] %llu records dropped", (unsigned long long) count);
+        return 1;
+    }
+    if (hdr.id >= r->site_count)
+        return -1;
+
+    binlog_render(&r->sites[hdr.id], &hdr, payload, line + pos, len - pos);
+    return 1;
+}
+
+void binlog_reader_close(BinlogReader *r)
+{
+    if (r == NULL) return;
+    for (uint32_t i = 0; i < r->site_count; i++) {
+        free((char *) r->sites[i].file);
+        free((char *) r->sites[i].func);
+        free((char *) r->sites[i].fmt);
+    }
+    free(r->sites);
+    if (r->file) fclose(r->file);
+    free(r);
+}
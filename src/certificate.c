@@ -1,6 +1,9 @@
 #include "certificate.h"
 #include "logging.h"
 
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
 int CA_certificate_file(TLSConnection **tls)
 {
     const char *cert_file = getenv("TLS_CERT_PATH");
@@ -19,4 +22,76 @@ int CA_certificate_priv_file(TLSConnection **tls)
     } else ERROR_PRINT("Please set PRIV_KEY_PATH");
 
     return -1;
-}
\ No newline at end of file
+}
+
+static const char *ca_key_names[CA_KEY_TYPE_COUNT] = {
+    [CA_KEY_EC_P256] = "P-256",
+    [CA_KEY_EC_P384] = "P-384",
+    [CA_KEY_RSA_2048] = "RSA-2048",
+    [CA_KEY_ED25519] = "Ed25519",
+};
+
+const char *CA_key_type_name(CAKeyType type)
+{
+    return type >= 0 && type < CA_KEY_TYPE_COUNT ? ca_key_names[type] : "unknown";
+}
+
+static EVP_PKEY *CA_generate_key(CAKeyType type)
+{
+    switch (type) {
+    case CA_KEY_EC_P256: return EVP_EC_gen("P-256");
+    case CA_KEY_EC_P384: return EVP_EC_gen("P-384");
+    case CA_KEY_RSA_2048: return EVP_RSA_gen(2048);
+    case CA_KEY_ED25519: return EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+    default: return NULL;
+    }
+}
+
+int CA_generate_self_signed(TLSConnection **tls, const char *cn)
+{
+    return CA_generate_self_signed_key(tls, cn, CA_KEY_EC_P256);
+}
+
+int CA_generate_self_signed_key(TLSConnection **tls, const char *cn, CAKeyType type)
+{
+    if (tls == NULL || *tls == NULL) return -1;
+
+    int ret = -1;
+    X509 *cert = NULL;
+    EVP_PKEY *pkey = CA_generate_key(type);
+    if (pkey == NULL) {
+        ERROR_PRINT("Cannot generate %s key for self-signed certificate", CA_key_type_name(type));
+        return -1;
+    }
+
+    cert = X509_new();
+    if (cert == NULL) goto out;
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 60L * 60 * 24);
+    X509_set_pubkey(cert, pkey);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) cn, -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    /* Ed25519 signs the whole message, no separate digest */
+    if (!X509_sign(cert, pkey, type == CA_KEY_ED25519 ? NULL : EVP_sha256())) {
+        ERROR_PRINT("Cannot sign self-signed certificate");
+        goto out;
+    }
+
+    if (SSL_CTX_use_certificate((*tls)->ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey((*tls)->ctx, pkey) != 1) {
+        ERROR_PRINT("Cannot install self-signed certificate");
+        goto out;
+    }
+    ret = 1;
+
+out:
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+    return ret;
+}
@@ -0,0 +1,672 @@
+/******************************************************************************
+ *  client-pool.c
+ *
+ *  Keep-alive pool of client TLS connections.
+ *
+ *  Description:
+ *  Producers sending many messages to the same server reuse established
+ *  connections instead of paying TCP and TLS setup for every message:
+ *   - client_pool_init(): pool on top of a configured client context
+ *   - client_pool_acquire(), client_pool_release(): exclusive use of a
+ *     connection for pipelined writes
+ *   - client_pool_send(): blocking send with one retry on a new connection
+ *   - client_pool_send_async(): queue a copy, completion callback later
+ *   - client_pool_evict_idle(): close connections idle too long
+ *
+ *  Implementation details:
+ *   - Endpoints keep a most recently used first list of idle connections
+ *     and a count of open ones, bounded by max_conns.  Acquire waits on a
+ *     condition variable when the bound is reached.
+ *   - Before reuse an idle connection is health checked with a
+ *     non-blocking MSG_PEEK.  Pending bytes (session tickets, a
+ *     close_notify) are run through SSL_read() on a non-blocking socket.
+ *   - The newest session ticket of every endpoint is kept, so connections
+ *     replacing evicted or dead ones resume instead of a full handshake.
+ *   - Asynchronous sends are pushed to an MPSC queue.  The worker thread
+ *     pops them in batches and writes consecutive messages to the same
+ *     endpoint over one connection, and evicts idle connections while
+ *     the queue is empty.
+ *   - The worker never waits for a connection.  Requests to an endpoint
+ *     whose connections are all acquired go to a deferred list, together
+ *     with every later request to it in the same round so their order
+ *     holds, and are retried first in the next round.
+ *   - SIGPIPE is blocked around every SSL call that may write, a dead
+ *     peer shows up as a failed call instead of killing the process.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "client-pool.h"
+#include "logging.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+
+#define CLIENT_POOL_LINGER_MS 100
+
+typedef struct CLIENT_REQ_T {
+    MPSCNode node;
+    struct CLIENT_REQ_T *next;  /* deferred list */
+    ClientEndpoint *ep;
+    client_send_cb cb;
+    void *arg;
+    size_t len;
+    unsigned char data[];
+} ClientRequest;
+
+static void *cp_worker_main(void *arg);
+
+typedef struct CLIENT_SIGPIPE_T {
+    sigset_t old;
+    int was_pending;
+} ClientSigpipe;
+
+static uint64_t cp_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void cp_sigpipe_block(ClientSigpipe *sp)
+{
+    sigset_t set, pending;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pending);
+    sp->was_pending = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &sp->old);
+}
+
+static void cp_sigpipe_restore(ClientSigpipe *sp)
+{
+    sigset_t set, pending;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pending);
+    /* Swallow the SIGPIPE our write raised, not one that was there before */
+    if (!sp->was_pending && sigismember(&pending, SIGPIPE)) {
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&set, NULL, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &sp->old, NULL);
+}
+
+static int cp_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    ClientConn *c = SSL_get_app_data(ssl);
+    if (c == NULL) return 0;
+
+    pthread_mutex_lock(&c->pool->lock);
+    SSL_SESSION_free(c->ep->session);
+    c->ep->session = session;
+    pthread_mutex_unlock(&c->pool->lock);
+    return 1;
+}
+
+ClientPool *client_pool_init(TLSConnection **tls, const ClientPoolOpts *opts)
+{
+    if (tls == NULL || *tls == NULL) {
+        ERROR_PRINT("Uninitialized TLS client");
+        return NULL;
+    }
+
+    ClientPool *pool = calloc(1, sizeof(ClientPool));
+    if (pool == NULL) {
+        ERROR_PRINT("Cannot allocate memory for client pool");
+        return NULL;
+    }
+
+    pool->ctx = (*tls)->ctx;
+    pool->max_conns = opts && opts->max_conns ? opts->max_conns : CLIENT_POOL_MAX_CONNS;
+    pool->idle_ns = opts && opts->idle_ns ? opts->idle_ns : CLIENT_POOL_IDLE_NS;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pthread_cond_init(&pool->drained, NULL);
+
+    pool->queue = mpsc_init_queue();
+    if (pool->queue == NULL || mpsc_enable_wakeup(pool->queue) < 0) {
+        ERROR_PRINT("Cannot create send queue for client pool");
+        client_pool_destroy(pool);
+        return NULL;
+    }
+
+    SSL_CTX_set_session_cache_mode(pool->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(pool->ctx, cp_new_session);
+
+    atomic_store(&pool->running, 1);
+    if (pthread_create(&pool->worker, NULL, cp_worker_main, pool) != 0) {
+        ERROR_PRINT("Cannot start client pool worker");
+        atomic_store(&pool->running, 0);
+        client_pool_destroy(pool);
+        return NULL;
+    }
+
+    DEBUG_PRINT("Client pool initialized, %zu connections per endpoint", pool->max_conns);
+    return pool;
+}
+
+static ClientEndpoint *cp_endpoint(ClientPool *pool, const char *ip, uint16_t port)
+{
+    struct in_addr addr;
+    if (inet_aton(ip, &addr) == 0) {
+        ERROR_PRINT("Address is not valid %s", ip);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    ClientEndpoint *ep = pool->endpoints;
+    while (ep != NULL && (ep->addr.sin_addr.s_addr != addr.s_addr || ep->addr.sin_port != htons(port)))
+        ep = ep->next;
+
+    if (ep == NULL && (ep = calloc(1, sizeof(ClientEndpoint))) != NULL) {
+        ep->addr.sin_family = AF_INET;
+        ep->addr.sin_port = htons(port);
+        ep->addr.sin_addr = addr;
+        ep->next = pool->endpoints;
+        pool->endpoints = ep;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (ep == NULL) ERROR_PRINT("Cannot allocate memory for endpoint %s:%u", ip, port);
+    return ep;
+}
+
+static void cp_close(ClientConn *c, int graceful)
+{
+    if (graceful) {
+        /*
+         * Closing with unread input sends a reset, which makes the server
+         * drop messages it has not read yet.  Read until its EOF, which
+         * also stores tickets of a connection that was never reused.
+         */
+        struct timeval linger = { .tv_sec = 0, .tv_usec = CLIENT_POOL_LINGER_MS * 1000 };
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &linger, sizeof(linger));
+        char buf[256];
+
+        ClientSigpipe sp;
+        cp_sigpipe_block(&sp);
+        SSL_shutdown(c->ssl);
+        shutdown(c->fd, SHUT_WR);
+        while (SSL_read(c->ssl, buf, sizeof(buf)) > 0)
+            ;
+        cp_sigpipe_restore(&sp);
+        ERR_clear_error();
+    } else if (SSL_version(c->ssl) == TLS1_3_VERSION) {
+        /*
+         * SSL_free() would mark the session of an unclean close as not
+         * resumable, TLS 1.3 tickets stay valid when their connection dies.
+         */
+        SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+    SSL_free(c->ssl);
+    close(c->fd);
+    free(c);
+}
+
+static ClientConn *cp_connect(ClientPool *pool, ClientEndpoint *ep)
+{
+    ClientConn *c = calloc(1, sizeof(ClientConn));
+    if (c == NULL) {
+        ERROR_PRINT("Cannot allocate memory for client connection");
+        return NULL;
+    }
+    c->pool = pool;
+    c->ep = ep;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *) &ep->addr, sizeof(ep->addr)) < 0) {
+        ERROR_PRINT("Cannot connect to server, errno %i", errno);
+        if (c->fd >= 0) close(c->fd);
+        free(c);
+        return NULL;
+    }
+
+    /* Messages are small and written one at a time */
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->ssl = SSL_new(pool->ctx);
+    if (c->ssl == NULL || !SSL_set_fd(c->ssl, c->fd)) {
+        ERROR_PRINT("Could not get ssl structure");
+        SSL_free(c->ssl);
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    SSL_set_app_data(c->ssl, c);
+
+    pthread_mutex_lock(&pool->lock);
+    if (ep->session) SSL_set_session(c->ssl, ep->session);
+    pthread_mutex_unlock(&pool->lock);
+
+    ClientSigpipe sp;
+    cp_sigpipe_block(&sp);
+    int ret = SSL_connect(c->ssl);
+    cp_sigpipe_restore(&sp);
+    if (ret != 1) {
+        ERROR_PRINT("SSL Connect was not successfull, error %i", SSL_get_error(c->ssl, ret));
+        ERR_clear_error();
+        cp_close(c, 0);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.handshakes++;
+    pool->stats.resumed += SSL_session_reused(c->ssl) == 1;
+    pthread_mutex_unlock(&pool->lock);
+    return c;
+}
+
+/* 1 if the idle connection can still be written to */
+static int cp_alive(ClientConn *c)
+{
+    char byte;
+    ssize_t n = recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0) return 0;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+
+    /* Tickets or a close_notify, let OpenSSL process them without blocking */
+    int flags = fcntl(c->fd, F_GETFL);
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+    int alive;
+    /* Running into EOF makes OpenSSL write an alert */
+    ClientSigpipe sp;
+    cp_sigpipe_block(&sp);
+    for (;;) {
+        char buf[256];
+        /* Servers we talk to don't send application data, it is dropped */
+        int r = SSL_read(c->ssl, buf, sizeof(buf));
+        if (r > 0) continue;
+        alive = SSL_get_error(c->ssl, r) == SSL_ERROR_WANT_READ;
+        break;
+    }
+    cp_sigpipe_restore(&sp);
+    fcntl(c->fd, F_SETFL, flags);
+
+    if (!alive) ERR_clear_error();
+    return alive;
+}
+
+static void cp_dead(ClientPool *pool, ClientConn *c)
+{
+    ClientEndpoint *ep = c->ep;
+    cp_close(c, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    ep->open--;
+    pool->stats.dead++;
+    pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * With busy NULL waits while max_conns connections are in use, otherwise
+ * returns NULL at once with *busy set.
+ */
+static ClientConn *cp_acquire(ClientPool *pool, ClientEndpoint *ep, int *busy)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        ClientConn *c = ep->idle;
+        if (c != NULL) {
+            ep->idle = c->next;
+            c->next = NULL;
+            pthread_mutex_unlock(&pool->lock);
+
+            if (cp_alive(c)) {
+                pthread_mutex_lock(&pool->lock);
+                pool->stats.reused++;
+                pthread_mutex_unlock(&pool->lock);
+                return c;
+            }
+            cp_dead(pool, c);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+
+        if (ep->open < pool->max_conns) {
+            ep->open++;
+            pthread_mutex_unlock(&pool->lock);
+
+            c = cp_connect(pool, ep);
+            if (c == NULL) {
+                pthread_mutex_lock(&pool->lock);
+                ep->open--;
+                pthread_cond_broadcast(&pool->available);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return c;
+        }
+
+        if (busy != NULL) {
+            *busy = 1;
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+}
+
+ClientConn *client_pool_acquire(ClientPool *pool, const char *ip, uint16_t port)
+{
+    ClientEndpoint *ep = cp_endpoint(pool, ip, port);
+    return ep ? cp_acquire(pool, ep, NULL) : NULL;
+}
+
+void client_pool_release(ClientPool *pool, ClientConn *c, int healthy)
+{
+    if (c == NULL) return;
+    if (!healthy) {
+        cp_dead(pool, c);
+        return;
+    }
+
+    c->last_used = cp_now();
+    pthread_mutex_lock(&pool->lock);
+    c->next = c->ep->idle;
+    c->ep->idle = c;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int cp_write(ClientConn *c, const void *buf, size_t len)
+{
+    size_t written = 0;
+    ClientSigpipe sp;
+    cp_sigpipe_block(&sp);
+    int ret = SSL_write_ex(c->ssl, buf, len, &written);
+    cp_sigpipe_restore(&sp);
+
+    if (ret != 1) {
+        ERR_clear_error();
+        return -1;
+    }
+    return 0;
+}
+
+static void cp_count(ClientPool *pool, int status)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (status == 0) pool->stats.sent++;
+    else pool->stats.failed++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Write over *conn, replacing it once if it turns out to be dead.  The
+ * peer may have received part of a failed write, so a retried message
+ * can arrive twice.  With busy set, -1 and *busy instead of waiting for
+ * a connection, the message is not counted then.
+ */
+static int cp_send_on(ClientPool *pool, ClientEndpoint *ep, ClientConn **conn, const void *buf, size_t len,
+                      int *busy)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (*conn == NULL && (*conn = cp_acquire(pool, ep, busy)) == NULL) {
+            if (busy != NULL && *busy) return -1;
+            break;
+        }
+        if (cp_write(*conn, buf, len) == 0) {
+            cp_count(pool, 0);
+            return 0;
+        }
+        cp_dead(pool, *conn);
+        *conn = NULL;
+    }
+    cp_count(pool, -1);
+    return -1;
+}
+
+int client_pool_send(ClientPool *pool, const char *ip, uint16_t port, const void *buf, size_t len)
+{
+    ClientEndpoint *ep = cp_endpoint(pool, ip, port);
+    if (ep == NULL) return -1;
+
+    ClientConn *conn = NULL;
+    int ret = cp_send_on(pool, ep, &conn, buf, len, NULL);
+    client_pool_release(pool, conn, 1);
+    return ret;
+}
+
+int client_pool_send_async(ClientPool *pool, const char *ip, uint16_t port, const void *buf, size_t len,
+                           client_send_cb cb, void *arg)
+{
+    ClientEndpoint *ep = cp_endpoint(pool, ip, port);
+    if (ep == NULL) return -1;
+
+    ClientRequest *req = malloc(sizeof(ClientRequest) + len);
+    if (req == NULL) {
+        ERROR_PRINT("Cannot allocate memory for %zu byte message", len);
+        return -1;
+    }
+    req->ep = ep;
+    req->cb = cb;
+    req->arg = arg;
+    req->len = len;
+    memcpy(req->data, buf, len);
+
+    atomic_fetch_add(&pool->pending, 1);
+    mpsc_push(pool->queue, &req->node);
+    return 0;
+}
+
+static void cp_complete(ClientPool *pool, ClientRequest *req, int status)
+{
+    if (req->cb) req->cb(req->arg, status);
+    free(req);
+
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->drained);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Worker state of one round: deferred requests first, then a batch */
+typedef struct CLIENT_ROUND_T {
+    uint64_t round;
+    ClientEndpoint *ep;
+    ClientConn *conn;
+    /* Oldest first, carried over to the next round */
+    ClientRequest *deferred;
+    ClientRequest **deferred_tail;
+} ClientRound;
+
+static void cp_defer(ClientRound *r, ClientRequest *req)
+{
+    req->next = NULL;
+    *r->deferred_tail = req;
+    r->deferred_tail = &req->next;
+}
+
+/* Consecutive messages to one endpoint share a connection */
+static void cp_round_send(ClientPool *pool, ClientRound *r, ClientRequest *req)
+{
+    if (req->ep != r->ep) {
+        client_pool_release(pool, r->conn, 1);
+        r->conn = NULL;
+        r->ep = req->ep;
+    }
+    if (r->ep->busy_round == r->round) {
+        cp_defer(r, req);
+        return;
+    }
+
+    int busy = 0;
+    int status = cp_send_on(pool, r->ep, &r->conn, req->data, req->len, &busy);
+    if (busy) {
+        r->ep->busy_round = r->round;
+        cp_defer(r, req);
+        return;
+    }
+    cp_complete(pool, req, status);
+}
+
+static void cp_round_begin(ClientPool *pool, ClientRound *r)
+{
+    ClientRequest *req = r->deferred;
+    r->round++;
+    r->deferred = NULL;
+    r->deferred_tail = &r->deferred;
+    while (req != NULL) {
+        ClientRequest *next = req->next;
+        cp_round_send(pool, r, req);
+        req = next;
+    }
+}
+
+static void cp_round_end(ClientPool *pool, ClientRound *r)
+{
+    client_pool_release(pool, r->conn, 1);
+    r->conn = NULL;
+    r->ep = NULL;
+}
+
+static void *cp_worker_main(void *arg)
+{
+    ClientPool *pool = arg;
+    MPSCNode *nodes[CLIENT_POOL_BATCH];
+    ClientRound r = { .deferred = NULL };
+    uint64_t wait_ms = pool->idle_ns / 2000000;
+    if (wait_ms > 1000) wait_ms = 1000;
+    if (wait_ms < 10) wait_ms = 10;
+
+    for (;;) {
+        cp_round_begin(pool, &r);
+        size_t n = mpsc_pop_batch(pool->queue, nodes, CLIENT_POOL_BATCH);
+        for (size_t i = 0; i < n; i++)
+            cp_round_send(pool, &r, MPSC_ENTRY(nodes[i], ClientRequest, node));
+        cp_round_end(pool, &r);
+        if (n > 0) continue;
+
+        if (!mpsc_is_empty(pool->queue)) {
+            /* A producer is between its exchange and link */
+            sched_yield();
+            continue;
+        }
+        if (!atomic_load(&pool->running) && r.deferred == NULL) break;
+
+        /* Deferred requests retry once a connection may have come back */
+        if (mpsc_arm_wakeup(pool->queue) == 0) {
+            struct pollfd pfd = { .fd = pool->queue->event_fd, .events = POLLIN };
+            poll(&pfd, 1, r.deferred != NULL ? 1 : (int) wait_ms);
+            mpsc_ack_wakeup(pool->queue);
+        }
+        client_pool_evict_idle(pool, cp_now());
+    }
+    return NULL;
+}
+
+void client_pool_flush(ClientPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0)
+        pthread_cond_wait(&pool->drained, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t client_pool_evict_idle(ClientPool *pool, uint64_t now)
+{
+    ClientConn *evict = NULL;
+    size_t count = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (ClientEndpoint *ep = pool->endpoints; ep != NULL; ep = ep->next) {
+        ClientConn **it = &ep->idle;
+        while (*it != NULL) {
+            ClientConn *c = *it;
+            if (now - c->last_used < pool->idle_ns) {
+                it = &c->next;
+                continue;
+            }
+            *it = c->next;
+            c->next = evict;
+            evict = c;
+            ep->open--;
+            count++;
+        }
+    }
+    pool->stats.evicted += count;
+    if (count) pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (evict != NULL) {
+        ClientConn *next = evict->next;
+        cp_close(evict, 1);
+        evict = next;
+    }
+    if (count) DEBUG_PRINT("Evicted %zu idle client connections", count);
+    return count;
+}
+
+void client_pool_get_stats(ClientPool *pool, ClientPoolStats *out)
+{
+    pthread_mutex_lock(&pool->lock);
+    *out = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void client_pool_destroy(ClientPool *pool)
+{
+    if (pool == NULL) return;
+
+    /* The worker completes everything still queued before it exits */
+    if (atomic_exchange(&pool->running, 0)) {
+        uint64_t one = 1;
+        if (write(pool->queue->event_fd, &one, sizeof(one)) < 0)
+            ERROR_PRINT("Cannot wake client pool worker, errno %i", errno);
+        pthread_join(pool->worker, NULL);
+    }
+
+    while (pool->endpoints != NULL) {
+        ClientEndpoint *ep = pool->endpoints;
+        pool->endpoints = ep->next;
+        while (ep->idle != NULL) {
+            ClientConn *c = ep->idle;
+            ep->idle = c->next;
+            cp_close(c, 1);
+            ep->open--;
+        }
+        if (ep->open) ERROR_PRINT("Endpoint destroyed with %zu connections still acquired", ep->open);
+        SSL_SESSION_free(ep->session);
+        free(ep);
+    }
+
+    if (pool->ctx) SSL_CTX_sess_set_new_cb(pool->ctx, NULL);
+    mpsc_destroy_queue(pool->queue);
+    pthread_cond_destroy(&pool->drained);
+    pthread_cond_destroy(&pool->available);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    DEBUG_PRINT("Client pool destroyed");
+}
@@ -19,6 +19,16 @@
  *
  *   MD_digest_free(md);
  *
+ * Algorithms are fetched from the provider once into a small registry
+ * (SHA-256, SHA-512, SHA3-256 and BLAKE2b-512 built in) and contexts are
+ * recycled per thread: MD_digest_acquire()/MD_digest_release() and
+ * MD_digest_oneshot() only reset an existing context, so the hot path does
+ * no fetches or allocations.
+ *
+ * Many small messages can be hashed with a single MD_digest_batch() call,
+ * which uses the SHA-NI or AVX2 multi-buffer kernels from sha256-mb.c when
+ * the CPU has them and falls back to EVP otherwise.
+ *
  * Abstraction benefits:
  * - Keeps OpenSSL-specific calls isolated in one place.
  * - Allows possible future change of the digest algorithm
@@ -48,50 +58,223 @@
 
 #include "digest.h"
 #include "logging.h"
+#include "sha256-mb.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct MD_ALG_ENTRY_T {
+    char *name;                 /* own copy, callers' strings may go away */
+    EVP_MD *md;
+    int size;
+} MDAlgorithmEntry;
+
+typedef struct MD_THREAD_T {
+    MessageDigest *free[MD_MAX_ALGS][MD_THREAD_CACHE];
+    int free_count[MD_MAX_ALGS];
+    EVP_MD_CTX *oneshot[MD_MAX_ALGS];
+} MDThreadCache;
+
+static const char *md_builtin[MD_BUILTIN_ALGS] = {
+    [MD_SHA256] = "SHA256",
+    [MD_SHA512] = "SHA512",
+    [MD_SHA3_256] = "SHA3-256",
+    [MD_BLAKE2B512] = "BLAKE2B-512",
+};
 
-static const char *md_alg = "SHA256";
+static MDAlgorithmEntry md_registry[MD_MAX_ALGS];
+static _Atomic int md_registry_count = 0;
+static pthread_mutex_t md_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t md_registry_once = PTHREAD_ONCE_INIT;
+static pthread_key_t md_thread_key;
+static __thread MDThreadCache *md_thread = NULL;
 
 /**
- * Internal helper to allocate and bind SHA-256 algorithm to a digest context.
+ * Fetch an algorithm into the next registry slot, caller holds the lock.
  */
-static MessageDigest *MD_set_digest_alg(void)
+static int MD_registry_add(const char *name)
 {
-    EVP_MD_CTX *ctx = NULL;
-    EVP_MD *sha256 = NULL;
+    int n = atomic_load_explicit(&md_registry_count, memory_order_relaxed);
+    if (n == MD_MAX_ALGS) {
+        ERROR_PRINT("Digest registry is full, cannot add %s", name);
+        return -1;
+    }
 
-    MessageDigest *md = malloc(sizeof(MessageDigest));
-    if (md == NULL) return NULL;
+    EVP_MD *md = EVP_MD_fetch(NULL, name, NULL);
+    if (md == NULL) {
+        ERROR_PRINT("Error while trying to get digest algorithm %s", name);
+        return -1;
+    }
 
-    ctx = EVP_MD_CTX_new();
-    if (ctx == NULL) {
-        ERROR_PRINT("Error occurred while trying to get context for message digest");
-        free(md);
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        ERROR_PRINT("Cannot allocate digest algorithm name %s", name);
+        EVP_MD_free(md);
+        return -1;
+    }
+
+    md_registry[n].name = copy;
+    md_registry[n].md = md;
+    md_registry[n].size = EVP_MD_get_size(md);
+    atomic_store_explicit(&md_registry_count, n + 1, memory_order_release);
+    return n;
+}
+
+static void MD_thread_exit(void *arg)
+{
+    MDThreadCache *tc = arg;
+    for (int a = 0; a < MD_MAX_ALGS; a++) {
+        for (int i = 0; i < tc->free_count[a]; i++) {
+            EVP_MD_CTX_free(tc->free[a][i]->ctx);
+            free(tc->free[a][i]);
+        }
+        EVP_MD_CTX_free(tc->oneshot[a]);
+    }
+    free(tc);
+}
+
+static void MD_registry_setup(void)
+{
+    pthread_key_create(&md_thread_key, MD_thread_exit);
+
+    pthread_mutex_lock(&md_registry_lock);
+    for (int i = 0; i < MD_BUILTIN_ALGS; i++) {
+        if (MD_registry_add(md_builtin[i]) != i) {
+            /* Keep the slot numbers fixed even if an algorithm is missing */
+            md_registry[i].name = strdup(md_builtin[i]);
+            md_registry[i].md = NULL;
+            atomic_store_explicit(&md_registry_count, i + 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&md_registry_lock);
+    DEBUG_PRINT("Digest registry initialized");
+}
+
+/**
+ * Fetch the built-in algorithms.  Safe to call any number of times.
+ */
+int MD_registry_init(void)
+{
+    pthread_once(&md_registry_once, MD_registry_setup);
+    return md_registry[MD_SHA256].md != NULL ? 0 : -1;
+}
+
+/**
+ * Add an algorithm by its OpenSSL name, returns its slot or -1.  Already
+ * registered names return the existing slot.
+ */
+int MD_register_algorithm(const char *name)
+{
+    MD_registry_init();
+
+    pthread_mutex_lock(&md_registry_lock);
+    int alg = MD_find_algorithm(name);
+    if (alg < 0) alg = MD_registry_add(name);
+    pthread_mutex_unlock(&md_registry_lock);
+    return alg;
+}
+
+int MD_find_algorithm(const char *name)
+{
+    MD_registry_init();
+
+    int n = atomic_load_explicit(&md_registry_count, memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        if (md_registry[i].md != NULL && strcasecmp(md_registry[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const EVP_MD *MD_get_algorithm(int alg)
+{
+    MD_registry_init();
+    if (alg < 0 || alg >= atomic_load_explicit(&md_registry_count, memory_order_acquire))
         return NULL;
+    return md_registry[alg].md;
+}
+
+const char *MD_algorithm_name(int alg)
+{
+    return MD_get_algorithm(alg) != NULL ? md_registry[alg].name : NULL;
+}
+
+static void MD_batch_forget(void);
+
+/**
+ * Free the registered algorithms and their names, and the calling thread's
+ * cached contexts.  Meant for exit, no thread may use digests afterwards.
+ */
+void MD_registry_cleanup(void)
+{
+    MD_batch_forget();
+    if (md_thread != NULL) {
+        pthread_setspecific(md_thread_key, NULL);
+        MD_thread_exit(md_thread);
+        md_thread = NULL;
     }
 
-    sha256 = EVP_MD_fetch(NULL, md_alg, NULL);
-    if (sha256 == NULL) {
-        ERROR_PRINT("Error while trying to get digest algorithm");
-        EVP_MD_CTX_free(ctx);
+    pthread_mutex_lock(&md_registry_lock);
+    int n = atomic_load_explicit(&md_registry_count, memory_order_relaxed);
+    atomic_store_explicit(&md_registry_count, 0, memory_order_release);
+    for (int i = 0; i < n; i++) {
+        EVP_MD_free(md_registry[i].md);
+        free(md_registry[i].name);
+        md_registry[i] = (MDAlgorithmEntry) { 0 };
+    }
+    pthread_mutex_unlock(&md_registry_lock);
+}
+
+/**
+ * Internal helper to allocate a digest context bound to a registered algorithm.
+ */
+static MessageDigest *MD_set_digest_alg(int alg)
+{
+    const EVP_MD *type = MD_get_algorithm(alg);
+    if (type == NULL) {
+        ERROR_PRINT("Unknown digest algorithm %i", alg);
+        return NULL;
+    }
+
+    MessageDigest *md = malloc(sizeof(MessageDigest));
+    if (md == NULL) return NULL;
+
+    md->ctx = EVP_MD_CTX_new();
+    if (md->ctx == NULL) {
+        ERROR_PRINT("Error occurred while trying to get context for message digest");
         free(md);
         return NULL;
     }
 
-    if (!EVP_DigestInit_ex(ctx, sha256, NULL)) {
+    if (!EVP_DigestInit_ex(md->ctx, type, NULL)) {
         ERROR_PRINT("Error while trying to bind algorithm to context");
-        EVP_MD_CTX_free(ctx);
-        EVP_MD_free(sha256);   
+        EVP_MD_CTX_free(md->ctx);
         free(md);
         return NULL;
     }
 
-    INFO_PRINT("MessageDigest is now intialized");
-    md->ctx = ctx;
-    md->sha256 = sha256;
-    md->md_size = EVP_MD_get_size(sha256);
+    md->md = type;
+    md->alg = alg;
+    md->md_size = md_registry[alg].size;
     return md;
 }
 
+static MDThreadCache *MD_get_thread(void)
+{
+    if (md_thread != NULL) return md_thread;
+
+    MD_registry_init();
+    md_thread = calloc(1, sizeof(MDThreadCache));
+    if (md_thread == NULL) {
+        ERROR_PRINT("Cannot allocate digest thread cache");
+        return NULL;
+    }
+    pthread_setspecific(md_thread_key, md_thread);
+    return md_thread;
+}
+
 /**
  * Update digest state with more message data.
  */
@@ -117,22 +300,216 @@ inline int MD_calculate_digest(MessageDigest *md, unsigned char *out, unsigned i
 }
 
 /**
- * Public initializer for message digest.
+ * Reset digest for a new message, keeping the context and algorithm.
+ */
+int MD_digest_reset(MessageDigest *md)
+{
+    if (!EVP_DigestInit_ex(md->ctx, NULL, NULL)) {
+        ERROR_PRINT("Could not reset digest");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Public initializer for message digest, SHA-256.
  */
 MessageDigest *MD_digest_init()
 {
-    return MD_set_digest_alg();
+    return MD_set_digest_alg(MD_SHA256);
+}
+
+MessageDigest *MD_digest_init_alg(int alg)
+{
+    return MD_set_digest_alg(alg);
 }
 
 /**
- * Free digest context and algorithm resources.
+ * Free digest context, the algorithm stays in the registry.
  */
 void MD_digest_free(MessageDigest **md)
 {
-    if (*md == NULL || md == NULL) return;
+    if (md == NULL || *md == NULL) return;
     EVP_MD_CTX_free((*md)->ctx);
-    EVP_MD_free((*md)->sha256);
     (*md)->ctx = NULL;
-    (*md)->sha256 = NULL;
+    (*md)->md = NULL;
     free(*md);
+    *md = NULL;
+}
+
+/**
+ * Take a ready digest from the calling thread's pool.
+ */
+MessageDigest *MD_digest_acquire(int alg)
+{
+    MDThreadCache *tc = MD_get_thread();
+    if (tc != NULL && alg >= 0 && alg < MD_MAX_ALGS && tc->free_count[alg] > 0)
+        return tc->free[alg][--tc->free_count[alg]];
+    return MD_set_digest_alg(alg);
+}
+
+/**
+ * Reset the digest and keep it for the next acquire, or free it when the
+ * thread already caches enough.
+ */
+void MD_digest_release(MessageDigest *md)
+{
+    if (md == NULL) return;
+
+    MDThreadCache *tc = MD_get_thread();
+    if (tc == NULL || tc->free_count[md->alg] == MD_THREAD_CACHE || MD_digest_reset(md) != 0) {
+        MD_digest_free(&md);
+        return;
+    }
+    tc->free[md->alg][tc->free_count[md->alg]++] = md;
+}
+
+/**
+ * Digest a single buffer.  The per-thread context is bound to its
+ * algorithm on first use and only reset afterwards.
+ */
+int MD_digest_oneshot(int alg, const void *msg, size_t len, unsigned char *out, unsigned int *out_len)
+{
+    MDThreadCache *tc = MD_get_thread();
+    const EVP_MD *type = MD_get_algorithm(alg);
+    if (tc == NULL || type == NULL) return -1;
+
+    EVP_MD_CTX *ctx = tc->oneshot[alg];
+    if (ctx == NULL) {
+        ctx = EVP_MD_CTX_new();
+        if (ctx == NULL) {
+            ERROR_PRINT("Error occurred while trying to get context for message digest");
+            return -1;
+        }
+        tc->oneshot[alg] = ctx;
+    } else {
+        type = NULL;
+    }
+
+    if (!EVP_DigestInit_ex(ctx, type, NULL) ||
+        !EVP_DigestUpdate(ctx, msg, len) ||
+        !EVP_DigestFinal_ex(ctx, out, out_len)) {
+        ERROR_PRINT("Could not calculate %s digest", md_registry[alg].name);
+        /* Start over with a fresh binding next time */
+        EVP_MD_CTX_free(ctx);
+        tc->oneshot[alg] = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static pthread_once_t md_batch_once = PTHREAD_ONCE_INIT;
+static const EVP_MD *md_batch_sha256 = NULL;
+static MDBatchImpl md_batch_impl = MD_BATCH_EVP;
+
+/**
+ * Pick the batch kernel once, SHA-NI beats the 8 lane AVX2 kernel on every
+ * CPU that has both.
+ */
+static MDBatchImpl MD_batch_best(void)
+{
+    if (sha256_mb_have_shani()) return MD_BATCH_SHANI;
+    if (sha256_mb_have_avx2()) return MD_BATCH_AVX2;
+    return MD_BATCH_EVP;
+}
+
+static void MD_batch_setup(void)
+{
+    md_batch_sha256 = MD_get_algorithm(MD_SHA256);
+    md_batch_impl = MD_batch_best();
+    DEBUG_PRINT("Batch digest uses %s", MD_batch_impl_name());
+}
+
+/* The registry is gone, the EVP fallback must not use its SHA-256 */
+static void MD_batch_forget(void)
+{
+    pthread_once(&md_batch_once, MD_batch_setup);
+    md_batch_sha256 = NULL;
+}
+
+/**
+ * EVP fallback, one context reused for the whole batch.
+ */
+static int MD_batch_evp(const unsigned char *const msgs[], const size_t lens[], size_t count,
+                        unsigned char *out)
+{
+    if (md_batch_sha256 == NULL) {
+        ERROR_PRINT("Error while trying to get digest algorithm");
+        return -1;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL) {
+        ERROR_PRINT("Error occurred while trying to get context for message digest");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!EVP_DigestInit_ex2(ctx, md_batch_sha256, NULL) ||
+            !EVP_DigestUpdate(ctx, msgs[i], lens[i]) ||
+            !EVP_DigestFinal_ex(ctx, out + i * MD_SHA256_SIZE, NULL)) {
+            ERROR_PRINT("Could not calculate digest %zu of batch", i);
+            EVP_MD_CTX_free(ctx);
+            return -1;
+        }
+    }
+    EVP_MD_CTX_free(ctx);
+    return 0;
+}
+
+/**
+ * Hash a batch of independent messages with the selected kernel.
+ */
+int MD_digest_batch(const unsigned char *const msgs[], const size_t lens[], size_t count,
+                    unsigned char *out)
+{
+    pthread_once(&md_batch_once, MD_batch_setup);
+    if (count == 0) return 0;
+    if (msgs == NULL || lens == NULL || out == NULL) return -1;
+
+    switch (md_batch_impl) {
+    case MD_BATCH_SHANI:
+        sha256_mb_shani(msgs, lens, count, out);
+        return 0;
+    case MD_BATCH_AVX2:
+        sha256_mb_avx2(msgs, lens, count, out);
+        return 0;
+    default:
+        return MD_batch_evp(msgs, lens, count, out);
+    }
+}
+
+/**
+ * Force a batch kernel, mainly for tests and benchmarks.
+ */
+int MD_batch_set_impl(MDBatchImpl impl)
+{
+    pthread_once(&md_batch_once, MD_batch_setup);
+
+    switch (impl) {
+    case MD_BATCH_AUTO:
+        impl = MD_batch_best();
+        break;
+    case MD_BATCH_EVP:
+        break;
+    case MD_BATCH_AVX2:
+        if (!sha256_mb_have_avx2()) return -1;
+        break;
+    case MD_BATCH_SHANI:
+        if (!sha256_mb_have_shani()) return -1;
+        break;
+    default:
+        return -1;
+    }
+    md_batch_impl = impl;
+    return 0;
+}
+
+const char *MD_batch_impl_name(void)
+{
+    switch (md_batch_impl) {
+    case MD_BATCH_SHANI: return "sha-ni";
+    case MD_BATCH_AVX2: return "avx2";
+    default: return "evp";
+    }
 }
@@ -16,7 +16,10 @@
  *
  *  Implementation details:
  *   - Uses integer keys (int) and generic pointers (void*) for values
- *   - Collision resolution with linear probing
+ *   - Keys are scrambled with a multiplicative hash, so negative keys and
+ *     keys differing only in high bits (IPv4 addresses) spread evenly
+ *   - Collision resolution with linear probing, removal shifts the rest of
+ *     the probe chain back instead of leaving tombstones
  *   - Does not resize automatically (capacity fixed at initialization)
  *
  *  License: MIT License
@@ -43,8 +46,14 @@
 #include "hashmap.h"
 #include "logging.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 
+static inline int HM_slot(HashMap *hm, int key)
+{
+    return (int) (((uint32_t) key * 2654435761U) % (uint32_t) hm->capacity);
+}
+
 HashMap *HM_init(int capacity)
 {
     HashMap *hm = malloc(sizeof(HashMap));
@@ -69,7 +78,7 @@ void *HM_add_value(HashMap *hm, int key, void *value) {
         return NULL;
     }
 
-    int idx = key % hm->capacity;
+    int idx = HM_slot(hm, key);
     for (int i = 0; i < hm->capacity; i++) {
         int try = (idx + i) % hm->capacity;
         HashEntry *entry = &hm->entries[try];
@@ -98,7 +107,7 @@ void *HM_get_value(HashMap *hm, int key)
         return NULL;
     }
 
-    int idx = key % hm->capacity;
+    int idx = HM_slot(hm, key);
     for (int i = 0; i < hm->capacity; i++) {
         int get = (idx + i) % hm->capacity;
         HashEntry *entry = &hm->entries[get];
@@ -115,6 +124,43 @@ void *HM_get_value(HashMap *hm, int key)
     return NULL;
 }
 
+void *HM_remove_value(HashMap *hm, int key)
+{
+    int idx = HM_slot(hm, key);
+    int hole = -1;
+    for (int i = 0; i < hm->capacity; i++) {
+        int try = (idx + i) % hm->capacity;
+        if (!hm->entries[try].used) break;
+        if (hm->entries[try].key == key) {
+            hole = try;
+            break;
+        }
+    }
+    if (hole < 0) return NULL;
+
+    void *value = hm->entries[hole].value;
+    hm->size--;
+
+    /* Move later entries of the chain into the hole when their home slot allows it */
+    int next = hole;
+    for (int i = 1; i < hm->capacity; i++) {
+        next = (next + 1) % hm->capacity;
+        HashEntry *entry = &hm->entries[next];
+        if (!entry->used) break;
+
+        int home = HM_slot(hm, entry->key);
+        int dist_hole = (hole - home + hm->capacity) % hm->capacity;
+        int dist_next = (next - home + hm->capacity) % hm->capacity;
+        if (dist_hole < dist_next) {
+            hm->entries[hole] = *entry;
+            hole = next;
+        }
+    }
+    hm->entries[hole].used = 0;
+    hm->entries[hole].value = NULL;
+    return value;
+}
+
 void HM_free(HashMap **hm)
 {
     if (hm == NULL || *hm == NULL) return;
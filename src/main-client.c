@@ -2,9 +2,8 @@
 #include "logging.h"
 #include "tls-connection.h"
 #include "session.h"
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include "certificate.h"
+#include "client-pool.h"
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -12,76 +11,57 @@
 static const char* ip = "127.0.0.1";
 static const uint16_t port = 6666;
 
+static void count_failures(void *arg, int status)
+{
+    if (status != 0) atomic_fetch_add((atomic_size_t *) arg, 1);
+}
+
 int main(int argc, char *argv[])
 {
-    struct sockaddr_in sockaddr;
-    socklen_t server_len = sizeof(sockaddr);
-    uint8_t *write_buffer = { "test message" };
+    const char *write_buffer = "test message";
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
 
     INFO_PRINT("Going to start tcp-client.");
-    int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (tcp_sock < 0) {
-        ERROR_PRINT("Failed to create socket.");
-        return -1;
-    }
-
-    memset(&sockaddr, 0, sizeof(sockaddr));
-    sockaddr.sin_port = htons(port);
-    sockaddr.sin_family = AF_INET;
-
-    if (inet_aton(ip, &sockaddr.sin_addr) == 0) {
-        ERROR_PRINT("Address is not valid %s", ip);
-        close(tcp_sock);
-        return -1;
-    }
-    
     TLSConnection *tls = TLS_init_client();
     if (tls == NULL) {
         ERROR_PRINT("Cannot initialize client");
-        close(tcp_sock);
         return -1;
     }
 
     if (CA_certificate_file(&tls) != 1) {
         ERROR_PRINT("Cannot set client certificate");
-        close(tcp_sock);
         TLS_free_connection(&tls);
         return -1;
     }
     if (CA_certificate_priv_file(&tls) != 1) {
         ERROR_PRINT("Cannot set client private key");
-        close(tcp_sock);
         TLS_free_connection(&tls);
         return -1;
     }
 
-    if (connect(tcp_sock, (struct sockaddr *) &sockaddr, server_len) < 0) {
-        ERROR_PRINT("Cannot connect to server ip %s, errno %i", ip, errno);
+    /* Messages share connections and sessions instead of a handshake each */
+    ClientPool *pool = client_pool_init(&tls, NULL);
+    if (pool == NULL) {
+        ERROR_PRINT("Cannot create client pool");
         TLS_free_connection(&tls);
-        close(tcp_sock);
         return -1;
     }
 
-    if (!TLS_init_ssl_for_socket(&tls, tcp_sock)) {
-        ERROR_PRINT("Could not initialize tls for socket.");
-        close(tcp_sock);
-        TLS_free_connection(&tls);
-        return -1;
+    atomic_size_t failed = 0;
+    INFO_PRINT("Going to write %s %zu times", write_buffer, count);
+    for (size_t i = 0; i < count; i++) {
+        if (client_pool_send_async(pool, ip, port, write_buffer, strlen(write_buffer),
+                                   count_failures, &failed) != 0)
+            atomic_fetch_add(&failed, 1);
     }
+    client_pool_flush(pool);
 
-    int ret = SSL_connect(tls->ssl);
-    if (ret != 1) {
-        int err = SSL_get_error(tls->ssl, ret);
-        ERROR_PRINT("SSL Connect was not successfull, error %i", err);
-        ERROR_PRINT("%s", stderr);
-        close(tcp_sock);
-        TLS_free_connection(&tls);
-        return -1;
-    }
+    ClientPoolStats stats;
+    client_pool_get_stats(pool, &stats);
+    INFO_PRINT("Sent %zu messages, %zu failed, %zu handshakes (%zu resumed)",
+               stats.sent, atomic_load(&failed), stats.handshakes, stats.resumed);
 
-    INFO_PRINT("Going to write %s", write_buffer);
-    SSL_write(tls->ssl, write_buffer, strlen(write_buffer));                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                    
+    client_pool_destroy(pool);
     TLS_free_connection(&tls);
-    close(tcp_sock);
-    return 0;
-}
\ No newline at end of file
+    return atomic_load(&failed) ? -1 : 0;
+}
@@ -0,0 +1,112 @@
+#include "digest.h"
+#include "merkle.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Print the Merkle root of files, or with -s the plain streaming digest.
+ *
+ *   filedigest [-a algorithm] [-c chunk bytes] [-t threads] [-s] [-v] file...
+ */
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_hex(const unsigned char *d, int len, const char *path)
+{
+    for (int i = 0; i < len; i++)
+        printf("%02x", d[i]);
+    printf("  %s\n", path);
+}
+
+static int stream_digest(int alg, const char *path, size_t *bytes)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    MessageDigest *md = MD_digest_acquire(alg);
+    unsigned char buf[1 << 16], out[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    size_t n;
+    *bytes = 0;
+    while (md != NULL && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        MD_update_message(md, buf, n);
+        *bytes += n;
+    }
+    fclose(f);
+    if (md == NULL) return -1;
+
+    int rc = MD_calculate_digest(md, out, &len);
+    MD_digest_release(md);
+    if (rc == 0) print_hex(out, (int) len, path);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    MerkleOpts opts = { .alg = MD_SHA256 };
+    int stream = 0, verbose = 0, opt;
+
+    while ((opt = getopt(argc, argv, "a:c:t:svh")) != -1) {
+        switch (opt) {
+        case 'a':
+            opts.alg = MD_find_algorithm(optarg);
+            if (opts.alg < 0) opts.alg = MD_register_algorithm(optarg);
+            if (opts.alg < 0) {
+                fprintf(stderr, "unknown digest %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c': opts.chunk_size = strtoul(optarg, NULL, 0); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 's': stream = 1; break;
+        case 'v': verbose = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-a algorithm] [-c chunk bytes] [-t threads] [-s] [-v] file...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "%s: no files\n", argv[0]);
+        return 1;
+    }
+
+    int ret = 0;
+    for (int i = optind; i < argc; i++) {
+        double start = now_sec();
+        size_t bytes = 0;
+
+        if (stream) {
+            if (stream_digest(opts.alg, argv[i], &bytes) != 0) ret = 1;
+        } else {
+            MerkleTree *t = merkle_open(argv[i], &opts);
+            if (t == NULL) {
+                ret = 1;
+                continue;
+            }
+            bytes = t->size;
+            print_hex(merkle_root(t), t->md_size, argv[i]);
+            if (verbose)
+                fprintf(stderr, "%zu chunks of %zu bytes, %i threads\n", t->leaves, t->chunk_size, t->threads);
+            merkle_close(t);
+        }
+
+        if (verbose) {
+            double elapsed = now_sec() - start;
+            fprintf(stderr, "%zu bytes in %.3f s, %.1f MB/s\n", bytes, elapsed, bytes / elapsed / 1e6);
+        }
+    }
+    MD_registry_cleanup();
+    return ret;
+}
@@ -0,0 +1,37 @@
+
+#include "binlog.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Render binary logs written by binlog_open() as text.
+ *
+ *   logdecode server.blog [more.blog ...]
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "-h") == 0) {
+        fprintf(stderr, "usage: %s <binary log>...\n", argv[0]);
+        return 1;
+    }
+
+    int ret = 0;
+    char line[4096];
+    for (int i = 1; i < argc; i++) {
+        BinlogReader *r = binlog_reader_open(argv[i]);
+        if (r == NULL) {
+            ret = 1;
+            continue;
+        }
+
+        int rc;
+        while ((rc = binlog_reader_next(r, line, sizeof(line))) == 1)
+            puts(line);
+        if (rc < 0) {
+            fprintf(stderr, "%s: corrupt record, stopping\n", argv[i]);
+            ret = 1;
+        }
+        binlog_reader_close(r);
+    }
+    return ret;
+}
@@ -2,67 +2,643 @@
 #include "tls-connection.h"
 #include "session.h"
 #include "certificate.h"
+#include "size-class.h"
+#include "binlog.h"
+#include "metrics.h"
+#include "tls-trace.h"
+#include "ring-buffer.h"
+#include "tls-lean.h"
+#include "pubsub.h"
+#include "admission.h"
+#include "topology.h"
+#include "memory-pool.h"
+#include "hashmap.h"
 
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <pthread.h>
+#include <time.h>
 
 static const char *ip = "127.0.0.1";
 static const uint16_t port = 6666;
 
-static pthread_t cthread;
+#define SERVER_MAX_SUBSCRIBERS 1024
+#define SERVER_IDLE_MS 30000
+#define SERVER_BACKLOG 128
+#define SERVER_NODE_CONNS 4096
+#define SERVER_FD_BACKOFF_MS 10
 
+static Metric *m_accepted, *m_active, *m_handshake_ok, *m_handshake_failed;
+static Metric *m_handshake_ns, *m_bytes_in, *m_bytes_out;
+
+static TLSConnection *tls;
+static AdmissionControl *admission;
+
+/*
+ * Per NUMA node accept state.  Without NUMA mode there is one of these,
+ * index -1, served by the main thread.
+ */
+typedef struct SERVER_NODE_T {
+    int index;                  /* into topology.nodes */
+    int listen_fd;
+    pthread_t acceptor;
+    pthread_attr_t attr;        /* connection threads stay on the node */
+    pthread_mutex_t lock;
+    MemoryPool *conn_pool;
+    HashMap *conns;             /* fd -> ServerConn */
+    int spare_fd;               /* given up to shed connections without descriptors */
+    uint64_t fd_logged_ns;
+} ServerNode;
+
+typedef struct SERVER_CONN_T {
+    int fd;
+    ServerNode *node;
+    uint8_t read_buffer[64];
+} ServerConn;
+
+static Topology topology;
+static ServerNode server_nodes[TOPO_MAX_NODES];
+static int server_node_count = 1;
+
+/* Connection threads are detached, teardown waits for this to drop to 0 */
+static pthread_mutex_t conns_live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_live_done = PTHREAD_COND_INITIALIZER;
+static size_t conns_live;
+
+static PubSub *pubsub;
+static pthread_mutex_t subscribers_lock = PTHREAD_MUTEX_INITIALIZER;
+static PubSubSubscriber *subscribers[SERVER_MAX_SUBSCRIBERS];
+static size_t subscriber_count;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* Wire level traffic, including handshakes, from the socket BIO counters */
+static void count_wire_bytes(SSL *ssl)
+{
+    metrics_add(m_bytes_in, BIO_number_read(SSL_get_rbio(ssl)));
+    metrics_add(m_bytes_out, BIO_number_written(SSL_get_wbio(ssl)));
+}
+
+static int64_t ssl_session_hits(void *ctx)
+{
+    return SSL_CTX_sess_hits((SSL_CTX *) ctx);
+}
+
+static int64_t rbuf_overwrites(__attribute__((__unused__)) void *arg)
+{
+    return (int64_t) rbuf_get_overwrite_events();
+}
+
+static int64_t admission_rate_limited(void *arg)
+{
+    AdmissionStats stats;
+    admission_get_stats(arg, &stats);
+    return (int64_t) stats.rate_limited;
+}
+
+static int64_t admission_busy(void *arg)
+{
+    AdmissionStats stats;
+    admission_get_stats(arg, &stats);
+    return (int64_t) stats.busy;
+}
+
+static int64_t admission_queued(void *arg)
+{
+    AdmissionStats stats;
+    admission_get_stats(arg, &stats);
+    return (int64_t) stats.queued;
+}
+
+static void server_register_metrics(SSL_CTX *ctx)
+{
+    m_accepted = metrics_counter("tls_connections_accepted_total", "Accepted TCP connections");
+    m_active = metrics_gauge("tls_connections_active", "Connections being served");
+    m_handshake_ok = metrics_counter("tls_handshakes_total", "Successful TLS handshakes");
+    m_handshake_failed = metrics_counter("tls_handshake_failures_total", "Failed TLS handshakes");
+    m_handshake_ns = metrics_histogram("tls_handshake_latency_ns", "SSL_accept() duration");
+    m_bytes_in = metrics_counter("tls_wire_bytes_in_total", "Bytes read from client sockets");
+    m_bytes_out = metrics_counter("tls_wire_bytes_out_total", "Bytes written to client sockets");
+    metrics_counter_fn("tls_session_cache_hits_total", "SSL_CTX_sess_hits()", ssl_session_hits, ctx);
+    metrics_counter_fn("rbuf_overwrite_events_total", "RingBuffer stores that dropped unread data",
+                       rbuf_overwrites, NULL);
+    metrics_counter_fn("tls_admission_rate_limited_total", "Connections closed by the source token bucket",
+                       admission_rate_limited, admission);
+    metrics_counter_fn("tls_admission_busy_total", "Connections closed with all handshake slots taken",
+                       admission_busy, admission);
+    metrics_gauge_fn("tls_admission_queued", "Admitted connections waiting for a handshake slot",
+                     admission_queued, admission);
+}
+
+static void server_drop_subscriber(size_t i)
+{
+    PubSubSubscriber *sub = subscribers[i];
+    SSL *ssl = sub->user;
+    int fd = SSL_get_fd(ssl);
+
+    pubsub_subscriber_free(sub);
+    SSL_shutdown(ssl);
+    count_wire_bytes(ssl);
+    SSL_free(ssl);
+    close(fd);
+    metrics_gauge_add(m_active, -1);
+    subscribers[i] = subscribers[--subscriber_count];
+}
+
+/*
+ * Whatever a subscriber socket does not take now is sent after the next
+ * publish.  Caller holds subscribers_lock.
+ */
+static void server_flush_subscribers(void)
+{
+    for (size_t i = 0; i < subscriber_count;) {
+        if (pubsub_flush(subscribers[i], pubsub_ssl_write, subscribers[i]->user) < 0) {
+            DEBUG_PRINT("Subscriber %zu went away", i);
+            server_drop_subscriber(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * "SUB <topic>" keeps the connection open as a subscriber, "PUB <topic>
+ * <text>" sends text to every subscriber of the topic.  Returns 1 when the
+ * subscriber took over ssl.
+ */
+static int server_pubsub_command(SSL *ssl, char *msg)
+{
+    char *topic = strchr(msg, ' ');
+    if (topic == NULL) return 0;
+    *topic++ = '\0';
+
+    if (strcmp(msg, "PUB") == 0) {
+        char *text = strchr(topic, ' ');
+        size_t len = 0;
+        if (text != NULL) {
+            *text++ = '\0';
+            len = strlen(text);
+        } else {
+            text = "";
+        }
+        int n = pubsub_publish(pubsub, topic, text, len);
+        INFO_PRINT("Published %zu bytes to %i subscribers of %s", len, n, topic);
+        pthread_mutex_lock(&subscribers_lock);
+        server_flush_subscribers();
+        pthread_mutex_unlock(&subscribers_lock);
+        return 0;
+    }
+
+    if (strcmp(msg, "SUB") != 0) return 0;
+
+    PubSubSubscriber *sub = pubsub_subscriber_new(pubsub, ssl);
+    if (sub == NULL || pubsub_subscribe(sub, topic) != 0) {
+        pubsub_subscriber_free(sub);
+        return 0;
+    }
+
+    pthread_mutex_lock(&subscribers_lock);
+    if (subscriber_count == SERVER_MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&subscribers_lock);
+        ERROR_PRINT("Too many subscribers, %s not subscribed", topic);
+        pubsub_subscriber_free(sub);
+        return 0;
+    }
+    int fd = SSL_get_fd(ssl);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    subscribers[subscriber_count++] = sub;
+    pthread_mutex_unlock(&subscribers_lock);
+    INFO_PRINT("Connection subscribed to %s", topic);
+    return 1;
+}
+
+static void set_recv_timeout(int fd, int ms)
+{
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * Connection state and table entry go back to the node that accepted it.
+ * Last thing a connection thread does with shared state.
+ */
+static void server_conn_free(ServerConn *conn)
+{
+    ServerNode *sn = conn->node;
+    pthread_mutex_lock(&sn->lock);
+    HM_remove_value(sn->conns, conn->fd);
+    pool_free(sn->conn_pool, conn);
+    pthread_mutex_unlock(&sn->lock);
+
+    pthread_mutex_lock(&conns_live_lock);
+    if (--conns_live == 0)
+        pthread_cond_broadcast(&conns_live_done);
+    pthread_mutex_unlock(&conns_live_lock);
+}
+
+/*
+ * Wake connection threads out of SSL_accept()/SSL_read() and wait until
+ * all of them are gone.  Acceptors have stopped, so no new ones start.
+ */
+static void server_conns_drain(void)
+{
+    for (int i = 0; i < server_node_count; i++) {
+        ServerNode *sn = &server_nodes[i];
+        if (sn->conn_pool == NULL) continue;
+        pthread_mutex_lock(&sn->lock);
+        for (int e = 0; e < sn->conns->capacity; e++) {
+            if (sn->conns->entries[e].used)
+                shutdown(sn->conns->entries[e].key, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&sn->lock);
+    }
+
+    pthread_mutex_lock(&conns_live_lock);
+    if (conns_live > 0)
+        INFO_PRINT("Waiting for %zu connections to close", conns_live);
+    while (conns_live > 0)
+        pthread_cond_wait(&conns_live_done, &conns_live_lock);
+    pthread_mutex_unlock(&conns_live_lock);
+}
+
+/*
+ * Connection thread, started for connections that passed admission.  The
+ * handshake waits for one of the admission slots, after that messages are
+ * served until the client closes or stays quiet for SERVER_IDLE_MS.
+ */
 void *handle_connection(void *client)
 {
+    ServerConn *conn = client;
+    int client_fd = conn->fd;
+
+    SSL *ssl = SSL_new(tls->ctx);
+    if (ssl == NULL || !SSL_set_fd(ssl, client_fd)) {
+        ERROR_PRINT("Could not initialize tls for socket.");
+        admission_cancel(admission);
+        SSL_free(ssl);
+        close(client_fd);
+        metrics_gauge_add(m_active, -1);
+        server_conn_free(conn);
+        return NULL;
+    }
 
+    /* A client that stalls the handshake must not keep the slot */
+    set_recv_timeout(client_fd, ADMISSION_HANDSHAKE_MS);
+    admission_begin(admission);
+    uint64_t handshake_start = now_ns();
+    int ret = SSL_accept(ssl);
+    metrics_record(m_handshake_ns, now_ns() - handshake_start);
+    admission_end(admission);
+
+    if (ret != 1) {
+        metrics_inc(m_handshake_failed);
+        metrics_gauge_add(m_active, -1);
+        count_wire_bytes(ssl);
+        int err = SSL_get_error(ssl, ret);
+        ERROR_PRINT("TLS/SSL handshake was not successfull, err %i", err);
+        SSL_free(ssl);
+        close(client_fd);
+        server_conn_free(conn);
+        return NULL;
+    }
+    metrics_inc(m_handshake_ok);
+    set_recv_timeout(client_fd, SERVER_IDLE_MS);
+
+    int n;
+    uint8_t *read_buffer = conn->read_buffer;
+    while ((n = SSL_read(ssl, read_buffer, sizeof(conn->read_buffer) - 1)) > 0) {
+        read_buffer[n] = 0;
+        INFO_PRINT("Received buffer %s", read_buffer);
+
+        /* Subscriber owns the connection from here on */
+        if (pubsub != NULL && server_pubsub_command(ssl, (char *) read_buffer)) {
+            server_conn_free(conn);
+            return NULL;
+        }
+    }
+
+    SSL_shutdown(ssl);
+    count_wire_bytes(ssl);
+    SSL_free(ssl);
+    close(client_fd);
+    metrics_gauge_add(m_active, -1);
+    server_conn_free(conn);
+    return NULL;
 }
 
-int main(__attribute__((__unused__)) int argc, __attribute__((__unused__)) char *argv[])
+/*
+ * Pool, connection table and thread attributes of a node.  Called on the
+ * node's pinned acceptor thread, so memory mbind() can't place is first
+ * touched locally.
+ */
+static int server_node_setup(ServerNode *sn)
+{
+    MemoryPoolOpts opts = {
+        .slab_blocks = 256,
+        .max_slabs = 0,
+        .free_slab_watermark = 1,
+        .flags = POOL_GROWABLE,
+    };
+    if (sn->index >= 0) {
+        opts.flags |= POOL_NODE_LOCAL;
+        opts.node = topology.nodes[sn->index].id;
+    }
+
+    pthread_mutex_init(&sn->lock, NULL);
+    sn->conn_pool = pool_init_ex(sizeof(ServerConn), &opts);
+    sn->conns = HM_init(SERVER_NODE_CONNS * 2);
+    if (sn->conn_pool == NULL || sn->conns == NULL) {
+        ERROR_PRINT("Cannot allocate connection table");
+        pool_destroy(sn->conn_pool);
+        sn->conn_pool = NULL;
+        HM_free(&sn->conns);
+        pthread_mutex_destroy(&sn->lock);
+        return -1;
+    }
+
+    sn->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pthread_attr_init(&sn->attr);
+    pthread_attr_setdetachstate(&sn->attr, PTHREAD_CREATE_DETACHED);
+    if (sn->index >= 0) topology_attr_set_node(&topology, &sn->attr, sn->index);
+
+    char prefix[32];
+    if (sn->index >= 0)
+        snprintf(prefix, sizeof(prefix), "conn_pool_node%i", topology.nodes[sn->index].id);
+    else
+        snprintf(prefix, sizeof(prefix), "conn_pool");
+    metrics_register_pool(prefix, sn->conn_pool, &sn->lock);
+    return 0;
+}
+
+/* Safe for nodes whose setup failed or never ran */
+static void server_node_destroy(ServerNode *sn)
+{
+    if (sn->conn_pool == NULL) return;
+    if (sn->spare_fd >= 0) close(sn->spare_fd);
+    pthread_attr_destroy(&sn->attr);
+    pool_destroy(sn->conn_pool);
+    HM_free(&sn->conns);
+    pthread_mutex_destroy(&sn->lock);
+    sn->conn_pool = NULL;
+}
+
+/*
+ * accept() out of descriptors leaves the connection queued, the next call
+ * fails again at once.  The spare descriptor makes room to take it off the
+ * queue and close it; when there is none to give up (ENFILE, or it could
+ * not be reopened) wait a moment instead of spinning.
+ */
+static void server_accept_no_fds(ServerNode *sn, int err)
+{
+    int shed = 0;
+    if (sn->spare_fd >= 0) {
+        close(sn->spare_fd);
+        int fd = accept(sn->listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            close(fd);
+            shed = 1;
+        }
+        sn->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    uint64_t now = now_ns();
+    if (now - sn->fd_logged_ns >= 1000000000ULL) {
+        ERROR_PRINT("Out of file descriptors, errno %i, dropping connections", err);
+        sn->fd_logged_ns = now;
+    }
+    if (!shed) poll(NULL, 0, SERVER_FD_BACKOFF_MS);
+}
+
+/* Returns only on a fatal accept() error or when the socket is shut down */
+static int server_accept_loop(ServerNode *sn)
 {
     struct sockaddr_in client_addr, server_addr;
     socklen_t client_len = sizeof(client_addr);
     socklen_t server_len = sizeof(server_addr);
 
-    uint8_t read_buffer[64];
+    while (1) {
+        INFO_PRINT("Server waiting for connection");
+        int client_fd = accept(sn->listen_fd, (struct sockaddr *) &client_addr, &client_len);
+        if (client_fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                server_accept_no_fds(sn, errno);
+                continue;
+            }
+            /* Connection reset while queued, keep serving */
+            if (errno == EINTR || errno == ECONNABORTED) {
+                ERROR_PRINT("Error %i occurred while accept connection.", errno);
+                continue;
+            }
+            ERROR_PRINT("Error %i occurred while accept connection.", errno);
+            return -1;
+        } else {
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+            int client_port = ntohs(client_addr.sin_port);
 
-    INFO_PRINT("Going to start TCP server.");
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
+            getsockname(client_fd, (struct sockaddr *)&server_addr, &server_len);
+
+            char server_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &server_addr.sin_addr, server_ip, sizeof(server_ip));
+            int server_port = ntohs(server_addr.sin_port);
+
+            DEBUG_PRINT("Connection accepted: client %s:%d -> server %s:%d",
+                    client_ip, client_port, server_ip, server_port);
+            metrics_inc(m_accepted);
+        }
+
+        /* Rejected before any TLS work, closing is all it costs */
+        AdmitResult admit = admission_try(admission, client_addr.sin_addr.s_addr, now_ns());
+        if (admit != ADMIT_OK) {
+            DEBUG_PRINT("Connection rejected, %s", admit == ADMIT_BUSY ? "handshakes busy" : "rate limited");
+            close(client_fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&sn->lock);
+        ServerConn *conn = sn->conns->size < SERVER_NODE_CONNS ? pool_malloc(sn->conn_pool) : NULL;
+        if (conn != NULL) {
+            conn->fd = client_fd;
+            conn->node = sn;
+            HM_add_value(sn->conns, client_fd, conn);
+        }
+        pthread_mutex_unlock(&sn->lock);
+        if (conn != NULL) {
+            pthread_mutex_lock(&conns_live_lock);
+            conns_live++;
+            pthread_mutex_unlock(&conns_live_lock);
+        }
+        if (conn == NULL) {
+            ERROR_PRINT("Connection table full, closing connection");
+            admission_cancel(admission);
+            close(client_fd);
+            continue;
+        }
+
+        metrics_gauge_add(m_active, 1);
+        pthread_t cthread;
+        int err = pthread_create(&cthread, &sn->attr, handle_connection, conn);
+        if (err != 0) {
+            ERROR_PRINT("Cannot start connection thread, error %i", err);
+            admission_cancel(admission);
+            close(client_fd);
+            metrics_gauge_add(m_active, -1);
+            server_conn_free(conn);
+        }
+    }
+}
+
+/* Acceptor of NUMA nodes other than the main thread's */
+static void *server_node_thread(void *arg)
+{
+    ServerNode *sn = arg;
+    topology_pin_thread(&topology, pthread_self(), sn->index, 0);
+    if (server_node_setup(sn) == 0)
+        server_accept_loop(sn);
+    ERROR_PRINT("Acceptor of NUMA node %i stopped", topology.nodes[sn->index].id);
+    return NULL;
+}
+
+/* Listening socket, with SO_REUSEPORT every NUMA node gets its own */
+static int server_listen(struct sockaddr_in *addr, int reuseport)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
         ERROR_PRINT("Could not get file descriptor for socket, errno %i.", errno);
         return -1;
     }
 
+    int one = 1;
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        ERROR_PRINT("Cannot set SO_REUSEPORT, errno %i", errno);
+
+    if (bind(sock, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        ERROR_PRINT("Cannot bind %i", errno);
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SERVER_BACKLOG) < 0) {
+        ERROR_PRINT("Error %i occurred when calling listen to socket", errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static double env_double(const char *name, double def)
+{
+    const char *value = getenv(name);
+    return value != NULL ? strtod(value, NULL) : def;
+}
+
+int main(__attribute__((__unused__)) int argc, __attribute__((__unused__)) char *argv[])
+{
+    struct sockaddr_in server_addr;
+
+    /* OpenSSL allocator has to be replaced before the first SSL_CTX_new() */
+    if (getenv("TLS_POOL_ALLOC") != NULL) {
+        SizeClassAllocator *sc = sc_init();
+        if (sc == NULL || sc_install_openssl(sc) != 0) {
+            ERROR_PRINT("Using default OpenSSL allocator");
+        } else {
+            for (int i = 0; i < SC_CLASS_COUNT; i++) {
+                char prefix[32];
+                snprintf(prefix, sizeof(prefix), "sc_pool_%zu", sc->classes[i].block_size);
+                metrics_register_pool(prefix, sc->classes[i].pool, &sc->classes[i].cache->lock);
+            }
+        }
+    }
+
+    /* Log records go to a binary file, render it with logdecode */
+    binlog_level_from_env();
+    const char *binlog_file = getenv("BINLOG_FILE");
+    if (binlog_file != NULL && binlog_open(binlog_file) != 0)
+        ERROR_PRINT("Logging to stdout");
+
+    /* Sampled handshake traces, open the file in chrome://tracing */
+    const char *trace_file = getenv("TLS_TRACE_FILE");
+    if (trace_file != NULL) {
+        const char *sample = getenv("TLS_TRACE_SAMPLE");
+        if (TLS_trace_open(trace_file, sample ? (unsigned) strtoul(sample, NULL, 10) : 1) != 0)
+            ERROR_PRINT("Handshake tracing disabled");
+    }
+
+    /* Acceptor, connection threads and their memory per NUMA node */
+    int numa = 0;
+    if (getenv("TLS_NUMA") != NULL && topology_load(&topology, NULL) > 0) {
+        numa = topology_is_numa(&topology);
+        if (!numa)
+            INFO_PRINT("Single NUMA node, TLS_NUMA has no effect");
+    }
+
+    INFO_PRINT("Going to start TCP server.");
     memset((void *) &server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port   = htons(port);
     if (inet_aton(ip, &server_addr.sin_addr) == 0) {
         ERROR_PRINT("Address is not valid %s", ip);
-        close(server_sock);
         return -1;
     }
 
-    if (bind(server_sock, (struct sockaddr *) &server_addr, server_len) < 0) {
-        ERROR_PRINT("Cannot bind %i", errno);
+    int server_sock = server_listen(&server_addr, numa);
+    if (server_sock < 0) return -1;
+
+    tls = TLS_init_server();
+    if (tls == NULL) {
+        ERROR_PRINT("Cannot create TLS connection");
         close(server_sock);
         return -1;
     }
 
-    if (listen(server_sock, 2) < 0) {
-        ERROR_PRINT("Error %i occurred when calling listen to socket", errno);
-        close(server_sock);
-        return -1;
+    /*
+     * Idle connections don't keep OpenSSL record buffers.  That is all the
+     * lean mode the server gets: TLSLeanConn needs non-blocking sockets and
+     * an event loop, connection threads block in SSL_read() instead.
+     */
+    if (getenv("TLS_LEAN") != NULL)
+        TLS_set_lean_mode(&tls);
+
+    /* Publish/subscribe commands, one shared copy per published message */
+    if (getenv("PUBSUB") != NULL) {
+        pubsub = pubsub_init(0, 0);
+        if (pubsub == NULL)
+            ERROR_PRINT("Publish/subscribe disabled");
+        else
+            signal(SIGPIPE, SIG_IGN);
     }
 
-    TLSConnection *tls = TLS_init_server();
-    if (tls == NULL) {
-        ERROR_PRINT("Cannot create TLS connection");
+    /*
+     * Handshakes are admitted before SSL_accept(), ADMISSION_RATE=-1 lifts the per-source limit.
+     * One handshake slot per CPU the connection threads run on, those of the NUMA nodes served.
+     */
+    size_t in_flight = numa ? (size_t) topology.cpu_count : admission_default_in_flight();
+    AdmissionOpts admission_opts = {
+        .rate = env_double("ADMISSION_RATE", ADMISSION_RATE),
+        .burst = env_double("ADMISSION_BURST", ADMISSION_BURST),
+        .max_in_flight = (size_t) env_double("ADMISSION_IN_FLIGHT", (double) in_flight),
+        .max_queued = (size_t) env_double("ADMISSION_QUEUE", 0),
+    };
+    admission = admission_init(&admission_opts);
+    if (admission == NULL) {
         close(server_sock);
+        TLS_free_connection(&tls);
         return -1;
     }
 
@@ -86,52 +662,66 @@ int main(__attribute__((__unused__)) int argc, __attribute__((__unused__)) char
         return -1;
     }
 
-    while (1) {
-        INFO_PRINT("Server waiting for connection");
-        int client_fd = accept(server_sock, (struct sockaddr *) &client_addr, &client_len);
-        if (client_fd < 0) {
-            ERROR_PRINT("Error %i occurred while accept connection.", errno);
-            close(server_sock);
-            TLS_free_connection(&tls);
-            return -1;
-        } else {
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-            int client_port = ntohs(client_addr.sin_port);
-
-            getsockname(client_fd, (struct sockaddr *)&server_addr, &server_len);
-
-            char server_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &server_addr.sin_addr, server_ip, sizeof(server_ip));
-            int server_port = ntohs(server_addr.sin_port);
+    server_register_metrics(tls->ctx);
+    const char *metrics_socket = getenv("METRICS_SOCKET");
+    if (metrics_socket != NULL && metrics_serve(metrics_socket) != 0)
+        ERROR_PRINT("Metrics socket disabled");
 
-            DEBUG_PRINT("Connection accepted: client %s:%d -> server %s:%d",
-                    client_ip, client_port, server_ip, server_port);
+    ServerNode *main_node = &server_nodes[0];
+    main_node->index = -1;
+    main_node->listen_fd = server_sock;
+    if (numa) {
+        server_node_count = topology.node_count;
+        for (int i = 1; i < server_node_count; i++) {
+            ServerNode *sn = &server_nodes[i];
+            sn->index = i;
+            sn->listen_fd = server_listen(&server_addr, 1);
+            if (sn->listen_fd < 0 ||
+                pthread_create(&sn->acceptor, NULL, server_node_thread, sn) != 0) {
+                ERROR_PRINT("Cannot start acceptor for NUMA node %i", topology.nodes[i].id);
+                if (sn->listen_fd >= 0) close(sn->listen_fd);
+                sn->listen_fd = -1;
+                continue;
+            }
         }
+        main_node->index = 0;
+        topology_pin_thread(&topology, pthread_self(), 0, 0);
+        INFO_PRINT("Serving from %i NUMA nodes", server_node_count);
+    }
 
-        if (!TLS_init_ssl_for_socket(&tls, client_fd)) {
-            ERROR_PRINT("Could not initialize tls for socket.");
-            close(server_sock);
-            TLS_free_connection(&tls);
-            return -1;
-        }
+    if (server_node_setup(main_node) == 0)
+        server_accept_loop(main_node);
 
-        int ret = SSL_accept(tls->ssl);
-        if (ret != 1) {
-            int err = SSL_get_error(tls->ssl, ret);
-            fprintf(stderr, "SSL handshake failed: %d\n", err);
-            ERROR_PRINT("%s", stderr);
-            ERROR_PRINT("TLS/SSL handshake was not successfull, err %i", err);
-            SSL_free(tls->ssl);
-            continue;
-        }
+    /* The stats socket reads the node pools, stop it before they go */
+    metrics_stop();
 
-        SSL_read(tls->ssl, read_buffer, sizeof(read_buffer));
-        INFO_PRINT("Received buffer %s", read_buffer);
+    /* Wake the other acceptors out of accept() and wait for them */
+    for (int i = 1; i < server_node_count; i++) {
+        ServerNode *sn = &server_nodes[i];
+        if (sn->listen_fd < 0) continue;
+        shutdown(sn->listen_fd, SHUT_RD);
+        pthread_join(sn->acceptor, NULL);
+    }
+
+    /* Connection threads use the node pools, pubsub, admission and tls */
+    server_conns_drain();
+    for (int i = 1; i < server_node_count; i++) {
+        ServerNode *sn = &server_nodes[i];
+        if (sn->listen_fd < 0) continue;
+        server_node_destroy(sn);
+        close(sn->listen_fd);
     }
 
+    while (subscriber_count > 0)
+        server_drop_subscriber(0);
+    pubsub_destroy(pubsub);
+    admission_destroy(admission);
+    server_node_destroy(main_node);
     TLS_free_connection(&tls);
     close(server_sock);
     INFO_PRINT("Socket is now closed.");
+    metrics_destroy();
+    TLS_trace_close();
+    binlog_close();
     return 0;
 }
\ No newline at end of file
@@ -5,6 +5,14 @@
  *  Supports pool initialization, allocation, deallocation, and destruction.
  *  Provides double-free protection using a bitmap.
  *
+ *  Blocks live in slabs.  pool_init() creates a single fixed slab, while
+ *  pool_init_ex() with POOL_GROWABLE adds slabs on demand, optionally
+ *  backed by huge pages, and unmaps fully free slabs once more than
+ *  free_slab_watermark of them are idle.  Each slab keeps its own free
+ *  list and bitmap, and blocks are mapped back to their slab with a
+ *  binary search over the slab bases.  POOL_NODE_LOCAL slabs are bound
+ *  to a NUMA node before their first use.
+ *
  *  Author: Hannu Raappana
  *  Created: 2025-08-19
  *
@@ -29,52 +37,267 @@
  ******************************************************************************/
 
 #include <stdint.h>
-#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "memory-pool.h"
+#include "topology.h"
 #include "logging.h"
 
-MemoryPool *pool_init(size_t bsize, size_t bcount)
+static void *pool_map_slab(MemoryPool *mp, size_t bytes)
+{
+    void *mem = MAP_FAILED;
+
+    if (mp->flags & POOL_HUGETLB) {
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            if (mp->flags & POOL_NODE_LOCAL)
+                topology_bind_memory(mem, bytes, mp->node);
+            return mem;
+        }
+        DEBUG_PRINT("MAP_HUGETLB failed, falling back to transparent huge pages");
+    }
+
+    mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    if (mp->flags & (POOL_HUGETLB | POOL_THP))
+        madvise(mem, bytes, MADV_HUGEPAGE);
+    if (mp->flags & POOL_NODE_LOCAL)
+        topology_bind_memory(mem, bytes, mp->node);
+    return mem;
+}
+
+static MemorySlab *pool_new_slab(MemoryPool *mp)
+{
+    size_t n = mp->slab_blocks;
+    size_t map_bytes = (n + 7) / 8;
+    MemorySlab *slab = malloc(sizeof(MemorySlab) + n * sizeof(void *) + map_bytes);
+    if (slab == NULL) return NULL;
+
+    slab->flist = (void **) (slab + 1);
+    slab->block_map = (unsigned char *) (slab->flist + n);
+    memset(slab->block_map, 0, map_bytes);
+    slab->flist_count = 0;
+    slab->carved = 0;
+    slab->free_count = n;
+    slab->prev_partial = NULL;
+    slab->next_partial = NULL;
+
+    slab->bytes = mp->block_size * n;
+    if (mp->flags & (POOL_HUGETLB | POOL_THP))
+        slab->bytes = (slab->bytes + POOL_HUGE_PAGE_SIZE - 1) & ~(POOL_HUGE_PAGE_SIZE - 1);
+    slab->mapped = (mp->flags & (POOL_GROWABLE | POOL_HUGETLB | POOL_THP | POOL_NODE_LOCAL)) != 0;
+    if (slab->mapped) {
+        slab->base = pool_map_slab(mp, slab->bytes);
+    } else {
+        slab->base = malloc(slab->bytes);
+    }
+    if (slab->base == NULL) {
+        free(slab);
+        return NULL;
+    }
+    return slab;
+}
+
+static void pool_free_slab(MemorySlab *slab)
 {
-    MemoryPool *mp = (MemoryPool *) malloc(sizeof(MemoryPool));
+    if (slab->mapped)
+        munmap(slab->base, slab->bytes);
+    else
+        free(slab->base);
+    free(slab);
+}
+
+static void pool_partial_push(MemoryPool *mp, MemorySlab *slab)
+{
+    slab->prev_partial = NULL;
+    slab->next_partial = mp->partial;
+    if (mp->partial) mp->partial->prev_partial = slab;
+    mp->partial = slab;
+}
+
+static void pool_partial_remove(MemoryPool *mp, MemorySlab *slab)
+{
+    if (slab->prev_partial) slab->prev_partial->next_partial = slab->next_partial;
+    else mp->partial = slab->next_partial;
+    if (slab->next_partial) slab->next_partial->prev_partial = slab->prev_partial;
+    slab->prev_partial = NULL;
+    slab->next_partial = NULL;
+}
+
+static inline size_t pool_block_index(MemoryPool *mp, size_t offset)
+{
+    if (mp->block_shift >= 0)
+        return offset >> mp->block_shift;
+    return offset / mp->block_size;
+}
+
+/*
+ * Index of the last slab whose base is <= addr, or -1.
+ */
+static long pool_slab_search(MemoryPool *mp, uintptr_t addr)
+{
+    long lo = 0, hi = (long) mp->slab_count - 1, found = -1;
+    while (lo <= hi) {
+        long mid = lo + (hi - lo) / 2;
+        if ((uintptr_t) mp->slabs[mid]->base <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+static MemorySlab *pool_find_slab(MemoryPool *mp, void *block)
+{
+    long i = pool_slab_search(mp, (uintptr_t) block);
+    if (i < 0) return NULL;
+
+    MemorySlab *slab = mp->slabs[i];
+    uintptr_t start = (uintptr_t) slab->base;
+    if ((uintptr_t) block >= start + mp->block_size * mp->slab_blocks)
+        return NULL;
+    return slab;
+}
+
+static MemorySlab *pool_add_slab(MemoryPool *mp)
+{
+    if (mp->slab_count == mp->slab_capacity) {
+        size_t cap = mp->slab_capacity ? mp->slab_capacity * 2 : 4;
+        MemorySlab **slabs = realloc(mp->slabs, cap * sizeof(MemorySlab *));
+        if (slabs == NULL) return NULL;
+        mp->slabs = slabs;
+        mp->slab_capacity = cap;
+    }
+
+    MemorySlab *slab = pool_new_slab(mp);
+    if (slab == NULL) {
+        ERROR_PRINT("Cannot allocate slab of %zu blocks", mp->slab_blocks);
+        return NULL;
+    }
+
+    size_t pos = (size_t) (pool_slab_search(mp, (uintptr_t) slab->base) + 1);
+    memmove(&mp->slabs[pos + 1], &mp->slabs[pos], (mp->slab_count - pos) * sizeof(MemorySlab *));
+    mp->slabs[pos] = slab;
+    mp->slab_count++;
+
+    mp->total_blocks += mp->slab_blocks;
+    mp->free_count += mp->slab_blocks;
+    mp->empty_slabs++;
+    pool_partial_push(mp, slab);
+
+    DEBUG_PRINT("Slab added. Start address: %p, End address: %p, slabs %zu",
+                slab->base, (char *) slab->base + slab->bytes, mp->slab_count);
+    return slab;
+}
+
+static void pool_release_slab(MemoryPool *mp, MemorySlab *slab)
+{
+    long i = pool_slab_search(mp, (uintptr_t) slab->base);
+    memmove(&mp->slabs[i], &mp->slabs[i + 1], (mp->slab_count - i - 1) * sizeof(MemorySlab *));
+    mp->slab_count--;
+
+    pool_partial_remove(mp, slab);
+    mp->total_blocks -= mp->slab_blocks;
+    mp->free_count -= mp->slab_blocks;
+    mp->empty_slabs--;
+
+    DEBUG_PRINT("Slab %p returned to the OS, slabs %zu", slab->base, mp->slab_count);
+    pool_free_slab(slab);
+}
+
+MemoryPool *pool_init_ex(size_t bsize, const MemoryPoolOpts *opts)
+{
+    if (bsize == 0 || opts == NULL || opts->slab_blocks == 0) {
+        ERROR_PRINT("Invalid memory pool parameters");
+        return NULL;
+    }
+
+    MemoryPool *mp = calloc(1, sizeof(MemoryPool));
     if (mp == NULL) {
-        ERROR_PRINT("Cannot allocate memory, block-size %li, block-count %li", bsize, bcount);
+        ERROR_PRINT("Cannot allocate memory, block-size %zu, slab-blocks %zu", bsize, opts->slab_blocks);
         return NULL;
     }
     mp->block_size = bsize;
-    mp->total_blocks = bcount;
-    mp->pool = malloc(bsize * bcount);
-    mp->free_count = bcount;
-    mp->flist = malloc(sizeof(void *) * bcount);
-    mp->block_map = calloc(1, (size_t) ceil((double) bcount / 8.0));
+    mp->block_shift = (bsize & (bsize - 1)) == 0 ? __builtin_ctzll(bsize) : -1;
+    mp->flags = opts->flags;
+    mp->node = opts->node;
+    mp->max_slabs = (opts->flags & POOL_GROWABLE) ? opts->max_slabs : 1;
+    mp->free_slab_watermark = opts->free_slab_watermark;
+    mp->slab_blocks = opts->slab_blocks;
+
+    /* Round huge page backed slabs up to whole huge pages */
+    if (opts->flags & (POOL_HUGETLB | POOL_THP)) {
+        size_t bytes = bsize * opts->slab_blocks;
+        bytes = (bytes + POOL_HUGE_PAGE_SIZE - 1) & ~(POOL_HUGE_PAGE_SIZE - 1);
+        mp->slab_blocks = bytes / bsize;
+    }
 
-    for (size_t i=0; i<bcount; i++) {
-        mp->flist[i] = ((char *) mp->pool + (i * bsize));
+    if (pool_add_slab(mp) == NULL) {
+        free(mp->slabs);
+        free(mp);
+        return NULL;
     }
 
-    DEBUG_PRINT("Memory pool initialized. Block- size %zu, block count %zu. \
-        Start address: %p \
-        End address: %p", \
-        bsize, bcount, mp->pool, (char *) mp->pool + bcount * bsize);
+    DEBUG_PRINT("Memory pool initialized. Block- size %zu, slab blocks %zu, flags 0x%x",
+                bsize, mp->slab_blocks, mp->flags);
     return mp;
 }
 
+MemoryPool *pool_init(size_t bsize, size_t bcount)
+{
+    MemoryPoolOpts opts = {
+        .slab_blocks = bcount,
+        .max_slabs = 1,
+        .free_slab_watermark = 0,
+        .flags = 0,
+    };
+    return pool_init_ex(bsize, &opts);
+}
+
 void *pool_malloc(MemoryPool *mp)
 {
     if (mp == NULL) {
         ERROR_PRINT("Uninitialized memory pool");
         return NULL;
-    } else if (!mp->free_count) {
-        ERROR_PRINT("Out of Memory");
-        return NULL;
+    }
+
+    MemorySlab *slab = mp->partial;
+    if (slab == NULL) {
+        if (!(mp->flags & POOL_GROWABLE) ||
+            (mp->max_slabs && mp->slab_count >= mp->max_slabs) ||
+            (slab = pool_add_slab(mp)) == NULL) {
+            ERROR_PRINT("Out of Memory");
+            return NULL;
+        }
     }
 
     void *block = NULL;
-    block = mp->flist[--mp->free_count];
+    if (slab->flist_count) {
+        block = slab->flist[--slab->flist_count];
+    } else {
+        /* Carve never used blocks lazily so fresh slabs are not touched */
+        block = (char *) slab->base + slab->carved++ * mp->block_size;
+    }
+
+    if (slab->free_count-- == mp->slab_blocks)
+        mp->empty_slabs--;
+    mp->free_count--;
+    if (mp->total_blocks - mp->free_count > mp->high_water)
+        mp->high_water = mp->total_blocks - mp->free_count;
+    if (slab->free_count == 0)
+        pool_partial_remove(mp, slab);
+
+    size_t index = pool_block_index(mp, (uintptr_t) block - (uintptr_t) slab->base);
+    WRITE_BITMAP(slab->block_map, index);
+
     DEBUG_PRINT("Memory allocated from address %p, block-size %zu, \
         free blocks left %zu", block, mp->block_size, mp->free_count);
-
-    WRITE_BITMAP(mp->block_map, mp->free_count);
     return block;
 }
 
@@ -85,39 +308,53 @@ void pool_free(MemoryPool *mp, void *block)
         return;
     }
 
-    uintptr_t pool_start = (uintptr_t) mp->pool;
-    uintptr_t pool_end   = pool_start + mp->block_size * mp->total_blocks;
-    uintptr_t blk_addr   = (uintptr_t) block;
-
-    if (blk_addr < pool_start || blk_addr >= pool_end) {
+    MemorySlab *slab = pool_find_slab(mp, block);
+    if (slab == NULL) {
         ERROR_PRINT("Block address %p outside of memory pool", block);
         return;
     }
 
-    size_t index = (blk_addr - pool_start) / mp->block_size;
-    if (READ_BITMAP(mp->block_map, index) == 0) {
-        ERROR_PRINT("Double free detected for block %p (index %zu)", block, index);
+    size_t offset = (uintptr_t) block - (uintptr_t) slab->base;
+    size_t index = pool_block_index(mp, offset);
+    if (offset != index * mp->block_size) {
+        ERROR_PRINT("Block address %p is not aligned to a block", block);
         return;
     }
 
-    CLEAR_BITMAP(mp->block_map, index);
-
-    if (mp->free_count < mp->total_blocks) {
-        mp->flist[mp->free_count++] = block;
-    } else {
-        ERROR_PRINT("Trying to free unallocated memory block %p.", block);
+    if (READ_BITMAP(slab->block_map, index) == 0) {
+        ERROR_PRINT("Double free detected for block %p (index %zu)", block, index);
         return;
     }
 
+    CLEAR_BITMAP(slab->block_map, index);
+    slab->flist[slab->flist_count++] = block;
+    mp->free_count++;
+
+    if (slab->free_count++ == 0)
+        pool_partial_push(mp, slab);
+
     DEBUG_PRINT("Memory freed block %p (index %zu)", block, index);
+
+    if (slab->free_count == mp->slab_blocks) {
+        mp->empty_slabs++;
+        if ((mp->flags & POOL_GROWABLE) && mp->slab_count > 1 &&
+            mp->empty_slabs > mp->free_slab_watermark)
+            pool_release_slab(mp, slab);
+    }
+}
+
+int pool_owns(MemoryPool *mp, void *block)
+{
+    if (mp == NULL || block == NULL) return 0;
+    return pool_find_slab(mp, block) != NULL;
 }
 
 void pool_destroy(MemoryPool *mp)
 {
     if (mp == NULL) return;
-    free(mp->pool);
-    free(mp->flist);
-    free(mp->block_map);
+    for (size_t i = 0; i < mp->slab_count; i++)
+        pool_free_slab(mp->slabs[i]);
+    free(mp->slabs);
     free(mp);
 
     DEBUG_PRINT("Memory pool destroyed");
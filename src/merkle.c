@@ -0,0 +1,434 @@
+/******************************************************************************
+ *  merkle.c
+ *
+ *  Parallel Merkle tree hashing of memory mapped files.
+ *
+ *  Description:
+ *  Hashing a multi-gigabyte file through one MessageDigest is limited to a
+ *  single core.  Splitting it into chunks gives independent leaves that
+ *  can be hashed on all cores, and the tree lets a receiver check single
+ *  chunks of a partial transfer against the root.
+ *   - merkle_open(): map a file and build its tree
+ *   - merkle_mark_dirty(), merkle_rehash(): rehash only modified chunks
+ *   - merkle_proof(), merkle_verify(): inclusion proofs for single chunks
+ *   - merkle_close(): unmap and free
+ *
+ *  Implementation details:
+ *   - The file is mapped read-only and shared, so in-place writes by other
+ *     processes are seen by the next rehash without remapping.
+ *   - Worker threads take chunk indices from an atomic counter and hash
+ *     them with a digest from the per-thread pool in digest.c.
+ *   - Leaves and inner nodes use different prefixes (0x00 and 0x01) so an
+ *     inner node can never pass as a leaf.  An odd node at the end of a
+ *     level is promoted as is.  An empty file has one empty leaf.
+ *   - Inner levels are cheap (one node per chunk pair) and are rebuilt on
+ *     the calling thread, only along the paths of dirty leaves.  If the
+ *     file size changed the file is remapped and all inner nodes rebuilt.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "merkle.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+
+typedef struct MERKLE_JOB_T {
+    MerkleTree *tree;
+    const size_t *chunks;
+    size_t count;
+    atomic_size_t next;
+    atomic_int failed;
+} MerkleJob;
+
+static inline unsigned char *merkle_node(MerkleTree *t, size_t level, size_t index)
+{
+    return t->nodes + (t->level_start[level] + index) * (size_t) t->md_size;
+}
+
+static int merkle_hash_prefixed(MessageDigest *md, unsigned char prefix, const void *a, size_t alen,
+                                const void *b, size_t blen, unsigned char *out)
+{
+    unsigned int len;
+    if (MD_digest_reset(md) != 0 ||
+        MD_update_message(md, &prefix, 1) != 0 ||
+        (alen && MD_update_message(md, (void *) a, alen) != 0) ||
+        (blen && MD_update_message(md, (void *) b, blen) != 0) ||
+        MD_calculate_digest(md, out, &len) != 0)
+        return -1;
+    return 0;
+}
+
+static int merkle_hash_leaf(MerkleTree *t, MessageDigest *md, size_t index)
+{
+    size_t off = index * t->chunk_size;
+    size_t len = off < t->size ? t->size - off : 0;
+    if (len > t->chunk_size) len = t->chunk_size;
+    return merkle_hash_prefixed(md, MERKLE_LEAF_PREFIX, t->map + off, len, NULL, 0,
+                                merkle_node(t, 0, index));
+}
+
+static void *merkle_worker(void *arg)
+{
+    MerkleJob *job = arg;
+    MessageDigest *md = MD_digest_acquire(job->tree->alg);
+    if (md == NULL) {
+        atomic_store(&job->failed, 1);
+        return NULL;
+    }
+
+    size_t i;
+    while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->count) {
+        if (merkle_hash_leaf(job->tree, md, job->chunks[i]) != 0) {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+    }
+    MD_digest_release(md);
+    return NULL;
+}
+
+/**
+ * Hash the given leaves on up to t->threads threads, the caller being one of them.
+ */
+static int merkle_hash_leaves(MerkleTree *t, const size_t *chunks, size_t count)
+{
+    MerkleJob job = { .tree = t, .chunks = chunks, .count = count };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+
+    size_t nthreads = (size_t) t->threads < count ? (size_t) t->threads : count;
+    pthread_t tids[nthreads ? nthreads : 1];
+    size_t started = 0;
+
+    for (size_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[started], NULL, merkle_worker, &job) != 0) {
+            ERROR_PRINT("Cannot start Merkle worker thread, continuing with %zu", started + 1);
+            break;
+        }
+        started++;
+    }
+    merkle_worker(&job);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    if (atomic_load(&job.failed)) {
+        ERROR_PRINT("Could not hash file chunks");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Recompute inner nodes above dirty leaves, t->dirty is consumed.
+ */
+static int merkle_build_inner(MerkleTree *t)
+{
+    MessageDigest *md = MD_digest_acquire(t->alg);
+    if (md == NULL) return -1;
+
+    for (size_t level = 1; level < t->levels; level++) {
+        size_t below = t->level_count[level - 1];
+        for (size_t i = 0; i < t->level_count[level]; i++) {
+            size_t l = 2 * i, r = 2 * i + 1;
+            unsigned char dirty = t->dirty[l] | (r < below ? t->dirty[r] : 0);
+            t->dirty[i] = dirty;
+            if (!dirty) continue;
+
+            int rc = 0;
+            if (r < below)
+                rc = merkle_hash_prefixed(md, MERKLE_NODE_PREFIX, merkle_node(t, level - 1, l), t->md_size,
+                                          merkle_node(t, level - 1, r), t->md_size, merkle_node(t, level, i));
+            else
+                memcpy(merkle_node(t, level, i), merkle_node(t, level - 1, l), t->md_size);
+            if (rc != 0) {
+                MD_digest_release(md);
+                return -1;
+            }
+        }
+    }
+
+    MD_digest_release(md);
+    memset(t->dirty, 0, t->leaves);
+    t->dirty_count = 0;
+    return 0;
+}
+
+/**
+ * Size the levels for the current file size.  Leaf hashes of chunks that
+ * exist in both layouts are kept.
+ */
+static int merkle_layout(MerkleTree *t)
+{
+    size_t leaves = t->size ? (t->size + t->chunk_size - 1) / t->chunk_size : 1;
+    size_t levels = 1, total = leaves;
+    for (size_t n = leaves; n > 1; n = (n + 1) / 2) {
+        levels++;
+        total += (n + 1) / 2;
+    }
+
+    size_t *start = calloc(levels, sizeof(size_t));
+    size_t *count = calloc(levels, sizeof(size_t));
+    unsigned char *nodes = malloc(total * (size_t) t->md_size);
+    unsigned char *dirty = calloc(leaves, 1);
+    if (start == NULL || count == NULL || nodes == NULL || dirty == NULL) {
+        ERROR_PRINT("Cannot allocate Merkle tree of %zu leaves", leaves);
+        free(start);
+        free(count);
+        free(nodes);
+        free(dirty);
+        return -1;
+    }
+
+    size_t n = leaves, pos = 0;
+    for (size_t l = 0; l < levels; l++) {
+        start[l] = pos;
+        count[l] = n;
+        pos += n;
+        n = (n + 1) / 2;
+    }
+
+    if (t->nodes != NULL) {
+        size_t keep = t->leaves < leaves ? t->leaves : leaves;
+        memcpy(nodes, t->nodes, keep * (size_t) t->md_size);
+        memcpy(dirty, t->dirty, keep);
+    }
+
+    free(t->level_start);
+    free(t->level_count);
+    free(t->nodes);
+    free(t->dirty);
+    t->level_start = start;
+    t->level_count = count;
+    t->nodes = nodes;
+    t->dirty = dirty;
+    t->levels = levels;
+    t->leaves = leaves;
+    return 0;
+}
+
+static int merkle_map(MerkleTree *t, size_t size)
+{
+    if (t->map != NULL) munmap((void *) t->map, t->size);
+    t->map = NULL;
+    t->size = size;
+    if (size == 0) return 0;
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, t->fd, 0);
+    if (map == MAP_FAILED) {
+        ERROR_PRINT("Cannot map %zu bytes: %s", size, strerror(errno));
+        t->size = 0;
+        return -1;
+    }
+    madvise(map, size, MADV_WILLNEED);
+    t->map = map;
+    return 0;
+}
+
+MerkleTree *merkle_open(const char *path, const MerkleOpts *opts)
+{
+    const EVP_MD *type = MD_get_algorithm(opts ? opts->alg : MD_SHA256);
+    if (type == NULL) {
+        ERROR_PRINT("Unknown digest algorithm for Merkle tree");
+        return NULL;
+    }
+
+    MerkleTree *t = calloc(1, sizeof(MerkleTree));
+    if (t == NULL) {
+        ERROR_PRINT("Cannot allocate memory for Merkle tree");
+        return NULL;
+    }
+    t->alg = opts ? opts->alg : MD_SHA256;
+    t->md_size = EVP_MD_get_size(type);
+    t->chunk_size = opts && opts->chunk_size ? opts->chunk_size : MERKLE_DEFAULT_CHUNK;
+    t->threads = opts && opts->threads > 0 ? opts->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (t->threads < 1) t->threads = 1;
+
+    t->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (t->fd < 0) {
+        ERROR_PRINT("Cannot open %s: %s", path, strerror(errno));
+        free(t);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(t->fd, &st) != 0 || merkle_map(t, (size_t) st.st_size) != 0 || merkle_layout(t) != 0) {
+        merkle_close(t);
+        return NULL;
+    }
+
+    memset(t->dirty, 1, t->leaves);
+    t->dirty_count = t->leaves;
+    if (merkle_rehash(t) < 0) {
+        merkle_close(t);
+        return NULL;
+    }
+
+    DEBUG_PRINT("Merkle tree of %s: %zu bytes, %zu leaves, %zu levels, %i threads",
+                path, t->size, t->leaves, t->levels, t->threads);
+    return t;
+}
+
+int merkle_mark_dirty(MerkleTree *t, off_t offset, size_t len)
+{
+    if (t == NULL || offset < 0) return -1;
+    if (len == 0) return 0;
+
+    size_t first = (size_t) offset / t->chunk_size;
+    size_t last = ((size_t) offset + len - 1) / t->chunk_size;
+    /* Chunks past the end are picked up by the size check in merkle_rehash() */
+    if (last >= t->leaves) last = t->leaves - 1;
+    for (size_t i = first; i <= last; i++) {
+        if (!t->dirty[i]) {
+            t->dirty[i] = 1;
+            t->dirty_count++;
+        }
+    }
+    return 0;
+}
+
+ssize_t merkle_rehash(MerkleTree *t)
+{
+    struct stat st;
+    if (fstat(t->fd, &st) != 0) {
+        ERROR_PRINT("Cannot stat Merkle tree file: %s", strerror(errno));
+        return -1;
+    }
+
+    int resized = (size_t) st.st_size != t->size;
+    if (resized) {
+        size_t old_leaves = t->leaves;
+        if (merkle_map(t, (size_t) st.st_size) != 0 || merkle_layout(t) != 0)
+            return -1;
+        /* The old last chunk changed length, new chunks were never hashed */
+        size_t from = old_leaves ? old_leaves - 1 : 0;
+        if (from > t->leaves - 1) from = t->leaves - 1;
+        for (size_t i = from; i < t->leaves; i++)
+            t->dirty[i] = 1;
+        t->dirty_count = 0;
+        for (size_t i = 0; i < t->leaves; i++)
+            t->dirty_count += t->dirty[i];
+    }
+
+    if (t->dirty_count == 0) return 0;
+
+    size_t *chunks = malloc(t->dirty_count * sizeof(size_t));
+    if (chunks == NULL) {
+        ERROR_PRINT("Cannot allocate list of %zu dirty chunks", t->dirty_count);
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < t->leaves; i++)
+        if (t->dirty[i]) chunks[n++] = i;
+
+    int rc = merkle_hash_leaves(t, chunks, n);
+    free(chunks);
+    if (rc != 0) return -1;
+
+    if (resized) memset(t->dirty, 1, t->leaves);
+    if (merkle_build_inner(t) != 0) return -1;
+    return (ssize_t) n;
+}
+
+const unsigned char *merkle_root(MerkleTree *t)
+{
+    return merkle_node(t, t->levels - 1, 0);
+}
+
+const unsigned char *merkle_leaf(MerkleTree *t, size_t index)
+{
+    return index < t->leaves ? merkle_node(t, 0, index) : NULL;
+}
+
+int merkle_hash_chunk(int alg, const void *data, size_t len, unsigned char *out)
+{
+    MessageDigest *md = MD_digest_acquire(alg);
+    if (md == NULL) return -1;
+    int rc = merkle_hash_prefixed(md, MERKLE_LEAF_PREFIX, data, len, NULL, 0, out);
+    MD_digest_release(md);
+    return rc;
+}
+
+ssize_t merkle_proof(MerkleTree *t, size_t index, unsigned char *out, size_t max)
+{
+    if (index >= t->leaves) return -1;
+
+    size_t n = 0;
+    for (size_t level = 0; level + 1 < t->levels; level++, index >>= 1) {
+        size_t sibling = index ^ 1;
+        if (sibling >= t->level_count[level]) continue;
+        if (n == max) return -1;
+        memcpy(out + n * (size_t) t->md_size, merkle_node(t, level, sibling), t->md_size);
+        n++;
+    }
+    return (ssize_t) n;
+}
+
+int merkle_verify(int alg, const unsigned char *leaf_hash, size_t index, size_t leaves,
+                  const unsigned char *proof, size_t proof_count, const unsigned char *root)
+{
+    if (index >= leaves) return 0;
+    MessageDigest *md = MD_digest_acquire(alg);
+    if (md == NULL) return 0;
+
+    size_t size = (size_t) md->md_size, used = 0;
+    unsigned char cur[EVP_MAX_MD_SIZE];
+    memcpy(cur, leaf_hash, size);
+
+    int ok = 1;
+    for (size_t count = leaves; count > 1 && ok; count = (count + 1) / 2, index >>= 1) {
+        if ((index ^ 1) >= count) continue;
+        if (used == proof_count) {
+            ok = 0;
+            break;
+        }
+        const unsigned char *sib = proof + used++ * size;
+        if (index & 1)
+            ok = merkle_hash_prefixed(md, MERKLE_NODE_PREFIX, sib, size, cur, size, cur) == 0;
+        else
+            ok = merkle_hash_prefixed(md, MERKLE_NODE_PREFIX, cur, size, sib, size, cur) == 0;
+    }
+
+    MD_digest_release(md);
+    return ok && used == proof_count && memcmp(cur, root, size) == 0;
+}
+
+void merkle_close(MerkleTree *t)
+{
+    if (t == NULL) return;
+    if (t->map != NULL) munmap((void *) t->map, t->size);
+    if (t->fd >= 0) close(t->fd);
+    free(t->level_start);
+    free(t->level_count);
+    free(t->nodes);
+    free(t->dirty);
+    free(t);
+}
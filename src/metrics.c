@@ -0,0 +1,428 @@
+/******************************************************************************
+ *  metrics.c
+ *
+ *  Metrics registry with a local stats socket.
+ *
+ *  Description:
+ *  Low-overhead counters, gauges and latency histograms for the server.
+ *   - metrics_counter(), metrics_gauge(), metrics_histogram(): register
+ *   - metrics_counter_fn(), metrics_gauge_fn(): values read on demand
+ *   - metrics_register_pool(): MemoryPool usage as gauges, read under the
+ *     lock that guards the pool
+ *   - metrics_add(), metrics_gauge_set(), metrics_record(): update
+ *   - metrics_dump(): text dump of all metrics
+ *   - metrics_serve(), metrics_stop(): dump over a Unix socket
+ *
+ *  Implementation details:
+ *   - Threads get a shard index round-robin on first use.  Counter and
+ *     histogram updates are relaxed atomic adds on the thread's own cache
+ *     line, so threads never contend unless they share a shard.
+ *   - Histograms are log-linear: values below 8 have their own bucket,
+ *     above that every power of two is split into 8 buckets, which bounds
+ *     the quantile error to 12.5%.  Values from 2^40 up are clamped.
+ *   - Reads sum the shards without stopping writers, so a dump is not an
+ *     atomic snapshot across metrics.
+ *   - The registry is a list under a mutex; registration is rare.
+ *   - The dump uses the Prometheus text format, histograms are exported
+ *     as count, sum, max and quantiles.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "metrics.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+__thread int metrics_shard_id = -1;
+
+static _Atomic int next_shard = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Metric *registry = NULL;
+
+static int server_fd = -1;
+static pthread_t server_thread;
+static char server_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+static const double dump_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+int metrics_assign_shard(void)
+{
+    metrics_shard_id = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % METRICS_SHARDS;
+    return metrics_shard_id;
+}
+
+static Metric *metrics_find(const char *name)
+{
+    for (Metric *m = registry; m != NULL; m = m->next)
+        if (strcmp(m->name, name) == 0)
+            return m;
+    return NULL;
+}
+
+static Metric *metrics_register(const char *name, const char *help, int type,
+                                int64_t (*fn)(void *), void *arg, pthread_mutex_t *lock)
+{
+    pthread_mutex_lock(&registry_lock);
+    Metric *m = metrics_find(name);
+    if (m != NULL) {
+        pthread_mutex_unlock(&registry_lock);
+        if (m->type != type) {
+            ERROR_PRINT("Metric %s already registered with another type", name);
+            return NULL;
+        }
+        return m;
+    }
+
+    m = calloc(1, sizeof(Metric));
+    if (m == NULL) goto fail;
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->help = help;
+    m->type = type;
+    m->fn = fn;
+    m->arg = arg;
+    m->lock = lock;
+
+    if (fn == NULL && type == METRIC_COUNTER) {
+        m->shards = aligned_alloc(METRICS_CACHE_LINE, METRICS_SHARDS * sizeof(MetricShard));
+        if (m->shards == NULL) goto fail;
+        memset(m->shards, 0, METRICS_SHARDS * sizeof(MetricShard));
+    } else if (type == METRIC_HISTOGRAM) {
+        m->hist = aligned_alloc(METRICS_CACHE_LINE, METRICS_SHARDS * sizeof(MetricHistShard));
+        if (m->hist == NULL) goto fail;
+        memset(m->hist, 0, METRICS_SHARDS * sizeof(MetricHistShard));
+    }
+
+    m->next = registry;
+    registry = m;
+    pthread_mutex_unlock(&registry_lock);
+    return m;
+
+fail:
+    pthread_mutex_unlock(&registry_lock);
+    if (m) free(m->shards);
+    free(m);
+    ERROR_PRINT("Cannot allocate memory for metric %s", name);
+    return NULL;
+}
+
+Metric *metrics_counter(const char *name, const char *help)
+{
+    return metrics_register(name, help, METRIC_COUNTER, NULL, NULL, NULL);
+}
+
+Metric *metrics_gauge(const char *name, const char *help)
+{
+    return metrics_register(name, help, METRIC_GAUGE, NULL, NULL, NULL);
+}
+
+Metric *metrics_histogram(const char *name, const char *help)
+{
+    return metrics_register(name, help, METRIC_HISTOGRAM, NULL, NULL, NULL);
+}
+
+Metric *metrics_counter_fn(const char *name, const char *help, int64_t (*fn)(void *), void *arg)
+{
+    return metrics_register(name, help, METRIC_COUNTER, fn, arg, NULL);
+}
+
+Metric *metrics_gauge_fn(const char *name, const char *help, int64_t (*fn)(void *), void *arg)
+{
+    return metrics_register(name, help, METRIC_GAUGE, fn, arg, NULL);
+}
+
+static int64_t pool_free_blocks(void *arg)
+{
+    return (int64_t) ((MemoryPool *) arg)->free_count;
+}
+
+static int64_t pool_total_blocks(void *arg)
+{
+    return (int64_t) ((MemoryPool *) arg)->total_blocks;
+}
+
+static int64_t pool_high_water(void *arg)
+{
+    return (int64_t) ((MemoryPool *) arg)->high_water;
+}
+
+int metrics_register_pool(const char *prefix, MemoryPool *mp, pthread_mutex_t *lock)
+{
+    char name[METRICS_NAME_LEN];
+    int ok = 1;
+
+    snprintf(name, sizeof(name), "%s_free_blocks", prefix);
+    ok &= metrics_register(name, "Free blocks in the pool", METRIC_GAUGE,
+                          pool_free_blocks, mp, lock) != NULL;
+    snprintf(name, sizeof(name), "%s_blocks", prefix);
+    ok &= metrics_register(name, "Blocks owned by the pool", METRIC_GAUGE,
+                          pool_total_blocks, mp, lock) != NULL;
+    snprintf(name, sizeof(name), "%s_high_water", prefix);
+    ok &= metrics_register(name, "Most blocks in use at once", METRIC_GAUGE,
+                          pool_high_water, mp, lock) != NULL;
+    return ok ? 0 : -1;
+}
+
+static inline int hist_bucket(uint64_t v)
+{
+    if (v >= (1ULL << METRICS_HIST_MAX_BITS))
+        v = (1ULL << METRICS_HIST_MAX_BITS) - 1;
+    if (v < METRICS_HIST_SUB)
+        return (int) v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (int) (v >> (e - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB - 1);
+    return (e - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB + sub;
+}
+
+uint64_t metrics_hist_bucket_upper(int bucket)
+{
+    if (bucket < METRICS_HIST_SUB)
+        return (uint64_t) bucket;
+    int e = bucket / METRICS_HIST_SUB + METRICS_HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (bucket % METRICS_HIST_SUB);
+    uint64_t width = 1ULL << (e - METRICS_HIST_SUB_BITS);
+    return ((METRICS_HIST_SUB + sub) << (e - METRICS_HIST_SUB_BITS)) + width - 1;
+}
+
+void metrics_record(Metric *m, uint64_t value)
+{
+    MetricHistShard *s = &m->hist[metrics_shard()];
+    atomic_fetch_add_explicit(&s->buckets[hist_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->sum, value, memory_order_relaxed);
+
+    /* The shard is practically thread-private, a plain compare is enough */
+    if (value > atomic_load_explicit(&s->max, memory_order_relaxed))
+        atomic_store_explicit(&s->max, value, memory_order_relaxed);
+}
+
+int64_t metrics_read(Metric *m)
+{
+    if (m->fn != NULL && m->lock != NULL) {
+        pthread_mutex_lock(m->lock);
+        int64_t value = m->fn(m->arg);
+        pthread_mutex_unlock(m->lock);
+        return value;
+    }
+    if (m->fn != NULL)
+        return m->fn(m->arg);
+
+    switch (m->type) {
+    case METRIC_COUNTER: {
+        uint64_t sum = 0;
+        for (int i = 0; i < METRICS_SHARDS; i++)
+            sum += atomic_load_explicit(&m->shards[i].value, memory_order_relaxed);
+        return (int64_t) sum;
+    }
+    case METRIC_GAUGE:
+        return atomic_load_explicit(&m->gauge, memory_order_relaxed);
+    default: {
+        MetricHistogramSnapshot snap;
+        metrics_hist_snapshot(m, &snap);
+        return (int64_t) snap.count;
+    }
+    }
+}
+
+void metrics_hist_snapshot(Metric *m, MetricHistogramSnapshot *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        MetricHistShard *s = &m->hist[i];
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&s->buckets[b], memory_order_relaxed);
+            snap->buckets[b] += n;
+            snap->count += n;
+        }
+        snap->sum += atomic_load_explicit(&s->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&s->max, memory_order_relaxed);
+        if (max > snap->max) snap->max = max;
+    }
+}
+
+uint64_t metrics_hist_quantile(const MetricHistogramSnapshot *snap, double q)
+{
+    if (snap->count == 0) return 0;
+
+    uint64_t rank = (uint64_t) (q * (double) snap->count);
+    if (rank >= snap->count) rank = snap->count - 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        seen += snap->buckets[b];
+        if (seen > rank) {
+            uint64_t upper = metrics_hist_bucket_upper(b);
+            return upper < snap->max ? upper : snap->max;
+        }
+    }
+    return snap->max;
+}
+
+static void metrics_dump_one(FILE *out, Metric *m)
+{
+    static const char *types[] = { "counter", "gauge", "summary" };
+
+    if (m->help) fprintf(out, "# HELP %s %s\n", m->name, m->help);
+    fprintf(out, "# TYPE %s %s\n", m->name, types[m->type]);
+
+    if (m->type != METRIC_HISTOGRAM) {
+        fprintf(out, "%s %lld\n", m->name, (long long) metrics_read(m));
+        return;
+    }
+
+    MetricHistogramSnapshot *snap = malloc(sizeof(MetricHistogramSnapshot));
+    if (snap == NULL) return;
+    metrics_hist_snapshot(m, snap);
+    for (size_t i = 0; i < sizeof(dump_quantiles) / sizeof(dump_quantiles[0]); i++)
+        fprintf(out, "%s{quantile=\"%g\"} %llu\n", m->name, dump_quantiles[i],
+                (unsigned long long) metrics_hist_quantile(snap, dump_quantiles[i]));
+    fprintf(out, "%s_max %llu\n", m->name, (unsigned long long) snap->max);
+    fprintf(out, "%s_sum %llu\n", m->name, (unsigned long long) snap->sum);
+    fprintf(out, "%s_count %llu\n", m->name, (unsigned long long) snap->count);
+    free(snap);
+}
+
+void metrics_dump(FILE *out)
+{
+    pthread_mutex_lock(&registry_lock);
+    /* The registry is newest first, dump in registration order */
+    size_t n = 0;
+    for (Metric *m = registry; m != NULL; m = m->next)
+        n++;
+    Metric **order = malloc((n ? n : 1) * sizeof(Metric *));
+    if (order != NULL) {
+        size_t i = n;
+        for (Metric *m = registry; m != NULL; m = m->next)
+            order[--i] = m;
+        for (i = 0; i < n; i++)
+            metrics_dump_one(out, order[i]);
+        free(order);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void metrics_send(int fd)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&text, &len);
+    if (mem == NULL) return;
+    metrics_dump(mem);
+    fclose(mem);
+
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = write(fd, text + sent, len - sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += (size_t) n;
+    }
+    free(text);
+}
+
+static void *metrics_server_main(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /* metrics_stop() shuts the socket down */
+            break;
+        }
+        metrics_send(client);
+        close(client);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *socket_path)
+{
+    struct sockaddr_un addr;
+
+    if (server_fd >= 0) {
+        ERROR_PRINT("Metrics socket already running at %s", server_path);
+        return -1;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        ERROR_PRINT("Metrics socket path too long: %s", socket_path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ERROR_PRINT("Cannot create metrics socket, errno %i", errno);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        ERROR_PRINT("Cannot listen on metrics socket %s, errno %i", socket_path, errno);
+        close(fd);
+        return -1;
+    }
+
+    if (pthread_create(&server_thread, NULL, metrics_server_main, (void *) (intptr_t) fd) != 0) {
+        ERROR_PRINT("Cannot start metrics thread");
+        close(fd);
+        unlink(socket_path);
+        return -1;
+    }
+
+    server_fd = fd;
+    snprintf(server_path, sizeof(server_path), "%s", socket_path);
+    INFO_PRINT("Metrics available at %s", socket_path);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (server_fd < 0) return;
+    shutdown(server_fd, SHUT_RDWR);
+    pthread_join(server_thread, NULL);
+    close(server_fd);
+    unlink(server_path);
+    server_fd = -1;
+}
+
+void metrics_destroy(void)
+{
+    metrics_stop();
+    pthread_mutex_lock(&registry_lock);
+    while (registry != NULL) {
+        Metric *m = registry;
+        registry = m->next;
+        free(m->shards);
+        free(m->hist);
+        free(m);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,190 @@
+/******************************************************************************
+ *  mpsc-queue.c
+ *
+ *  Intrusive lock-free multi-producer/single-consumer queue.
+ *
+ *  Description:
+ *  This module provides a Vyukov-style MPSC queue for handing connection
+ *  events and outbound messages between threads:
+ *   - mpsc_init_queue(): initialize a new empty queue
+ *   - mpsc_push(): enqueue a node, callable from any thread
+ *   - mpsc_pop(): dequeue one node, consumer thread only
+ *   - mpsc_pop_batch(): dequeue up to max nodes at once
+ *   - mpsc_enable_wakeup(): eventfd wakeup for an epoll based consumer
+ *
+ *  Implementation details:
+ *   - The queue is intrusive: callers embed MPSCNode in their own structure
+ *     (usually allocated from a MemoryPool) and use MPSC_ENTRY() to get
+ *     back to it.  The queue itself never allocates after init.
+ *   - Push is a single atomic exchange and is wait-free.  Pop may return
+ *     NULL while a producer is between its exchange and its link store,
+ *     in that case the consumer simply tries again later.
+ *   - The eventfd is only written when the consumer has armed it, so a
+ *     busy consumer costs producers no syscalls.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "mpsc-queue.h"
+#include "logging.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+MPSCQueue *mpsc_init_queue(void)
+{
+    MPSCQueue *q = aligned_alloc(MPSC_CACHE_LINE, sizeof(MPSCQueue));
+    if (q == NULL) {
+        ERROR_PRINT("Cannot allocate memory for MPSC queue");
+        return NULL;
+    }
+
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_init(&q->armed, 0);
+    q->event_fd = -1;
+
+    DEBUG_PRINT("MPSC queue is now initialized");
+    return q;
+}
+
+void mpsc_destroy_queue(MPSCQueue *q)
+{
+    if (q == NULL) return;
+    if (q->event_fd >= 0)
+        close(q->event_fd);
+    free(q);
+}
+
+/*
+ * Producer half of the handshake with mpsc_arm_wakeup(): the node is in
+ * head before armed is read, and the consumer stores armed before it reads
+ * head.  Both sides need the full fence, otherwise each can miss the
+ * other's store and the consumer sleeps on a non-empty queue.
+ */
+static void mpsc_signal(MPSCQueue *q)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->armed, memory_order_relaxed) == 0) return;
+    if (atomic_exchange(&q->armed, 0) == 0) return;
+
+    uint64_t one = 1;
+    while (write(q->event_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+void mpsc_push(MPSCQueue *q, MPSCNode *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    MPSCNode *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+
+    if (q->event_fd >= 0)
+        mpsc_signal(q);
+}
+
+MPSCNode *mpsc_pop(MPSCQueue *q)
+{
+    MPSCNode *tail = q->tail;
+    MPSCNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* Producer has swapped head but not yet linked its node */
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    /* Last node, put stub back behind it so it can be detached */
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    MPSCNode *prev = atomic_exchange_explicit(&q->head, &q->stub, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, &q->stub, memory_order_release);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+size_t mpsc_pop_batch(MPSCQueue *q, MPSCNode **nodes, size_t max)
+{
+    size_t count = 0;
+    while (count < max) {
+        MPSCNode *node = mpsc_pop(q);
+        if (node == NULL) break;
+        nodes[count++] = node;
+    }
+    return count;
+}
+
+int mpsc_is_empty(MPSCQueue *q)
+{
+    return q->tail == &q->stub &&
+           atomic_load_explicit(&q->head, memory_order_acquire) == &q->stub;
+}
+
+int mpsc_enable_wakeup(MPSCQueue *q)
+{
+    if (q == NULL) return -1;
+    if (q->event_fd >= 0) return q->event_fd;
+
+    q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->event_fd < 0) {
+        ERROR_PRINT("Cannot create eventfd for MPSC queue, errno %i", errno);
+        return -1;
+    }
+    return q->event_fd;
+}
+
+int mpsc_arm_wakeup(MPSCQueue *q)
+{
+    atomic_store_explicit(&q->armed, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!mpsc_is_empty(q)) {
+        /* Work arrived meanwhile, don't sleep */
+        atomic_store(&q->armed, 0);
+        return 1;
+    }
+    return 0;
+}
+
+void mpsc_ack_wakeup(MPSCQueue *q)
+{
+    uint64_t value;
+    while (read(q->event_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,313 @@
+/******************************************************************************
+ *  pool-cache.c
+ *
+ *  Thread-local magazine caches on top of MemoryPool.
+ *
+ *  Description:
+ *  MemoryPool itself is single-threaded.  This module lets many threads
+ *  share one pool with the magazine/depot scheme:
+ *   - pcache_init(): wrap an existing pool
+ *   - pcache_malloc(): allocate a block, lock-free while magazines last
+ *   - pcache_free(): free a block from any thread
+ *   - pcache_flush_thread(): return calling thread's magazines to the depot
+ *   - pcache_destroy(): return all cached blocks to the pool
+ *
+ *  Implementation details:
+ *   - Each thread owns a "loaded" and a "previous" magazine.  Alloc pops
+ *     from loaded, free pushes to loaded, and the two are swapped when one
+ *     runs dry or fills up, so a thread bouncing on the boundary does not
+ *     hit the depot on every call.
+ *   - The depot keeps lists of full and empty magazines under a mutex.
+ *     Full magazines beyond max_full are flushed back to the pool.
+ *   - Per-thread state is found with pthread_getspecific() and flushed to
+ *     the depot automatically when the thread exits.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "pool-cache.h"
+#include "logging.h"
+
+static PoolMagazine *pcache_new_magazine(PoolCache *pc)
+{
+    PoolMagazine *mag = malloc(sizeof(PoolMagazine) + pc->mag_size * sizeof(void *));
+    if (mag == NULL) {
+        ERROR_PRINT("Cannot allocate magazine of %zu rounds", pc->mag_size);
+        return NULL;
+    }
+    mag->next = NULL;
+    mag->rounds = 0;
+    return mag;
+}
+
+/*
+ * Depot helpers, caller holds pc->lock.
+ */
+static PoolMagazine *depot_take(PoolMagazine **list)
+{
+    PoolMagazine *mag = *list;
+    if (mag != NULL) {
+        *list = mag->next;
+        mag->next = NULL;
+    }
+    return mag;
+}
+
+static void depot_put(PoolMagazine **list, PoolMagazine *mag)
+{
+    mag->next = *list;
+    *list = mag;
+}
+
+static void depot_flush_to_pool(PoolCache *pc, PoolMagazine *mag)
+{
+    while (mag->rounds > 0)
+        pool_free(pc->pool, mag->slots[--mag->rounds]);
+}
+
+static void depot_fill_from_pool(PoolCache *pc, PoolMagazine *mag)
+{
+    size_t want = pc->mag_size / 2 ? pc->mag_size / 2 : 1;
+    while (mag->rounds < want &&
+           (pc->pool->free_count > 0 || (pc->pool->flags & POOL_GROWABLE))) {
+        void *block = pool_malloc(pc->pool);
+        if (block == NULL) break;
+        mag->slots[mag->rounds++] = block;
+    }
+}
+
+static void depot_release_thread(PoolCache *pc, PoolThreadCache *tc)
+{
+    PoolMagazine *mags[2] = { tc->loaded, tc->previous };
+    for (int i = 0; i < 2; i++) {
+        if (mags[i] == NULL) continue;
+        if (mags[i]->rounds == 0) {
+            depot_put(&pc->empty, mags[i]);
+        } else if (pc->full_count < pc->max_full && mags[i]->rounds == pc->mag_size) {
+            depot_put(&pc->full, mags[i]);
+            pc->full_count++;
+        } else {
+            /* Partial magazines go straight back to the pool */
+            depot_flush_to_pool(pc, mags[i]);
+            depot_put(&pc->empty, mags[i]);
+        }
+    }
+    tc->loaded = NULL;
+    tc->previous = NULL;
+}
+
+static void pcache_thread_exit(void *arg)
+{
+    PoolThreadCache *tc = arg;
+    PoolCache *pc = tc->pc;
+
+    pthread_mutex_lock(&pc->lock);
+    depot_release_thread(pc, tc);
+    for (PoolThreadCache **it = &pc->threads; *it != NULL; it = &(*it)->next) {
+        if (*it == tc) {
+            *it = tc->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+    free(tc);
+}
+
+static PoolThreadCache *pcache_get_thread(PoolCache *pc)
+{
+    PoolThreadCache *tc = pthread_getspecific(pc->key);
+    if (tc != NULL) return tc;
+
+    tc = calloc(1, sizeof(PoolThreadCache));
+    if (tc == NULL) {
+        ERROR_PRINT("Cannot allocate thread cache");
+        return NULL;
+    }
+    tc->pc = pc;
+
+    pthread_mutex_lock(&pc->lock);
+    tc->loaded = depot_take(&pc->empty);
+    tc->previous = depot_take(&pc->empty);
+    tc->next = pc->threads;
+    pc->threads = tc;
+    pthread_mutex_unlock(&pc->lock);
+
+    if (tc->loaded == NULL) tc->loaded = pcache_new_magazine(pc);
+    if (tc->previous == NULL) tc->previous = pcache_new_magazine(pc);
+    pthread_setspecific(pc->key, tc);
+
+    if (tc->loaded == NULL || tc->previous == NULL) {
+        pcache_thread_exit(tc);
+        pthread_setspecific(pc->key, NULL);
+        return NULL;
+    }
+
+    DEBUG_PRINT("Thread cache created for pool %p", (void *) pc->pool);
+    return tc;
+}
+
+PoolCache *pcache_init(MemoryPool *mp, size_t mag_size, size_t max_full)
+{
+    if (mp == NULL) {
+        ERROR_PRINT("Uninitialized memory pool");
+        return NULL;
+    }
+
+    PoolCache *pc = calloc(1, sizeof(PoolCache));
+    if (pc == NULL) {
+        ERROR_PRINT("Cannot allocate memory for pool cache");
+        return NULL;
+    }
+
+    if (pthread_key_create(&pc->key, pcache_thread_exit) != 0) {
+        ERROR_PRINT("Cannot create thread key for pool cache");
+        free(pc);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pc->lock, NULL);
+    pc->pool = mp;
+    pc->mag_size = mag_size ? mag_size : PCACHE_DEFAULT_MAG_SIZE;
+    pc->max_full = max_full ? max_full : PCACHE_DEFAULT_MAX_FULL;
+
+    DEBUG_PRINT("Pool cache initialized, magazine size %zu, depot limit %zu",
+                pc->mag_size, pc->max_full);
+    return pc;
+}
+
+void *pcache_malloc(PoolCache *pc)
+{
+    PoolThreadCache *tc = pcache_get_thread(pc);
+    if (tc == NULL) return NULL;
+
+    if (tc->loaded->rounds > 0)
+        return tc->loaded->slots[--tc->loaded->rounds];
+
+    if (tc->previous->rounds > 0) {
+        PoolMagazine *tmp = tc->loaded;
+        tc->loaded = tc->previous;
+        tc->previous = tmp;
+        return tc->loaded->slots[--tc->loaded->rounds];
+    }
+
+    /* Both magazines empty, refill from the depot */
+    pthread_mutex_lock(&pc->lock);
+    PoolMagazine *full = depot_take(&pc->full);
+    if (full != NULL) {
+        pc->full_count--;
+        depot_put(&pc->empty, tc->previous);
+        tc->previous = tc->loaded;
+        tc->loaded = full;
+    } else {
+        depot_fill_from_pool(pc, tc->loaded);
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    if (tc->loaded->rounds == 0) {
+        ERROR_PRINT("Out of Memory");
+        return NULL;
+    }
+    return tc->loaded->slots[--tc->loaded->rounds];
+}
+
+void pcache_free(PoolCache *pc, void *block)
+{
+    if (block == NULL) return;
+    PoolThreadCache *tc = pcache_get_thread(pc);
+    if (tc == NULL) {
+        pthread_mutex_lock(&pc->lock);
+        pool_free(pc->pool, block);
+        pthread_mutex_unlock(&pc->lock);
+        return;
+    }
+
+    if (tc->loaded->rounds < pc->mag_size) {
+        tc->loaded->slots[tc->loaded->rounds++] = block;
+        return;
+    }
+
+    if (tc->previous->rounds == 0) {
+        PoolMagazine *tmp = tc->loaded;
+        tc->loaded = tc->previous;
+        tc->previous = tmp;
+        tc->loaded->slots[tc->loaded->rounds++] = block;
+        return;
+    }
+
+    /* Both magazines full, hand one over to the depot */
+    pthread_mutex_lock(&pc->lock);
+    PoolMagazine *empty = NULL;
+    if (pc->full_count < pc->max_full) {
+        empty = depot_take(&pc->empty);
+        if (empty == NULL)
+            empty = pcache_new_magazine(pc);
+    }
+    if (empty != NULL) {
+        depot_put(&pc->full, tc->previous);
+        pc->full_count++;
+        tc->previous = tc->loaded;
+        tc->loaded = empty;
+    } else {
+        /* Depot is saturated, give the blocks back to the pool */
+        depot_flush_to_pool(pc, tc->previous);
+        PoolMagazine *tmp = tc->loaded;
+        tc->loaded = tc->previous;
+        tc->previous = tmp;
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    tc->loaded->slots[tc->loaded->rounds++] = block;
+}
+
+void pcache_flush_thread(PoolCache *pc)
+{
+    PoolThreadCache *tc = pthread_getspecific(pc->key);
+    if (tc == NULL) return;
+    pcache_thread_exit(tc);
+    pthread_setspecific(pc->key, NULL);
+}
+
+void pcache_destroy(PoolCache *pc)
+{
+    if (pc == NULL) return;
+    pthread_key_delete(pc->key);
+
+    pthread_mutex_lock(&pc->lock);
+    while (pc->threads != NULL) {
+        PoolThreadCache *tc = pc->threads;
+        pc->threads = tc->next;
+        depot_release_thread(pc, tc);
+        free(tc);
+    }
+
+    PoolMagazine *mag;
+    while ((mag = depot_take(&pc->full)) != NULL) {
+        depot_flush_to_pool(pc, mag);
+        free(mag);
+    }
+    while ((mag = depot_take(&pc->empty)) != NULL)
+        free(mag);
+    pthread_mutex_unlock(&pc->lock);
+
+    pthread_mutex_destroy(&pc->lock);
+    free(pc);
+    DEBUG_PRINT("Pool cache destroyed");
+}
@@ -0,0 +1,377 @@
+/******************************************************************************
+ *  pubsub.c
+ *
+ *  Topic based publish/subscribe fan-out without per-subscriber copies.
+ *
+ *  Description:
+ *  A published message is stored once and every subscriber of the topic
+ *  queues a pointer to it.  Connections write straight from the shared
+ *  buffer, so the only per-subscriber work on the plaintext is the TLS
+ *  encryption itself.
+ *   - pubsub_init(): message pool and topic table
+ *   - pubsub_subscriber_new(), pubsub_subscribe(): one per connection
+ *   - pubsub_publish(), pubsub_publish_msg(): fan a message out
+ *   - pubsub_flush(): write a subscriber's queue with a write callback
+ *
+ *  Implementation details:
+ *   - Messages are reference counted blocks of a growable MemoryPool
+ *     behind a PoolCache, so they can be freed on whichever connection
+ *     thread writes them last.  Publishing adds all subscriber references
+ *     with one atomic add and gives back the ones for full queues at the
+ *     end.
+ *   - Each subscriber has a power-of-two ring of message pointers under
+ *     its own mutex.  The flushing thread only holds it to look at the
+ *     head, never while writing.
+ *   - Topics are a short list under a rwlock, publishers only read it.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "pubsub.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <string.h>
+#include <openssl/ssl.h>
+
+#define PUBSUB_SLAB_BLOCKS 64
+
+static size_t pubsub_round_pow2(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+PubSub *pubsub_init(size_t max_message, size_t queue_len)
+{
+    PubSub *ps = calloc(1, sizeof(PubSub));
+    if (ps == NULL) {
+        ERROR_PRINT("Cannot allocate memory for pub/sub");
+        return NULL;
+    }
+
+    ps->max_message = max_message ? max_message : PUBSUB_MAX_MESSAGE;
+    ps->queue_len = pubsub_round_pow2(queue_len ? queue_len : PUBSUB_QUEUE_LEN);
+
+    /* Cache line multiple keeps payloads of neighbouring blocks apart */
+    size_t block_size = (sizeof(PubSubMessage) + ps->max_message + 63) & ~(size_t) 63;
+    MemoryPoolOpts opts = {
+        .slab_blocks = PUBSUB_SLAB_BLOCKS,
+        .max_slabs = 0,
+        .free_slab_watermark = 2,
+        .flags = POOL_GROWABLE,
+    };
+    ps->pool = pool_init_ex(block_size, &opts);
+    ps->cache = ps->pool ? pcache_init(ps->pool, 0, 0) : NULL;
+    if (ps->cache == NULL) {
+        ERROR_PRINT("Cannot create message pool of %zu byte blocks", block_size);
+        pool_destroy(ps->pool);
+        free(ps);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&ps->lock, NULL);
+    DEBUG_PRINT("Pub/sub initialized, messages up to %zu bytes pooled, queue %zu",
+                ps->max_message, ps->queue_len);
+    return ps;
+}
+
+void pubsub_destroy(PubSub *ps)
+{
+    if (ps == NULL) return;
+
+    size_t live = atomic_load(&ps->live);
+    if (live > 0)
+        ERROR_PRINT("Pub/sub destroyed with %zu messages still referenced", live);
+
+    PubSubTopic *t = ps->topics;
+    while (t != NULL) {
+        PubSubTopic *next = t->next;
+        free(t->subs);
+        free(t);
+        t = next;
+    }
+
+    pcache_destroy(ps->cache);
+    pool_destroy(ps->pool);
+    pthread_rwlock_destroy(&ps->lock);
+    free(ps);
+    DEBUG_PRINT("Pub/sub destroyed");
+}
+
+/* Caller holds ps->lock */
+static PubSubTopic *pubsub_find_topic(PubSub *ps, const char *name)
+{
+    for (PubSubTopic *t = ps->topics; t != NULL; t = t->next) {
+        if (strcmp(t->name, name) == 0) return t;
+    }
+    return NULL;
+}
+
+/* Caller holds ps->lock for writing, removes t when it has no subscribers left */
+static void pubsub_remove_sub(PubSub *ps, PubSubTopic *t, PubSubSubscriber *sub)
+{
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->subs[i] == sub) {
+            t->subs[i] = t->subs[--t->count];
+            break;
+        }
+    }
+    if (t->count > 0) return;
+
+    for (PubSubTopic **it = &ps->topics; *it != NULL; it = &(*it)->next) {
+        if (*it == t) {
+            *it = t->next;
+            break;
+        }
+    }
+    free(t->subs);
+    free(t);
+}
+
+PubSubMessage *pubsub_msg_alloc(PubSub *ps, size_t len)
+{
+    PubSubMessage *msg;
+    int pooled = len <= ps->max_message;
+
+    if (pooled) msg = pcache_malloc(ps->cache);
+    else msg = malloc(sizeof(PubSubMessage) + len);
+    if (msg == NULL) {
+        ERROR_PRINT("Cannot allocate message of %zu bytes", len);
+        return NULL;
+    }
+
+    atomic_init(&msg->refs, 1);
+    msg->pooled = (uint32_t) pooled;
+    msg->ps = ps;
+    msg->len = len;
+    atomic_fetch_add_explicit(&ps->live, 1, memory_order_relaxed);
+    return msg;
+}
+
+static void pubsub_msg_put(PubSubMessage *msg, unsigned refs)
+{
+    if (atomic_fetch_sub_explicit(&msg->refs, refs, memory_order_acq_rel) != refs) return;
+
+    PubSub *ps = msg->ps;
+    atomic_fetch_sub_explicit(&ps->live, 1, memory_order_relaxed);
+    if (msg->pooled) pcache_free(ps->cache, msg);
+    else free(msg);
+}
+
+void pubsub_msg_release(PubSubMessage *msg)
+{
+    if (msg != NULL) pubsub_msg_put(msg, 1);
+}
+
+int pubsub_publish_msg(PubSub *ps, const char *topic, PubSubMessage *msg)
+{
+    if (msg == NULL) return -1;
+
+    pthread_rwlock_rdlock(&ps->lock);
+    PubSubTopic *t = pubsub_find_topic(ps, topic);
+    size_t count = t ? t->count : 0;
+    /* Every reference up front, the message may be written before the loop ends */
+    atomic_fetch_add_explicit(&msg->refs, (unsigned) count, memory_order_relaxed);
+
+    unsigned unused = 1;
+    for (size_t i = 0; i < count; i++) {
+        PubSubSubscriber *sub = t->subs[i];
+        pthread_mutex_lock(&sub->lock);
+        if (sub->tail - sub->head > sub->queue_mask) {
+            sub->dropped++;
+            unused++;
+        } else {
+            sub->queue[sub->tail++ & sub->queue_mask] = msg;
+        }
+        pthread_mutex_unlock(&sub->lock);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+
+    atomic_fetch_add_explicit(&ps->published, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ps->queued, count - (unused - 1), memory_order_relaxed);
+    atomic_fetch_add_explicit(&ps->dropped, unused - 1, memory_order_relaxed);
+
+    int queued = (int) (count - (unused - 1));
+    pubsub_msg_put(msg, unused);
+    return queued;
+}
+
+int pubsub_publish(PubSub *ps, const char *topic, const void *data, size_t len)
+{
+    PubSubMessage *msg = pubsub_msg_alloc(ps, len);
+    if (msg == NULL) return -1;
+    memcpy(msg->data, data, len);
+    return pubsub_publish_msg(ps, topic, msg);
+}
+
+PubSubSubscriber *pubsub_subscriber_new(PubSub *ps, void *user)
+{
+    PubSubSubscriber *sub = calloc(1, sizeof(PubSubSubscriber));
+    if (sub != NULL)
+        sub->queue = calloc(ps->queue_len, sizeof(PubSubMessage *));
+    if (sub == NULL || sub->queue == NULL) {
+        ERROR_PRINT("Cannot allocate memory for subscriber");
+        free(sub);
+        return NULL;
+    }
+
+    sub->ps = ps;
+    sub->queue_mask = ps->queue_len - 1;
+    sub->user = user;
+    pthread_mutex_init(&sub->lock, NULL);
+    return sub;
+}
+
+void pubsub_subscriber_free(PubSubSubscriber *sub)
+{
+    if (sub == NULL) return;
+    PubSub *ps = sub->ps;
+
+    /* No publisher can reach the queue after this */
+    pthread_rwlock_wrlock(&ps->lock);
+    PubSubTopic *t = ps->topics;
+    while (t != NULL) {
+        PubSubTopic *next = t->next;
+        pubsub_remove_sub(ps, t, sub);
+        t = next;
+    }
+    pthread_rwlock_unlock(&ps->lock);
+
+    while (sub->head != sub->tail)
+        pubsub_msg_put(sub->queue[sub->head++ & sub->queue_mask], 1);
+
+    pthread_mutex_destroy(&sub->lock);
+    free(sub->queue);
+    free(sub);
+}
+
+int pubsub_subscribe(PubSubSubscriber *sub, const char *topic)
+{
+    PubSub *ps = sub->ps;
+    if (strlen(topic) >= PUBSUB_TOPIC_LEN) {
+        ERROR_PRINT("Topic name %s is too long", topic);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&ps->lock);
+    PubSubTopic *t = pubsub_find_topic(ps, topic);
+    if (t == NULL) {
+        t = calloc(1, sizeof(PubSubTopic));
+        if (t == NULL) {
+            pthread_rwlock_unlock(&ps->lock);
+            ERROR_PRINT("Cannot allocate memory for topic %s", topic);
+            return -1;
+        }
+        strcpy(t->name, topic);
+        t->next = ps->topics;
+        ps->topics = t;
+    }
+
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->subs[i] == sub) {
+            pthread_rwlock_unlock(&ps->lock);
+            return 0;
+        }
+    }
+
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 8;
+        PubSubSubscriber **subs = realloc(t->subs, capacity * sizeof(PubSubSubscriber *));
+        if (subs == NULL) {
+            if (t->count == 0) pubsub_remove_sub(ps, t, sub);
+            pthread_rwlock_unlock(&ps->lock);
+            ERROR_PRINT("Cannot grow subscriber list of topic %s", topic);
+            return -1;
+        }
+        t->subs = subs;
+        t->capacity = capacity;
+    }
+    t->subs[t->count++] = sub;
+    pthread_rwlock_unlock(&ps->lock);
+    return 0;
+}
+
+int pubsub_unsubscribe(PubSubSubscriber *sub, const char *topic)
+{
+    PubSub *ps = sub->ps;
+    pthread_rwlock_wrlock(&ps->lock);
+    PubSubTopic *t = pubsub_find_topic(ps, topic);
+    if (t != NULL) pubsub_remove_sub(ps, t, sub);
+    pthread_rwlock_unlock(&ps->lock);
+    return t != NULL ? 0 : -1;
+}
+
+ssize_t pubsub_flush(PubSubSubscriber *sub, pubsub_write_fn fn, void *ctx)
+{
+    ssize_t total = 0;
+
+    while (1) {
+        pthread_mutex_lock(&sub->lock);
+        PubSubMessage *msg = sub->head != sub->tail ? sub->queue[sub->head & sub->queue_mask] : NULL;
+        pthread_mutex_unlock(&sub->lock);
+        if (msg == NULL) return total;
+
+        /* A retried write gets the same pointer and length as the failed one */
+        while (sub->offset < msg->len) {
+            ssize_t n = fn(ctx, msg->data + sub->offset, msg->len - sub->offset);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return total;
+            if (n < 0) return -1;
+            if (n == 0) return total;
+            sub->offset += (size_t) n;
+            total += n;
+        }
+
+        pthread_mutex_lock(&sub->lock);
+        sub->head++;
+        pthread_mutex_unlock(&sub->lock);
+        sub->offset = 0;
+        pubsub_msg_put(msg, 1);
+    }
+}
+
+size_t pubsub_pending(PubSubSubscriber *sub)
+{
+    pthread_mutex_lock(&sub->lock);
+    size_t n = sub->tail - sub->head;
+    pthread_mutex_unlock(&sub->lock);
+    return n;
+}
+
+ssize_t pubsub_ssl_write(void *ssl, const void *buf, size_t len)
+{
+    size_t written = 0;
+    if (SSL_write_ex((SSL *) ssl, buf, len, &written) == 1)
+        return (ssize_t) written;
+
+    int err = SSL_get_error((SSL *) ssl, 0);
+    errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : EPIPE;
+    return -1;
+}
+
+void pubsub_get_stats(PubSub *ps, PubSubStats *out)
+{
+    out->published = atomic_load_explicit(&ps->published, memory_order_relaxed);
+    out->queued = atomic_load_explicit(&ps->queued, memory_order_relaxed);
+    out->dropped = atomic_load_explicit(&ps->dropped, memory_order_relaxed);
+    out->live = atomic_load_explicit(&ps->live, memory_order_relaxed);
+}
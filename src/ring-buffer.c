@@ -2,9 +2,9 @@
  *  Ring Buffer Implementation
  *  
  *  File: ring-buffer.c
- *  Description: Implements a fixed-size circular buffer (ring buffer) for byte
- *               storage with overwrite support. Supports reading and writing
- *               with wrap-around handling, as well as checking free space and
+ *  Description: Implements a circular buffer (ring buffer) for byte storage
+ *               with overwrite support. Supports reading and writing with
+ *               wrap-around handling, as well as checking free space and
  *               readable data.
  *
  *  Author: Hannu Raappana
@@ -14,6 +14,13 @@
  *  Notes:
  *  - Overwrites old data when the buffer is full.
  *  - Wrap-around handled automatically.
+ *  - Size is chosen at init time and rounded up to a power of two.  Head and
+ *    tail are free-running 64-bit counters indexed with a mask, so the whole
+ *    capacity is usable and head == tail always means empty.
+ *  - rbuf_peek()/rbuf_skip() give access to readable data without copying.
+ *  - rbuf_init_mirrored() maps the storage twice back-to-back, so reads and
+ *    writes never have to be split at the wrap point and the network layer
+ *    can work in place through rbuf_write_ptr()/rbuf_read_ptr().
  *  - Thread-safety is NOT implemented; use appropriate locking if needed.
  *
  *  MIT License
@@ -37,85 +44,181 @@
  *  SOFTWARE.
  ******************************************************************************/
 
+#define _GNU_SOURCE
 #include "ring-buffer.h"
 #include "logging.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-size_t rbuf_readable(RingBuffer *rb)
+#define RBUF_ALIGN 64
+
+static _Atomic uint64_t overwrite_events = 0;
+
+static inline size_t rbuf_readable(RingBuffer *rb)
 {
-    size_t total = sizeof(rb->data);
-    if (rb->head >= rb->tail)
-        return rb->head - rb->tail;
-    else
-        return total - rb->tail + rb->head;
+    return (size_t) (rb->head - rb->tail);
 }
 
-size_t rbuf_free_space(RingBuffer *rb)
+static inline size_t rbuf_free_space(RingBuffer *rb)
 {
-    size_t total = sizeof(rb->data);
-    return total - rbuf_readable(rb);
+    return rb->size - rbuf_readable(rb);
 }
 
 void rbuf_store_data(RingBuffer *rb, uint8_t *src, size_t count)
 {
-    size_t total = sizeof(rb->data);
+    size_t total = rb->size;
+
+    if (count > rbuf_free_space(rb)) {
+        rb->overwrites++;
+        atomic_fetch_add_explicit(&overwrite_events, 1, memory_order_relaxed);
+    }
 
     if (count >= total) {
         src += count - total;
+        rb->tail = rb->head + count - total;
+        rb->head = rb->tail;
         count = total;
-        rb->tail = 0;
-        rb->head = 0;
     }
 
     size_t free = rbuf_free_space(rb);
     if (count > free) {
         size_t over = count - free;
-        rb->tail = (rb->tail + over) % total; 
+        rb->tail += over;
     }
 
-    size_t first = total - rb->head;
+    size_t pos = rb->head & rb->mask;
+    size_t first = rb->mirrored ? total : total - pos;
     if (count > first) {
-        memcpy(rb->data + rb->head, src, first);
+        memcpy(rb->data + pos, src, first);
         memcpy(rb->data, src + first, count - first);
     } else {
-        memcpy(rb->data + rb->head, src, count);
+        memcpy(rb->data + pos, src, count);
     }
 
-    rb->head = (rb->head + count) % total;
-    DEBUG_PRINT("store: tail %zu, head %zu, count %zu", rb->tail, rb->head, count);
+    rb->head += count;
+    DEBUG_PRINT("store: tail %" PRIu64 ", head %" PRIu64 ", count %zu", rb->tail, rb->head, count);
 }
 
 size_t rbuf_pop_data(RingBuffer *rb, uint8_t *dest, size_t count)
 {
-    size_t total = sizeof(rb->data);
+    size_t total = rb->size;
     size_t read = rbuf_readable(rb);
     if (read == 0) {
-        DEBUG_PRINT("Buffer empty, tail %zu, head %zu", rb->tail, rb->head);
+        DEBUG_PRINT("Buffer empty, tail %" PRIu64 ", head %" PRIu64, rb->tail, rb->head);
         return 0;
     }
     if (count > read)
         count = read;
 
-    size_t first = total - rb->tail;
+    size_t pos = rb->tail & rb->mask;
+    size_t first = rb->mirrored ? total : total - pos;
     if (count > first) {
-        memcpy(dest, rb->data + rb->tail, first);
+        memcpy(dest, rb->data + pos, first);
         memcpy(dest + first, rb->data, count - first);
     } else {
-        memcpy(dest, rb->data + rb->tail, count);
+        memcpy(dest, rb->data + pos, count);
     }
 
-    rb->tail = (rb->tail + count) % total;
-    DEBUG_PRINT("pop: tail %zu, head %zu, count %zu", rb->tail, rb->head, count);
+    rb->tail += count;
+    DEBUG_PRINT("pop: tail %" PRIu64 ", head %" PRIu64 ", count %zu", rb->tail, rb->head, count);
+
+    return count;
+}
+
+size_t rbuf_peek(RingBuffer *rb, struct iovec iov[2], int *iovcnt)
+{
+    size_t read = rbuf_readable(rb);
+    size_t pos = rb->tail & rb->mask;
+    size_t first = rb->mirrored ? rb->size : rb->size - pos;
+
+    if (read == 0) {
+        *iovcnt = 0;
+        return 0;
+    }
+
+    iov[0].iov_base = rb->data + pos;
+    if (read > first) {
+        iov[0].iov_len = first;
+        iov[1].iov_base = rb->data;
+        iov[1].iov_len = read - first;
+        *iovcnt = 2;
+    } else {
+        iov[0].iov_len = read;
+        *iovcnt = 1;
+    }
+    return read;
+}
 
+size_t rbuf_skip(RingBuffer *rb, size_t count)
+{
+    size_t read = rbuf_readable(rb);
+    if (count > read)
+        count = read;
+    rb->tail += count;
     return count;
 }
 
+uint8_t *rbuf_write_ptr(RingBuffer *rb, size_t *avail)
+{
+    size_t pos = rb->head & rb->mask;
+    size_t free = rbuf_free_space(rb);
+    if (!rb->mirrored && free > rb->size - pos)
+        free = rb->size - pos;
+    *avail = free;
+    return rb->data + pos;
+}
+
+size_t rbuf_write_iov(RingBuffer *rb, struct iovec iov[2], int *iovcnt)
+{
+    size_t free = rbuf_free_space(rb);
+    size_t first;
+
+    iov[0].iov_base = rbuf_write_ptr(rb, &first);
+    iov[0].iov_len = first;
+    *iovcnt = first ? 1 : 0;
+    if (free > first) {
+        iov[1].iov_base = rb->data;
+        iov[1].iov_len = free - first;
+        *iovcnt = 2;
+    }
+    return free;
+}
+
+void rbuf_commit(RingBuffer *rb, size_t count)
+{
+    size_t free = rbuf_free_space(rb);
+    if (count > free) {
+        ERROR_PRINT("Commit of %zu bytes exceeds free space %zu", count, free);
+        count = free;
+    }
+    rb->head += count;
+}
+
+uint8_t *rbuf_read_ptr(RingBuffer *rb, size_t *avail)
+{
+    size_t pos = rb->tail & rb->mask;
+    size_t read = rbuf_readable(rb);
+    if (!rb->mirrored && read > rb->size - pos)
+        read = rb->size - pos;
+    *avail = read;
+    return rb->data + pos;
+}
+
+void rbuf_consume(RingBuffer *rb, size_t count)
+{
+    rbuf_skip(rb, count);
+}
+
 size_t rbuf_get_buffer_size(RingBuffer *rb)
 {
-    return sizeof(rb->data);
+    return rb->size;
 }
 
 size_t rbuf_get_free_space(RingBuffer *rb)
@@ -123,18 +226,109 @@ size_t rbuf_get_free_space(RingBuffer *rb)
     return rbuf_free_space(rb);
 }
 
-RingBuffer *rbuf_init_buffer(void)
+uint64_t rbuf_get_overwrite_events(void)
+{
+    return atomic_load_explicit(&overwrite_events, memory_order_relaxed);
+}
+
+size_t rbuf_get_readable(RingBuffer *rb)
+{
+    return rbuf_readable(rb);
+}
+
+RingBuffer *rbuf_init_buffer_size(size_t size)
+{
+    if (size == 0) {
+        ERROR_PRINT("Ring buffer size cannot be zero");
+        return NULL;
+    }
+
+    size_t pow2 = RBUF_ALIGN;
+    while (pow2 < size)
+        pow2 <<= 1;
+    if (pow2 != size)
+        DEBUG_PRINT("Ring buffer size %zu rounded up to %zu", size, pow2);
+
+    RingBuffer *buff = malloc(sizeof(RingBuffer));
+    if (buff == NULL) return NULL;
+
+    buff->data = aligned_alloc(RBUF_ALIGN, pow2);
+    if (buff->data == NULL) {
+        ERROR_PRINT("Cannot allocate %zu bytes for ring buffer", pow2);
+        free(buff);
+        return NULL;
+    }
+    buff->size = pow2;
+    buff->mask = pow2 - 1;
+    buff->head = 0;
+    buff->tail = 0;
+    buff->mirrored = 0;
+    buff->overwrites = 0;
+    return buff;
+}
+
+RingBuffer *rbuf_init_mirrored(size_t size)
 {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pow2 = page;
+    while (pow2 < size)
+        pow2 <<= 1;
+
     RingBuffer *buff = malloc(sizeof(RingBuffer));
-    if (buff) {
-        buff->head = 0;
-        buff->tail = 0;
+    if (buff == NULL) return NULL;
+
+    int fd = memfd_create("rbuf", MFD_CLOEXEC);
+    if (fd < 0) {
+        ERROR_PRINT("memfd_create failed, errno %i", errno);
+        free(buff);
+        return NULL;
     }
+    if (ftruncate(fd, (off_t) pow2) < 0) {
+        ERROR_PRINT("Cannot size ring buffer memfd to %zu, errno %i", pow2, errno);
+        goto fail_fd;
+    }
+
+    /* Reserve address space for both copies, then map the file over it */
+    uint8_t *base = mmap(NULL, 2 * pow2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        ERROR_PRINT("Cannot reserve %zu bytes for mirrored ring buffer", 2 * pow2);
+        goto fail_fd;
+    }
+    if (mmap(base, pow2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + pow2, pow2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        ERROR_PRINT("Cannot map mirrored ring buffer, errno %i", errno);
+        munmap(base, 2 * pow2);
+        goto fail_fd;
+    }
+    close(fd);
+
+    buff->data = base;
+    buff->size = pow2;
+    buff->mask = pow2 - 1;
+    buff->head = 0;
+    buff->tail = 0;
+    buff->mirrored = 1;
+    buff->overwrites = 0;
+    DEBUG_PRINT("Mirrored ring buffer of %zu bytes at %p", pow2, (void *) base);
     return buff;
+
+fail_fd:
+    close(fd);
+    free(buff);
+    return NULL;
+}
+
+RingBuffer *rbuf_init_buffer(void)
+{
+    return rbuf_init_buffer_size(BUFFER_SIZE);
 }
 
 void rbuf_free_buffer(RingBuffer *rb)
 {
     if (rb == NULL) return;
+    if (rb->mirrored)
+        munmap(rb->data, 2 * rb->size);
+    else
+        free(rb->data);
     free(rb);
 }
@@ -0,0 +1,431 @@
+/******************************************************************************
+ *  ring-journal.c
+ *
+ *  Persistent RingBuffer journal backed by an mmap()ed file.
+ *
+ *  Description:
+ *  Records are appended into a RingBuffer whose storage is a file, so
+ *  received messages can be journaled at memory speed and replayed after a
+ *  crash.  Like rbuf_store_data(), a full journal overwrites the oldest
+ *  data, but always whole records at a time.
+ *   - rbuf_journal_open(): create or recover a journal file
+ *   - rbuf_journal_append(): add a record, returns its sequence number
+ *   - rbuf_journal_sync(): flush dirty records and the header
+ *   - rbuf_journal_trim(): release records a consumer has processed
+ *   - rbuf_journal_reader_init(), rbuf_journal_next(): iterate records and
+ *     detect records that were overwritten before they were read
+ *   - rbuf_journal_replay(): walk all records, e.g. after a restart
+ *
+ *  Implementation details:
+ *   - File layout is one header page followed by the power-of-two record
+ *     area.  The record area is mapped twice back-to-back like
+ *     rbuf_init_mirrored(), so records are always contiguous in memory.
+ *   - Every record is a 16 byte header (length, CRC32, sequence number)
+ *     followed by the payload, padded to 8 bytes.
+ *   - Sequence numbers are consecutive.  Recovery walks from the tail and
+ *     stops at the first record with a bad CRC or an unexpected sequence,
+ *     which also rejects stale records from the previous lap.
+ *   - Syncing flushes the record pages before the header page, so a synced
+ *     header never points past synced records.  Between syncs the kernel
+ *     may write pages back in any order; unsynced records are lost if they
+ *     are torn, and a torn tail record empties the journal.
+ *   - The batch interval is checked on append, there is no timer thread.
+ *   - Thread-safety is NOT implemented; use appropriate locking if needed.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include "ring-journal.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RJ_ALIGN 8
+#define RJ_REC_SIZE(len) \
+    ((sizeof(RingJournalRecordHeader) + (len) + RJ_ALIGN - 1) & ~(size_t) (RJ_ALIGN - 1))
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t rj_record_crc(uint32_t len, uint64_t seq, const void *payload)
+{
+    uint32_t crc = 0xffffffffU;
+    crc = crc32_update(crc, &len, sizeof(len));
+    crc = crc32_update(crc, &seq, sizeof(seq));
+    crc = crc32_update(crc, payload, len);
+    return crc ^ 0xffffffffU;
+}
+
+static uint64_t rj_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static inline RingJournalRecordHeader *rj_record_at(RingJournal *j, uint64_t pos)
+{
+    return (RingJournalRecordHeader *) (j->rb.data + (pos & j->rb.mask));
+}
+
+static void rj_update_header(RingJournal *j)
+{
+    j->hdr->head = j->rb.head;
+    j->hdr->tail = j->rb.tail;
+}
+
+static void rj_evict_oldest(RingJournal *j)
+{
+    RingJournalRecordHeader *rh = rj_record_at(j, j->rb.tail);
+    rbuf_consume(&j->rb, RJ_REC_SIZE(rh->len));
+    j->hdr->tail_seq++;
+}
+
+static int rj_record_valid(RingJournal *j, uint64_t pos, size_t room)
+{
+    RingJournalRecordHeader *rh = rj_record_at(j, pos);
+    if (sizeof(*rh) > room || RJ_REC_SIZE(rh->len) > room)
+        return 0;
+    return rh->crc == rj_record_crc(rh->len, rh->seq, rh + 1);
+}
+
+/*
+ * The file header and the records live on different pages, and the kernel
+ * may write a full journal's overwritten records back before the header
+ * that moved the tail past them.  Find the oldest intact record in the
+ * ring from such a stale tail, 0 if there is none.
+ */
+static int rj_find_tail(RingJournal *j, uint64_t *tail, uint64_t *tail_seq)
+{
+    size_t size = j->rb.size;
+    uint64_t best_pos = 0, best_seq = UINT64_MAX;
+
+    for (size_t off = RJ_ALIGN; off + sizeof(RingJournalRecordHeader) <= size; off += RJ_ALIGN) {
+        RingJournalRecordHeader *rh = rj_record_at(j, *tail + off);
+        if (rh->seq <= *tail_seq || rh->seq >= best_seq)
+            continue;
+        if (!rj_record_valid(j, *tail + off, size - off))
+            continue;
+        best_pos = *tail + off;
+        best_seq = rh->seq;
+    }
+    if (best_seq == UINT64_MAX)
+        return 0;
+
+    *tail = best_pos;
+    *tail_seq = best_seq;
+    j->hdr->tail_seq = best_seq;
+    return 1;
+}
+
+static void rj_recover(RingJournal *j)
+{
+    uint64_t tail = j->hdr->tail;
+    uint64_t seq = j->hdr->tail_seq;
+    size_t size = j->rb.size;
+
+    if (j->hdr->head != tail && (rj_record_at(j, tail)->seq != seq || !rj_record_valid(j, tail, size))) {
+        uint64_t stale_seq = seq;
+        if (rj_find_tail(j, &tail, &seq))
+            INFO_PRINT("Journal tail moved from record %" PRIu64 " to %" PRIu64 ", header was stale",
+                       stale_seq, seq);
+    }
+
+    uint64_t pos = tail;
+    while (pos - tail + sizeof(RingJournalRecordHeader) <= size) {
+        RingJournalRecordHeader *rh = rj_record_at(j, pos);
+        if (rh->seq != seq || !rj_record_valid(j, pos, size - (pos - tail)))
+            break;
+        pos += RJ_REC_SIZE(rh->len);
+        seq++;
+    }
+
+    if (pos == tail && j->hdr->head != tail)
+        ERROR_PRINT("Journal tail record %" PRIu64 " is damaged, starting empty", j->hdr->tail_seq);
+    else if (pos < j->hdr->head)
+        ERROR_PRINT("Dropped %" PRIu64 " torn bytes from journal end", j->hdr->head - pos);
+
+    j->rb.tail = tail;
+    j->rb.head = pos;
+    j->hdr->head_seq = seq;
+    rj_update_header(j);
+    INFO_PRINT("Journal recovered, records %" PRIu64 "..%" PRIu64, j->hdr->tail_seq, seq);
+}
+
+RingJournal *rbuf_journal_open(const char *path, size_t size, const RingJournalOpts *opts)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pow2 = page;
+    while (pow2 < size)
+        pow2 <<= 1;
+
+    pthread_once(&crc_once, crc32_init_table);
+
+    RingJournal *j = calloc(1, sizeof(RingJournal));
+    if (j == NULL) {
+        ERROR_PRINT("Cannot allocate memory for journal");
+        return NULL;
+    }
+    if (opts) j->opts = *opts;
+
+    j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (j->fd < 0) {
+        ERROR_PRINT("Cannot open journal %s, errno %i", path, errno);
+        free(j);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(j->fd, &st) < 0) {
+        ERROR_PRINT("Cannot stat journal %s, errno %i", path, errno);
+        goto fail_fd;
+    }
+
+    int created = st.st_size == 0;
+    if (created) {
+        if (ftruncate(j->fd, (off_t) (page + pow2)) < 0) {
+            ERROR_PRINT("Cannot size journal to %zu, errno %i", page + pow2, errno);
+            goto fail_fd;
+        }
+    } else {
+        RingJournalHeader fh;
+        if (pread(j->fd, &fh, sizeof(fh), 0) != sizeof(fh) ||
+            fh.magic != RJ_MAGIC || fh.version != RJ_VERSION ||
+            (uint64_t) st.st_size != page + fh.size || (fh.size & (fh.size - 1))) {
+            ERROR_PRINT("%s is not a journal file", path);
+            goto fail_fd;
+        }
+        if (fh.size != pow2)
+            INFO_PRINT("Journal %s keeps its existing size %" PRIu64, path, fh.size);
+        pow2 = fh.size;
+    }
+
+    /* Header page followed by the record area mapped twice */
+    j->map_bytes = page + 2 * pow2;
+    uint8_t *base = mmap(NULL, j->map_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        ERROR_PRINT("Cannot reserve %zu bytes for journal", j->map_bytes);
+        goto fail_fd;
+    }
+    int prot = PROT_READ | PROT_WRITE;
+    if (mmap(base, page, prot, MAP_SHARED | MAP_FIXED, j->fd, 0) == MAP_FAILED ||
+        mmap(base + page, pow2, prot, MAP_SHARED | MAP_FIXED, j->fd, (off_t) page) == MAP_FAILED ||
+        mmap(base + page + pow2, pow2, prot, MAP_SHARED | MAP_FIXED, j->fd, (off_t) page) == MAP_FAILED) {
+        ERROR_PRINT("Cannot map journal, errno %i", errno);
+        munmap(base, j->map_bytes);
+        goto fail_fd;
+    }
+
+    j->hdr = (RingJournalHeader *) base;
+    j->rb.data = base + page;
+    j->rb.size = pow2;
+    j->rb.mask = pow2 - 1;
+    j->rb.mirrored = 1;
+
+    if (created) {
+        memset(j->hdr, 0, sizeof(RingJournalHeader));
+        j->hdr->magic = RJ_MAGIC;
+        j->hdr->version = RJ_VERSION;
+        j->hdr->size = pow2;
+        msync(j->hdr, page, MS_SYNC);
+    } else {
+        rj_recover(j);
+    }
+
+    j->synced_head = j->rb.head;
+    j->last_sync_ms = rj_now_ms();
+    DEBUG_PRINT("Journal %s opened, %zu bytes of records", path, pow2);
+    return j;
+
+fail_fd:
+    close(j->fd);
+    free(j);
+    return NULL;
+}
+
+int rbuf_journal_sync(RingJournal *j)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    int ret = 0;
+
+    if (j->opts.sync_method == RJ_SYNC_FDATASYNC) {
+        ret = fdatasync(j->fd);
+    } else {
+        uint64_t dirty = j->rb.head - j->synced_head;
+        if (dirty >= j->rb.size) {
+            ret = msync(j->rb.data, j->rb.size, MS_SYNC);
+        } else if (dirty > 0) {
+            /* Dirty range is contiguous thanks to the mirrored mapping */
+            uintptr_t start = (uintptr_t) (j->rb.data + (j->synced_head & j->rb.mask));
+            uintptr_t end = start + dirty;
+            start &= ~(uintptr_t) (page - 1);
+            ret = msync((void *) start, end - start, MS_SYNC);
+        }
+        if (ret == 0)
+            ret = msync(j->hdr, page, MS_SYNC);
+    }
+
+    if (ret < 0) {
+        ERROR_PRINT("Journal sync failed, errno %i", errno);
+        return -1;
+    }
+    j->synced_head = j->rb.head;
+    j->pending_records = 0;
+    j->last_sync_ms = rj_now_ms();
+    return 0;
+}
+
+static int rj_sync_due(RingJournal *j)
+{
+    switch (j->opts.durability) {
+    case RJ_DURABILITY_ALWAYS:
+        return 1;
+    case RJ_DURABILITY_BATCH:
+        if (j->opts.batch_records && j->pending_records >= j->opts.batch_records)
+            return 1;
+        if (j->opts.batch_bytes && j->rb.head - j->synced_head >= j->opts.batch_bytes)
+            return 1;
+        if (j->opts.batch_interval_ms &&
+            rj_now_ms() - j->last_sync_ms >= j->opts.batch_interval_ms)
+            return 1;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+int rbuf_journal_append(RingJournal *j, const void *data, size_t len, uint64_t *seq)
+{
+    size_t total = RJ_REC_SIZE(len);
+    if (total > j->rb.size || len > UINT32_MAX) {
+        ERROR_PRINT("Record of %zu bytes does not fit into journal", len);
+        return -1;
+    }
+
+    /* Overwrite whole records so the tail always points at a record header */
+    while (rbuf_get_free_space(&j->rb) < total)
+        rj_evict_oldest(j);
+    j->hdr->tail = j->rb.tail;
+
+    size_t avail;
+    uint8_t *dst = rbuf_write_ptr(&j->rb, &avail);
+    RingJournalRecordHeader *rh = (RingJournalRecordHeader *) dst;
+    rh->len = (uint32_t) len;
+    rh->seq = j->hdr->head_seq;
+    rh->crc = rj_record_crc(rh->len, rh->seq, data);
+    memcpy(rh + 1, data, len);
+    memset(dst + sizeof(*rh) + len, 0, total - sizeof(*rh) - len);
+    rbuf_commit(&j->rb, total);
+
+    if (seq) *seq = rh->seq;
+    j->hdr->head_seq++;
+    j->hdr->head = j->rb.head;
+    j->pending_records++;
+
+    if (rj_sync_due(j))
+        return rbuf_journal_sync(j);
+    return 0;
+}
+
+void rbuf_journal_trim(RingJournal *j, uint64_t seq)
+{
+    while (j->hdr->tail_seq <= seq && rbuf_get_readable(&j->rb) > 0)
+        rj_evict_oldest(j);
+    j->hdr->tail = j->rb.tail;
+}
+
+void rbuf_journal_reader_init(RingJournal *j, RingJournalReader *r)
+{
+    r->pos = j->rb.tail;
+    r->next_seq = j->hdr->tail_seq;
+    r->lost = 0;
+}
+
+int rbuf_journal_next(RingJournal *j, RingJournalReader *r, RingJournalRecord *rec)
+{
+    if (r->next_seq < j->hdr->tail_seq) {
+        r->lost += j->hdr->tail_seq - r->next_seq;
+        r->pos = j->rb.tail;
+        r->next_seq = j->hdr->tail_seq;
+        return RJ_OVERWRITTEN;
+    }
+    if (r->pos == j->rb.head)
+        return 0;
+
+    RingJournalRecordHeader *rh = rj_record_at(j, r->pos);
+    rec->seq = rh->seq;
+    rec->data = rh + 1;
+    rec->len = rh->len;
+    r->pos += RJ_REC_SIZE(rh->len);
+    r->next_seq = rh->seq + 1;
+    return 1;
+}
+
+size_t rbuf_journal_replay(RingJournal *j, void (*cb)(const RingJournalRecord *, void *), void *arg)
+{
+    RingJournalReader r;
+    RingJournalRecord rec;
+    size_t count = 0;
+
+    rbuf_journal_reader_init(j, &r);
+    while (rbuf_journal_next(j, &r, &rec) == 1) {
+        cb(&rec, arg);
+        count++;
+    }
+    return count;
+}
+
+void rbuf_journal_close(RingJournal *j)
+{
+    if (j == NULL) return;
+    if (j->opts.durability != RJ_DURABILITY_NONE)
+        rbuf_journal_sync(j);
+    munmap(j->hdr, j->map_bytes);
+    close(j->fd);
+    free(j);
+}
@@ -1,14 +1,85 @@
 #include "session.h"
 #include "logging.h"
+#include "tls-trace.h"
 #include "whitelist.h"
 
+#include <pthread.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+
+/*
+ * ALLOWED_PUBKEYS parsed once, followed by keys added at runtime with
+ * TLS_whitelist_add_pubkey().  Parsing PEM on every handshake cost more
+ * than the comparison itself.
+ */
+static EVP_PKEY *whitelist_keys[SESSION_MAX_PUBKEYS];
+static int whitelist_static = 0;
+static int whitelist_count = 0;
+static pthread_rwlock_t whitelist_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t whitelist_once = PTHREAD_ONCE_INIT;
+
+static void session_whitelist_load(void)
+{
+    int whitelist_s = sizeof(ALLOWED_PUBKEYS) / sizeof(ALLOWED_PUBKEYS[0]);
+
+    pthread_rwlock_wrlock(&whitelist_lock);
+    for (int i = 0; i < whitelist_s && whitelist_count < SESSION_MAX_PUBKEYS; i++) {
+        BIO *bio = BIO_new_mem_buf(ALLOWED_PUBKEYS[i], -1);
+        EVP_PKEY *allowed_pub = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+        if (allowed_pub) whitelist_keys[whitelist_count++] = allowed_pub;
+    }
+    /* Placeholder entries don't parse, that is fine */
+    ERR_clear_error();
+    whitelist_static = whitelist_count;
+    pthread_rwlock_unlock(&whitelist_lock);
+}
+
+static int session_whitelist_contains(EVP_PKEY *pubkey)
+{
+    int allowed = 0;
+
+    pthread_once(&whitelist_once, session_whitelist_load);
+    pthread_rwlock_rdlock(&whitelist_lock);
+    for (int i = 0; i < whitelist_count && !allowed; i++)
+        allowed = EVP_PKEY_eq(pubkey, whitelist_keys[i]) == 1;
+    pthread_rwlock_unlock(&whitelist_lock);
+    return allowed;
+}
+
+int TLS_whitelist_add_pubkey(EVP_PKEY *pubkey)
+{
+    if (pubkey == NULL) return -1;
+    pthread_once(&whitelist_once, session_whitelist_load);
+
+    pthread_rwlock_wrlock(&whitelist_lock);
+    if (whitelist_count == SESSION_MAX_PUBKEYS || !EVP_PKEY_up_ref(pubkey)) {
+        pthread_rwlock_unlock(&whitelist_lock);
+        ERROR_PRINT("Cannot add public key to whitelist");
+        return -1;
+    }
+    whitelist_keys[whitelist_count++] = pubkey;
+    pthread_rwlock_unlock(&whitelist_lock);
+    return 0;
+}
+
+void TLS_whitelist_clear(void)
+{
+    pthread_once(&whitelist_once, session_whitelist_load);
+
+    pthread_rwlock_wrlock(&whitelist_lock);
+    while (whitelist_count > whitelist_static)
+        EVP_PKEY_free(whitelist_keys[--whitelist_count]);
+    pthread_rwlock_unlock(&whitelist_lock);
+}
+
 /**
  * Session handler for TLS handshake
  * 
  * Allow only whitelisted clients
  * 
  */
-static int session_handler(int preverify_ok, X509_STORE_CTX *ctx)
+static int session_verify(int preverify_ok, X509_STORE_CTX *ctx)
 {
     int depth = X509_STORE_CTX_get_error_depth(ctx);
     X509 *cert = X509_STORE_CTX_get_current_cert(ctx);
@@ -24,7 +95,7 @@ static int session_handler(int preverify_ok, X509_STORE_CTX *ctx)
     if (depth == 0 && cert) {
         char subject[256];
         X509_NAME_oneline(X509_get_subject_name(cert), subject, sizeof(subject));
-        INFO_PRINT("Client cert subject: %s\n", subject);
+        DEBUG_PRINT("Client cert subject: %s", subject);
 
         // CN whitelist
         if (strstr(subject, ALLOWED_CN) == NULL) {
@@ -35,24 +106,7 @@ static int session_handler(int preverify_ok, X509_STORE_CTX *ctx)
         EVP_PKEY *pubkey = X509_get_pubkey(cert);
         if (!pubkey) return 0;
 
-        int allowed = 0;
-        int whitelist_s = sizeof(ALLOWED_PUBKEYS) / sizeof(ALLOWED_PUBKEYS[0]);
-        for (int i = 0; i<whitelist_s; i++) {
-            BIO *bio = BIO_new_mem_buf(ALLOWED_PUBKEYS[i], -1);
-            EVP_PKEY *allowed_pub = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
-            BIO_free(bio);
-
-            if (!allowed_pub) continue;
-
-            if (EVP_PKEY_eq(pubkey, allowed_pub) == 1) {
-                allowed = 1;
-                EVP_PKEY_free(allowed_pub);
-                break;
-            }
-
-            EVP_PKEY_free(allowed_pub);
-        }
-
+        int allowed = session_whitelist_contains(pubkey);
         EVP_PKEY_free(pubkey);
 
         if (!allowed) {
@@ -60,12 +114,22 @@ static int session_handler(int preverify_ok, X509_STORE_CTX *ctx)
             return 0;
         }
 
-        INFO_PRINT("Client public key verified");
+        DEBUG_PRINT("Client public key verified");
     }
 
     return 1;
 }
 
+static int session_handler(int preverify_ok, X509_STORE_CTX *ctx)
+{
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+
+    TLS_trace_mark(ssl, "session_handler", 1);
+    int ret = session_verify(preverify_ok, ctx);
+    TLS_trace_mark(ssl, "session_handler", 0);
+    return ret;
+}
+
 void TLS_set_session_cache_mode(TLSConnection **tls, void *cache_id, unsigned int id_size)
 {
     if (!tls || !*tls) return;
@@ -114,3 +178,16 @@ int TLS_server_set_client_verification(TLSConnection **tls, const bool verificat
     
     return ret;
 }
+
+int TLS_server_trust_client_cert(TLSConnection **tls, X509 *cert)
+{
+    if (tls == NULL || *tls == NULL || cert == NULL) return -1;
+
+    X509_STORE *store = SSL_CTX_get_cert_store((*tls)->ctx);
+    if (X509_STORE_add_cert(store, cert) != 1) {
+        ERROR_PRINT("Cannot add client certificate to trust store");
+        return -1;
+    }
+    SSL_CTX_set_verify((*tls)->ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, session_handler);
+    return 1;
+}
@@ -0,0 +1,396 @@
+/******************************************************************************
+ *  sha256-mb.c
+ *
+ *  Multi-buffer SHA-256 kernels.
+ *
+ *  Description:
+ *  Hashing thousands of small messages through EVP spends most of the time
+ *  in per-call overhead and leaves the SIMD units idle.  These kernels hash
+ *  many independent messages in one call:
+ *   - sha256_mb_shani(): SHA-NI instructions, two messages interleaved
+ *   - sha256_mb_avx2(): eight messages at once, one per 32-bit lane
+ *   - sha256_mb_have_*(): runtime CPU feature checks
+ *
+ *  Implementation details:
+ *   - Kernels are compiled with target attributes, so the file builds with
+ *     the default flags and the caller picks a kernel after checking CPUID.
+ *   - Each message is split into its full 64 byte blocks, read in place,
+ *     and one or two padded tail blocks built on the stack.
+ *   - Both kernels run the same lane scheduler: when a lane finishes its
+ *     message the digest is written out and the next message is loaded
+ *     into that lane, so different lengths don't stall the others.  Idle
+ *     lanes at the end hash a dummy block whose result is discarded.
+ *   - SHA-NI rounds are latency bound, interleaving two messages nearly
+ *     doubles throughput over hashing them one after another.
+ *   - Message words are loaded with an 8x8 transpose instead of gathers.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "sha256-mb.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_MB_X86 1
+#else
+#define SHA256_MB_X86 0
+#endif
+
+#define SHA256_BLOCK 64
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t IV256[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* Padded last block(s) of a message */
+typedef struct SHA256_TAIL_T {
+    size_t full_blocks;
+    size_t tail_blocks;
+    uint8_t tail[2 * SHA256_BLOCK];
+} SHA256Tail;
+
+static void sha256_prepare_tail(SHA256Tail *t, const unsigned char *msg, size_t len)
+{
+    size_t rem = len % SHA256_BLOCK;
+    uint64_t bits = (uint64_t) len * 8;
+
+    t->full_blocks = len / SHA256_BLOCK;
+    t->tail_blocks = rem < SHA256_BLOCK - 8 ? 1 : 2;
+    memset(t->tail, 0, sizeof(t->tail));
+    if (rem) memcpy(t->tail, msg + t->full_blocks * SHA256_BLOCK, rem);
+    t->tail[rem] = 0x80;
+
+    uint8_t *end = t->tail + t->tail_blocks * SHA256_BLOCK;
+    for (int i = 1; i <= 8; i++) {
+        end[-i] = (uint8_t) bits;
+        bits >>= 8;
+    }
+}
+
+static void sha256_store_digest(const uint32_t state[8], unsigned char *out)
+{
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char) (state[i] >> 24);
+        out[4 * i + 1] = (unsigned char) (state[i] >> 16);
+        out[4 * i + 2] = (unsigned char) (state[i] >> 8);
+        out[4 * i + 3] = (unsigned char) state[i];
+    }
+}
+
+#if SHA256_MB_X86
+
+int sha256_mb_have_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx & (1U << 29)) && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+}
+
+int sha256_mb_have_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * Lane scheduler shared by the kernels.  A kernel hashes one block in each
+ * of its lanes per step; finished lanes are refilled with the next message.
+ */
+typedef struct SHA256_LANE_T {
+    const unsigned char *msg;
+    size_t index;
+    size_t next;
+    int active;
+    SHA256Tail t;
+} SHA256Lane;
+
+typedef struct SHA256_KERNEL_T {
+    int lanes;
+    void (*init)(void *state, int lane);
+    void (*step)(void *state, const uint8_t *const blocks[]);
+    void (*final)(void *state, int lane, unsigned char *out);
+} SHA256Kernel;
+
+static void sha256_mb_run(const SHA256Kernel *k, void *state, const unsigned char *const msgs[],
+                          const size_t lens[], size_t count, unsigned char *out)
+{
+    static const uint8_t dummy[SHA256_BLOCK];
+    SHA256Lane lanes[SHA256_MB_LANES];
+    const uint8_t *blocks[SHA256_MB_LANES];
+    size_t next_msg = 0;
+    int active = 0;
+
+    for (int j = 0; j < k->lanes; j++) {
+        lanes[j].active = 0;
+        if (next_msg < count) {
+            SHA256Lane *l = &lanes[j];
+            l->msg = msgs[next_msg];
+            l->index = next_msg;
+            l->next = 0;
+            l->active = 1;
+            sha256_prepare_tail(&l->t, msgs[next_msg], lens[next_msg]);
+            k->init(state, j);
+            next_msg++;
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        for (int j = 0; j < k->lanes; j++) {
+            SHA256Lane *l = &lanes[j];
+            if (!l->active)
+                blocks[j] = dummy;
+            else if (l->next < l->t.full_blocks)
+                blocks[j] = l->msg + l->next * SHA256_BLOCK;
+            else
+                blocks[j] = l->t.tail + (l->next - l->t.full_blocks) * SHA256_BLOCK;
+        }
+
+        k->step(state, blocks);
+
+        for (int j = 0; j < k->lanes; j++) {
+            SHA256Lane *l = &lanes[j];
+            if (!l->active || ++l->next < l->t.full_blocks + l->t.tail_blocks)
+                continue;
+
+            k->final(state, j, out + 32 * l->index);
+            if (next_msg < count) {
+                l->msg = msgs[next_msg];
+                l->index = next_msg;
+                l->next = 0;
+                sha256_prepare_tail(&l->t, msgs[next_msg], lens[next_msg]);
+                k->init(state, j);
+                next_msg++;
+            } else {
+                l->active = 0;
+                active--;
+            }
+        }
+    }
+}
+
+/*
+ * SHA-NI, two lanes.  sha256rnds2 is latency bound, so two independent
+ * messages run almost as fast as one.  State is kept as ABEF/CDGH pairs.
+ */
+#define SHANI_LANES 2
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani_init(void *state, int lane)
+{
+    __m128i (*st)[2] = state;
+    st[lane][0] = _mm_set_epi32((int) IV256[0], (int) IV256[1], (int) IV256[4], (int) IV256[5]);
+    st[lane][1] = _mm_set_epi32((int) IV256[2], (int) IV256[3], (int) IV256[6], (int) IV256[7]);
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani_step(void *state, const uint8_t *const blocks[])
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i (*st)[2] = state;
+    __m128i abef[SHANI_LANES], cdgh[SHANI_LANES], w[SHANI_LANES][4];
+
+    for (int l = 0; l < SHANI_LANES; l++) {
+        abef[l] = st[l][0];
+        cdgh[l] = st[l][1];
+    }
+
+#pragma GCC unroll 16
+    for (int i = 0; i < 16; i++) {
+        __m128i k = _mm_loadu_si128((const __m128i *) &K256[4 * i]);
+#pragma GCC unroll 2
+        for (int l = 0; l < SHANI_LANES; l++) {
+            if (i < 4) {
+                w[l][i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (blocks[l] + 16 * i)), bswap);
+            } else {
+                __m128i x = _mm_sha256msg1_epu32(w[l][i & 3], w[l][(i + 1) & 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[l][(i + 3) & 3], w[l][(i + 2) & 3], 4));
+                w[l][i & 3] = _mm_sha256msg2_epu32(x, w[l][(i + 3) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(w[l][i & 3], k);
+            cdgh[l] = _mm_sha256rnds2_epu32(cdgh[l], abef[l], msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            abef[l] = _mm_sha256rnds2_epu32(abef[l], cdgh[l], msg);
+        }
+    }
+
+    for (int l = 0; l < SHANI_LANES; l++) {
+        st[l][0] = _mm_add_epi32(st[l][0], abef[l]);
+        st[l][1] = _mm_add_epi32(st[l][1], cdgh[l]);
+    }
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani_final(void *state, int lane, unsigned char *out)
+{
+    __m128i (*st)[2] = state;
+    uint32_t words[8];
+
+    __m128i tmp = _mm_shuffle_epi32(st[lane][0], 0x1b);         /* FEBA */
+    __m128i cdgh = _mm_shuffle_epi32(st[lane][1], 0xb1);        /* DCHG */
+    _mm_storeu_si128((__m128i *) &words[0], _mm_blend_epi16(tmp, cdgh, 0xf0));  /* DCBA */
+    _mm_storeu_si128((__m128i *) &words[4], _mm_alignr_epi8(cdgh, tmp, 8));     /* HGFE */
+    sha256_store_digest(words, out);
+}
+
+void sha256_mb_shani(const unsigned char *const msgs[], const size_t lens[],
+                     size_t count, unsigned char *out)
+{
+    static const SHA256Kernel kernel = {
+        SHANI_LANES, sha256_shani_init, sha256_shani_step, sha256_shani_final,
+    };
+    __m128i state[SHANI_LANES][2];
+    sha256_mb_run(&kernel, state, msgs, lens, count, out);
+}
+
+/*
+ * AVX2, 8 lanes
+ */
+#define V_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define V_XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256((a), (b)), (c))
+#define V_ADD(a, b) _mm256_add_epi32((a), (b))
+#define V_S0(a) V_XOR3(V_ROTR((a), 2), V_ROTR((a), 13), V_ROTR((a), 22))
+#define V_S1(e) V_XOR3(V_ROTR((e), 6), V_ROTR((e), 11), V_ROTR((e), 25))
+#define V_s0(w) V_XOR3(V_ROTR((w), 7), V_ROTR((w), 18), _mm256_srli_epi32((w), 3))
+#define V_s1(w) V_XOR3(V_ROTR((w), 17), V_ROTR((w), 19), _mm256_srli_epi32((w), 10))
+#define V_CH(e, f, g) _mm256_xor_si256(_mm256_and_si256((e), (f)), _mm256_andnot_si256((e), (g)))
+#define V_MAJ(a, b, c) _mm256_or_si256(_mm256_and_si256((a), (b)), \
+                                       _mm256_and_si256((c), _mm256_or_si256((a), (b))))
+
+/* Word i of all 8 blocks, byte swapped, in w[i] for i = off..off+7 */
+__attribute__((target("avx2")))
+static void sha256_avx2_load8(__m256i *w, const uint8_t *const blocks[8], int off)
+{
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i r[8], t[8], u[8];
+
+    for (int j = 0; j < 8; j++)
+        r[j] = _mm256_loadu_si256((const __m256i *) (blocks[j] + 4 * off));
+    for (int j = 0; j < 8; j += 2) {
+        t[j] = _mm256_unpacklo_epi32(r[j], r[j + 1]);
+        t[j + 1] = _mm256_unpackhi_epi32(r[j], r[j + 1]);
+    }
+    for (int j = 0; j < 8; j += 4) {
+        u[j] = _mm256_unpacklo_epi64(t[j], t[j + 2]);
+        u[j + 1] = _mm256_unpackhi_epi64(t[j], t[j + 2]);
+        u[j + 2] = _mm256_unpacklo_epi64(t[j + 1], t[j + 3]);
+        u[j + 3] = _mm256_unpackhi_epi64(t[j + 1], t[j + 3]);
+    }
+    for (int j = 0; j < 4; j++) {
+        w[off + j] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[j], u[j + 4], 0x20), bswap);
+        w[off + j + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[j], u[j + 4], 0x31), bswap);
+    }
+}
+
+/* state is uint32_t[word][lane] */
+__attribute__((target("avx2")))
+static void sha256_avx2_step(void *state, const uint8_t *const blocks[])
+{
+    uint32_t (*st)[SHA256_MB_LANES] = state;
+    __m256i w[16];
+    __m256i s[8], v[8];
+
+    sha256_avx2_load8(w, blocks, 0);
+    sha256_avx2_load8(w, blocks, 8);
+    for (int i = 0; i < 8; i++)
+        s[i] = v[i] = _mm256_loadu_si256((const __m256i *) st[i]);
+
+#pragma GCC unroll 64
+    for (int t = 0; t < 64; t++) {
+        if (t >= 16)
+            w[t & 15] = V_ADD(V_ADD(V_s1(w[(t - 2) & 15]), w[(t - 7) & 15]),
+                              V_ADD(V_s0(w[(t - 15) & 15]), w[t & 15]));
+
+        /* Registers rotate by renaming: lane word i of round t lives in v[(i - t) & 7] */
+        __m256i *a = &v[(0 - t) & 7], *b = &v[(1 - t) & 7], *c = &v[(2 - t) & 7];
+        __m256i *d = &v[(3 - t) & 7], *e = &v[(4 - t) & 7], *f = &v[(5 - t) & 7];
+        __m256i *g = &v[(6 - t) & 7], *h = &v[(7 - t) & 7];
+        __m256i t1 = V_ADD(V_ADD(*h, V_S1(*e)),
+                           V_ADD(V_CH(*e, *f, *g),
+                                 V_ADD(_mm256_set1_epi32((int) K256[t]), w[t & 15])));
+        __m256i t2 = V_ADD(V_S0(*a), V_MAJ(*a, *b, *c));
+        *d = V_ADD(*d, t1);
+        *h = V_ADD(t1, t2);
+    }
+
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *) st[i], V_ADD(s[i], v[i]));
+}
+
+static void sha256_avx2_init(void *state, int lane)
+{
+    uint32_t (*st)[SHA256_MB_LANES] = state;
+    for (int i = 0; i < 8; i++)
+        st[i][lane] = IV256[i];
+}
+
+static void sha256_avx2_final(void *state, int lane, unsigned char *out)
+{
+    uint32_t (*st)[SHA256_MB_LANES] = state;
+    uint32_t words[8];
+    for (int i = 0; i < 8; i++)
+        words[i] = st[i][lane];
+    sha256_store_digest(words, out);
+}
+
+void sha256_mb_avx2(const unsigned char *const msgs[], const size_t lens[],
+                    size_t count, unsigned char *out)
+{
+    static const SHA256Kernel kernel = {
+        SHA256_MB_LANES, sha256_avx2_init, sha256_avx2_step, sha256_avx2_final,
+    };
+    _Alignas(32) uint32_t state[8][SHA256_MB_LANES];
+    sha256_mb_run(&kernel, state, msgs, lens, count, out);
+}
+
+#else
+
+int sha256_mb_have_shani(void) { return 0; }
+int sha256_mb_have_avx2(void) { return 0; }
+
+void sha256_mb_shani(const unsigned char *const msgs[], const size_t lens[],
+                     size_t count, unsigned char *out)
+{
+    (void) msgs; (void) lens; (void) count; (void) out;
+}
+
+void sha256_mb_avx2(const unsigned char *const msgs[], const size_t lens[],
+                    size_t count, unsigned char *out)
+{
+    (void) msgs; (void) lens; (void) count; (void) out;
+}
+
+#endif
@@ -0,0 +1,283 @@
+/******************************************************************************
+ *  size-class.c
+ *
+ *  General purpose size-class allocator built from MemoryPools.
+ *
+ *  Description:
+ *  Requests are rounded up to a power-of-two class between 32 bytes and
+ *  4 KiB, each class being a growable MemoryPool behind a PoolCache.
+ *  Anything larger falls back to malloc.
+ *   - sc_init(): create the allocator and its class pools
+ *   - sc_malloc(), sc_realloc(), sc_free(): malloc compatible front end
+ *   - sc_get_stats(), sc_dump_stats(): per-class statistics
+ *   - sc_install_openssl(): route OpenSSL allocations through it
+ *
+ *  Implementation details:
+ *   - Every allocation carries a 16 byte header with its class and the
+ *     requested size, so free and realloc don't need the size and the
+ *     returned pointer keeps 16 byte alignment.
+ *   - The common path is a thread-local magazine pop/push, the pools are
+ *     only touched under the PoolCache depot lock.
+ *   - Statistics are relaxed atomic counters.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "size-class.h"
+#include "logging.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <openssl/crypto.h>
+
+#define SC_MAGIC 0x5c5c5c5cU
+#define SC_LARGE UINT32_MAX
+
+typedef struct SC_HDR_T {
+    uint32_t cls;
+    uint32_t magic;
+    size_t size;
+} SizeClassHeader;
+
+_Static_assert(sizeof(SizeClassHeader) == SC_HEADER_SIZE, "size class header must keep 16 byte alignment");
+
+static SizeClassAllocator *openssl_sc = NULL;
+
+static inline int sc_class_index(size_t total)
+{
+    if (total <= (1UL << SC_MIN_SHIFT)) return 0;
+    int shift = 64 - __builtin_clzll((unsigned long long) (total - 1));
+    if (shift > SC_MAX_SHIFT) return -1;
+    return shift - SC_MIN_SHIFT;
+}
+
+static inline SizeClassHeader *sc_header(void *ptr)
+{
+    return (SizeClassHeader *) ((char *) ptr - SC_HEADER_SIZE);
+}
+
+SizeClassAllocator *sc_init(void)
+{
+    SizeClassAllocator *sc = calloc(1, sizeof(SizeClassAllocator));
+    if (sc == NULL) {
+        ERROR_PRINT("Cannot allocate memory for size-class allocator");
+        return NULL;
+    }
+
+    for (int i = 0; i < SC_CLASS_COUNT; i++) {
+        SizeClass *c = &sc->classes[i];
+        c->block_size = 1UL << (SC_MIN_SHIFT + i);
+
+        MemoryPoolOpts opts = {
+            .slab_blocks = SC_SLAB_BYTES / c->block_size,
+            .max_slabs = 0,
+            .free_slab_watermark = 2,
+            .flags = POOL_GROWABLE,
+        };
+        c->pool = pool_init_ex(c->block_size, &opts);
+        c->cache = c->pool ? pcache_init(c->pool, 0, 0) : NULL;
+        if (c->cache == NULL) {
+            ERROR_PRINT("Cannot create pool for size class %zu", c->block_size);
+            pool_destroy(c->pool);
+            c->pool = NULL;
+            sc_destroy(sc);
+            return NULL;
+        }
+    }
+
+    DEBUG_PRINT("Size-class allocator initialized, %i classes %lu..%lu bytes",
+                SC_CLASS_COUNT, 1UL << SC_MIN_SHIFT, 1UL << SC_MAX_SHIFT);
+    return sc;
+}
+
+void *sc_malloc(SizeClassAllocator *sc, size_t size)
+{
+    SizeClassHeader *hdr;
+    int idx = sc_class_index(size + SC_HEADER_SIZE);
+
+    if (idx < 0) {
+        hdr = malloc(size + SC_HEADER_SIZE);
+        if (hdr == NULL) return NULL;
+        hdr->cls = SC_LARGE;
+        atomic_fetch_add_explicit(&sc->large_allocs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&sc->large_requested, size, memory_order_relaxed);
+    } else {
+        SizeClass *c = &sc->classes[idx];
+        hdr = pcache_malloc(c->cache);
+        if (hdr == NULL) return NULL;
+        hdr->cls = (uint32_t) idx;
+        atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->requested, size, memory_order_relaxed);
+    }
+
+    hdr->magic = SC_MAGIC;
+    hdr->size = size;
+    return (char *) hdr + SC_HEADER_SIZE;
+}
+
+void sc_free(SizeClassAllocator *sc, void *ptr)
+{
+    if (ptr == NULL) return;
+
+    SizeClassHeader *hdr = sc_header(ptr);
+    if (hdr->magic != SC_MAGIC) {
+        ERROR_PRINT("Pointer %p was not allocated by size-class allocator", ptr);
+        return;
+    }
+    hdr->magic = 0;
+
+    if (hdr->cls == SC_LARGE) {
+        atomic_fetch_add_explicit(&sc->large_frees, 1, memory_order_relaxed);
+        free(hdr);
+        return;
+    }
+
+    SizeClass *c = &sc->classes[hdr->cls];
+    atomic_fetch_add_explicit(&c->frees, 1, memory_order_relaxed);
+    pcache_free(c->cache, hdr);
+}
+
+void *sc_realloc(SizeClassAllocator *sc, void *ptr, size_t size)
+{
+    if (ptr == NULL) return sc_malloc(sc, size);
+    if (size == 0) {
+        sc_free(sc, ptr);
+        return NULL;
+    }
+
+    SizeClassHeader *hdr = sc_header(ptr);
+    if (hdr->magic != SC_MAGIC) {
+        ERROR_PRINT("Pointer %p was not allocated by size-class allocator", ptr);
+        return NULL;
+    }
+
+    /* Still fits into the same class */
+    if (hdr->cls != SC_LARGE && sc_class_index(size + SC_HEADER_SIZE) == (int) hdr->cls) {
+        hdr->size = size;
+        return ptr;
+    }
+
+    void *new_ptr = sc_malloc(sc, size);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, hdr->size < size ? hdr->size : size);
+    sc_free(sc, ptr);
+    return new_ptr;
+}
+
+size_t sc_get_stats(SizeClassAllocator *sc, SizeClassStats *out, size_t max)
+{
+    size_t n = 0;
+    for (int i = 0; i < SC_CLASS_COUNT && n < max; i++, n++) {
+        SizeClass *c = &sc->classes[i];
+        out[n].block_size = c->block_size;
+        out[n].allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+        out[n].frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+        out[n].live = out[n].allocs - out[n].frees;
+        out[n].requested = atomic_load_explicit(&c->requested, memory_order_relaxed);
+
+        pthread_mutex_lock(&c->cache->lock);
+        out[n].pool_blocks = c->pool->total_blocks;
+        out[n].pool_free = c->pool->free_count;
+        pthread_mutex_unlock(&c->cache->lock);
+    }
+
+    if (n < max) {
+        out[n].block_size = 0;
+        out[n].allocs = atomic_load_explicit(&sc->large_allocs, memory_order_relaxed);
+        out[n].frees = atomic_load_explicit(&sc->large_frees, memory_order_relaxed);
+        out[n].live = out[n].allocs - out[n].frees;
+        out[n].requested = atomic_load_explicit(&sc->large_requested, memory_order_relaxed);
+        out[n].pool_blocks = 0;
+        out[n].pool_free = 0;
+        n++;
+    }
+    return n;
+}
+
+void sc_dump_stats(SizeClassAllocator *sc, FILE *out)
+{
+    SizeClassStats stats[SC_CLASS_COUNT + 1];
+    size_t n = sc_get_stats(sc, stats, SC_CLASS_COUNT + 1);
+
+    fprintf(out, "%8s %12s %12s %10s %14s %10s %10s\n",
+            "class", "allocs", "frees", "live", "requested", "blocks", "pool-free");
+    for (size_t i = 0; i < n; i++) {
+        char name[24];
+        if (stats[i].block_size) snprintf(name, sizeof(name), "%zu", stats[i].block_size);
+        else snprintf(name, sizeof(name), "large");
+        fprintf(out, "%8s %12zu %12zu %10zu %14zu %10zu %10zu\n", name,
+                stats[i].allocs, stats[i].frees, stats[i].live, stats[i].requested,
+                stats[i].pool_blocks, stats[i].pool_free);
+    }
+}
+
+void sc_destroy(SizeClassAllocator *sc)
+{
+    if (sc == NULL) return;
+    if (sc == openssl_sc) {
+        ERROR_PRINT("Allocator is installed into OpenSSL and cannot be destroyed");
+        return;
+    }
+
+    for (int i = 0; i < SC_CLASS_COUNT; i++) {
+        pcache_destroy(sc->classes[i].cache);
+        pool_destroy(sc->classes[i].pool);
+    }
+    free(sc);
+    DEBUG_PRINT("Size-class allocator destroyed");
+}
+
+static void *sc_crypto_malloc(size_t num, __attribute__((__unused__)) const char *file,
+                              __attribute__((__unused__)) int line)
+{
+    return sc_malloc(openssl_sc, num);
+}
+
+static void *sc_crypto_realloc(void *ptr, size_t num, __attribute__((__unused__)) const char *file,
+                               __attribute__((__unused__)) int line)
+{
+    return sc_realloc(openssl_sc, ptr, num);
+}
+
+static void sc_crypto_free(void *ptr, __attribute__((__unused__)) const char *file,
+                           __attribute__((__unused__)) int line)
+{
+    sc_free(openssl_sc, ptr);
+}
+
+int sc_install_openssl(SizeClassAllocator *sc)
+{
+    if (sc == NULL) return -1;
+    if (openssl_sc != NULL) {
+        ERROR_PRINT("OpenSSL allocator already installed");
+        return -1;
+    }
+
+    openssl_sc = sc;
+    if (!CRYPTO_set_mem_functions(sc_crypto_malloc, sc_crypto_realloc, sc_crypto_free)) {
+        ERROR_PRINT("OpenSSL has already allocated memory, install the allocator before SSL_CTX_new()");
+        openssl_sc = NULL;
+        return -1;
+    }
+
+    INFO_PRINT("OpenSSL allocations now go through size-class allocator");
+    return 0;
+}
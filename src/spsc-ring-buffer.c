@@ -0,0 +1,195 @@
+/******************************************************************************
+ *  spsc-ring-buffer.c
+ *
+ *  Lock-free single-producer/single-consumer mode for the ring buffer.
+ *
+ *  Description:
+ *  Lets an I/O thread hand bytes to a worker thread without a mutex:
+ *   - rbuf_spsc_init(): create a ring of a power-of-two size
+ *   - rbuf_spsc_store(), rbuf_spsc_publish(), rbuf_spsc_push(): producer
+ *   - rbuf_spsc_pop(), rbuf_spsc_peek(), rbuf_spsc_consume(): consumer
+ *
+ *  Implementation details:
+ *   - Same free-running counter and mask scheme as RingBuffer.
+ *   - Head is only written by the producer and tail only by the consumer,
+ *     both with release stores paired with acquire loads on the other side.
+ *   - Each side caches the other side's counter and only reloads it when
+ *     the cached value says the ring is full (producer) or empty (consumer),
+ *     which keeps cache line ping-pong to a minimum.
+ *   - Private counters and the two published ones each get a cache line.
+ *   - Exactly one producer thread and one consumer thread are supported.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "spsc-ring-buffer.h"
+#include "logging.h"
+
+#include <string.h>
+
+SPSCRingBuffer *rbuf_spsc_init(size_t size)
+{
+    size_t pow2 = SPSC_CACHE_LINE;
+    while (pow2 < size)
+        pow2 <<= 1;
+
+    SPSCRingBuffer *rb = aligned_alloc(SPSC_CACHE_LINE, sizeof(SPSCRingBuffer));
+    if (rb == NULL) {
+        ERROR_PRINT("Cannot allocate memory for SPSC ring buffer");
+        return NULL;
+    }
+
+    rb->data = aligned_alloc(SPSC_CACHE_LINE, pow2);
+    if (rb->data == NULL) {
+        ERROR_PRINT("Cannot allocate %zu bytes for SPSC ring buffer", pow2);
+        free(rb);
+        return NULL;
+    }
+    rb->size = pow2;
+    rb->mask = pow2 - 1;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+    rb->head_local = 0;
+    rb->tail_cache = 0;
+    rb->tail_local = 0;
+    rb->head_cache = 0;
+
+    DEBUG_PRINT("SPSC ring buffer initialized, size %zu", pow2);
+    return rb;
+}
+
+void rbuf_spsc_free(SPSCRingBuffer *rb)
+{
+    if (rb == NULL) return;
+    free(rb->data);
+    free(rb);
+}
+
+size_t rbuf_spsc_free_space(SPSCRingBuffer *rb)
+{
+    rb->tail_cache = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    return rb->size - (size_t) (rb->head_local - rb->tail_cache);
+}
+
+size_t rbuf_spsc_store(SPSCRingBuffer *rb, const uint8_t *src, size_t count)
+{
+    size_t free = rb->size - (size_t) (rb->head_local - rb->tail_cache);
+    if (count > free) {
+        rb->tail_cache = atomic_load_explicit(&rb->tail, memory_order_acquire);
+        free = rb->size - (size_t) (rb->head_local - rb->tail_cache);
+        if (count > free)
+            count = free;
+    }
+    if (count == 0) return 0;
+
+    size_t pos = rb->head_local & rb->mask;
+    size_t first = rb->size - pos;
+    if (count > first) {
+        memcpy(rb->data + pos, src, first);
+        memcpy(rb->data, src + first, count - first);
+    } else {
+        memcpy(rb->data + pos, src, count);
+    }
+
+    rb->head_local += count;
+    return count;
+}
+
+void rbuf_spsc_publish(SPSCRingBuffer *rb)
+{
+    atomic_store_explicit(&rb->head, rb->head_local, memory_order_release);
+}
+
+size_t rbuf_spsc_push(SPSCRingBuffer *rb, const uint8_t *src, size_t count)
+{
+    count = rbuf_spsc_store(rb, src, count);
+    if (count)
+        rbuf_spsc_publish(rb);
+    return count;
+}
+
+size_t rbuf_spsc_readable(SPSCRingBuffer *rb)
+{
+    size_t read = (size_t) (rb->head_cache - rb->tail_local);
+    if (read == 0) {
+        rb->head_cache = atomic_load_explicit(&rb->head, memory_order_acquire);
+        read = (size_t) (rb->head_cache - rb->tail_local);
+    }
+    return read;
+}
+
+size_t rbuf_spsc_pop(SPSCRingBuffer *rb, uint8_t *dest, size_t count)
+{
+    size_t read = (size_t) (rb->head_cache - rb->tail_local);
+    if (count > read) {
+        rb->head_cache = atomic_load_explicit(&rb->head, memory_order_acquire);
+        read = (size_t) (rb->head_cache - rb->tail_local);
+        if (count > read)
+            count = read;
+    }
+    if (count == 0) return 0;
+
+    size_t pos = rb->tail_local & rb->mask;
+    size_t first = rb->size - pos;
+    if (count > first) {
+        memcpy(dest, rb->data + pos, first);
+        memcpy(dest + first, rb->data, count - first);
+    } else {
+        memcpy(dest, rb->data + pos, count);
+    }
+
+    rb->tail_local += count;
+    atomic_store_explicit(&rb->tail, rb->tail_local, memory_order_release);
+    return count;
+}
+
+size_t rbuf_spsc_peek(SPSCRingBuffer *rb, struct iovec iov[2], int *iovcnt)
+{
+    size_t read = rbuf_spsc_readable(rb);
+    size_t pos = rb->tail_local & rb->mask;
+    size_t first = rb->size - pos;
+
+    if (read == 0) {
+        *iovcnt = 0;
+        return 0;
+    }
+
+    iov[0].iov_base = rb->data + pos;
+    if (read > first) {
+        iov[0].iov_len = first;
+        iov[1].iov_base = rb->data;
+        iov[1].iov_len = read - first;
+        *iovcnt = 2;
+    } else {
+        iov[0].iov_len = read;
+        *iovcnt = 1;
+    }
+    return read;
+}
+
+void rbuf_spsc_consume(SPSCRingBuffer *rb, size_t count)
+{
+    size_t read = (size_t) (rb->head_cache - rb->tail_local);
+    if (count > read)
+        count = read;
+    rb->tail_local += count;
+    atomic_store_explicit(&rb->tail, rb->tail_local, memory_order_release);
+}
@@ -3,7 +3,53 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <string.h>
+#include <pthread.h>
 #include "digest.h"
+#include "merkle.h"
+#include "aead.h"
+#include "mpsc-queue.h"
+#include "memory-pool.h"
+#include "pool-cache.h"
+#include "size-class.h"
+#include "arena.h"
+#include "typed-pool.h"
+#include "ring-buffer.h"
+#include "spsc-ring-buffer.h"
+#include "tls-bio.h"
+#include "ring-journal.h"
+#include "binlog.h"
+#include "metrics.h"
+#include "tls-trace.h"
+#include <sys/un.h>
+#include "certificate.h"
+#include "session.h"
+#include "tls-lean.h"
+#include "client-pool.h"
+#include "pubsub.h"
+#include "hashmap.h"
+#include "admission.h"
+#include "topology.h"
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <openssl/err.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+
+typedef struct {
+    uint32_t id;
+    uint8_t flags;
+} SmallObj;
+
+typedef struct {
+    uint64_t counter;
+} HotCounter;
+
+DEFINE_POOL(SmallObj, 130)
+DEFINE_POOL_CACHELINE(HotCounter, 8)
 
 static void test_md_sha256_update(void **state) {
     (void) state;
@@ -59,10 +105,1875 @@ static void test_md_sha256_multiple_updates(void **state) {
     MD_digest_free(&md);
 }
 
+static void test_md_sha256_batch(void **state) {
+    (void) state;
+
+    static const char *kat_msgs[] = {
+        "",
+        "abc",
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+        "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+        "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+    };
+    static const char *kat_hex[] = {
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+        "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1",
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+    };
+    enum { KAT = 5, MIXED = 53 };
+
+    /* Four short vectors plus one million 'a' */
+    size_t million = 1000000;
+    unsigned char *big = malloc(million);
+    assert_non_null(big);
+    memset(big, 'a', million);
+
+    const unsigned char *msgs[KAT];
+    size_t lens[KAT];
+    unsigned char expected[KAT][MD_SHA256_SIZE];
+    for (int i = 0; i < KAT; i++) {
+        msgs[i] = i < KAT - 1 ? (const unsigned char *) kat_msgs[i] : big;
+        lens[i] = i < KAT - 1 ? strlen(kat_msgs[i]) : million;
+        for (int b = 0; b < MD_SHA256_SIZE; b++)
+            sscanf(kat_hex[i] + 2 * b, "%2hhx", &expected[i][b]);
+    }
+
+    /* Mixed lengths around the padding boundaries, checked against EVP */
+    unsigned char data[300];
+    const unsigned char *mixed[MIXED];
+    size_t mixed_lens[MIXED];
+    unsigned char reference[MIXED][MD_SHA256_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (unsigned char) (i * 131 + 7);
+    for (int i = 0; i < MIXED; i++) {
+        mixed[i] = data + i;
+        mixed_lens[i] = (size_t) (i * 37) % 250;
+    }
+    mixed_lens[1] = 55;
+    mixed_lens[2] = 56;
+    mixed_lens[3] = 64;
+    assert_int_equal(MD_batch_set_impl(MD_BATCH_EVP), 0);
+    assert_int_equal(MD_digest_batch(mixed, mixed_lens, MIXED, &reference[0][0]), 0);
+
+    MDBatchImpl impls[] = { MD_BATCH_EVP, MD_BATCH_AVX2, MD_BATCH_SHANI };
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (MD_batch_set_impl(impls[k]) != 0) continue;
+
+        unsigned char out[MIXED][MD_SHA256_SIZE];
+        assert_int_equal(MD_digest_batch(msgs, lens, KAT, &out[0][0]), 0);
+        assert_memory_equal(out, expected, sizeof(expected));
+
+        memset(out, 0, sizeof(out));
+        assert_int_equal(MD_digest_batch(mixed, mixed_lens, MIXED, &out[0][0]), 0);
+        assert_memory_equal(out, reference, sizeof(reference));
+    }
+
+    assert_int_equal(MD_batch_set_impl(MD_BATCH_AUTO), 0);
+    free(big);
+}
+
+static void test_md_registry_thread_pool(void **state) {
+    (void) state;
+
+    static const char *abc_hex[MD_BUILTIN_ALGS] = {
+        [MD_SHA256] = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        [MD_SHA512] = "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+                      "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+        [MD_SHA3_256] = "3a985da74fe225b2045c172d6bd390bd855f086e3e9d525b46bfe24511431532",
+        [MD_BLAKE2B512] = "ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+                          "7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923",
+    };
+
+    assert_int_equal(MD_registry_init(), 0);
+    assert_int_equal(MD_find_algorithm("sha3-256"), MD_SHA3_256);
+    assert_int_equal(MD_register_algorithm("SHA256"), MD_SHA256);
+    assert_int_equal(MD_find_algorithm("no-such-digest"), -1);
+    assert_null(MD_get_algorithm(MD_MAX_ALGS));
+
+    for (int alg = 0; alg < MD_BUILTIN_ALGS; alg++) {
+        unsigned char expected[EVP_MAX_MD_SIZE], out[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        size_t size = strlen(abc_hex[alg]) / 2;
+        for (size_t b = 0; b < size; b++)
+            sscanf(abc_hex[alg] + 2 * b, "%2hhx", &expected[b]);
+
+        /* Released digests come back reset on the next acquire */
+        MessageDigest *md = MD_digest_acquire(alg);
+        assert_non_null(md);
+        assert_int_equal(md->md_size, (int) size);
+        assert_int_equal(MD_update_message(md, "garbage", 7), 0);
+        MD_digest_release(md);
+
+        MessageDigest *again = MD_digest_acquire(alg);
+        assert_ptr_equal(again, md);
+        assert_int_equal(MD_update_message(again, "abc", 3), 0);
+        assert_int_equal(MD_calculate_digest(again, out, &len), 0);
+        assert_int_equal(len, size);
+        assert_memory_equal(out, expected, size);
+        MD_digest_release(again);
+
+        /* Twice through the cached context */
+        for (int i = 0; i < 2; i++) {
+            memset(out, 0, sizeof(out));
+            assert_int_equal(MD_digest_oneshot(alg, "abc", 3, out, &len), 0);
+            assert_int_equal(len, size);
+            assert_memory_equal(out, expected, size);
+        }
+    }
+}
+
+static void test_md_register_copies_name(void **state) {
+    (void) state;
+
+    /* The registry keeps its own copy, the caller's buffer may be reused */
+    char name[32];
+    snprintf(name, sizeof(name), "%s", "SHA3-224");
+    int alg = MD_register_algorithm(name);
+    assert_true(alg >= MD_BUILTIN_ALGS);
+    memset(name, 'x', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+
+    assert_string_equal(MD_algorithm_name(alg), "SHA3-224");
+    assert_int_equal(MD_find_algorithm("sha3-224"), alg);
+    assert_int_equal(MD_find_algorithm(name), -1);
+
+    unsigned char out[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    assert_int_equal(MD_digest_oneshot(alg, "abc", 3, out, &len), 0);
+    assert_int_equal(len, 28);
+}
+
+static void test_merkle_file_tree(void **state) {
+    (void) state;
+
+    char path[] = "/tmp/test-merkle-XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+
+    unsigned char data[10 * 4096 + 123];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (unsigned char) (i * 7 + (i >> 12));
+    assert_int_equal(write(fd, data, sizeof(data)), sizeof(data));
+
+    MerkleOpts opts = { .chunk_size = 4096, .threads = 4, .alg = MD_SHA256 };
+    MerkleTree *t = merkle_open(path, &opts);
+    assert_non_null(t);
+    assert_int_equal(t->leaves, 11);
+
+    /* Same root with one thread, every chunk verifies against it */
+    MerkleOpts serial = opts;
+    serial.threads = 1;
+    MerkleTree *s = merkle_open(path, &serial);
+    assert_non_null(s);
+    assert_memory_equal(merkle_root(t), merkle_root(s), t->md_size);
+    merkle_close(s);
+
+    unsigned char proof[16 * MD_SHA256_SIZE], leaf[MD_SHA256_SIZE];
+    for (size_t i = 0; i < t->leaves; i++) {
+        size_t len = i < 10 ? 4096 : 123;
+        assert_int_equal(merkle_hash_chunk(MD_SHA256, data + i * 4096, len, leaf), 0);
+        assert_memory_equal(leaf, merkle_leaf(t, i), MD_SHA256_SIZE);
+        ssize_t n = merkle_proof(t, i, proof, 16);
+        assert_true(n > 0);
+        assert_int_equal(merkle_verify(MD_SHA256, leaf, i, t->leaves, proof, (size_t) n, merkle_root(t)), 1);
+        leaf[0] ^= 1;
+        assert_int_equal(merkle_verify(MD_SHA256, leaf, i, t->leaves, proof, (size_t) n, merkle_root(t)), 0);
+    }
+
+    /* In-place write, only the touched chunk is rehashed */
+    unsigned char old_root[MD_SHA256_SIZE];
+    memcpy(old_root, merkle_root(t), MD_SHA256_SIZE);
+    assert_int_equal(pwrite(fd, "x", 1, 3 * 4096 + 5), 1);
+    assert_int_equal(merkle_mark_dirty(t, 3 * 4096 + 5, 1), 0);
+    assert_int_equal(merkle_rehash(t), 1);
+    assert_memory_not_equal(old_root, merkle_root(t), MD_SHA256_SIZE);
+    s = merkle_open(path, &serial);
+    assert_memory_equal(merkle_root(t), merkle_root(s), t->md_size);
+    merkle_close(s);
+
+    /* Growing the file rehashes the old tail chunk and the new ones */
+    assert_int_equal(write(fd, data, 5000), 5000);
+    assert_int_equal(merkle_rehash(t), 2);
+    assert_int_equal(t->leaves, 12);
+    s = merkle_open(path, &serial);
+    assert_memory_equal(merkle_root(t), merkle_root(s), t->md_size);
+    merkle_close(s);
+    assert_int_equal(merkle_rehash(t), 0);
+
+    merkle_close(t);
+    close(fd);
+    unlink(path);
+}
+
+static void hex_decode(const char *hex, unsigned char *out)
+{
+    for (size_t i = 0; hex[2 * i]; i++)
+        sscanf(hex + 2 * i, "%2hhx", &out[i]);
+}
+
+static void test_aead_vectors_iov_batch(void **state) {
+    (void) state;
+
+    /* GCM spec test case 16 and RFC 8439 section 2.8.2 */
+    static const struct {
+        int alg;
+        const char *key, *iv, *aad, *pt, *ct, *tag;
+    } kat[] = {
+        { AEAD_AES_256_GCM,
+          "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+          "cafebabefacedbaddecaf888",
+          "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+          "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+          "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+          "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+          "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+          "76fc6ece0f4e1768cddf8853bb2d551b" },
+        { AEAD_CHACHA20_POLY1305,
+          "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+          "070000004041424344454647",
+          "50515253c0c1c2c3c4c5c6c7",
+          "4c616469657320616e642047656e746c656d656e206f662074686520636c6173"
+          "73206f66202739393a204966204920636f756c64206f6666657220796f75206f"
+          "6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73"
+          "637265656e20776f756c642062652069742e",
+          "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+          "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+          "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+          "3ff4def08e4b7a9de576d26586cec64b6116",
+          "1ae10b594f09e26a7e902ecbd0600691" },
+    };
+
+    for (size_t k = 0; k < sizeof(kat) / sizeof(kat[0]); k++) {
+        unsigned char key[AEAD_KEY_SIZE], iv[AEAD_IV_SIZE], aad[32], pt[128], ct[128], tag[AEAD_TAG_SIZE];
+        unsigned char buf[128], out_tag[AEAD_TAG_SIZE];
+        size_t aad_len = strlen(kat[k].aad) / 2, len = strlen(kat[k].pt) / 2;
+        hex_decode(kat[k].key, key);
+        hex_decode(kat[k].iv, iv);
+        hex_decode(kat[k].aad, aad);
+        hex_decode(kat[k].pt, pt);
+        hex_decode(kat[k].ct, ct);
+        hex_decode(kat[k].tag, tag);
+
+        AEADCipher *c = AEAD_init(kat[k].alg, key);
+        assert_non_null(c);
+
+        memcpy(buf, pt, len);
+        assert_int_equal(AEAD_encrypt(c, iv, aad, aad_len, buf, len, out_tag), 0);
+        assert_memory_equal(buf, ct, len);
+        assert_memory_equal(out_tag, tag, AEAD_TAG_SIZE);
+        assert_int_equal(AEAD_decrypt(c, iv, aad, aad_len, buf, len, tag), 0);
+        assert_memory_equal(buf, pt, len);
+
+        /* Scatter/gather over uneven segments gives the same result */
+        struct iovec iov[3] = {
+            { .iov_base = buf, .iov_len = 5 },
+            { .iov_base = buf + 5, .iov_len = 17 },
+            { .iov_base = buf + 22, .iov_len = len - 22 },
+        };
+        assert_int_equal(AEAD_encrypt_iov(c, iv, aad, aad_len, iov, 3, out_tag), 0);
+        assert_memory_equal(buf, ct, len);
+        assert_memory_equal(out_tag, tag, AEAD_TAG_SIZE);
+
+        /* A flipped bit fails and leaves no plaintext behind */
+        buf[3] ^= 0x80;
+        assert_int_equal(AEAD_decrypt_iov(c, iv, aad, aad_len, iov, 3, tag), -1);
+        for (size_t i = 0; i < len; i++) assert_int_equal(buf[i], 0);
+
+        /* Batch of mixed lengths matches one by one encryption */
+        enum { BATCH = 9 };
+        unsigned char data[BATCH][300], single[BATCH][300], ivs[BATCH][AEAD_IV_SIZE];
+        unsigned char tags[BATCH][AEAD_TAG_SIZE], single_tags[BATCH][AEAD_TAG_SIZE];
+        AEADMessage msgs[BATCH];
+        for (int i = 0; i < BATCH; i++) {
+            memset(data[i], 'a' + i, sizeof(data[i]));
+            memcpy(single[i], data[i], sizeof(data[i]));
+            memcpy(ivs[i], iv, AEAD_IV_SIZE);
+            ivs[i][0] = (unsigned char) i;
+            msgs[i] = (AEADMessage) { .iv = ivs[i], .aad = aad, .aad_len = (size_t) i,
+                                      .buf = data[i], .len = (size_t) i * 33, .tag = tags[i] };
+            assert_int_equal(AEAD_encrypt(c, ivs[i], aad, (size_t) i, single[i], (size_t) i * 33,
+                                          single_tags[i]), 0);
+        }
+        assert_int_equal(AEAD_encrypt_batch(c, msgs, BATCH), 0);
+        assert_memory_equal(data, single, sizeof(data));
+        assert_memory_equal(tags, single_tags, sizeof(tags));
+
+        tags[4][0] ^= 1;
+        assert_int_equal(AEAD_decrypt_batch(c, msgs, BATCH), 1);
+        assert_int_equal(msgs[4].status, -1);
+        for (int i = 0; i < BATCH; i++) {
+            if (i == 4) continue;
+            assert_int_equal(msgs[i].status, 0);
+            for (size_t b = 0; b < msgs[i].len; b++) assert_int_equal(data[i][b], 'a' + i);
+        }
+
+        AEAD_free(&c);
+        assert_null(c);
+    }
+}
+
+typedef struct {
+    MPSCNode node;
+    int producer;
+    int seq;
+} MPSCTestItem;
+
+#define MPSC_TEST_PRODUCERS 4
+#define MPSC_TEST_ITEMS 5000
+
+typedef struct {
+    MPSCQueue *q;
+    MPSCTestItem *items;
+    int producer;
+} MPSCTestProducer;
+
+static void *mpsc_producer(void *arg)
+{
+    MPSCTestProducer *p = arg;
+    for (int i = 0; i < MPSC_TEST_ITEMS; i++) {
+        p->items[i].producer = p->producer;
+        p->items[i].seq = i;
+        mpsc_push(p->q, &p->items[i].node);
+    }
+    return NULL;
+}
+
+static void test_mpsc_queue_order_batch_wakeup(void **state) {
+    (void) state;
+
+    MPSCQueue *q = mpsc_init_queue();
+    assert_non_null(q);
+    assert_true(mpsc_is_empty(q));
+    assert_null(mpsc_pop(q));
+
+    /* FIFO through the stub, also after the queue ran empty */
+    MPSCTestItem items[10];
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 10; i++) {
+            items[i].seq = i;
+            mpsc_push(q, &items[i].node);
+        }
+        assert_false(mpsc_is_empty(q));
+        for (int i = 0; i < 3; i++)
+            assert_int_equal(MPSC_ENTRY(mpsc_pop(q), MPSCTestItem, node)->seq, i);
+
+        MPSCNode *batch[16];
+        assert_int_equal(mpsc_pop_batch(q, batch, 4), 4);
+        for (int i = 0; i < 4; i++)
+            assert_int_equal(MPSC_ENTRY(batch[i], MPSCTestItem, node)->seq, 3 + i);
+        assert_int_equal(mpsc_pop_batch(q, batch, 16), 3);
+        assert_int_equal(MPSC_ENTRY(batch[2], MPSCTestItem, node)->seq, 9);
+        assert_int_equal(mpsc_pop_batch(q, batch, 16), 0);
+        assert_true(mpsc_is_empty(q));
+    }
+
+    /* Armed on an empty queue the next push signals, otherwise no sleep */
+    int efd = mpsc_enable_wakeup(q);
+    assert_true(efd >= 0);
+    assert_int_equal(mpsc_arm_wakeup(q), 0);
+    struct pollfd pfd = { .fd = efd, .events = POLLIN };
+    assert_int_equal(poll(&pfd, 1, 0), 0);
+    mpsc_push(q, &items[0].node);
+    assert_int_equal(poll(&pfd, 1, 0), 1);
+    mpsc_ack_wakeup(q);
+    assert_int_equal(mpsc_arm_wakeup(q), 1);
+    assert_ptr_equal(mpsc_pop(q), &items[0].node);
+
+    /* Several producers: per producer order holds and no wakeup is lost */
+    static MPSCTestItem produced[MPSC_TEST_PRODUCERS][MPSC_TEST_ITEMS];
+    MPSCTestProducer producers[MPSC_TEST_PRODUCERS];
+    pthread_t th[MPSC_TEST_PRODUCERS];
+    for (int p = 0; p < MPSC_TEST_PRODUCERS; p++) {
+        producers[p] = (MPSCTestProducer) { .q = q, .items = produced[p], .producer = p };
+        pthread_create(&th[p], NULL, mpsc_producer, &producers[p]);
+    }
+
+    int next[MPSC_TEST_PRODUCERS] = { 0 };
+    int received = 0;
+    while (received < MPSC_TEST_PRODUCERS * MPSC_TEST_ITEMS) {
+        MPSCNode *batch[64];
+        size_t n = mpsc_pop_batch(q, batch, 64);
+        for (size_t i = 0; i < n; i++) {
+            MPSCTestItem *item = MPSC_ENTRY(batch[i], MPSCTestItem, node);
+            assert_int_equal(item->seq, next[item->producer]++);
+        }
+        received += (int) n;
+        if (n > 0 || received == MPSC_TEST_PRODUCERS * MPSC_TEST_ITEMS) continue;
+
+        if (mpsc_arm_wakeup(q) == 0) {
+            /* A push in progress has swapped head, the wakeup must come */
+            assert_int_equal(poll(&pfd, 1, 5000), 1);
+            mpsc_ack_wakeup(q);
+        }
+    }
+    for (int p = 0; p < MPSC_TEST_PRODUCERS; p++) {
+        pthread_join(th[p], NULL);
+        assert_int_equal(next[p], MPSC_TEST_ITEMS);
+    }
+    assert_true(mpsc_is_empty(q));
+    mpsc_destroy_queue(q);
+}
+
+static void *pcache_free_worker(void *arg)
+{
+    void **args = arg;
+    /* Lands in this thread's magazine, thread exit gives it back */
+    pcache_free(args[0], args[1]);
+    return NULL;
+}
+
+static void test_pool_cache_magazines(void **state) {
+    (void) state;
+
+    MemoryPool *mp = pool_init(32, 64);
+    assert_non_null(mp);
+    PoolCache *pc = pcache_init(mp, 8, 2);
+    assert_non_null(pc);
+
+    /* Past both magazines, refills come from the pool half a magazine at a time */
+    void *blocks[20];
+    for (int i = 0; i < 20; i++) {
+        blocks[i] = pcache_malloc(pc);
+        assert_non_null(blocks[i]);
+        assert_true(pool_owns(mp, blocks[i]));
+        for (int j = 0; j < i; j++)
+            assert_ptr_not_equal(blocks[i], blocks[j]);
+    }
+    assert_true(mp->free_count <= 64 - 20);
+
+    /* Both magazines fill up, full ones are exchanged with the depot */
+    for (int i = 0; i < 20; i++)
+        pcache_free(pc, blocks[i]);
+    assert_int_equal(pc->full_count, 1);
+
+    /* Allocation drains the magazines and the depot without the pool */
+    size_t pool_free_count = mp->free_count;
+    for (int i = 0; i < 20; i++)
+        blocks[i] = pcache_malloc(pc);
+    assert_int_equal(mp->free_count, pool_free_count);
+    assert_int_equal(pc->full_count, 0);
+
+    /* A block freed by another thread is reused after that thread exits */
+    void *remote = blocks[0];
+    void *args[2] = { pc, remote };
+    pthread_t th;
+    pthread_create(&th, NULL, pcache_free_worker, args);
+    pthread_join(th, NULL);
+    assert_null(pc->threads->next);
+
+    for (int i = 1; i < 20; i++)
+        pcache_free(pc, blocks[i]);
+    pcache_flush_thread(pc);
+    assert_null(pc->threads);
+    assert_int_equal(mp->free_count + pc->full_count * pc->mag_size, 64);
+
+    void *all[64];
+    int found = 0;
+    for (int i = 0; i < 64; i++) {
+        all[i] = pcache_malloc(pc);
+        assert_non_null(all[i]);
+        found += all[i] == remote;
+    }
+    assert_int_equal(found, 1);
+    assert_null(pcache_malloc(pc));
+
+    for (int i = 0; i < 64; i++)
+        pcache_free(pc, all[i]);
+    pcache_destroy(pc);
+    assert_int_equal(mp->free_count, 64);
+    pool_destroy(mp);
+}
+
+static void test_pool_growable_slabs(void **state) {
+    (void) state;
+
+    MemoryPoolOpts opts = {
+        .slab_blocks = 16,
+        .max_slabs = 0,
+        .free_slab_watermark = 1,
+        .flags = POOL_GROWABLE,
+    };
+    MemoryPool *mp = pool_init_ex(32, &opts);
+    assert_non_null(mp);
+
+    void *blocks[100];
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = pool_malloc(mp);
+        assert_non_null(blocks[i]);
+        assert_true(pool_owns(mp, blocks[i]));
+    }
+    assert_int_equal(mp->slab_count, 7);
+    assert_int_equal(mp->total_blocks - mp->free_count, 100);
+
+    for (int i = 0; i < 100; i++)
+        pool_free(mp, blocks[i]);
+
+    /* Double free is ignored and does not corrupt the counters */
+    pool_free(mp, blocks[0]);
+    assert_int_equal(mp->free_count, mp->total_blocks);
+
+    /* Fully free slabs beyond the watermark went back to the OS */
+    assert_int_equal(mp->slab_count, 1);
+    assert_false(pool_owns(mp, blocks));
+
+    pool_destroy(mp);
+}
+
+static void test_size_class_alloc(void **state) {
+    (void) state;
+
+    SizeClassAllocator *sc = sc_init();
+    assert_non_null(sc);
+
+    char *small = sc_malloc(sc, 10);
+    char *large = sc_malloc(sc, 100000);
+    assert_non_null(small);
+    assert_non_null(large);
+    assert_int_equal((uintptr_t) small % 16, 0);
+    memcpy(small, "0123456789", 10);
+
+    /* Grows out of the 32 byte class and keeps the contents */
+    small = sc_realloc(sc, small, 200);
+    assert_non_null(small);
+    assert_memory_equal(small, "0123456789", 10);
+
+    SizeClassStats stats[SC_CLASS_COUNT + 1];
+    size_t n = sc_get_stats(sc, stats, SC_CLASS_COUNT + 1);
+    assert_int_equal(n, SC_CLASS_COUNT + 1);
+    assert_int_equal(stats[0].allocs, 1);
+    assert_int_equal(stats[0].frees, 1);
+    assert_int_equal(stats[3].live, 1);
+    assert_int_equal(stats[SC_CLASS_COUNT].live, 1);
+
+    sc_free(sc, small);
+    sc_free(sc, large);
+    sc_destroy(sc);
+}
+
+static void test_arena_mark_rewind_reset(void **state) {
+    (void) state;
+
+    Arena *arena = arena_init(256);
+    assert_non_null(arena);
+
+    char *a = arena_alloc_aligned(arena, 3, 1);
+    uint64_t *b = arena_alloc_aligned(arena, sizeof(uint64_t), 64);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_int_equal((uintptr_t) b % 64, 0);
+
+    ArenaMark mark = arena_mark(arena);
+    void *c = arena_alloc(arena, 100);
+    void *big = arena_alloc(arena, 1000);
+    assert_non_null(big);
+
+    /* Rewinding hands out the same memory again */
+    arena_rewind(arena, mark);
+    assert_ptr_equal(arena_alloc(arena, 100), c);
+
+    /* Reset keeps the blocks, the next allocations reuse them */
+    size_t capacity = arena_capacity(arena);
+    arena_reset(arena);
+    assert_ptr_equal(arena_alloc_aligned(arena, 3, 1), a);
+    arena_alloc(arena, 1000);
+    assert_int_equal(arena_capacity(arena), capacity);
+
+    arena_destroy(arena);
+}
+
+static void test_typed_pool(void **state) {
+    (void) state;
+
+    assert_int_equal(SmallObj_pool_stride, 8);
+    assert_int_equal(HotCounter_pool_stride, TPOOL_CACHE_LINE);
+
+    SmallObjPool *p = SmallObj_pool_create();
+    assert_non_null(p);
+
+    SmallObj *objs[130];
+    for (int i = 0; i < 130; i++) {
+        objs[i] = SmallObj_pool_alloc(p);
+        assert_non_null(objs[i]);
+        assert_int_equal((uintptr_t) objs[i] % _Alignof(SmallObj), 0);
+    }
+    assert_null(SmallObj_pool_alloc(p));
+
+    assert_int_equal(SmallObj_pool_free(p, objs[70]), 0);
+    assert_int_equal(SmallObj_pool_free(p, objs[70]), -1);
+    assert_int_equal(SmallObj_pool_free(p, (SmallObj *) ((char *) objs[3] + 1)), -1);
+    assert_ptr_equal(SmallObj_pool_alloc(p), objs[70]);
+    SmallObj_pool_destroy(p);
+
+    HotCounterPool hot;
+    HotCounter_pool_init(&hot);
+    HotCounter *a = HotCounter_pool_alloc(&hot);
+    HotCounter *b = HotCounter_pool_alloc(&hot);
+    assert_int_equal((uintptr_t) a % TPOOL_CACHE_LINE, 0);
+    assert_int_equal((char *) b - (char *) a, TPOOL_CACHE_LINE);
+}
+
+static void test_rbuf_sized_peek_skip(void **state) {
+    (void) state;
+
+    RingBuffer *rb = rbuf_init_buffer_size(100);
+    assert_non_null(rb);
+    assert_int_equal(rbuf_get_buffer_size(rb), 128);
+
+    uint8_t in[300], out[300];
+    for (int i = 0; i < 300; i++) in[i] = (uint8_t) i;
+
+    /* Whole capacity is usable */
+    rbuf_store_data(rb, in, 128);
+    assert_int_equal(rbuf_get_readable(rb), 128);
+    assert_int_equal(rbuf_get_free_space(rb), 0);
+    assert_int_equal(rbuf_skip(rb, 100), 100);
+
+    /* Wraps around, peek returns both halves without copying */
+    rbuf_store_data(rb, in, 60);
+    struct iovec iov[2];
+    int iovcnt;
+    assert_int_equal(rbuf_peek(rb, iov, &iovcnt), 88);
+    assert_int_equal(iovcnt, 2);
+    assert_int_equal(iov[0].iov_len, 28);
+    assert_memory_equal(iov[0].iov_base, in + 100, 28);
+    assert_memory_equal(iov[1].iov_base, in, 60);
+
+    /* Overwrite keeps the newest bytes */
+    rbuf_store_data(rb, in, 300);
+    assert_int_equal(rbuf_pop_data(rb, out, sizeof(out)), 128);
+    assert_memory_equal(out, in + 172, 128);
+    assert_int_equal(rbuf_pop_data(rb, out, sizeof(out)), 0);
+
+    rbuf_free_buffer(rb);
+}
+
+#define SPSC_TEST_BYTES (1 << 20)
+
+static void *spsc_producer(void *arg)
+{
+    SPSCRingBuffer *rb = arg;
+    uint8_t chunk[97];
+    size_t sent = 0;
+    while (sent < SPSC_TEST_BYTES) {
+        size_t len = 1 + sent % sizeof(chunk);
+        if (len > SPSC_TEST_BYTES - sent) len = SPSC_TEST_BYTES - sent;
+        for (size_t i = 0; i < len; i++)
+            chunk[i] = (uint8_t) ((sent + i) % 251);
+        size_t n;
+        while ((n = rbuf_spsc_push(rb, chunk, len)) == 0)
+            sched_yield();
+        sent += n;
+    }
+    return NULL;
+}
+
+static void test_spsc_ring_wrap_full_cached(void **state) {
+    (void) state;
+
+    SPSCRingBuffer *rb = rbuf_spsc_init(100);
+    assert_non_null(rb);
+    assert_int_equal(rb->size, 128);
+
+    uint8_t in[256], out[256];
+    for (int i = 0; i < 256; i++)
+        in[i] = (uint8_t) i;
+
+    /* Empty */
+    struct iovec iov[2];
+    int iovcnt = -1;
+    assert_int_equal(rbuf_spsc_readable(rb), 0);
+    assert_int_equal(rbuf_spsc_pop(rb, out, 1), 0);
+    assert_int_equal(rbuf_spsc_peek(rb, iov, &iovcnt), 0);
+    assert_int_equal(iovcnt, 0);
+
+    /* Stored bytes stay invisible until published */
+    assert_int_equal(rbuf_spsc_store(rb, in, 10), 10);
+    assert_int_equal(rbuf_spsc_readable(rb), 0);
+    rbuf_spsc_publish(rb);
+    assert_int_equal(rbuf_spsc_readable(rb), 10);
+
+    /* Full at capacity, a push takes only what fits */
+    assert_int_equal(rbuf_spsc_push(rb, in + 10, 200), 118);
+    assert_int_equal(rbuf_spsc_free_space(rb), 0);
+    assert_int_equal(rbuf_spsc_push(rb, in, 1), 0);
+    assert_int_equal(rbuf_spsc_readable(rb), 10);
+    assert_int_equal(rbuf_spsc_pop(rb, out, 200), 128);
+    assert_memory_equal(out, in, 128);
+
+    /* Producer's cached tail is stale, a push refreshes it once it runs out */
+    assert_int_equal(rbuf_spsc_push(rb, in, 128), 128);
+    assert_int_equal(rbuf_spsc_pop(rb, out, 100), 100);
+    assert_int_equal(rb->tail_cache, 128);
+    assert_int_equal(rbuf_spsc_push(rb, in + 128, 50), 50);
+    assert_int_equal(rb->tail_cache, 228);
+
+    /* Consumer's cached head is stale too, a pop wraps across the end */
+    assert_int_equal(rb->head_cache, 256);
+    assert_int_equal(rbuf_spsc_peek(rb, iov, &iovcnt), 28);
+    assert_int_equal(iovcnt, 1);
+    assert_int_equal(rbuf_spsc_pop(rb, out, 200), 78);
+    assert_int_equal(rb->head_cache, 306);
+    assert_memory_equal(out, in + 100, 78);
+
+    /* Wrapped data is split at the end of the buffer */
+    assert_int_equal(rbuf_spsc_push(rb, in, 100), 100);
+    assert_int_equal(rbuf_spsc_peek(rb, iov, &iovcnt), 100);
+    assert_int_equal(iovcnt, 2);
+    assert_int_equal(iov[0].iov_len, 78);
+    assert_int_equal(iov[1].iov_len, 22);
+    assert_ptr_equal(iov[1].iov_base, rb->data);
+    assert_memory_equal(iov[0].iov_base, in, 78);
+    rbuf_spsc_consume(rb, 78);
+    assert_int_equal(rbuf_spsc_pop(rb, out, 256), 22);
+    assert_memory_equal(out, in + 78, 22);
+    assert_int_equal(rbuf_spsc_readable(rb), 0);
+    rbuf_spsc_free(rb);
+
+    /* Producer thread with odd chunk sizes, bytes arrive in order */
+    rb = rbuf_spsc_init(256);
+    assert_non_null(rb);
+    pthread_t th;
+    pthread_create(&th, NULL, spsc_producer, rb);
+    size_t received = 0;
+    int mismatches = 0;
+    while (received < SPSC_TEST_BYTES) {
+        size_t n = rbuf_spsc_pop(rb, out, 1 + received % 61);
+        for (size_t i = 0; i < n; i++)
+            mismatches += out[i] != (uint8_t) ((received + i) % 251);
+        received += n;
+        if (n == 0) sched_yield();
+    }
+    pthread_join(th, NULL);
+    assert_int_equal(mismatches, 0);
+    assert_int_equal(rbuf_spsc_readable(rb), 0);
+    rbuf_spsc_free(rb);
+}
+
+static void test_rbuf_mirrored_in_place(void **state) {
+    (void) state;
+
+    RingBuffer *rb = rbuf_init_mirrored(4096);
+    assert_non_null(rb);
+    size_t size = rbuf_get_buffer_size(rb);
+
+    uint8_t in[1000];
+    for (size_t i = 0; i < sizeof(in); i++) in[i] = (uint8_t) (i * 7);
+
+    /* Move the window close to the end of the mapping */
+    size_t avail;
+    rbuf_write_ptr(rb, &avail);
+    assert_int_equal(avail, size);
+    rbuf_commit(rb, size - 100);
+    rbuf_consume(rb, size - 100);
+
+    /* The writable region spans the wrap point */
+    uint8_t *w = rbuf_write_ptr(rb, &avail);
+    assert_int_equal(avail, size);
+    memcpy(w, in, sizeof(in));
+    rbuf_commit(rb, sizeof(in));
+
+    uint8_t *r = rbuf_read_ptr(rb, &avail);
+    assert_int_equal(avail, sizeof(in));
+    assert_memory_equal(r, in, sizeof(in));
+    assert_memory_equal(rb->data, in + 100, sizeof(in) - 100);
+    rbuf_consume(rb, avail);
+
+    rbuf_store_data(rb, in, sizeof(in));
+    uint8_t out[1000];
+    assert_int_equal(rbuf_pop_data(rb, out, sizeof(out)), sizeof(in));
+    assert_memory_equal(out, in, sizeof(in));
+
+    rbuf_free_buffer(rb);
+}
+
+static int tls_pump_handshake(SSL *client, SSL *server)
+{
+    int client_done = 0, server_done = 0;
+    for (int i = 0; i < 100 && !(client_done && server_done); i++) {
+        if (!client_done) client_done = SSL_do_handshake(client) == 1;
+        if (!server_done) server_done = SSL_do_handshake(server) == 1;
+    }
+    return client_done && server_done;
+}
+
+static void test_tls_over_ring_buffers(void **state) {
+    (void) state;
+
+    RingBuffer *c2s = rbuf_init_buffer_size(32 * 1024);
+    RingBuffer *s2c = rbuf_init_buffer_size(32 * 1024);
+    TLSConnection *server = TLS_init_server();
+    TLSConnection *client = TLS_init_client();
+    assert_non_null(server);
+    assert_non_null(client);
+    assert_int_equal(CA_generate_self_signed(&server, "localhost"), 1);
+
+    assert_int_equal(TLS_init_ssl_for_buffers(&server, c2s, s2c), 1);
+    assert_int_equal(TLS_init_ssl_for_buffers(&client, s2c, c2s), 1);
+    SSL_set_accept_state(server->ssl);
+    SSL_set_connect_state(client->ssl);
+    assert_true(tls_pump_handshake(client->ssl, server->ssl));
+
+    const char msg[] = "over ring buffers";
+    char buf[64];
+    assert_int_equal(SSL_write(client->ssl, msg, sizeof(msg)), sizeof(msg));
+    assert_int_equal(SSL_read(server->ssl, buf, sizeof(buf)), sizeof(msg));
+    assert_memory_equal(buf, msg, sizeof(msg));
+
+    /* Nothing buffered, reads ask for a retry instead of failing */
+    assert_int_equal(SSL_read(server->ssl, buf, sizeof(buf)), -1);
+    assert_int_equal(SSL_get_error(server->ssl, -1), SSL_ERROR_WANT_READ);
+
+    /* Ciphertext round trip through a real socket pair */
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    assert_int_equal(SSL_write(server->ssl, msg, sizeof(msg)), sizeof(msg));
+    size_t pending = rbuf_get_readable(s2c);
+    assert_int_equal(TLS_bio_drain_to_socket(fds[0], s2c), pending);
+    assert_int_equal(TLS_bio_fill_from_socket(fds[1], s2c), pending);
+    assert_int_equal(SSL_read(client->ssl, buf, sizeof(buf)), sizeof(msg));
+    assert_memory_equal(buf, msg, sizeof(msg));
+    close(fds[0]);
+    close(fds[1]);
+
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+    rbuf_free_buffer(c2s);
+    rbuf_free_buffer(s2c);
+}
+
+static int tls_pair_handshake(SSL_CTX *client_ctx, SSL_CTX *server_ctx)
+{
+    BIO *cbio, *sbio;
+    SSL *c = SSL_new(client_ctx);
+    SSL *s = SSL_new(server_ctx);
+    assert_int_equal(BIO_new_bio_pair(&cbio, 0, &sbio, 0), 1);
+    SSL_set_bio(c, cbio, cbio);
+    SSL_set_bio(s, sbio, sbio);
+    SSL_set_connect_state(c);
+    SSL_set_accept_state(s);
+    int ok = tls_pump_handshake(c, s);
+    SSL_free(c);
+    SSL_free(s);
+    return ok;
+}
+
+static void test_tls_client_whitelist_runtime_keys(void **state) {
+    (void) state;
+
+    TLSConnection *server = TLS_init_server();
+    TLSConnection *client = TLS_init_client();
+    TLSConnection *other = TLS_init_client();
+    TLSConnection *stranger = TLS_init_client();
+    assert_int_equal(CA_generate_self_signed(&server, "localhost"), 1);
+    assert_int_equal(CA_generate_self_signed(&client, "Horse test"), 1);
+    assert_int_equal(CA_generate_self_signed(&other, "Horse other"), 1);
+    assert_int_equal(CA_generate_self_signed(&stranger, "Zebra"), 1);
+    X509 *cert = SSL_CTX_get0_certificate(client->ctx);
+    EVP_PKEY *key = X509_get0_pubkey(cert);
+
+    /* Client certificates are only asked for once a certificate is trusted */
+    assert_true(tls_pair_handshake(client->ctx, server->ctx));
+    assert_int_equal(TLS_server_trust_client_cert(&server, NULL), -1);
+    assert_int_equal(TLS_server_trust_client_cert(&server, cert), 1);
+    assert_int_equal(TLS_server_trust_client_cert(&server, SSL_CTX_get0_certificate(stranger->ctx)), 1);
+    assert_false(tls_pair_handshake(client->ctx, server->ctx));
+    ERR_clear_error();
+
+    /* Only the added key passes, and only with a whitelisted CN */
+    assert_int_equal(TLS_whitelist_add_pubkey(NULL), -1);
+    assert_int_equal(TLS_whitelist_add_pubkey(key), 0);
+    assert_true(tls_pair_handshake(client->ctx, server->ctx));
+    assert_false(tls_pair_handshake(other->ctx, server->ctx));
+    ERR_clear_error();
+    assert_int_equal(TLS_whitelist_add_pubkey(X509_get0_pubkey(SSL_CTX_get0_certificate(stranger->ctx))), 0);
+    assert_false(tls_pair_handshake(stranger->ctx, server->ctx));
+    ERR_clear_error();
+
+    /* Clearing drops the runtime keys, the whitelist holds its own references */
+    TLS_whitelist_clear();
+    assert_false(tls_pair_handshake(client->ctx, server->ctx));
+    ERR_clear_error();
+    TLS_whitelist_clear();
+
+    /* The placeholder ALLOWED_PUBKEYS entry does not parse, so all slots are free */
+    for (int i = 0; i < SESSION_MAX_PUBKEYS; i++)
+        assert_int_equal(TLS_whitelist_add_pubkey(key), 0);
+    assert_int_equal(TLS_whitelist_add_pubkey(key), -1);
+    assert_true(tls_pair_handshake(client->ctx, server->ctx));
+    TLS_whitelist_clear();
+
+    TLS_free_connection(&stranger);
+    TLS_free_connection(&other);
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+}
+
+static void test_tls_key_types_client_whitelist(void **state) {
+    (void) state;
+
+    for (int key = 0; key < CA_KEY_TYPE_COUNT; key++) {
+        TLSConnection *server = TLS_init_server();
+        TLSConnection *client = TLS_init_client();
+        assert_int_equal(CA_generate_self_signed_key(&server, "localhost", key), 1);
+        assert_true(tls_pair_handshake(client->ctx, server->ctx));
+
+        /* Client certificate must pass the CN and public key whitelist */
+        assert_int_equal(CA_generate_self_signed_key(&client, "Horse test", key), 1);
+        X509 *cert = SSL_CTX_get0_certificate(client->ctx);
+        assert_int_equal(TLS_server_trust_client_cert(&server, cert), 1);
+        assert_false(tls_pair_handshake(client->ctx, server->ctx));
+        ERR_clear_error();
+
+        assert_int_equal(TLS_whitelist_add_pubkey(X509_get0_pubkey(cert)), 0);
+        assert_true(tls_pair_handshake(client->ctx, server->ctx));
+
+        TLS_whitelist_clear();
+        assert_false(tls_pair_handshake(client->ctx, server->ctx));
+        ERR_clear_error();
+
+        TLS_free_connection(&client);
+        TLS_free_connection(&server);
+    }
+}
+
+/*
+ * Checks that lean connections hold no buffers while idle.  The resident
+ * memory per idle connection is measured by bench-tls-idle instead: the
+ * test binary runs under ASan, whose quarantine and redzones swamp a few
+ * KiB per connection, and an RSS threshold would depend on the allocator
+ * and the machine.
+ */
+static void test_tls_lean_idle_buffers(void **state) {
+    (void) state;
+
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+    TLSConnection *server = TLS_init_server();
+    TLSConnection *client = TLS_init_client();
+    assert_int_equal(CA_generate_self_signed(&server, "localhost"), 1);
+    TLS_set_lean_mode(&server);
+    TLS_set_lean_mode(&client);
+
+    /* Server keeps empty buffers until shrunk, client drops them at once */
+    TLSLeanPool *lazy = TLS_lean_pool_init(0, TLS_LEAN_IDLE_NS);
+    TLSLeanPool *eager = TLS_lean_pool_init(1000, 0);
+    assert_non_null(lazy);
+    assert_non_null(eager);
+    assert_int_equal(eager->buffer_size, 1024);
+
+    TLSLeanConn *s = TLS_lean_conn_new(&server, lazy, fds[0]);
+    TLSLeanConn *c = TLS_lean_conn_new(&client, eager, fds[1]);
+    SSL_set_accept_state(s->ssl);
+    SSL_set_connect_state(c->ssl);
+    assert_null(s->in.data);
+
+    int s_done = 0, c_done = 0;
+    for (int i = 0; i < 100 && !(s_done && c_done); i++) {
+        if (!c_done) c_done = TLS_lean_handshake(c);
+        if (!s_done) s_done = TLS_lean_handshake(s);
+        assert_true(c_done >= 0 && s_done >= 0);
+    }
+    assert_true(s_done && c_done);
+    assert_int_equal(atomic_load(&eager->in_use), 0);
+
+    const char msg[] = "lean ping";
+    char buf[64];
+    for (int round = 0; round < 2; round++) {
+        assert_int_equal(TLS_lean_write(c, msg, sizeof(msg)), sizeof(msg));
+        assert_null(c->out.data);
+        assert_int_equal(TLS_lean_read(s, buf, sizeof(buf)), sizeof(msg));
+        assert_memory_equal(buf, msg, sizeof(msg));
+        assert_int_equal(TLS_lean_write(s, buf, sizeof(msg)), sizeof(msg));
+        assert_int_equal(TLS_lean_read(c, buf, sizeof(buf)), sizeof(msg));
+
+        /* Nothing to read, the client holds no buffers while idle */
+        assert_int_equal(TLS_lean_read(c, buf, sizeof(buf)), -1);
+        assert_int_equal(errno, EAGAIN);
+        assert_int_equal(atomic_load(&eager->in_use), 0);
+
+        assert_int_equal(atomic_load(&lazy->in_use), 2);
+        assert_int_equal(TLS_lean_shrink(s, s->last_active + 1), 0);
+        assert_int_equal(TLS_lean_shrink(s, s->last_active + TLS_LEAN_IDLE_NS), 1);
+        assert_int_equal(atomic_load(&lazy->in_use), 0);
+    }
+
+    close(fds[1]);
+    assert_int_equal(TLS_lean_read(s, buf, sizeof(buf)), 0);
+
+    TLS_lean_conn_free(c);
+    TLS_lean_conn_free(s);
+    TLS_lean_pool_destroy(lazy);
+    TLS_lean_pool_destroy(eager);
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+    close(fds[0]);
+}
+
+static void journal_count_cb(const RingJournalRecord *rec, void *arg)
+{
+    uint64_t *expect = arg;
+    assert_int_equal(rec->seq, *expect);
+    assert_int_equal(rec->len, sizeof(uint64_t));
+    assert_memory_equal(rec->data, &rec->seq, sizeof(uint64_t));
+    (*expect)++;
+}
+
+static void test_rbuf_journal_persist_replay(void **state) {
+    (void) state;
+
+    char path[] = "/tmp/rbuf-journal-XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    RingJournalOpts opts = { .durability = RJ_DURABILITY_BATCH, .batch_records = 16 };
+    RingJournal *j = rbuf_journal_open(path, 4096, &opts);
+    assert_non_null(j);
+
+    RingJournalReader reader;
+    RingJournalRecord rec;
+    rbuf_journal_reader_init(j, &reader);
+
+    /* 24 byte records, 4 KiB holds 170 of them, so early ones are evicted */
+    for (uint64_t i = 0; i < 500; i++) {
+        uint64_t seq;
+        assert_int_equal(rbuf_journal_append(j, &i, sizeof(i), &seq), 0);
+        assert_int_equal(seq, i);
+    }
+    uint64_t oldest = j->hdr->tail_seq;
+    assert_true(oldest > 0);
+
+    /* The reader was lapped and learns how much it missed */
+    assert_int_equal(rbuf_journal_next(j, &reader, &rec), RJ_OVERWRITTEN);
+    assert_int_equal(reader.lost, oldest);
+    assert_int_equal(rbuf_journal_next(j, &reader, &rec), 1);
+    assert_int_equal(rec.seq, oldest);
+
+    rbuf_journal_trim(j, oldest + 9);
+    rbuf_journal_close(j);
+
+    /* Reopen and replay everything that survived */
+    j = rbuf_journal_open(path, 4096, &opts);
+    assert_non_null(j);
+    uint64_t expect = oldest + 10;
+    assert_int_equal(rbuf_journal_replay(j, journal_count_cb, &expect), 500 - oldest - 10);
+    assert_int_equal(expect, 500);
+
+    /* Corrupt the newest record, recovery cuts the journal before it */
+    uint64_t last_pos = j->rb.head - 24;
+    j->rb.data[(last_pos & j->rb.mask) + 16] ^= 0xff;
+    rbuf_journal_close(j);
+
+    j = rbuf_journal_open(path, 4096, &opts);
+    assert_non_null(j);
+    assert_int_equal(j->hdr->head_seq, 499);
+    uint64_t seq;
+    assert_int_equal(rbuf_journal_append(j, &(uint64_t){ 499 }, sizeof(uint64_t), &seq), 0);
+    assert_int_equal(seq, 499);
+
+    /*
+     * Records that overwrote the oldest ones reached the disk, the header
+     * moving the tail past them did not.  The stale tail points into the
+     * middle of a newer record.
+     */
+    uint64_t stale_tail = j->hdr->tail, stale_seq = j->hdr->tail_seq;
+    for (uint64_t i = 500; i < 600; i++)
+        assert_int_equal(rbuf_journal_append(j, &i, sizeof(i), NULL), 0);
+    oldest = j->hdr->tail_seq;
+    assert_true(oldest > stale_seq);
+    j->hdr->tail = stale_tail;
+    j->hdr->tail_seq = stale_seq;
+    rbuf_journal_close(j);
+
+    j = rbuf_journal_open(path, 4096, &opts);
+    assert_non_null(j);
+    assert_int_equal(j->hdr->tail_seq, oldest);
+    assert_int_equal(j->hdr->head_seq, 600);
+    expect = oldest;
+    assert_int_equal(rbuf_journal_replay(j, journal_count_cb, &expect), 600 - oldest);
+    assert_int_equal(expect, 600);
+    rbuf_journal_close(j);
+    unlink(path);
+}
+
+static pthread_key_t binlog_test_key;
+
+/* Runs after the logger's own destructor, whose ring must still be there */
+static void binlog_worker_exit(void *arg)
+{
+    binlog_flush();
+    BINLOG(BL_INFO, "worker %s destructor", (const char *) arg);
+}
+
+static void *binlog_worker(void *arg)
+{
+    for (int i = 0; i < 100; i++)
+        BINLOG(BL_INFO, "worker %s iteration %d", (const char *) arg, i);
+    pthread_setspecific(binlog_test_key, arg);
+    return NULL;
+}
+
+static void test_binlog_roundtrip(void **state) {
+    (void) state;
+
+    char path[] = "/tmp/binlog-XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    int saved_level = atomic_load(&binlog_level);
+    assert_int_equal(binlog_open(path), 0);
+    binlog_set_level(BL_INFO);
+
+    char name[] = "alpha";
+    size_t big = 1UL << 40;
+    BINLOG(BL_INFO, "mixed %d %u %zu %s %5.2f %x%%", -7, 7u, big, name, 3.14159, 255);
+    BINLOG(BL_DEBUG, "filtered at runtime %d", 1);
+    BINLOG(BL_ERROR, "no arguments");
+
+    pthread_t th;
+    assert_int_equal(pthread_key_create(&binlog_test_key, binlog_worker_exit), 0);
+    pthread_create(&th, NULL, binlog_worker, "beta");
+    pthread_join(th, NULL);
+    pthread_key_delete(binlog_test_key);
+    binlog_close();
+    atomic_store(&binlog_level, saved_level);
+
+    BinlogReader *r = binlog_reader_open(path);
+    assert_non_null(r);
+    char line[512];
+    int lines = 0, mixed = 0, errors = 0, workers = 0, destructors = 0;
+    while (binlog_reader_next(r, line, sizeof(line)) == 1) {
+        /* Threads are drained ring by ring, so only count matches */
+        if (strstr(line, "[INFO] src/test-all.c:") &&
+            strstr(line, "test_binlog_roundtrip(): mixed -7 7 1099511627776 alpha  3.14 ff%"))
+            mixed++;
+        if (strstr(line, "[ERROR]") && strstr(line, "no arguments"))
+            errors++;
+        if (strstr(line, "binlog_worker(): worker beta iteration"))
+            workers++;
+        if (strstr(line, "binlog_worker_exit(): worker beta destructor"))
+            destructors++;
+        lines++;
+    }
+    assert_int_equal(mixed, 1);
+    assert_int_equal(errors, 1);
+    assert_int_equal(workers, 100);
+    assert_int_equal(destructors, 1);
+    assert_int_equal(lines, 103);
+    binlog_reader_close(r);
+    unlink(path);
+}
+
+static void *metrics_worker(void *arg)
+{
+    Metric *counter = arg;
+    for (int i = 0; i < 10000; i++)
+        metrics_inc(counter);
+    return NULL;
+}
+
+static void test_metrics_registry_and_socket(void **state) {
+    (void) state;
+
+    Metric *requests = metrics_counter("test_requests_total", "Requests");
+    Metric *latency = metrics_histogram("test_latency_ns", "Latency");
+    Metric *depth = metrics_gauge("test_queue_depth", NULL);
+    assert_ptr_equal(metrics_counter("test_requests_total", NULL), requests);
+    assert_null(metrics_gauge("test_requests_total", NULL));
+
+    pthread_t th[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&th[i], NULL, metrics_worker, requests);
+    for (int i = 0; i < 4; i++)
+        pthread_join(th[i], NULL);
+    assert_int_equal(metrics_read(requests), 40000);
+
+    metrics_gauge_set(depth, 7);
+    metrics_gauge_add(depth, -2);
+    assert_int_equal(metrics_read(depth), 5);
+
+    /* 1..1000 us, quantiles are exact to one log-linear bucket (12.5%) */
+    for (uint64_t v = 1; v <= 1000; v++)
+        metrics_record(latency, v * 1000);
+    MetricHistogramSnapshot *snap = malloc(sizeof(*snap));
+    metrics_hist_snapshot(latency, snap);
+    assert_int_equal(snap->count, 1000);
+    assert_int_equal(snap->max, 1000000);
+    uint64_t p50 = metrics_hist_quantile(snap, 0.5);
+    uint64_t p99 = metrics_hist_quantile(snap, 0.99);
+    assert_true(p50 >= 500000 && p50 <= 500000 * 9 / 8);
+    assert_true(p99 >= 990000 && p99 <= 1000000);
+    free(snap);
+
+    MemoryPool *mp = pool_init(64, 16);
+    pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+    assert_int_equal(metrics_register_pool("test_pool", mp, &pool_lock), 0);
+    pthread_mutex_lock(&pool_lock);
+    void *a = pool_malloc(mp), *b = pool_malloc(mp);
+    pool_free(mp, a);
+    pool_free(mp, b);
+    pthread_mutex_unlock(&pool_lock);
+    assert_int_equal(mp->high_water, 2);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/metrics-test-%d.sock", (int) getpid());
+    assert_int_equal(metrics_serve(path), 0);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    assert_int_equal(connect(fd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+    char text[8192];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fd, text + len, sizeof(text) - 1 - len)) > 0)
+        len += (size_t) n;
+    text[len] = 0;
+    close(fd);
+
+    assert_non_null(strstr(text, "# TYPE test_requests_total counter\ntest_requests_total 40000\n"));
+    assert_non_null(strstr(text, "test_queue_depth 5\n"));
+    assert_non_null(strstr(text, "test_latency_ns_count 1000\n"));
+    assert_non_null(strstr(text, "test_latency_ns{quantile=\"0.5\"}"));
+    assert_non_null(strstr(text, "test_pool_free_blocks 16\n"));
+    assert_non_null(strstr(text, "test_pool_high_water 2\n"));
+
+    metrics_destroy();
+    pool_destroy(mp);
+}
+
+static void test_tls_handshake_trace(void **state) {
+    (void) state;
+
+    char path[] = "/tmp/tls-trace-XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+    assert_int_equal(TLS_trace_open(path, 1), 0);
+
+    RingBuffer *c2s = rbuf_init_buffer_size(32 * 1024);
+    RingBuffer *s2c = rbuf_init_buffer_size(32 * 1024);
+    TLSConnection *server = TLS_init_server();
+    TLSConnection *client = TLS_init_client();
+    assert_int_equal(CA_generate_self_signed(&server, "localhost"), 1);
+    assert_int_equal(TLS_init_ssl_for_buffers(&server, c2s, s2c), 1);
+    assert_int_equal(TLS_init_ssl_for_buffers(&client, s2c, c2s), 1);
+    SSL_set_accept_state(server->ssl);
+    SSL_set_connect_state(client->ssl);
+    assert_true(tls_pump_handshake(client->ssl, server->ssl));
+
+    /* Post-handshake messages like TLS 1.3 session tickets run the handshake
+     * callbacks again on some OpenSSL versions, that is no new handshake */
+    char byte = 0;
+    assert_int_equal(SSL_write(server->ssl, "x", 1), 1);
+    assert_int_equal(SSL_read(client->ssl, &byte, 1), 1);
+    assert_int_equal(byte, 'x');
+    TLS_trace_info(client->ssl, SSL_CB_HANDSHAKE_START, 1);
+    TLS_trace_info(client->ssl, SSL_CB_HANDSHAKE_DONE, 1);
+
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+    rbuf_free_buffer(c2s);
+    rbuf_free_buffer(s2c);
+
+    /* Server without a certificate fails with retryable-looking ret < 0 exits */
+    c2s = rbuf_init_buffer_size(32 * 1024);
+    s2c = rbuf_init_buffer_size(32 * 1024);
+    server = TLS_init_server();
+    client = TLS_init_client();
+    assert_int_equal(TLS_init_ssl_for_buffers(&server, c2s, s2c), 1);
+    assert_int_equal(TLS_init_ssl_for_buffers(&client, s2c, c2s), 1);
+    SSL_set_accept_state(server->ssl);
+    SSL_set_connect_state(client->ssl);
+    assert_false(tls_pump_handshake(client->ssl, server->ssl));
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+    rbuf_free_buffer(c2s);
+    rbuf_free_buffer(s2c);
+
+    /* Freed after the ClientHello, never finished */
+    c2s = rbuf_init_buffer_size(32 * 1024);
+    s2c = rbuf_init_buffer_size(32 * 1024);
+    client = TLS_init_client();
+    assert_int_equal(TLS_init_ssl_for_buffers(&client, s2c, c2s), 1);
+    SSL_set_connect_state(client->ssl);
+    assert_int_equal(SSL_do_handshake(client->ssl), -1);
+    TLS_free_connection(&client);
+    rbuf_free_buffer(c2s);
+    rbuf_free_buffer(s2c);
+    TLS_trace_close();
+
+    FILE *f = fopen(path, "r");
+    assert_non_null(f);
+    char *text = calloc(1, 65536);
+    size_t len = fread(text, 1, 65535, f);
+    fclose(f);
+    assert_true(len > 0);
+
+    assert_int_equal(text[0], '[');
+    assert_non_null(strstr(text, "\"name\":\"handshake (server)\",\"cat\":\"handshake\",\"ph\":\"X\""));
+    /* ok, failed and aborted, none for the post-handshake messages */
+    int client_spans = 0;
+    for (char *p = text; (p = strstr(p, "\"name\":\"handshake (client)\"")) != NULL; p++)
+        client_spans++;
+    assert_int_equal(client_spans, 3);
+    assert_non_null(strstr(text, "\"result\":\"ok\""));
+    assert_non_null(strstr(text, "\"name\":\"SSLv3/TLS write server hello\",\"cat\":\"state\""));
+    char *failed = strstr(text, "\"result\":\"failed\"");
+    assert_non_null(failed);
+    assert_non_null(strstr(failed + 1, "\"result\":\"failed\""));
+    assert_non_null(strstr(text, "\"result\":\"aborted\""));
+    assert_non_null(strstr(text, "\n]\n"));
+    free(text);
+    unlink(path);
+}
+
+typedef struct {
+    SSL_CTX *ctx;
+    int listen_fd;
+    atomic_int conns;
+    atomic_int open;
+    atomic_size_t bytes;
+} SinkServer;
+
+typedef struct {
+    SinkServer *srv;
+    SSL *ssl;
+} SinkConn;
+
+static void *sink_reader(void *arg)
+{
+    SinkConn *sc = arg;
+    char buf[512];
+    int n;
+    while ((n = SSL_read(sc->ssl, buf, sizeof(buf))) > 0)
+        atomic_fetch_add(&sc->srv->bytes, (size_t) n);
+    close(SSL_get_fd(sc->ssl));
+    SSL_free(sc->ssl);
+    atomic_fetch_sub(&sc->srv->open, 1);
+    free(sc);
+    return NULL;
+}
+
+/* Keep-alive server reading until the client goes away */
+static void *sink_acceptor(void *arg)
+{
+    SinkServer *srv = arg;
+    int fd;
+
+    /* Tickets may be written after the client already left, reader threads inherit this */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    while ((fd = accept(srv->listen_fd, NULL, NULL)) >= 0) {
+        SinkConn *sc = malloc(sizeof(SinkConn));
+        sc->srv = srv;
+        sc->ssl = SSL_new(srv->ctx);
+        SSL_set_fd(sc->ssl, fd);
+        if (SSL_accept(sc->ssl) != 1) {
+            SSL_free(sc->ssl);
+            close(fd);
+            free(sc);
+            continue;
+        }
+        atomic_fetch_add(&srv->conns, 1);
+        atomic_fetch_add(&srv->open, 1);
+        pthread_t th;
+        pthread_create(&th, NULL, sink_reader, sc);
+        pthread_detach(th);
+    }
+    return NULL;
+}
+
+static void count_sent(void *arg, int status)
+{
+    if (status == 0) atomic_fetch_add((atomic_int *) arg, 1);
+}
+
+/* Loopback listener for sink_acceptor(), returns the port */
+static uint16_t sink_listen(SinkServer *srv)
+{
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    assert_int_equal(bind(srv->listen_fd, (struct sockaddr *) &addr, len), 0);
+    assert_int_equal(listen(srv->listen_fd, 16), 0);
+    assert_int_equal(getsockname(srv->listen_fd, (struct sockaddr *) &addr, &len), 0);
+    return ntohs(addr.sin_port);
+}
+
+static void test_client_pool_keepalive(void **state) {
+    (void) state;
+
+    TLSConnection *server = TLS_init_server();
+    assert_int_equal(CA_generate_self_signed(&server, "localhost"), 1);
+    SinkServer srv = { .ctx = server->ctx };
+    SinkServer other = { .ctx = server->ctx };
+    uint16_t port = sink_listen(&srv);
+    uint16_t other_port = sink_listen(&other);
+    pthread_t acceptor, other_acceptor;
+    pthread_create(&acceptor, NULL, sink_acceptor, &srv);
+    pthread_create(&other_acceptor, NULL, sink_acceptor, &other);
+
+    TLSConnection *client = TLS_init_client();
+    ClientPoolOpts opts = { .max_conns = 2, .idle_ns = 60ULL * 1000000000ULL };
+    ClientPool *pool = client_pool_init(&client, &opts);
+    assert_non_null(pool);
+
+    /* One handshake for a hundred blocking sends */
+    const char msg[8] = "message";
+    for (int i = 0; i < 100; i++)
+        assert_int_equal(client_pool_send(pool, "127.0.0.1", port, msg, sizeof(msg)), 0);
+
+    atomic_int done = 0;
+    for (int i = 0; i < 200; i++)
+        assert_int_equal(client_pool_send_async(pool, "127.0.0.1", port, msg, sizeof(msg), count_sent, &done), 0);
+    client_pool_flush(pool);
+    assert_int_equal(atomic_load(&done), 200);
+
+    ClientPoolStats st;
+    client_pool_get_stats(pool, &st);
+    assert_true(st.handshakes >= 1 && st.handshakes <= 2);
+    assert_int_equal(st.sent, 300);
+    assert_int_equal(st.failed, 0);
+
+    /* A connection that died while idle is replaced, not written to */
+    ClientConn *c = client_pool_acquire(pool, "127.0.0.1", port);
+    assert_non_null(c);
+    shutdown(c->fd, SHUT_RDWR);
+    client_pool_release(pool, c, 1);
+    assert_int_equal(client_pool_send(pool, "127.0.0.1", port, msg, sizeof(msg)), 0);
+    client_pool_get_stats(pool, &st);
+    assert_true(st.dead >= 1);
+
+    /* Replacements for evicted connections resume the session */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t later = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec + opts.idle_ns;
+    assert_true(client_pool_evict_idle(pool, later) >= 1);
+    size_t handshakes = st.handshakes;
+    assert_int_equal(client_pool_send(pool, "127.0.0.1", port, msg, sizeof(msg)), 0);
+    client_pool_get_stats(pool, &st);
+    assert_int_equal(st.handshakes, handshakes + 1);
+    assert_true(st.resumed >= 1);
+
+    /* With every connection to one endpoint taken, the worker serves the others */
+    ClientConn *held[2];
+    for (int i = 0; i < 2; i++)
+        assert_non_null(held[i] = client_pool_acquire(pool, "127.0.0.1", port));
+    atomic_int done_held = 0, done_other = 0;
+    assert_int_equal(client_pool_send_async(pool, "127.0.0.1", port, msg, sizeof(msg), count_sent, &done_held), 0);
+    assert_int_equal(client_pool_send_async(pool, "127.0.0.1", other_port, msg, sizeof(msg), count_sent,
+                                            &done_other), 0);
+    for (int i = 0; i < 500 && atomic_load(&done_other) == 0; i++)
+        usleep(10000);
+    assert_int_equal(atomic_load(&done_other), 1);
+    assert_int_equal(atomic_load(&done_held), 0);
+    for (int i = 0; i < 2; i++)
+        client_pool_release(pool, held[i], 1);
+    client_pool_flush(pool);
+    assert_int_equal(atomic_load(&done_held), 1);
+    client_pool_get_stats(pool, &st);
+
+    client_pool_destroy(pool);
+    for (int i = 0; i < 500 && atomic_load(&srv.open) + atomic_load(&other.open) > 0; i++)
+        usleep(10000);
+    assert_int_equal(atomic_load(&srv.open), 0);
+    assert_int_equal(atomic_load(&other.open), 0);
+    assert_int_equal(atomic_load(&srv.bytes), 303 * sizeof(msg));
+    assert_int_equal(atomic_load(&other.bytes), sizeof(msg));
+    assert_int_equal(atomic_load(&srv.conns) + atomic_load(&other.conns), (int) st.handshakes);
+
+    shutdown(srv.listen_fd, SHUT_RDWR);
+    shutdown(other.listen_fd, SHUT_RDWR);
+    pthread_join(acceptor, NULL);
+    pthread_join(other_acceptor, NULL);
+    close(srv.listen_fd);
+    close(other.listen_fd);
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+}
+
+typedef struct {
+    char data[256];
+    size_t len;
+    size_t budget;              /* bytes accepted before EAGAIN */
+} PubSubSink;
+
+static ssize_t pubsub_sink_write(void *ctx, const void *buf, size_t len)
+{
+    PubSubSink *sink = ctx;
+    if (sink->budget == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = len < sink->budget ? len : sink->budget;
+    if (n > 3) n = 3;
+    memcpy(sink->data + sink->len, buf, n);
+    sink->len += n;
+    sink->budget -= n;
+    return (ssize_t) n;
+}
+
+static void test_pubsub_fanout_shared_buffers(void **state) {
+    (void) state;
+
+    PubSub *ps = pubsub_init(64, 3);
+    assert_non_null(ps);
+    assert_int_equal(ps->queue_len, 4);
+
+    PubSubSink sinks[3];
+    PubSubSubscriber *subs[3];
+    memset(sinks, 0, sizeof(sinks));
+    for (int i = 0; i < 3; i++) {
+        subs[i] = pubsub_subscriber_new(ps, &sinks[i]);
+        assert_non_null(subs[i]);
+        assert_int_equal(pubsub_subscribe(subs[i], "news"), 0);
+    }
+    assert_int_equal(pubsub_subscribe(subs[0], "news"), 0);
+    assert_int_equal(pubsub_subscribe(subs[2], "sports"), 0);
+    assert_int_equal(pubsub_publish(ps, "weather", "x", 1), 0);
+
+    /* One copy in one pool block, queued to every subscriber */
+    const char msg[] = "breaking news";
+    assert_int_equal(pubsub_publish(ps, "news", msg, sizeof(msg)), 3);
+    assert_ptr_equal(subs[0]->queue[0], subs[1]->queue[0]);
+    assert_ptr_equal(subs[0]->queue[0], subs[2]->queue[0]);
+    assert_true(pool_owns(ps->pool, subs[0]->queue[0]));
+    assert_int_equal(pubsub_publish(ps, "sports", "goal", 5), 1);
+
+    /* Partial writes resume from the same offset */
+    sinks[0].budget = 5;
+    assert_int_equal(pubsub_flush(subs[0], pubsub_sink_write, &sinks[0]), 5);
+    assert_int_equal(pubsub_pending(subs[0]), 1);
+    sinks[0].budget = sizeof(sinks[0].data);
+    assert_int_equal(pubsub_flush(subs[0], pubsub_sink_write, &sinks[0]), sizeof(msg) - 5);
+    assert_memory_equal(sinks[0].data, msg, sizeof(msg));
+
+    sinks[1].budget = sizeof(sinks[1].data);
+    assert_int_equal(pubsub_flush(subs[1], pubsub_sink_write, &sinks[1]), sizeof(msg));
+    PubSubStats stats;
+    pubsub_get_stats(ps, &stats);
+    assert_int_equal(stats.live, 2);
+
+    sinks[2].budget = sizeof(sinks[2].data);
+    assert_int_equal(pubsub_flush(subs[2], pubsub_sink_write, &sinks[2]), sizeof(msg) + 5);
+    assert_memory_equal(sinks[2].data + sizeof(msg), "goal", 5);
+    pubsub_get_stats(ps, &stats);
+    assert_int_equal(stats.live, 0);
+
+    /* A subscriber that does not keep up misses messages past its queue */
+    for (int i = 0; i < 6; i++) {
+        sinks[0].len = 0;
+        assert_int_equal(pubsub_publish(ps, "news", "tick", 5), i < 4 ? 3 : 2);
+        assert_int_equal(pubsub_flush(subs[0], pubsub_sink_write, &sinks[0]), 5);
+        assert_int_equal(pubsub_flush(subs[2], pubsub_sink_write, &sinks[2]), 5);
+    }
+    assert_int_equal(subs[1]->dropped, 2);
+    pubsub_get_stats(ps, &stats);
+    assert_int_equal(stats.published, 9);
+    assert_int_equal(stats.dropped, 2);
+    assert_int_equal(stats.live, 4);
+
+    /* Queued references go away with the subscriber */
+    pubsub_subscriber_free(subs[1]);
+    pubsub_get_stats(ps, &stats);
+    assert_int_equal(stats.live, 0);
+
+    /* Larger than the pool blocks, encrypted straight from the shared buffer */
+    RingBuffer *c2s = rbuf_init_buffer_size(32 * 1024);
+    RingBuffer *s2c = rbuf_init_buffer_size(32 * 1024);
+    TLSConnection *server = TLS_init_server();
+    TLSConnection *client = TLS_init_client();
+    assert_int_equal(CA_generate_self_signed(&server, "localhost"), 1);
+    assert_int_equal(TLS_init_ssl_for_buffers(&server, c2s, s2c), 1);
+    assert_int_equal(TLS_init_ssl_for_buffers(&client, s2c, c2s), 1);
+    SSL_set_accept_state(server->ssl);
+    SSL_set_connect_state(client->ssl);
+    assert_true(tls_pump_handshake(client->ssl, server->ssl));
+
+    char big[1000], buf[1000];
+    memset(big, 'p', sizeof(big));
+    assert_int_equal(pubsub_publish(ps, "sports", big, sizeof(big)), 1);
+    assert_false(pool_owns(ps->pool, subs[2]->queue[subs[2]->head & subs[2]->queue_mask]));
+    assert_int_equal(pubsub_flush(subs[2], pubsub_ssl_write, server->ssl), sizeof(big));
+    assert_int_equal(SSL_read(client->ssl, buf, sizeof(buf)), sizeof(big));
+    assert_memory_equal(buf, big, sizeof(big));
+
+    pubsub_subscriber_free(subs[0]);
+    pubsub_subscriber_free(subs[2]);
+    pubsub_get_stats(ps, &stats);
+    assert_int_equal(stats.live, 0);
+    assert_null(ps->topics);
+    pubsub_destroy(ps);
+
+    TLS_free_connection(&client);
+    TLS_free_connection(&server);
+    rbuf_free_buffer(c2s);
+    rbuf_free_buffer(s2c);
+}
+
+static void test_hashmap_remove_negative_keys(void **state) {
+    (void) state;
+
+    HashMap *hm = HM_init(64);
+    assert_non_null(hm);
+    int values[48];
+    void *expected[48] = { 0 };
+
+    /* Random add/remove against a plain array, keys -24..23 collide a lot */
+    uint32_t x = 12345;
+    for (int op = 0; op < 20000; op++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        int slot = (int) (x % 48);
+        int key = slot - 24;
+        if (x & 0x10000) {
+            assert_ptr_equal(HM_remove_value(hm, key), expected[slot]);
+            expected[slot] = NULL;
+        } else {
+            assert_ptr_equal(HM_add_value(hm, key, &values[slot]), &values[slot]);
+            expected[slot] = &values[slot];
+        }
+        for (int k = 0; k < 48; k++)
+            assert_ptr_equal(HM_get_value(hm, k - 24), expected[k]);
+    }
+
+    /* IPv4 addresses in network byte order are negative as int */
+    int addr = (int) inet_addr("10.1.2.200");
+    assert_true(addr < 0);
+    assert_non_null(HM_add_value(hm, addr, &values[0]));
+    assert_ptr_equal(HM_get_value(hm, addr), &values[0]);
+    assert_ptr_equal(HM_remove_value(hm, addr), &values[0]);
+    assert_null(HM_remove_value(hm, addr));
+    HM_free(&hm);
+}
+
+typedef struct {
+    AdmissionControl *adm;
+    atomic_int started;
+} AdmissionWaiter;
+
+static void *admission_waiter(void *arg)
+{
+    AdmissionWaiter *w = arg;
+    admission_begin(w->adm);
+    atomic_store(&w->started, 1);
+    admission_end(w->adm);
+    return NULL;
+}
+
+static void test_admission_token_buckets(void **state) {
+    (void) state;
+
+    const uint64_t sec = 1000000000ULL;
+    uint32_t a = inet_addr("10.0.0.1"), b = inet_addr("10.0.0.2");
+    AdmissionOpts opts = { .rate = 1.0, .burst = 2.0, .max_in_flight = 1, .max_queued = 1, .max_sources = 2 };
+    AdmissionControl *adm = admission_init(&opts);
+    assert_non_null(adm);
+
+    /* One handshake running, one queued, the rest closed at once */
+    assert_int_equal(admission_try(adm, a, 0), ADMIT_OK);
+    assert_int_equal(admission_try(adm, a, 0), ADMIT_OK);
+    assert_int_equal(admission_try(adm, b, 0), ADMIT_BUSY);
+
+    admission_begin(adm);
+    AdmissionWaiter w = { .adm = adm };
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, admission_waiter, &w), 0);
+    AdmissionStats stats;
+    for (int i = 0; i < 1000; i++) {
+        admission_get_stats(adm, &stats);
+        if (stats.queued == 1) break;
+        usleep(1000);
+    }
+    assert_int_equal(stats.in_flight, 1);
+    assert_int_equal(stats.queued, 1);
+    usleep(20000);
+    assert_int_equal(atomic_load(&w.started), 0);
+    admission_end(adm);
+    pthread_join(thread, NULL);
+    assert_int_equal(atomic_load(&w.started), 1);
+
+    /* Out of tokens until the bucket refills, other sources unaffected */
+    assert_int_equal(admission_try(adm, a, sec / 2), ADMIT_RATE_LIMITED);
+    assert_int_equal(admission_try(adm, b, sec / 2), ADMIT_OK);
+    admission_cancel(adm);
+    assert_int_equal(admission_try(adm, a, sec), ADMIT_OK);
+    admission_cancel(adm);
+
+    /* Full table: refilled buckets are dropped, later sources share one */
+    uint32_t c = inet_addr("10.0.0.3"), d = inet_addr("10.0.0.4");
+    uint32_t e = inet_addr("10.0.0.5"), f = inet_addr("10.0.0.6");
+    assert_int_equal(admission_try(adm, c, 10 * sec), ADMIT_OK);
+    admission_cancel(adm);
+    assert_int_equal(admission_try(adm, d, 10 * sec), ADMIT_OK);
+    admission_cancel(adm);
+    admission_get_stats(adm, &stats);
+    assert_int_equal(stats.sources, 2);
+    assert_int_equal(admission_try(adm, e, 10 * sec), ADMIT_OK);
+    admission_cancel(adm);
+    assert_int_equal(admission_try(adm, f, 10 * sec), ADMIT_OK);
+    admission_cancel(adm);
+    assert_int_equal(admission_try(adm, e, 10 * sec), ADMIT_RATE_LIMITED);
+    assert_int_equal(admission_try(adm, c, 10 * sec), ADMIT_OK);
+    admission_cancel(adm);
+
+    admission_get_stats(adm, &stats);
+    assert_int_equal(stats.admitted, 9);
+    assert_int_equal(stats.rate_limited, 2);
+    assert_int_equal(stats.busy, 1);
+    assert_int_equal(stats.in_flight + stats.queued, 0);
+    admission_destroy(adm);
+
+    /* Defaults scale with the CPUs */
+    adm = admission_init(NULL);
+    assert_non_null(adm);
+    assert_int_equal(adm->max_in_flight, sysconf(_SC_NPROCESSORS_ONLN));
+    assert_int_equal(adm->max_queued, adm->max_in_flight * ADMISSION_QUEUE_PER_SLOT);
+    admission_destroy(adm);
+}
+
+static void topo_write(const char *root, const char *rel, const char *content)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    if (content == NULL) {
+        assert_int_equal(mkdir(path, 0700), 0);
+        return;
+    }
+    FILE *f = fopen(path, "w");
+    assert_non_null(f);
+    fputs(content, f);
+    fclose(f);
+}
+
+typedef struct {
+    Topology *topo;
+    int node;
+} TopoProbe;
+
+static void *topo_probe_thread(void *arg)
+{
+    TopoProbe *probe = arg;
+    probe->node = topology_node_of_cpu(probe->topo, -1);
+    return NULL;
+}
+
+static void test_topology_sysfs_node_pools(void **state) {
+    (void) state;
+
+    /* Two nodes with CPUs and one with memory only */
+    char root[] = "/tmp/topology-XXXXXX";
+    assert_non_null(mkdtemp(root));
+    const char *dirs[] = { "devices", "devices/system", "devices/system/node",
+                           "devices/system/node/node1", "devices/system/node/node0",
+                           "devices/system/node/node2" };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+        topo_write(root, dirs[i], NULL);
+    topo_write(root, "devices/system/node/node1/cpulist", "1-3,5-5\n");
+    topo_write(root, "devices/system/node/node0/cpulist", "0,4\n");
+    topo_write(root, "devices/system/node/node2/cpulist", "\n");
+    topo_write(root, "devices/system/node/possible", "0-2\n");
+
+    Topology topo;
+    assert_int_equal(topology_load(&topo, root), 2);
+    assert_true(topology_is_numa(&topo));
+    assert_int_equal(topo.cpu_count, 6);
+    assert_int_equal(topo.nodes[0].id, 0);
+    assert_int_equal(topo.nodes[0].cpu_count, 2);
+    assert_int_equal(topo.nodes[1].id, 1);
+    assert_int_equal(topo.nodes[1].cpu_count, 4);
+    assert_int_equal(topology_node_of_cpu(&topo, 4), 0);
+    assert_int_equal(topology_node_of_cpu(&topo, 5), 1);
+
+    /* Threads created with the node's attributes run on its CPUs */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    assert_int_equal(topology_attr_set_node(&topo, &attr, 0), 0);
+    TopoProbe probe = { .topo = &topo, .node = -1 };
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, &attr, topo_probe_thread, &probe), 0);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+    assert_int_equal(probe.node, 0);
+
+    /* No node directories: all online CPUs are one node */
+    const char *rm[] = { "devices/system/node/node0/cpulist", "devices/system/node/node1/cpulist",
+                         "devices/system/node/node2/cpulist", "devices/system/node/possible" };
+    char path[256];
+    for (size_t i = 0; i < sizeof(rm) / sizeof(rm[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, rm[i]);
+        unlink(path);
+    }
+    for (int i = (int) (sizeof(dirs) / sizeof(dirs[0])) - 1; i >= 2; i--) {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+        rmdir(path);
+    }
+    topo_write(root, "devices/system/cpu", NULL);
+    topo_write(root, "devices/system/cpu/online", "0-7\n");
+    assert_int_equal(topology_load(&topo, root), 1);
+    assert_false(topology_is_numa(&topo));
+    assert_int_equal(topo.cpu_count, 8);
+
+    /* Single node: pinning does nothing, node-local pools still work */
+    assert_int_equal(topology_pin_thread(&topo, pthread_self(), 0, 3), 0);
+    MemoryPoolOpts opts = { .slab_blocks = 64, .flags = POOL_GROWABLE | POOL_NODE_LOCAL, .node = 0 };
+    MemoryPool *mp = pool_init_ex(256, &opts);
+    assert_non_null(mp);
+    void *blocks[100];
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = pool_malloc(mp);
+        assert_non_null(blocks[i]);
+        memset(blocks[i], i, 256);
+    }
+    assert_int_equal(mp->slab_count, 2);
+    for (int i = 0; i < 100; i++)
+        pool_free(mp, blocks[i]);
+    pool_destroy(mp);
+
+    snprintf(path, sizeof(path), "%s/devices/system/cpu/online", root);
+    unlink(path);
+    const char *left[] = { "devices/system/cpu", "devices/system", "devices", "" };
+    for (size_t i = 0; i < sizeof(left) / sizeof(left[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, left[i]);
+        assert_int_equal(rmdir(path), 0);
+    }
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_md_sha256_update),
         cmocka_unit_test(test_md_sha256_multiple_updates),
+        cmocka_unit_test(test_md_sha256_batch),
+        cmocka_unit_test(test_md_registry_thread_pool),
+        cmocka_unit_test(test_md_register_copies_name),
+        cmocka_unit_test(test_merkle_file_tree),
+        cmocka_unit_test(test_aead_vectors_iov_batch),
+        cmocka_unit_test(test_mpsc_queue_order_batch_wakeup),
+        cmocka_unit_test(test_pool_cache_magazines),
+        cmocka_unit_test(test_pool_growable_slabs),
+        cmocka_unit_test(test_size_class_alloc),
+        cmocka_unit_test(test_arena_mark_rewind_reset),
+        cmocka_unit_test(test_typed_pool),
+        cmocka_unit_test(test_rbuf_sized_peek_skip),
+        cmocka_unit_test(test_rbuf_mirrored_in_place),
+        cmocka_unit_test(test_spsc_ring_wrap_full_cached),
+        cmocka_unit_test(test_tls_over_ring_buffers),
+        cmocka_unit_test(test_tls_client_whitelist_runtime_keys),
+        cmocka_unit_test(test_tls_key_types_client_whitelist),
+        cmocka_unit_test(test_tls_lean_idle_buffers),
+        cmocka_unit_test(test_rbuf_journal_persist_replay),
+        cmocka_unit_test(test_binlog_roundtrip),
+        cmocka_unit_test(test_metrics_registry_and_socket),
+        cmocka_unit_test(test_tls_handshake_trace),
+        cmocka_unit_test(test_client_pool_keepalive),
+        cmocka_unit_test(test_pubsub_fanout_shared_buffers),
+        cmocka_unit_test(test_hashmap_remove_negative_keys),
+        cmocka_unit_test(test_admission_token_buckets),
+        cmocka_unit_test(test_topology_sysfs_node_pools),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,243 @@
+/******************************************************************************
+ *  tls-bio.c
+ *
+ *  OpenSSL BIO backed by a pair of RingBuffers.
+ *
+ *  Description:
+ *  With SSL_set_fd() OpenSSL issues its own read()/write() for every TLS
+ *  record.  This BIO decouples TLS processing from socket I/O: OpenSSL
+ *  reads ciphertext from an input RingBuffer and writes ciphertext to an
+ *  output RingBuffer, and the event loop moves data between the socket and
+ *  the buffers with large readv()/writev() calls.
+ *   - TLS_bio_new(): create a BIO on top of two caller owned buffers
+ *   - TLS_init_ssl_for_buffers(): like TLS_init_ssl_for_socket()
+ *   - TLS_bio_fill_from_socket(): readv() into free space of the input
+ *   - TLS_bio_drain_to_socket(): writev() pending output
+ *   - TLS_bio_set_eof(): peer closed, reads return EOF once drained
+ *
+ *  Implementation details:
+ *   - The BIO_METHOD is created once and shared by all connections.
+ *   - Writes only use free space in the output buffer, the ring's overwrite
+ *     mode would silently drop unsent records.
+ *   - An empty input or full output sets the retry flags, so SSL_read()
+ *     and SSL_write() report SSL_ERROR_WANT_READ/WANT_WRITE.
+ *   - The same code runs over plain in-memory buffer pairs, which is how
+ *     the tests drive a full handshake without sockets.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "tls-bio.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+typedef struct TLS_BIO_T {
+    RingBuffer *in;
+    RingBuffer *out;
+    int eof;
+} TLSBioData;
+
+static BIO_METHOD *rbuf_method = NULL;
+static pthread_once_t rbuf_method_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Classic read/write callbacks: -1 with a retry flag when the buffer is
+ * empty/full, 0 on EOF, like the socket and memory BIOs.  SSL_read() and
+ * SSL_write() then return -1 and SSL_get_error() reports WANT_READ/WRITE.
+ */
+static int rbuf_bio_write(BIO *bio, const char *data, int len)
+{
+    TLSBioData *d = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    if (len <= 0) return 0;
+
+    size_t free = rbuf_get_free_space(d->out);
+    if (free == 0) {
+        BIO_set_retry_write(bio);
+        return -1;
+    }
+    if ((size_t) len > free)
+        len = (int) free;
+
+    /* Never let the ring overwrite unsent ciphertext */
+    rbuf_store_data(d->out, (uint8_t *) data, (size_t) len);
+    return len;
+}
+
+static int rbuf_bio_read(BIO *bio, char *data, int len)
+{
+    TLSBioData *d = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    if (len <= 0) return 0;
+
+    if (rbuf_get_readable(d->in) == 0) {
+        if (d->eof) return 0;
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    return (int) rbuf_pop_data(d->in, (uint8_t *) data, (size_t) len);
+}
+
+static long rbuf_bio_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+    (void) num;
+    (void) ptr;
+    TLSBioData *d = BIO_get_data(bio);
+
+    switch (cmd) {
+    case BIO_CTRL_FLUSH:
+        return 1;
+    case BIO_CTRL_PENDING:
+        return (long) rbuf_get_readable(d->in);
+    case BIO_CTRL_WPENDING:
+        return (long) rbuf_get_readable(d->out);
+    case BIO_CTRL_EOF:
+        return d->eof && rbuf_get_readable(d->in) == 0;
+    default:
+        return 0;
+    }
+}
+
+static int rbuf_bio_create(BIO *bio)
+{
+    TLSBioData *d = calloc(1, sizeof(TLSBioData));
+    if (d == NULL) return 0;
+    BIO_set_data(bio, d);
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static int rbuf_bio_destroy(BIO *bio)
+{
+    free(BIO_get_data(bio));
+    BIO_set_data(bio, NULL);
+    BIO_set_init(bio, 0);
+    return 1;
+}
+
+static void rbuf_method_init(void)
+{
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "ring buffer");
+    if (m == NULL) return;
+
+    if (!BIO_meth_set_write(m, rbuf_bio_write) ||
+        !BIO_meth_set_read(m, rbuf_bio_read) ||
+        !BIO_meth_set_ctrl(m, rbuf_bio_ctrl) ||
+        !BIO_meth_set_create(m, rbuf_bio_create) ||
+        !BIO_meth_set_destroy(m, rbuf_bio_destroy)) {
+        BIO_meth_free(m);
+        return;
+    }
+    rbuf_method = m;
+}
+
+BIO *TLS_bio_new(RingBuffer *in, RingBuffer *out)
+{
+    pthread_once(&rbuf_method_once, rbuf_method_init);
+    if (rbuf_method == NULL) {
+        ERROR_PRINT("Cannot create ring buffer BIO method");
+        return NULL;
+    }
+
+    BIO *bio = BIO_new(rbuf_method);
+    if (bio == NULL) {
+        ERROR_PRINT("Cannot create ring buffer BIO");
+        return NULL;
+    }
+
+    TLSBioData *d = BIO_get_data(bio);
+    d->in = in;
+    d->out = out;
+    return bio;
+}
+
+void TLS_bio_set_eof(BIO *bio)
+{
+    TLSBioData *d = BIO_get_data(bio);
+    if (d) d->eof = 1;
+}
+
+int TLS_init_ssl_for_buffers(TLSConnection **tls, RingBuffer *in, RingBuffer *out)
+{
+    SSL *ssl = SSL_new((*tls)->ctx);
+    if (ssl == NULL) {
+        ERROR_PRINT("Could not get ssl structure");
+        return -1;
+    }
+
+    BIO *bio = TLS_bio_new(in, out);
+    if (bio == NULL) {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    /* SSL takes over the single reference for both directions */
+    SSL_set_bio(ssl, bio, bio);
+    (*tls)->ssl = ssl;
+    return 1;
+}
+
+ssize_t TLS_bio_fill_from_socket(int fd, RingBuffer *in)
+{
+    struct iovec iov[2];
+    int iovcnt;
+
+    if (rbuf_write_iov(in, iov, &iovcnt) == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = readv(fd, iov, iovcnt);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        rbuf_commit(in, (size_t) n);
+    return n;
+}
+
+ssize_t TLS_bio_drain_to_socket(int fd, RingBuffer *out)
+{
+    struct iovec iov[2];
+    int iovcnt;
+
+    if (rbuf_peek(out, iov, &iovcnt) == 0)
+        return 0;
+
+    /* A peer that went away must not kill the process with SIGPIPE */
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t) iovcnt };
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK)
+            n = writev(fd, iov, iovcnt);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        rbuf_consume(out, (size_t) n);
+    return n;
+}
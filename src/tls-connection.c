@@ -1,8 +1,11 @@
 #include "tls-connection.h"
+#include "tls-trace.h"
 #include "logging.h"
 
 static void tls_info_callback(const SSL *ssl, int where, int ret) {
     const char *state = "";
+
+    TLS_trace_info(ssl, where, ret);
     
     if (where & SSL_CB_HANDSHAKE_START) {
         DEBUG_PRINT("[TLS] Handshake started\n");
@@ -0,0 +1,333 @@
+/******************************************************************************
+ *  tls-lean.c
+ *
+ *  Memory-lean TLS connections for servers with many idle clients.
+ *
+ *  Description:
+ *  An idle connection normally pins OpenSSL's read and write buffers (34
+ *  KiB and more) and its application ring buffers.  Here both are only
+ *  held while bytes are in flight:
+ *   - TLS_set_lean_mode(): SSL_MODE_RELEASE_BUFFERS on the context
+ *   - TLS_lean_pool_init(): shared pool of ring buffer blocks
+ *   - TLS_lean_conn_new(), TLS_lean_handshake(), TLS_lean_read(),
+ *     TLS_lean_write(), TLS_lean_flush(): non-blocking connection I/O
+ *   - TLS_lean_shrink(): drop the buffers of an idle connection
+ *
+ *  Implementation details:
+ *   - The connection embeds its two RingBuffer headers and the ring
+ *     buffer BIO points at them.  Only the data pointer comes and goes,
+ *     an unbacked ring has size 0 and looks full/empty to the BIO.
+ *   - Both rings are attached before every SSL call and empty ones are
+ *     released afterwards (idle_ns 0) or by TLS_lean_shrink(), so busy
+ *     request/response connections don't bounce blocks through the pool.
+ *   - Blocks come from a growable MemoryPool behind a PoolCache, so idle
+ *     slabs are unmapped and any thread may release a block.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "tls-lean.h"
+#include "tls-bio.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define TLS_LEAN_SLAB_BLOCKS 16
+#define TLS_LEAN_MAG_SIZE 8
+
+static uint64_t lean_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void TLS_set_lean_mode(TLSConnection **tls)
+{
+    if (tls == NULL || *tls == NULL) return;
+    SSL_CTX_set_mode((*tls)->ctx, SSL_MODE_RELEASE_BUFFERS);
+}
+
+TLSLeanPool *TLS_lean_pool_init(size_t buffer_size, uint64_t idle_ns)
+{
+    size_t size = TLS_LEAN_BUFFER_SIZE;
+    if (buffer_size) {
+        size = 1;
+        while (size < buffer_size) size <<= 1;
+    }
+
+    TLSLeanPool *lp = calloc(1, sizeof(TLSLeanPool));
+    if (lp == NULL) {
+        ERROR_PRINT("Cannot allocate memory for lean buffer pool");
+        return NULL;
+    }
+
+    MemoryPoolOpts opts = {
+        .slab_blocks = TLS_LEAN_SLAB_BLOCKS,
+        .max_slabs = 0,
+        .free_slab_watermark = 1,
+        .flags = POOL_GROWABLE,
+    };
+    lp->pool = pool_init_ex(size, &opts);
+    lp->cache = lp->pool ? pcache_init(lp->pool, TLS_LEAN_MAG_SIZE, 2) : NULL;
+    if (lp->cache == NULL) {
+        ERROR_PRINT("Cannot create lean buffer pool");
+        pool_destroy(lp->pool);
+        free(lp);
+        return NULL;
+    }
+
+    lp->buffer_size = size;
+    lp->idle_ns = idle_ns;
+    DEBUG_PRINT("Lean buffer pool initialized, %zu byte buffers", size);
+    return lp;
+}
+
+void TLS_lean_pool_destroy(TLSLeanPool *lp)
+{
+    if (lp == NULL) return;
+    size_t in_use = atomic_load(&lp->in_use);
+    if (in_use)
+        ERROR_PRINT("Lean buffer pool destroyed with %zu buffers in use", in_use);
+    pcache_destroy(lp->cache);
+    pool_destroy(lp->pool);
+    free(lp);
+}
+
+static int lean_attach(TLSLeanConn *c, RingBuffer *rb)
+{
+    if (rb->data != NULL) return 0;
+
+    uint8_t *block = pcache_malloc(c->pool->cache);
+    if (block == NULL) return -1;
+    atomic_fetch_add_explicit(&c->pool->in_use, 1, memory_order_relaxed);
+
+    rb->data = block;
+    rb->size = c->pool->buffer_size;
+    rb->mask = rb->size - 1;
+    rb->head = rb->tail = 0;
+    return 0;
+}
+
+static void lean_detach(TLSLeanConn *c, RingBuffer *rb)
+{
+    if (rb->data == NULL || rbuf_get_readable(rb) != 0) return;
+
+    pcache_free(c->pool->cache, rb->data);
+    atomic_fetch_sub_explicit(&c->pool->in_use, 1, memory_order_relaxed);
+    rb->data = NULL;
+    rb->size = 0;
+    rb->mask = 0;
+    rb->head = rb->tail = 0;
+}
+
+static int lean_begin(TLSLeanConn *c)
+{
+    if (lean_attach(c, &c->in) != 0 || lean_attach(c, &c->out) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void lean_end(TLSLeanConn *c)
+{
+    c->last_active = lean_now();
+    if (c->pool->idle_ns == 0) {
+        lean_detach(c, &c->in);
+        lean_detach(c, &c->out);
+    }
+}
+
+/* Send buffered ciphertext, 0 when everything went out */
+static int lean_drain(TLSLeanConn *c)
+{
+    while (rbuf_get_readable(&c->out) > 0) {
+        if (TLS_bio_drain_to_socket(c->fd, &c->out) < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    }
+    return 0;
+}
+
+/* 1 when new ciphertext arrived, 0 when none yet, -1 on EOF or error */
+static int lean_fill(TLSLeanConn *c)
+{
+    ssize_t n = TLS_bio_fill_from_socket(c->fd, &c->in);
+    if (n > 0) return 1;
+    if (n == 0) {
+        TLS_bio_set_eof(SSL_get_rbio(c->ssl));
+        return -1;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ? 0 : -1;
+}
+
+TLSLeanConn *TLS_lean_conn_new(TLSConnection **tls, TLSLeanPool *pool, int fd)
+{
+    if (tls == NULL || *tls == NULL || pool == NULL) return NULL;
+
+    TLSLeanConn *c = calloc(1, sizeof(TLSLeanConn));
+    if (c == NULL) {
+        ERROR_PRINT("Cannot allocate memory for lean connection");
+        return NULL;
+    }
+
+    c->ssl = SSL_new((*tls)->ctx);
+    BIO *bio = c->ssl ? TLS_bio_new(&c->in, &c->out) : NULL;
+    if (bio == NULL) {
+        ERROR_PRINT("Could not get ssl structure");
+        SSL_free(c->ssl);
+        free(c);
+        return NULL;
+    }
+    SSL_set_bio(c->ssl, bio, bio);
+    c->fd = fd;
+    c->pool = pool;
+    c->last_active = lean_now();
+    return c;
+}
+
+void TLS_lean_conn_free(TLSLeanConn *c)
+{
+    if (c == NULL) return;
+    SSL_free(c->ssl);
+    /* Unsent data is dropped with the connection */
+    c->in.tail = c->in.head;
+    c->out.tail = c->out.head;
+    lean_detach(c, &c->in);
+    lean_detach(c, &c->out);
+    free(c);
+}
+
+int TLS_lean_handshake(TLSLeanConn *c)
+{
+    if (lean_begin(c) != 0) return -1;
+
+    int ret = -1;
+    for (;;) {
+        int r = SSL_do_handshake(c->ssl);
+        int drained = lean_drain(c);
+        if (drained < 0) break;
+        if (r == 1) {
+            ret = 1;
+            break;
+        }
+
+        int err = SSL_get_error(c->ssl, r);
+        if (err == SSL_ERROR_WANT_READ) {
+            int filled = lean_fill(c);
+            if (filled > 0) continue;
+            if (filled == 0) ret = 0;
+        } else if (err == SSL_ERROR_WANT_WRITE && drained > 0) {
+            ret = 0;
+        }
+        break;
+    }
+
+    lean_end(c);
+    return ret;
+}
+
+ssize_t TLS_lean_read(TLSLeanConn *c, void *buf, size_t len)
+{
+    if (lean_begin(c) != 0) return -1;
+
+    ssize_t ret = -1;
+    int eof = 0;
+    for (;;) {
+        size_t n = 0;
+        int r = SSL_read_ex(c->ssl, buf, len, &n);
+        /* Tickets and key updates may need an answer, alerts after EOF don't */
+        if (lean_drain(c) < 0 && !eof) break;
+        if (r == 1) {
+            ret = (ssize_t) n;
+            break;
+        }
+
+        int err = SSL_get_error(c->ssl, r);
+        if (err == SSL_ERROR_WANT_READ) {
+            int filled = lean_fill(c);
+            if (filled > 0) continue;
+            if (filled == 0) {
+                errno = EAGAIN;
+            } else if (!eof && BIO_eof(SSL_get_rbio(c->ssl))) {
+                /* One more round so OpenSSL sees the EOF */
+                eof = 1;
+                continue;
+            }
+        } else if (err == SSL_ERROR_ZERO_RETURN || eof) {
+            ret = 0;
+        }
+        break;
+    }
+
+    lean_end(c);
+    return ret;
+}
+
+ssize_t TLS_lean_write(TLSLeanConn *c, const void *buf, size_t len)
+{
+    if (lean_begin(c) != 0) return -1;
+
+    ssize_t ret = -1;
+    for (;;) {
+        size_t n = 0;
+        int r = SSL_write_ex(c->ssl, buf, len, &n);
+        int drained = lean_drain(c);
+        if (drained < 0) break;
+        if (r == 1) {
+            ret = (ssize_t) n;
+            break;
+        }
+
+        /* The ring is full of ciphertext the socket did not take yet */
+        if (SSL_get_error(c->ssl, r) == SSL_ERROR_WANT_WRITE) {
+            if (drained == 0) continue;
+            errno = EAGAIN;
+        }
+        break;
+    }
+
+    lean_end(c);
+    return ret;
+}
+
+ssize_t TLS_lean_flush(TLSLeanConn *c)
+{
+    size_t pending = rbuf_get_readable(&c->out);
+    int drained = lean_drain(c);
+    if (drained < 0) return -1;
+    lean_end(c);
+    return (ssize_t) (pending - rbuf_get_readable(&c->out));
+}
+
+int TLS_lean_shrink(TLSLeanConn *c, uint64_t now)
+{
+    if (now - c->last_active < c->pool->idle_ns) return 0;
+    if (rbuf_get_readable(&c->in) || rbuf_get_readable(&c->out)) return 0;
+
+    lean_detach(c, &c->in);
+    lean_detach(c, &c->out);
+    /* Only fails while OpenSSL still holds unprocessed data */
+    SSL_free_buffers(c->ssl);
+    return 1;
+}
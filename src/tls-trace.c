@@ -0,0 +1,281 @@
+/******************************************************************************
+ *  tls-trace.c
+ *
+ *  Per-phase TLS handshake tracing in Chrome trace-event format.
+ *
+ *  Description:
+ *  Records a monotonic timestamp for every handshake state the info
+ *  callback sees and writes sampled handshakes to a JSON trace file.
+ *   - TLS_trace_open(): start tracing into a file with a sampling rate
+ *   - TLS_trace_info(): called from tls_info_callback()
+ *   - TLS_trace_mark(): begin/end of a named span, e.g. session_handler
+ *   - TLS_trace_close(): finish the JSON array
+ *
+ *  Implementation details:
+ *   - The sampling decision is taken at the first SSL_CB_HANDSHAKE_START
+ *     of a connection.  Only sampled connections get a span buffer,
+ *     attached with SSL ex_data and freed together with the SSL object.
+ *     Afterwards the ex_data holds trace_skip, so the callbacks that
+ *     post-handshake messages (TLS 1.3 tickets, key updates) or a
+ *     renegotiation run don't open new handshake spans.
+ *   - A state lasts from its transition until the next one, so the time
+ *     spent generating a key share or verifying a certificate shows up as
+ *     the duration of the state that precedes it.
+ *   - Each handshake is written on SSL_CB_HANDSHAKE_DONE or a failed
+ *     SSL_CB_EXIT as complete ("X") events: one for the whole handshake,
+ *     one per state and one per mark.  The tid is a per-handshake number
+ *     so every handshake gets its own row.  A handshake still open when
+ *     the SSL object is freed is written as "aborted".
+ *   - SSL_CB_EXIT with ret < 0 is also how non-blocking BIOs report a
+ *     retry, it counts as a failure only when SSL_get_error() says so or
+ *     a fatal alert was sent.
+ *   - Timestamps are CLOCK_MONOTONIC in microseconds as Chrome expects.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#include "tls-trace.h"
+#include "logging.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_STATE      0
+#define TRACE_MARK_BEGIN 1
+#define TRACE_MARK_END   2
+
+typedef struct TLS_TRACE_EVENT_T {
+    uint64_t ts_ns;
+    const char *name;
+    int kind;
+} TLSTraceEvent;
+
+typedef struct TLS_TRACE_T {
+    uint64_t id;
+    uint64_t start_ns;
+    int server;
+    int count;
+    int dropped;
+    const char *alert;
+    int fatal_alert;            /* sent by this side */
+    TLSTraceEvent events[TLS_TRACE_MAX_EVENTS];
+} TLSTrace;
+
+_Atomic int tls_trace_enabled = 0;
+
+static FILE *trace_file = NULL;
+static int trace_first = 1;
+static unsigned trace_sample = 1;
+static _Atomic uint64_t trace_seq = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_index = -1;
+/* ex_data of connections not sampled or already written */
+static char trace_skip;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void trace_flush(TLSTrace *t, const char *result);
+
+static void trace_free_cb(__attribute__((__unused__)) void *parent, void *ptr,
+                          __attribute__((__unused__)) CRYPTO_EX_DATA *ad,
+                          __attribute__((__unused__)) int idx,
+                          __attribute__((__unused__)) long argl,
+                          __attribute__((__unused__)) void *argp)
+{
+    if (ptr == NULL || ptr == &trace_skip) return;
+    /* Connection closed or freed in the middle of the handshake */
+    trace_flush(ptr, "aborted");
+    free(ptr);
+}
+
+static void trace_index_init(void)
+{
+    trace_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, trace_free_cb);
+}
+
+int TLS_trace_open(const char *path, unsigned sample_every)
+{
+    pthread_once(&trace_once, trace_index_init);
+    if (trace_index < 0) {
+        ERROR_PRINT("Cannot allocate SSL ex_data index for tracing");
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        ERROR_PRINT("Handshake trace already open");
+        return -1;
+    }
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        ERROR_PRINT("Cannot open trace file %s", path);
+        return -1;
+    }
+    fputs("[\n", trace_file);
+    trace_first = 1;
+    trace_sample = sample_every ? sample_every : 1;
+    pthread_mutex_unlock(&trace_lock);
+
+    atomic_store_explicit(&tls_trace_enabled, 1, memory_order_relaxed);
+    INFO_PRINT("Tracing 1/%u handshakes into %s", trace_sample, path);
+    return 0;
+}
+
+void TLS_trace_close(void)
+{
+    atomic_store_explicit(&tls_trace_enabled, 0, memory_order_relaxed);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_add(TLSTrace *t, const char *name, int kind)
+{
+    if (t->count == TLS_TRACE_MAX_EVENTS) {
+        t->dropped++;
+        return;
+    }
+    t->events[t->count].ts_ns = trace_now_ns();
+    t->events[t->count].name = name;
+    t->events[t->count].kind = kind;
+    t->count++;
+}
+
+static void trace_emit(const char *name, const char *cat, uint64_t id,
+                       uint64_t from_ns, uint64_t to_ns, const char *args)
+{
+    fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+            "\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f%s%s}",
+            trace_first ? "" : ",\n", name, cat, (int) getpid(), (unsigned long long) id,
+            from_ns / 1000.0, (to_ns - from_ns) / 1000.0,
+            args ? ",\"args\":" : "", args ? args : "");
+    trace_first = 0;
+}
+
+static void trace_flush(TLSTrace *t, const char *result)
+{
+    uint64_t end_ns = trace_now_ns();
+    char name[48], args[128];
+
+    snprintf(name, sizeof(name), "handshake (%s)", t->server ? "server" : "client");
+    snprintf(args, sizeof(args), "{\"result\":\"%s\",\"alert\":\"%s\",\"dropped\":%d}",
+             result, t->alert ? t->alert : "", t->dropped);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    trace_emit(name, "handshake", t->id, t->start_ns, end_ns, args);
+    uint64_t state_end = end_ns;
+    for (int i = t->count - 1; i >= 0; i--) {
+        TLSTraceEvent *e = &t->events[i];
+        if (e->kind == TRACE_STATE) {
+            trace_emit(e->name, "state", t->id, e->ts_ns, state_end, NULL);
+            state_end = e->ts_ns;
+        } else if (e->kind == TRACE_MARK_BEGIN) {
+            /* Pair with the first matching end after it */
+            uint64_t mark_end = end_ns;
+            for (int j = i + 1; j < t->count; j++) {
+                if (t->events[j].kind == TRACE_MARK_END && strcmp(t->events[j].name, e->name) == 0) {
+                    mark_end = t->events[j].ts_ns;
+                    break;
+                }
+            }
+            trace_emit(e->name, "mark", t->id, e->ts_ns, mark_end, NULL);
+        }
+    }
+    fflush(trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void TLS_trace_info(const SSL *ssl, int where, int ret)
+{
+    if (!TLS_trace_active()) return;
+    SSL *s = (SSL *) ssl;
+    TLSTrace *t = SSL_get_ex_data(ssl, trace_index);
+
+    if (where & SSL_CB_HANDSHAKE_START) {
+        if (t != NULL) return;
+        uint64_t seq = atomic_fetch_add_explicit(&trace_seq, 1, memory_order_relaxed);
+        if (seq % trace_sample == 0 && (t = calloc(1, sizeof(TLSTrace))) != NULL) {
+            t->id = seq;
+            t->start_ns = trace_now_ns();
+            t->server = SSL_is_server(s);
+            SSL_set_ex_data(s, trace_index, t);
+        } else {
+            SSL_set_ex_data(s, trace_index, &trace_skip);
+        }
+        return;
+    }
+    if (t == NULL || t == (TLSTrace *) &trace_skip) return;
+
+    if (where & SSL_CB_LOOP)
+        trace_add(t, SSL_state_string_long(ssl), TRACE_STATE);
+    if (where & SSL_CB_ALERT) {
+        t->alert = SSL_alert_desc_string_long(ret & 0xff);
+        if ((where & SSL_CB_WRITE_ALERT) == SSL_CB_WRITE_ALERT && (ret >> 8) == SSL3_AL_FATAL)
+            t->fatal_alert = 1;
+    }
+
+    const char *result = NULL;
+    if (where & SSL_CB_HANDSHAKE_DONE) {
+        result = "ok";
+    } else if ((where & SSL_CB_EXIT) && ret == 0) {
+        result = "failed";
+    } else if ((where & SSL_CB_EXIT) && ret < 0) {
+        int err = SSL_get_error(ssl, ret);
+        if (t->fatal_alert || (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE))
+            result = "failed";
+    }
+
+    if (result != NULL) {
+        trace_flush(t, result);
+        SSL_set_ex_data(s, trace_index, &trace_skip);
+        free(t);
+    }
+}
+
+void TLS_trace_mark(const SSL *ssl, const char *name, int begin)
+{
+    if (!TLS_trace_active() || ssl == NULL) return;
+    TLSTrace *t = SSL_get_ex_data(ssl, trace_index);
+    if (t != NULL && t != (TLSTrace *) &trace_skip)
+        trace_add(t, name, begin ? TRACE_MARK_BEGIN : TRACE_MARK_END);
+}
@@ -0,0 +1,216 @@
+/******************************************************************************
+ *  topology.c
+ *
+ *  CPU and NUMA layout from sysfs, thread pinning and node-local memory.
+ *
+ *  Description:
+ *  Lets the server keep a connection on one NUMA node: the thread that
+ *  accepted it, the threads serving it and the memory they use.
+ *   - topology_load(): parse nodeN/cpulist under /sys/devices/system/node
+ *   - topology_node_of_cpu(): CPU to node index
+ *   - topology_pin_thread(), topology_attr_set_node(): CPU affinity
+ *   - topology_bind_memory(): mbind() a range to a node
+ *
+ *  Implementation details:
+ *   - Nodes without CPUs (memory only) are left out, nothing can be
+ *     pinned to them.  Without node directories, all online CPUs from
+ *     devices/system/cpu/online form a single node.
+ *   - Pinning is skipped on single node machines, so the scheduler keeps
+ *     its freedom where locality can't be improved.
+ *   - mbind() is called through syscall() with MPOL_PREFERRED, so there
+ *     is no libnuma dependency and a full node falls back to others
+ *     instead of failing allocations.
+ *
+ *  License: MIT License
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include "topology.h"
+#include "logging.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Parse a sysfs CPU list like "0-3,8,10-11" into mask, returns CPU count or -1 */
+static int topology_parse_cpulist(const char *path, uint64_t *mask)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char line[4096];
+    int count = 0;
+    if (fgets(line, sizeof(line), f) != NULL) {
+        char *p = line;
+        while (*p != '\0' && *p != '\n') {
+            char *end;
+            long first = strtol(p, &end, 10), last = first;
+            if (end == p) break;
+            if (*end == '-') {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+            }
+            for (long cpu = first; cpu <= last && cpu < TOPO_MAX_CPUS; cpu++) {
+                if (!(mask[cpu / 64] & (1ULL << (cpu % 64)))) count++;
+                mask[cpu / 64] |= 1ULL << (cpu % 64);
+            }
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+static int topology_cmp_node(const void *a, const void *b)
+{
+    return ((const TopologyNode *) a)->id - ((const TopologyNode *) b)->id;
+}
+
+int topology_load(Topology *topo, const char *sysfs_root)
+{
+    const char *root = sysfs_root ? sysfs_root : "/sys";
+    char path[512];
+
+    memset(topo, 0, sizeof(Topology));
+    for (int i = 0; i < TOPO_MAX_CPUS; i++)
+        topo->cpu_node[i] = -1;
+
+    snprintf(path, sizeof(path), "%s/devices/system/node", root);
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    while (dir != NULL && (ent = readdir(dir)) != NULL && topo->node_count < TOPO_MAX_NODES) {
+        int id;
+        char tail;
+        if (sscanf(ent->d_name, "node%d%c", &id, &tail) != 1) continue;
+
+        TopologyNode *node = &topo->nodes[topo->node_count];
+        snprintf(path, sizeof(path), "%s/devices/system/node/%s/cpulist", root, ent->d_name);
+        node->cpu_count = topology_parse_cpulist(path, node->cpus);
+        if (node->cpu_count <= 0) {
+            DEBUG_PRINT("Skipping NUMA node %i without CPUs", id);
+            memset(node, 0, sizeof(TopologyNode));
+            continue;
+        }
+        node->id = id;
+        topo->node_count++;
+    }
+    if (dir != NULL) closedir(dir);
+
+    if (topo->node_count == 0) {
+        TopologyNode *node = &topo->nodes[0];
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/online", root);
+        node->cpu_count = topology_parse_cpulist(path, node->cpus);
+        if (node->cpu_count <= 0) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            if (n <= 0) {
+                ERROR_PRINT("Cannot find out the online CPUs");
+                return -1;
+            }
+            memset(node->cpus, 0, sizeof(node->cpus));
+            for (long cpu = 0; cpu < n && cpu < TOPO_MAX_CPUS; cpu++)
+                node->cpus[cpu / 64] |= 1ULL << (cpu % 64);
+            node->cpu_count = (int) (n < TOPO_MAX_CPUS ? n : TOPO_MAX_CPUS);
+        }
+        topo->node_count = 1;
+    }
+
+    qsort(topo->nodes, (size_t) topo->node_count, sizeof(TopologyNode), topology_cmp_node);
+    for (int n = 0; n < topo->node_count; n++) {
+        for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++) {
+            if (!(topo->nodes[n].cpus[cpu / 64] & (1ULL << (cpu % 64)))) continue;
+            if (topo->cpu_node[cpu] < 0) topo->cpu_count++;
+            topo->cpu_node[cpu] = (short) n;
+        }
+    }
+
+    DEBUG_PRINT("Topology: %i NUMA nodes, %i CPUs", topo->node_count, topo->cpu_count);
+    return topo->node_count;
+}
+
+int topology_node_of_cpu(const Topology *topo, int cpu)
+{
+    if (cpu < 0) cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= TOPO_MAX_CPUS || topo->cpu_node[cpu] < 0) return 0;
+    return topo->cpu_node[cpu];
+}
+
+/* CPU set of the node, or of its core-th CPU.  Returns 0 if there is nothing to pin */
+static int topology_node_cpuset(const Topology *topo, int node, int core, cpu_set_t *set)
+{
+    if (!topology_is_numa(topo) || node < 0 || node >= topo->node_count) return 0;
+
+    const TopologyNode *n = &topo->nodes[node];
+    int pick = core >= 0 ? core % n->cpu_count : -1;
+    CPU_ZERO(set);
+    for (int cpu = 0; cpu < TOPO_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (!(n->cpus[cpu / 64] & (1ULL << (cpu % 64)))) continue;
+        if (pick < 0 || pick-- == 0) CPU_SET(cpu, set);
+        if (pick < 0 && core >= 0) break;
+    }
+    return 1;
+}
+
+int topology_pin_thread(const Topology *topo, pthread_t thread, int node, int core)
+{
+    cpu_set_t set;
+    if (!topology_node_cpuset(topo, node, core, &set)) return 0;
+
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0) {
+        ERROR_PRINT("Cannot pin thread to node %i, error %i", topo->nodes[node].id, err);
+        return -1;
+    }
+    return 0;
+}
+
+int topology_attr_set_node(const Topology *topo, pthread_attr_t *attr, int node)
+{
+    cpu_set_t set;
+    if (!topology_node_cpuset(topo, node, -1, &set)) return 0;
+
+    int err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (err != 0) {
+        ERROR_PRINT("Cannot set thread affinity to node %i, error %i", topo->nodes[node].id, err);
+        return -1;
+    }
+    return 0;
+}
+
+int topology_bind_memory(void *addr, size_t len, int node_id)
+{
+    if (node_id < 0 || node_id >= TOPO_MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned long mask[TOPO_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    mask[node_id / (8 * sizeof(unsigned long))] = 1UL << (node_id % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, TOPO_MAX_NODES + 1, 0) != 0) {
+        DEBUG_PRINT("mbind() to node %i failed, errno %i, relying on first touch", node_id, errno);
+        return -1;
+    }
+    return 0;
+}